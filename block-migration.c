@@ -211,7 +211,9 @@ static int mig_save_device_bulk(Monitor *mon, QEMUFile *f,
     BlkMigBlock *blk;
     int nr_sectors;
 
-    if (bmds->shared_base) {
+    /* Without a backing file, unallocated sectors read as zeros and are not
+     * part of the shared base */
+    if (bmds->shared_base && bs->backing_hd) {
         while (cur_sector < total_sectors &&
                !bdrv_is_allocated(bs, cur_sector, MAX_IS_ALLOCATED_SEARCH,
                                   &nr_sectors)) {
@@ -387,7 +389,7 @@ static int mig_save_device_dirty(Monitor *mon, QEMUFile *f,
 
     for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
         if (bmds_aio_inflight(bmds, sector)) {
-            qemu_aio_flush();
+            bdrv_drain_all();
         }
         if (bdrv_get_dirty(bmds->bs, sector)) {
 
@@ -30,6 +30,10 @@
 #include "qjson.h"
 #include "qemu-coroutine.h"
 #include "qmp-commands.h"
+#include "host-utils.h"
+#ifdef CONFIG_POSIX
+#include "block/raw-posix-aio.h"
+#endif
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -47,7 +51,10 @@
 
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
+#define NANOSECONDS_PER_SECOND  1000000000.0
+
 static void bdrv_dev_change_media_cb(BlockDriverState *bs, bool load);
+static void bdrv_io_limits_disable(BlockDriverState *bs);
 static BlockDriverAIOCB *bdrv_aio_readv_em(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque);
@@ -85,6 +92,9 @@ static BlockDriverState *bs_snapshots;
 /* If non-zero, use only whitelisted block drivers */
 static int use_bdrv_whitelist;
 
+/* true while bdrv_drain_all() lets throttled requests through */
+static bool bdrv_draining;
+
 #ifdef _WIN32
 static int is_windows_drive_prefix(const char *filename)
 {
@@ -213,6 +223,9 @@ BlockDriverState *bdrv_new(const char *device_name)
         QTAILQ_INSERT_TAIL(&bdrv_states, bs, list);
     }
     bdrv_iostatus_disable(bs);
+    qemu_co_queue_init(&bs->throttled_reqs);
+    notifier_list_init(&bs->close_notifiers);
+    bs->idle_start_ns = get_clock();
     return bs;
 }
 
@@ -272,6 +285,76 @@ int bdrv_create_file(const char* filename, QEMUOptionParameter *options)
     return bdrv_create(drv, filename, options);
 }
 
+static const char *prealloc_mode_names[] = {
+    [PREALLOC_OFF]      = "off",
+    [PREALLOC_METADATA] = "metadata",
+    [PREALLOC_FALLOC]   = "falloc",
+    [PREALLOC_FULL]     = "full",
+};
+
+int bdrv_parse_prealloc_mode(const char *value, PreallocMode *mode)
+{
+    int i;
+
+    if (!value) {
+        *mode = PREALLOC_OFF;
+        return 0;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(prealloc_mode_names); i++) {
+        if (!strcmp(value, prealloc_mode_names[i])) {
+            *mode = i;
+            return 0;
+        }
+    }
+
+    error_report("Invalid preallocation mode: '%s'", value);
+    return -EINVAL;
+}
+
+/*
+ * Create the file of an image with its final size.  Space for falloc and
+ * full preallocation is reserved by the protocol driver, metadata is left
+ * to the caller.
+ */
+int bdrv_create_file_prealloc(const char *filename, int64_t size,
+                              PreallocMode mode)
+{
+    BlockDriver *drv;
+    QEMUOptionParameter *options;
+    int ret;
+
+    drv = bdrv_find_protocol(filename);
+    if (drv == NULL) {
+        return -ENOENT;
+    }
+
+    if (!drv->create_options ||
+        !get_option_parameter(drv->create_options, BLOCK_OPT_SIZE)) {
+        error_report("Protocol '%s' does not support preallocation",
+                     drv->format_name);
+        return -ENOTSUP;
+    }
+    options = parse_option_parameters("", drv->create_options, NULL);
+    set_option_parameter_int(options, BLOCK_OPT_SIZE, size);
+
+    if (mode == PREALLOC_FALLOC || mode == PREALLOC_FULL) {
+        if (!get_option_parameter(options, BLOCK_OPT_PREALLOC)) {
+            error_report("Protocol '%s' does not support preallocation",
+                         drv->format_name);
+            ret = -ENOTSUP;
+            goto out;
+        }
+        set_option_parameter(options, BLOCK_OPT_PREALLOC,
+                             prealloc_mode_names[mode]);
+    }
+
+    ret = bdrv_create(drv, filename, options);
+out:
+    free_option_parameters(options);
+    return ret;
+}
+
 #ifdef _WIN32
 void get_tmp_filename(char *filename, int size)
 {
@@ -698,6 +781,14 @@ unlink_and_fail:
 
 void bdrv_close(BlockDriverState *bs)
 {
+    if (bs->drv) {
+        notifier_list_notify(&bs->close_notifiers, bs);
+    }
+
+    if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
+        bdrv_drain_all();
+    }
+
     if (bs->drv) {
         if (bs == bs_snapshots) {
             bs_snapshots = NULL;
@@ -733,6 +824,28 @@ void bdrv_close_all(void)
     }
 }
 
+/*
+ * Wait for all requests to complete, including the ones that are held back
+ * by I/O throttling.
+ *
+ * Throttled requests wait for a timer, which qemu_aio_wait() does not run, so
+ * they are released without further delay while draining.
+ */
+void bdrv_drain_all(void)
+{
+    BlockDriverState *bs;
+
+    bdrv_draining = true;
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        while (qemu_co_queue_next(&bs->throttled_reqs)) {
+            /* do nothing */
+        }
+    }
+
+    qemu_aio_flush();
+    bdrv_draining = false;
+}
+
 /* make a BlockDriverState anonymous by removing from bdrv_state list.
    Also, NULL terminate the device_name to prevent double remove */
 void bdrv_make_anon(BlockDriverState *bs)
@@ -756,6 +869,7 @@ void bdrv_delete(BlockDriverState *bs)
     }
 
     assert(bs != bs_snapshots);
+    bdrv_io_limits_disable(bs);
     g_free(bs);
 }
 
@@ -863,6 +977,77 @@ int bdrv_check(BlockDriverState *bs, BdrvCheckResult *res)
     return bs->drv->bdrv_check(bs, res);
 }
 
+typedef struct DefragCo {
+    BlockDriverState *bs;
+    int64_t *offset;
+    int64_t max_bytes;
+    int64_t ret;
+} DefragCo;
+
+static void coroutine_fn bdrv_defrag_co_entry(void *opaque)
+{
+    DefragCo *dco = opaque;
+
+    dco->ret = dco->bs->drv->bdrv_co_defrag(dco->bs, dco->offset,
+                                            dco->max_bytes);
+}
+
+/*
+ * Defragment the image so that guest-contiguous data is contiguous in the
+ * image file.  The work is done in steps: each call continues at guest byte
+ * *offset, which is 0 for the first call, moves about max_bytes of data and
+ * advances *offset.  Defragmentation is complete when *offset reaches the
+ * image size.  Guest requests may run between the calls.
+ *
+ * Each step runs in a coroutine.  The driver holds back requests that arrive
+ * meanwhile, but requests that were in flight before must have completed.
+ *
+ * Returns the number of bytes moved or -errno.
+ */
+int64_t bdrv_defrag(BlockDriverState *bs, int64_t *offset, int64_t max_bytes)
+{
+    BlockDriver *drv = bs->drv;
+    Coroutine *co;
+    DefragCo dco = {
+        .bs = bs,
+        .offset = offset,
+        .max_bytes = max_bytes,
+        .ret = NOT_DONE,
+    };
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_co_defrag) {
+        return -ENOTSUP;
+    }
+    if (bs->read_only) {
+        return -EACCES;
+    }
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_defrag_co_entry(&dco);
+    } else {
+        co = qemu_coroutine_create(bdrv_defrag_co_entry);
+        qemu_coroutine_enter(co, &dco);
+        while (dco.ret == NOT_DONE) {
+            qemu_aio_wait();
+        }
+    }
+    return dco.ret;
+}
+
+/* Drop the state of a defragmentation that is not continued */
+void bdrv_defrag_cancel(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_defrag_cancel) {
+        drv->bdrv_defrag_cancel(bs);
+    }
+}
+
 #define COMMIT_BUF_SECTORS 2048
 
 /* commit COW file into the raw image */
@@ -1252,6 +1437,196 @@ int bdrv_pwrite_sync(BlockDriverState *bs, int64_t offset,
     return 0;
 }
 
+/**************************************************************/
+/* I/O throttling */
+
+static void bdrv_block_timer(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+
+    qemu_co_queue_next(&bs->throttled_reqs);
+}
+
+static void bdrv_io_limits_enable(BlockDriverState *bs)
+{
+    if (!bs->block_timer) {
+        bs->block_timer = qemu_new_timer_ns(rt_clock, bdrv_block_timer, bs);
+    }
+    bs->slice_start = 0;
+    bs->slice_end = 0;
+    memset(&bs->io_disps, 0, sizeof(bs->io_disps));
+    bs->io_limits_enabled = true;
+}
+
+static void bdrv_io_limits_disable(BlockDriverState *bs)
+{
+    bs->io_limits_enabled = false;
+
+    /* Throttled requests see the flag and go ahead */
+    while (qemu_co_queue_next(&bs->throttled_reqs)) {
+        /* do nothing */
+    }
+
+    if (bs->block_timer) {
+        qemu_del_timer(bs->block_timer);
+        qemu_free_timer(bs->block_timer);
+        bs->block_timer = NULL;
+    }
+}
+
+static bool bdrv_io_limits_set(BlockIOLimit *io_limits)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (io_limits->bps[i] || io_limits->iops[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Set bytes per second and operations per second limits for a drive.  Zero
+ * means unlimited.  A total limit takes precedence over the read and write
+ * limits of the same kind.
+ */
+void bdrv_set_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits)
+{
+    bs->io_limits = *io_limits;
+
+    if (bdrv_io_limits_set(io_limits)) {
+        bdrv_io_limits_enable(bs);
+    } else if (bs->io_limits_enabled) {
+        bdrv_io_limits_disable(bs);
+    }
+}
+
+/*
+ * The limit that applies to a request and the amount dispatched against it in
+ * the current slice.  Returns 0 if the request is not limited.
+ */
+static int64_t bdrv_io_limit(int64_t *limits, uint64_t *disps, bool is_write,
+                             double *base)
+{
+    if (limits[BLOCK_IO_LIMIT_TOTAL]) {
+        *base = disps[BLOCK_IO_LIMIT_READ] + disps[BLOCK_IO_LIMIT_WRITE];
+        return limits[BLOCK_IO_LIMIT_TOTAL];
+    }
+
+    *base = disps[is_write];
+    return limits[is_write];
+}
+
+/*
+ * Returns the time in seconds after the start of the slice at which 'amount'
+ * more bytes or operations can be dispatched without exceeding the limit, or
+ * a negative value if they can be dispatched now.
+ */
+static double bdrv_io_limit_delay(int64_t limit, double base, double amount,
+                                  double slice_time, double elapsed_time)
+{
+    if (!limit || base + amount <= limit * slice_time) {
+        return -1;
+    }
+
+    return (base + amount) / limit - elapsed_time;
+}
+
+/*
+ * Checks whether a request fits into the budget of the current slice.  If it
+ * does not, *wait is set to the number of nanoseconds after which it will,
+ * and the slice is extended so that what was dispatched so far is still taken
+ * into account at that point.
+ */
+static bool bdrv_exceed_io_limits(BlockDriverState *bs, bool is_write,
+                                  int nb_sectors, int64_t *wait)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    double elapsed_time, slice_time, base;
+    double bps_wait, iops_wait, wait_time;
+    int64_t limit;
+
+    /* Start a new slice once the previous one has run out */
+    if (now > bs->slice_end) {
+        bs->slice_start = now;
+        bs->slice_end = now + BLOCK_IO_SLICE_TIME;
+        memset(&bs->io_disps, 0, sizeof(bs->io_disps));
+    }
+
+    elapsed_time = (now - bs->slice_start) / NANOSECONDS_PER_SECOND;
+    slice_time = (bs->slice_end - bs->slice_start) / NANOSECONDS_PER_SECOND;
+
+    limit = bdrv_io_limit(bs->io_limits.bps, bs->io_disps.bytes, is_write,
+                          &base);
+    bps_wait = bdrv_io_limit_delay(limit, base,
+                                   (double)nb_sectors * BDRV_SECTOR_SIZE,
+                                   slice_time, elapsed_time);
+
+    limit = bdrv_io_limit(bs->io_limits.iops, bs->io_disps.ios, is_write,
+                          &base);
+    iops_wait = bdrv_io_limit_delay(limit, base, 1, slice_time, elapsed_time);
+
+    wait_time = MAX(bps_wait, iops_wait);
+    if (wait_time < 0) {
+        return false;
+    }
+
+    *wait = wait_time * NANOSECONDS_PER_SECOND + 1;
+    bs->slice_end = MAX(bs->slice_end, now + *wait + BLOCK_IO_SLICE_TIME);
+    return true;
+}
+
+/*
+ * Delay a request until it fits into the configured limits.  Requests are
+ * dispatched in FIFO order: a request that still exceeds the limits when its
+ * timer fires goes back to the head of the queue, and every request that is
+ * let through wakes up the next one in line.
+ */
+static void coroutine_fn bdrv_io_limits_intercept(BlockDriverState *bs,
+    bool is_write, int nb_sectors)
+{
+    int64_t wait_time;
+
+    if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
+        qemu_co_queue_wait(&bs->throttled_reqs);
+    }
+
+    while (bs->io_limits_enabled && !bdrv_draining &&
+           bdrv_exceed_io_limits(bs, is_write, nb_sectors, &wait_time)) {
+        qemu_mod_timer(bs->block_timer,
+                       qemu_get_clock_ns(rt_clock) + wait_time);
+        qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
+    }
+
+    bs->io_disps.bytes[is_write] += (uint64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    bs->io_disps.ios[is_write]++;
+
+    qemu_co_queue_next(&bs->throttled_reqs);
+}
+
+/*
+ * Requests in flight are counted where they enter the driver, so that a
+ * request the device model never completes or restarts does not skew them.
+ */
+static void bdrv_in_flight_begin(BlockDriverState *bs)
+{
+    if (bs->in_flight++ == 0) {
+        bs->idle_time_ns += get_clock() - bs->idle_start_ns;
+    }
+    if (bs->in_flight > bs->max_in_flight) {
+        bs->max_in_flight = bs->in_flight;
+    }
+}
+
+static void bdrv_in_flight_end(BlockDriverState *bs)
+{
+    assert(bs->in_flight > 0);
+    if (--bs->in_flight == 0) {
+        bs->idle_start_ns = get_clock();
+    }
+}
+
 /*
  * Handle a read request in coroutine context
  */
@@ -1259,6 +1634,7 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
 {
     BlockDriver *drv = bs->drv;
+    int ret;
 
     if (!drv) {
         return -ENOMEDIUM;
@@ -1267,7 +1643,15 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         return -EIO;
     }
 
-    return drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_intercept(bs, false, nb_sectors);
+    }
+
+    bdrv_in_flight_begin(bs);
+    ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    bdrv_in_flight_end(bs);
+
+    return ret;
 }
 
 int coroutine_fn bdrv_co_readv(BlockDriverState *bs, int64_t sector_num,
@@ -1297,7 +1681,13 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         return -EIO;
     }
 
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_intercept(bs, true, nb_sectors);
+    }
+
+    bdrv_in_flight_begin(bs);
     ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
+    bdrv_in_flight_end(bs);
 
     if (bs->dirty_bitmap) {
         set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
@@ -1781,7 +2171,8 @@ int bdrv_has_zero_init(BlockDriverState *bs)
 /*
  * Returns true iff the specified sector is present in the disk image. Drivers
  * not implementing the functionality are assumed to not support backing files,
- * hence all their sectors are reported as allocated.
+ * hence all their sectors are reported as allocated.  Sectors of an image
+ * without backing file that are reported as unallocated read as zeroes.
  *
  * 'pnum' is set to the number of sectors (including and immediately following
  * the specified sector) that are known to be in the same
@@ -1789,20 +2180,166 @@ int bdrv_has_zero_init(BlockDriverState *bs)
  *
  * 'nb_sectors' is the max value 'pnum' should be set to.
  */
+int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, int *pnum)
+{
+    int64_t n;
+
+    if (sector_num >= bs->total_sectors) {
+        *pnum = 0;
+        return 0;
+    }
+
+    n = bs->total_sectors - sector_num;
+    if (n < nb_sectors) {
+        nb_sectors = n;
+    }
+
+    if (bs->drv->bdrv_co_is_allocated) {
+        return bs->drv->bdrv_co_is_allocated(bs, sector_num, nb_sectors,
+                                             pnum);
+    }
+    if (bs->drv->bdrv_is_allocated) {
+        return bs->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
+    }
+
+    *pnum = nb_sectors;
+    return 1;
+}
+
+typedef struct BdrvCoIsAllocatedData {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    int *pnum;
+    int ret;
+    bool done;
+} BdrvCoIsAllocatedData;
+
+static void coroutine_fn bdrv_is_allocated_co_entry(void *opaque)
+{
+    BdrvCoIsAllocatedData *data = opaque;
+
+    data->ret = bdrv_co_is_allocated(data->bs, data->sector_num,
+                                     data->nb_sectors, data->pnum);
+    data->done = true;
+}
+
+/*
+ * Synchronous wrapper around bdrv_co_is_allocated().
+ *
+ * See bdrv_co_is_allocated() for details.
+ */
 int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
 	int *pnum)
 {
-    int64_t n;
-    if (!bs->drv->bdrv_is_allocated) {
-        if (sector_num >= bs->total_sectors) {
-            *pnum = 0;
-            return 0;
+    Coroutine *co;
+    BdrvCoIsAllocatedData data = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .pnum = pnum,
+        .done = false,
+    };
+
+    if (!bs->drv->bdrv_co_is_allocated) {
+        /* Avoid the coroutine for drivers with a synchronous callback */
+        return bdrv_co_is_allocated(bs, sector_num, nb_sectors, pnum);
+    }
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_is_allocated_co_entry(&data);
+    } else {
+        co = qemu_coroutine_create(bdrv_is_allocated_co_entry);
+        qemu_coroutine_enter(co, &data);
+        while (!data.done) {
+            qemu_aio_wait();
         }
-        n = bs->total_sectors - sector_num;
-        *pnum = (n < nb_sectors) ? (n) : (nb_sectors);
-        return 1;
     }
-    return bs->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
+    return data.ret;
+}
+
+/*
+ * Append an extent to the array, merging it with the last one if they are
+ * contiguous and have the same status.
+ */
+void bdrv_add_extent(BlockExtent *extents, int *nb_extents,
+                     int64_t sector_num, int64_t nb_sectors, int flags,
+                     BlockDriverState *file, int64_t offset)
+{
+    BlockExtent *last = *nb_extents ? &extents[*nb_extents - 1] : NULL;
+
+    if (last && last->flags == flags && last->file == file &&
+        last->sector_num + last->nb_sectors == sector_num &&
+        (!(flags & BDRV_EXTENT_OFFSET) ||
+         last->offset + last->nb_sectors * BDRV_SECTOR_SIZE == offset)) {
+        last->nb_sectors += nb_sectors;
+        return;
+    }
+
+    extents[*nb_extents] = (BlockExtent) {
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .flags      = flags,
+        .file       = file,
+        .offset     = offset,
+    };
+    (*nb_extents)++;
+}
+
+/*
+ * Describe the allocation status of the sectors starting at sector_num.
+ *
+ * Fills in up to max_extents contiguous extents, the first of which starts
+ * at sector_num, and returns their number.  The extents may cover less than
+ * nb_sectors; callers loop to get the rest.  Returns 0 if sector_num is
+ * beyond the end of the image, and -errno on failure.
+ *
+ * Unlike bdrv_is_allocated(), a single call returns many ranges, which
+ * drivers that know their metadata layout can produce cheaply.
+ */
+int bdrv_get_extents(BlockDriverState *bs, int64_t sector_num,
+                     int64_t nb_sectors, BlockExtent *extents,
+                     int max_extents)
+{
+    BlockDriver *drv = bs->drv;
+    int64_t length;
+    int nb_extents = 0;
+    int ret, n;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+
+    length = bdrv_getlength(bs);
+    if (length < 0) {
+        return length;
+    }
+    length /= BDRV_SECTOR_SIZE;
+    if (sector_num >= length || nb_sectors <= 0 || max_extents <= 0) {
+        return 0;
+    }
+    nb_sectors = MIN(nb_sectors, length - sector_num);
+
+    if (drv->bdrv_get_extents) {
+        return drv->bdrv_get_extents(bs, sector_num, nb_sectors, extents,
+                                     max_extents);
+    }
+
+    while (nb_sectors > 0 && nb_extents < max_extents) {
+        ret = bdrv_is_allocated(bs, sector_num,
+                                MIN(nb_sectors, INT_MAX / BDRV_SECTOR_SIZE),
+                                &n);
+        if (n <= 0) {
+            break;
+        }
+        bdrv_add_extent(extents, &nb_extents, sector_num, n,
+                        ret ? BDRV_EXTENT_DATA : 0, NULL, 0);
+        sector_num += n;
+        nb_sectors -= n;
+    }
+    return nb_extents ? nb_extents : -EIO;
 }
 
 void bdrv_mon_event(const BlockDriverState *bdrv,
@@ -1869,7 +2406,50 @@ BlockInfoList *qmp_query_block(Error **errp)
                 info->value->inserted->has_backing_file = true;
                 info->value->inserted->backing_file = g_strdup(bs->backing_file);
             }
+
+            info->value->inserted->bps =
+                           bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
+            info->value->inserted->bps_rd =
+                           bs->io_limits.bps[BLOCK_IO_LIMIT_READ];
+            info->value->inserted->bps_wr =
+                           bs->io_limits.bps[BLOCK_IO_LIMIT_WRITE];
+            info->value->inserted->iops =
+                           bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
+            info->value->inserted->iops_rd =
+                           bs->io_limits.iops[BLOCK_IO_LIMIT_READ];
+            info->value->inserted->iops_wr =
+                           bs->io_limits.iops[BLOCK_IO_LIMIT_WRITE];
+        }
+
+        /* XXX: waiting for the qapi to support GSList */
+        if (!cur_item) {
+            head = cur_item = info;
+        } else {
+            cur_item->next = info;
+            cur_item = info;
         }
+    }
+
+    return head;
+}
+
+/* Non-empty buckets of a latency histogram, in ascending order */
+static BlockLatencyBucketList *qmp_query_latency(const uint64_t *latency)
+{
+    BlockLatencyBucketList *head = NULL, *cur_item = NULL;
+    int i;
+
+    for (i = 0; i < BDRV_LATENCY_BUCKETS; i++) {
+        BlockLatencyBucketList *info;
+
+        if (!latency[i]) {
+            continue;
+        }
+
+        info = g_malloc0(sizeof(*info));
+        info->value = g_malloc0(sizeof(*info->value));
+        info->value->latency_ns = i ? 1000LL << (i - 1) : 0;
+        info->value->count = latency[i];
 
         /* XXX: waiting for the qapi to support GSList */
         if (!cur_item) {
@@ -1905,12 +2485,38 @@ static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
     s->stats->wr_total_time_ns = bs->total_time_ns[BDRV_ACCT_WRITE];
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
+    s->stats->rd_latency = qmp_query_latency(bs->latency[BDRV_ACCT_READ]);
+    s->stats->wr_latency = qmp_query_latency(bs->latency[BDRV_ACCT_WRITE]);
+    s->stats->flush_latency = qmp_query_latency(bs->latency[BDRV_ACCT_FLUSH]);
+    s->stats->in_flight = bs->in_flight;
+    s->stats->max_in_flight = bs->max_in_flight;
+    s->stats->idle_time_ns = bs->idle_time_ns;
+    s->stats->rd_merged = bs->nr_merged[BDRV_ACCT_READ];
+    s->stats->wr_merged = bs->nr_merged[BDRV_ACCT_WRITE];
+    if (bs->in_flight == 0) {
+        s->stats->idle_time_ns += get_clock() - bs->idle_start_ns;
+    }
+    if (bs->has_cache_stats) {
+        s->stats->has_cache_hits = true;
+        s->stats->cache_hits = bs->nr_cache_hits;
+        s->stats->has_cache_misses = true;
+        s->stats->cache_misses = bs->nr_cache_misses;
+    }
+    if (bs->has_misaligned_stats) {
+        s->stats->has_misaligned = true;
+        s->stats->misaligned = bs->nr_misaligned;
+    }
 
     if (bs->file) {
         s->has_parent = true;
         s->parent = qmp_query_blockstat(bs->file, NULL);
     }
 
+    if (bs->backing_hd) {
+        s->has_backing = true;
+        s->backing = qmp_query_blockstat(bs->backing_hd, NULL);
+    }
+
     return s;
 }
 
@@ -1969,6 +2575,57 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
 
+/*
+ * Compress one cluster of @buf into @out_buf, which must be at least one
+ * cluster in size.  Unlike every other bdrv_* function this one is safe to
+ * call from threads other than the one doing I/O on @bs.
+ *
+ * Returns the compressed length, 0 if the data does not compress and must be
+ * written as is, or -errno.
+ */
+int bdrv_compress_cluster(BlockDriverState *bs, const uint8_t *buf,
+                          uint8_t *out_buf, int level)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_compress_cluster)
+        return -ENOTSUP;
+
+    return drv->bdrv_compress_cluster(bs, buf, out_buf, level);
+}
+
+/*
+ * Write a cluster compressed by bdrv_compress_cluster().  @buf holds the
+ * uncompressed data and is used when @out_len is 0.
+ */
+int bdrv_write_compressed_cluster(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf,
+                                  const uint8_t *out_buf, int out_len)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverInfo bdi;
+    int nb_sectors;
+
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_write_compressed_cluster)
+        return -ENOTSUP;
+    if (bdrv_get_info(bs, &bdi) < 0 || bdi.cluster_size <= 0)
+        return -EINVAL;
+
+    nb_sectors = bdi.cluster_size >> BDRV_SECTOR_BITS;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return -EIO;
+
+    if (bs->dirty_bitmap) {
+        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+    }
+
+    return drv->bdrv_write_compressed_cluster(bs, sector_num, buf,
+                                              out_buf, out_len);
+}
+
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BlockDriver *drv = bs->drv;
@@ -2250,12 +2907,11 @@ typedef struct MultiwriteCB {
     } callbacks[];
 } MultiwriteCB;
 
-static void multiwrite_user_cb(MultiwriteCB *mcb)
+static void multiwrite_free_bufs(MultiwriteCB *mcb)
 {
     int i;
 
     for (i = 0; i < mcb->num_callbacks; i++) {
-        mcb->callbacks[i].cb(mcb->callbacks[i].opaque, mcb->error);
         if (mcb->callbacks[i].free_qiov) {
             qemu_iovec_destroy(mcb->callbacks[i].free_qiov);
         }
@@ -2264,6 +2920,16 @@ static void multiwrite_user_cb(MultiwriteCB *mcb)
     }
 }
 
+static void multiwrite_user_cb(MultiwriteCB *mcb)
+{
+    int i;
+
+    for (i = 0; i < mcb->num_callbacks; i++) {
+        mcb->callbacks[i].cb(mcb->callbacks[i].opaque, mcb->error);
+    }
+    multiwrite_free_bufs(mcb);
+}
+
 static void multiwrite_cb(void *opaque, int ret)
 {
     MultiwriteCB *mcb = opaque;
@@ -2299,27 +2965,33 @@ static int multiwrite_req_compare(const void *a, const void *b)
 }
 
 /*
- * Takes a bunch of requests and tries to merge them. Returns the number of
- * requests that remain after merging.
+ * Takes a bunch of requests sorted by start sector and merges as many of them
+ * as possible into the first one. Returns the number of requests that were
+ * merged, including the first one.
+ *
+ * Reads are only merged if they are exactly sequential: there is no buffer
+ * to read overlapping or gap sectors into.
  */
 static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
-    int num_reqs, MultiwriteCB *mcb)
+    int num_reqs, MultiwriteCB *mcb, bool is_write)
 {
-    int i, outidx;
+    int i;
 
-    // Sort requests by start sector
-    qsort(reqs, num_reqs, sizeof(*reqs), &multiwrite_req_compare);
+    mcb->callbacks[0].cb = reqs[0].cb;
+    mcb->callbacks[0].opaque = reqs[0].opaque;
 
     // Check if adjacent requests touch the same clusters. If so, combine them,
     // filling up gaps with zero sectors.
-    outidx = 0;
     for (i = 1; i < num_reqs; i++) {
         int merge = 0;
-        int64_t oldreq_last = reqs[outidx].sector + reqs[outidx].nb_sectors;
+        int64_t oldreq_last = reqs[0].sector + reqs[0].nb_sectors;
+        QEMUIOVector *qiov;
+        size_t size;
 
         // This handles the cases that are valid for all block drivers, namely
         // exactly sequential writes and overlapping writes.
-        if (reqs[i].sector <= oldreq_last) {
+        if (is_write ? reqs[i].sector <= oldreq_last
+                     : reqs[i].sector == oldreq_last) {
             merge = 1;
         }
 
@@ -2327,71 +2999,92 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
         // even if there is a gap of some sectors between them. In this case,
         // the gap is filled with zeros (therefore only applicable for yet
         // unused space in format like qcow2).
-        if (!merge && bs->drv->bdrv_merge_requests) {
-            merge = bs->drv->bdrv_merge_requests(bs, &reqs[outidx], &reqs[i]);
+        if (!merge && is_write && bs->drv->bdrv_merge_requests) {
+            merge = bs->drv->bdrv_merge_requests(bs, &reqs[0], &reqs[i]);
         }
 
-        if (reqs[outidx].qiov->niov + reqs[i].qiov->niov + 1 > IOV_MAX) {
+        if (reqs[0].qiov->niov + reqs[i].qiov->niov + 1 > IOV_MAX) {
             merge = 0;
         }
 
-        if (merge) {
-            size_t size;
-            QEMUIOVector *qiov = g_malloc0(sizeof(*qiov));
-            qemu_iovec_init(qiov,
-                reqs[outidx].qiov->niov + reqs[i].qiov->niov + 1);
-
-            // Add the first request to the merged one. If the requests are
-            // overlapping, drop the last sectors of the first request.
-            size = (reqs[i].sector - reqs[outidx].sector) << 9;
-            qemu_iovec_concat(qiov, reqs[outidx].qiov, size);
-
-            // We might need to add some zeros between the two requests
-            if (reqs[i].sector > oldreq_last) {
-                size_t zero_bytes = (reqs[i].sector - oldreq_last) << 9;
-                uint8_t *buf = qemu_blockalign(bs, zero_bytes);
-                memset(buf, 0, zero_bytes);
-                qemu_iovec_add(qiov, buf, zero_bytes);
-                mcb->callbacks[i].free_buf = buf;
-            }
+        if (!merge) {
+            break;
+        }
 
-            // Add the second request
-            qemu_iovec_concat(qiov, reqs[i].qiov, reqs[i].qiov->size);
+        qiov = g_malloc0(sizeof(*qiov));
+        qemu_iovec_init(qiov, reqs[0].qiov->niov + reqs[i].qiov->niov + 1);
 
-            reqs[outidx].nb_sectors = qiov->size >> 9;
-            reqs[outidx].qiov = qiov;
+        // Add the first request to the merged one. If the requests are
+        // overlapping, drop the last sectors of the first request.
+        size = (reqs[i].sector - reqs[0].sector) << 9;
+        qemu_iovec_concat(qiov, reqs[0].qiov, size);
 
-            mcb->callbacks[i].free_qiov = reqs[outidx].qiov;
-        } else {
-            outidx++;
-            reqs[outidx].sector     = reqs[i].sector;
-            reqs[outidx].nb_sectors = reqs[i].nb_sectors;
-            reqs[outidx].qiov       = reqs[i].qiov;
+        // We might need to add some zeros between the two requests
+        if (reqs[i].sector > oldreq_last) {
+            size_t zero_bytes = (reqs[i].sector - oldreq_last) << 9;
+            uint8_t *buf = qemu_blockalign(bs, zero_bytes);
+            memset(buf, 0, zero_bytes);
+            qemu_iovec_add(qiov, buf, zero_bytes);
+            mcb->callbacks[i].free_buf = buf;
         }
+
+        // Add the second request
+        qemu_iovec_concat(qiov, reqs[i].qiov, reqs[i].qiov->size);
+
+        reqs[0].nb_sectors = qiov->size >> 9;
+        reqs[0].qiov = qiov;
+
+        mcb->callbacks[i].cb = reqs[i].cb;
+        mcb->callbacks[i].opaque = reqs[i].opaque;
+        mcb->callbacks[i].free_qiov = qiov;
+        bs->nr_merged[is_write ? BDRV_ACCT_WRITE : BDRV_ACCT_READ]++;
     }
 
-    return outidx + 1;
+    mcb->num_callbacks = i;
+    return i;
 }
 
 /*
- * Submit multiple AIO write requests at once.
- *
- * On success, the function returns 0 and all requests in the reqs array have
- * been submitted. In error case this function returns -1, and any of the
- * requests may or may not be submitted yet. In particular, this means that the
- * callback will be called for some of the requests, for others it won't. The
- * caller must check the error field of the BlockRequest to wait for the right
- * callbacks (if error != 0, no callback will be called).
- *
- * The implementation may modify the contents of the reqs array, e.g. to merge
- * requests. However, the fields opaque and error are left unmodified as they
- * are used to signal failure for a single request to the caller.
+ * Submits the requests starting at reqs[0] that can be merged into a single
+ * one. They share a completion and an error code, requests that could not be
+ * merged are not affected by them. Returns the number of requests submitted,
+ * or -1 if the merged request could not be submitted.
  */
-int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+static int multiwrite_submit_merged(BlockDriverState *bs, BlockRequest *reqs,
+                                    int num_reqs, bool is_write)
 {
     BlockDriverAIOCB *acb;
     MultiwriteCB *mcb;
-    int i;
+    int n;
+
+    mcb = g_malloc0(sizeof(*mcb) + num_reqs * sizeof(*mcb->callbacks));
+    n = multiwrite_merge(bs, reqs, num_reqs, mcb, is_write);
+    mcb->num_requests = 1;
+
+    if (is_write) {
+        trace_bdrv_aio_multiwrite(mcb, mcb->num_callbacks, 1);
+        acb = bdrv_aio_writev(bs, reqs[0].sector, reqs[0].qiov,
+            reqs[0].nb_sectors, multiwrite_cb, mcb);
+    } else {
+        trace_bdrv_aio_multiread(mcb, mcb->num_callbacks, 1);
+        acb = bdrv_aio_readv(bs, reqs[0].sector, reqs[0].qiov,
+            reqs[0].nb_sectors, multiwrite_cb, mcb);
+    }
+
+    if (acb == NULL) {
+        trace_bdrv_aio_multiwrite_earlyfail(mcb);
+        multiwrite_free_bufs(mcb);
+        g_free(mcb);
+        return -1;
+    }
+
+    return n;
+}
+
+static int bdrv_aio_multi_rw(BlockDriverState *bs, BlockRequest *reqs,
+                             int num_reqs, bool is_write)
+{
+    int i, j, n;
 
     /* don't submit writes if we don't have a medium */
     if (bs->drv == NULL) {
@@ -2401,78 +3094,56 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
         return -1;
     }
 
-    if (num_reqs == 0) {
-        return 0;
-    }
-
-    // Create MultiwriteCB structure
-    mcb = g_malloc0(sizeof(*mcb) + num_reqs * sizeof(*mcb->callbacks));
-    mcb->num_requests = 0;
-    mcb->num_callbacks = num_reqs;
-
-    for (i = 0; i < num_reqs; i++) {
-        mcb->callbacks[i].cb = reqs[i].cb;
-        mcb->callbacks[i].opaque = reqs[i].opaque;
-    }
-
-    // Check for mergable requests
-    num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb);
-
-    trace_bdrv_aio_multiwrite(mcb, mcb->num_callbacks, num_reqs);
+    // Sort requests by start sector
+    qsort(reqs, num_reqs, sizeof(*reqs), &multiwrite_req_compare);
 
     /*
-     * Run the aio requests. As soon as one request can't be submitted
-     * successfully, fail all requests that are not yet submitted (we must
-     * return failure for all requests anyway)
+     * Each group of merged requests completes on its own, so a slow or
+     * failing request does not hold back or fail the unrelated ones.
      *
-     * num_requests cannot be set to the right value immediately: If
-     * bdrv_aio_writev fails for some request, num_requests would be too high
-     * and therefore multiwrite_cb() would never recognize the multiwrite
-     * request as completed. We also cannot use the loop variable i to set it
-     * when the first request fails because the callback may already have been
-     * called for previously submitted requests. Thus, num_requests must be
-     * incremented for each request that is submitted.
-     *
-     * The problem that callbacks may be called early also means that we need
-     * to take care that num_requests doesn't become 0 before all requests are
-     * submitted - multiwrite_cb() would consider the multiwrite request
-     * completed. A dummy request that is "completed" by a manual call to
-     * multiwrite_cb() takes care of this.
+     * As soon as one group can't be submitted, fail all requests that are
+     * not yet submitted. The groups that were submitted before report their
+     * result through their callbacks.
      */
-    mcb->num_requests = 1;
-
-    // Run the aio requests
-    for (i = 0; i < num_reqs; i++) {
-        mcb->num_requests++;
-        acb = bdrv_aio_writev(bs, reqs[i].sector, reqs[i].qiov,
-            reqs[i].nb_sectors, multiwrite_cb, mcb);
-
-        if (acb == NULL) {
-            // We can only fail the whole thing if no request has been
-            // submitted yet. Otherwise we'll wait for the submitted AIOs to
-            // complete and report the error in the callback.
-            if (i == 0) {
-                trace_bdrv_aio_multiwrite_earlyfail(mcb);
-                goto fail;
-            } else {
-                trace_bdrv_aio_multiwrite_latefail(mcb, i);
-                multiwrite_cb(mcb, -EIO);
-                break;
+    for (i = 0; i < num_reqs; i += n) {
+        n = multiwrite_submit_merged(bs, &reqs[i], num_reqs - i, is_write);
+        if (n < 0) {
+            for (j = i; j < num_reqs; j++) {
+                reqs[j].error = -EIO;
             }
+            return -1;
         }
     }
 
-    /* Complete the dummy request */
-    multiwrite_cb(mcb, 0);
-
     return 0;
+}
 
-fail:
-    for (i = 0; i < mcb->num_callbacks; i++) {
-        reqs[i].error = -EIO;
-    }
-    g_free(mcb);
-    return -1;
+/*
+ * Submit multiple AIO write requests at once.
+ *
+ * On success, the function returns 0 and all requests in the reqs array have
+ * been submitted. In error case this function returns -1, and any of the
+ * requests may or may not be submitted yet. In particular, this means that the
+ * callback will be called for some of the requests, for others it won't. The
+ * caller must check the error field of the BlockRequest to wait for the right
+ * callbacks (if error != 0, no callback will be called).
+ *
+ * The implementation may modify the contents of the reqs array, e.g. to merge
+ * requests. However, the fields opaque and error are left unmodified as they
+ * are used to signal failure for a single request to the caller.
+ */
+int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+{
+    return bdrv_aio_multi_rw(bs, reqs, num_reqs, true);
+}
+
+/*
+ * Submit multiple AIO read requests at once, merging sequential ones.  Same
+ * semantics as bdrv_aio_multiwrite().
+ */
+int bdrv_aio_multiread(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+{
+    return bdrv_aio_multi_rw(bs, reqs, num_reqs, false);
 }
 
 void bdrv_aio_cancel(BlockDriverAIOCB *acb)
@@ -2576,7 +3247,7 @@ typedef struct BlockDriverAIOCBCoroutine {
 
 static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
 {
-    qemu_aio_flush();
+    bdrv_drain_all();
 }
 
 static AIOPool bdrv_em_co_aio_pool = {
@@ -2780,6 +3451,32 @@ static int coroutine_fn bdrv_co_writev_em(BlockDriverState *bs,
     return bdrv_co_io_em(bs, sector_num, nb_sectors, iov, true);
 }
 
+/*
+ * Run func(opaque) on a worker thread and yield until it is done, so that
+ * drivers can decompress or checksum data without blocking the main loop.
+ * func must not touch any block layer state.  Hosts without a worker pool
+ * run it right away.
+ */
+int coroutine_fn bdrv_co_run_in_worker(BlockDriverState *bs,
+                                       int (*func)(void *), void *opaque)
+{
+#ifdef CONFIG_POSIX
+    CoroutineIOCompletion co = {
+        .coroutine = qemu_coroutine_self(),
+    };
+    BlockDriverAIOCB *acb;
+
+    if (paio_init() == 0) {
+        acb = paio_call(bs, func, opaque, bdrv_co_io_em_complete, &co);
+        if (acb) {
+            qemu_coroutine_yield();
+            return co.ret;
+        }
+    }
+#endif
+    return func(opaque);
+}
+
 static void coroutine_fn bdrv_flush_co_entry(void *opaque)
 {
     RwCo *rwco = opaque;
@@ -2787,14 +3484,10 @@ static void coroutine_fn bdrv_flush_co_entry(void *opaque)
     rwco->ret = bdrv_co_flush(rwco->bs);
 }
 
-int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+static int coroutine_fn bdrv_co_do_flush(BlockDriverState *bs)
 {
     int ret;
 
-    if (!bs->drv) {
-        return 0;
-    }
-
     /* Write back cached data to the OS even with cache=unsafe */
     if (bs->drv->bdrv_co_flush_to_os) {
         ret = bs->drv->bdrv_co_flush_to_os(bs);
@@ -2839,6 +3532,21 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
     }
 }
 
+int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+{
+    int ret;
+
+    if (!bs->drv) {
+        return 0;
+    }
+
+    bdrv_in_flight_begin(bs);
+    ret = bdrv_co_do_flush(bs);
+    bdrv_in_flight_end(bs);
+
+    return ret;
+}
+
 void bdrv_invalidate_cache(BlockDriverState *bs)
 {
     if (bs->drv && bs->drv->bdrv_invalidate_cache) {
@@ -2996,6 +3704,36 @@ void bdrv_lock_medium(BlockDriverState *bs, bool locked)
     }
 }
 
+/**
+ * Start collecting requests into a batch.  Requests submitted until the
+ * matching bdrv_io_unplug() may be delayed by the driver and handed to the
+ * host in a single call.  Calls can be nested.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+/**
+ * Submit the requests collected since bdrv_io_plug().
+ */
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
 /* needed for generic scsi interface */
 
 int bdrv_ioctl(BlockDriverState *bs, unsigned long int req, void *buf)
@@ -3084,6 +3822,16 @@ int bdrv_in_use(BlockDriverState *bs)
     return bs->in_use;
 }
 
+void bdrv_add_close_notifier(BlockDriverState *bs, Notifier *notify)
+{
+    notifier_list_add(&bs->close_notifiers, notify);
+}
+
+void bdrv_remove_close_notifier(BlockDriverState *bs, Notifier *notify)
+{
+    notifier_list_remove(&bs->close_notifiers, notify);
+}
+
 void bdrv_iostatus_enable(BlockDriverState *bs)
 {
     bs->iostatus_enabled = true;
@@ -3136,14 +3884,26 @@ bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
     cookie->type = type;
 }
 
+static int bdrv_latency_bucket(int64_t latency_ns)
+{
+    uint64_t latency_us = MAX(latency_ns, 0) / 1000;
+    int bucket = latency_us ? 64 - clz64(latency_us) : 0;
+
+    return MIN(bucket, BDRV_LATENCY_BUCKETS - 1);
+}
+
 void
 bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
 {
+    int64_t now = get_clock();
+    int64_t latency_ns = now - cookie->start_time_ns;
+
     assert(cookie->type < BDRV_MAX_IOTYPE);
 
     bs->nr_bytes[cookie->type] += cookie->bytes;
     bs->nr_ops[cookie->type]++;
-    bs->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
+    bs->total_time_ns[cookie->type] += latency_ns;
+    bs->latency[cookie->type][bdrv_latency_bucket(latency_ns)]++;
 }
 
 int bdrv_img_create(const char *filename, const char *fmt,
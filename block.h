@@ -6,6 +6,7 @@
 #include "qemu-option.h"
 #include "qemu-coroutine.h"
 #include "qobject.h"
+#include "notify.h"
 
 /* block.c */
 typedef struct BlockDriver BlockDriver;
@@ -17,6 +18,23 @@ typedef struct BlockDriverInfo {
     int64_t vm_state_offset;
 } BlockDriverInfo;
 
+/*
+ * A range of sectors with uniform allocation status, as returned by
+ * bdrv_get_extents().  If none of the flags below is set the range is not
+ * allocated in this image and its contents come from the backing file.
+ */
+#define BDRV_EXTENT_DATA    0x1 /* data is allocated in this image */
+#define BDRV_EXTENT_ZERO    0x2 /* range reads as zeroes */
+#define BDRV_EXTENT_OFFSET  0x4 /* file/offset is where the data is stored */
+
+typedef struct BlockExtent {
+    int64_t sector_num;
+    int64_t nb_sectors;
+    int flags;
+    BlockDriverState *file;
+    int64_t offset;     /* in bytes */
+} BlockExtent;
+
 typedef struct QEMUSnapshotInfo {
     char id_str[128]; /* unique snapshot id */
     /* the following fields are informative. They are not needed for
@@ -158,6 +176,9 @@ typedef struct BdrvCheckResult {
 
 int bdrv_check(BlockDriverState *bs, BdrvCheckResult *res);
 
+int64_t bdrv_defrag(BlockDriverState *bs, int64_t *offset, int64_t max_bytes);
+void bdrv_defrag_cancel(BlockDriverState *bs);
+
 /* async block I/O */
 typedef struct BlockDriverAIOCB BlockDriverAIOCB;
 typedef void BlockDriverCompletionFunc(void *opaque, int ret);
@@ -177,7 +198,7 @@ BlockDriverAIOCB *bdrv_aio_discard(BlockDriverState *bs,
 void bdrv_aio_cancel(BlockDriverAIOCB *acb);
 
 typedef struct BlockRequest {
-    /* Fields to be filled by multiwrite caller */
+    /* Fields to be filled by multiwrite/multiread caller */
     int64_t sector;
     int nb_sectors;
     QEMUIOVector *qiov;
@@ -190,6 +211,8 @@ typedef struct BlockRequest {
 
 int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs,
     int num_reqs);
+int bdrv_aio_multiread(BlockDriverState *bs, BlockRequest *reqs,
+    int num_reqs);
 
 /* sg packet commands */
 int bdrv_ioctl(BlockDriverState *bs, unsigned long int req, void *buf);
@@ -206,12 +229,21 @@ int bdrv_flush(BlockDriverState *bs);
 int coroutine_fn bdrv_co_flush(BlockDriverState *bs);
 void bdrv_flush_all(void);
 void bdrv_close_all(void);
+void bdrv_drain_all(void);
 
 int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors);
 int bdrv_co_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors);
 int bdrv_has_zero_init(BlockDriverState *bs);
+int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, int *pnum);
 int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
                       int *pnum);
+int bdrv_get_extents(BlockDriverState *bs, int64_t sector_num,
+                     int64_t nb_sectors, BlockExtent *extents,
+                     int max_extents);
+void bdrv_add_extent(BlockExtent *extents, int *nb_extents,
+                     int64_t sector_num, int64_t nb_sectors, int flags,
+                     BlockDriverState *file, int64_t offset);
 
 #define BIOS_ATA_TRANSLATION_AUTO   0
 #define BIOS_ATA_TRANSLATION_NONE   1
@@ -245,6 +277,8 @@ int bdrv_is_inserted(BlockDriverState *bs);
 int bdrv_media_changed(BlockDriverState *bs);
 void bdrv_lock_medium(BlockDriverState *bs, bool locked);
 void bdrv_eject(BlockDriverState *bs, int eject_flag);
+void bdrv_io_plug(BlockDriverState *bs);
+void bdrv_io_unplug(BlockDriverState *bs);
 void bdrv_get_format(BlockDriverState *bs, char *buf, int buf_size);
 BlockDriverState *bdrv_find(const char *name);
 BlockDriverState *bdrv_next(BlockDriverState *bs);
@@ -259,6 +293,11 @@ void bdrv_iterate_format(void (*it)(void *opaque, const char *name),
 const char *bdrv_get_device_name(BlockDriverState *bs);
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors);
+int bdrv_compress_cluster(BlockDriverState *bs, const uint8_t *buf,
+                          uint8_t *out_buf, int level);
+int bdrv_write_compressed_cluster(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf,
+                                  const uint8_t *out_buf, int out_len);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 
 const char *bdrv_get_encrypted_filename(BlockDriverState *bs);
@@ -308,6 +347,18 @@ int64_t bdrv_get_dirty_count(BlockDriverState *bs);
 void bdrv_set_in_use(BlockDriverState *bs, int in_use);
 int bdrv_in_use(BlockDriverState *bs);
 
+void bdrv_add_close_notifier(BlockDriverState *bs, Notifier *notify);
+
+#ifdef CONFIG_LINUX_AIO
+int raw_get_aio_fd(BlockDriverState *bs);
+#else
+static inline int raw_get_aio_fd(BlockDriverState *bs)
+{
+    return -ENOTSUP;
+}
+#endif
+void bdrv_remove_close_notifier(BlockDriverState *bs, Notifier *notify);
+
 enum BlockAcctType {
     BDRV_ACCT_READ,
     BDRV_ACCT_WRITE,
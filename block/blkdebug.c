@@ -23,8 +23,12 @@
  */
 
 #include "qemu-common.h"
+#include "qemu-timer.h"
 #include "block_int.h"
 #include "module.h"
+#ifdef CONFIG_POSIX
+#include "block/raw-posix-aio.h"
+#endif
 
 typedef struct BlkdebugVars {
     int state;
@@ -41,18 +45,38 @@ typedef struct BlkdebugVars {
     bool inject_immediately;
 } BlkdebugVars;
 
+/* Request types for delay and bandwidth rules */
+enum {
+    BLKDEBUG_IO_READ,
+    BLKDEBUG_IO_WRITE,
+    BLKDEBUG_IO_FLUSH,
+    BLKDEBUG_IO_MAX,
+};
+
 typedef struct BDRVBlkdebugState {
     BlkdebugVars vars;
     QLIST_HEAD(list, BlkdebugRule) rules[BLKDBG_EVENT_MAX];
+    QLIST_HEAD(io_list, BlkdebugRule) io_rules[BLKDEBUG_IO_MAX];
+
+    /* Fixed seed, so that runs with the same requests get the same delays */
+    uint64_t rand_state;
 } BDRVBlkdebugState;
 
 typedef struct BlkdebugAIOCB {
     BlockDriverAIOCB common;
     QEMUBH *bh;
     int ret;
+
+    /* Delayed requests */
+    BlockDriverAIOCB *child;    /* request or sleep in flight */
+    int64_t complete_at;        /* earliest completion time (get_clock()) */
+    int64_t delay_ns;
+    QEMUTimer *timer;           /* delay timer, if timers run */
+    QLIST_ENTRY(BlkdebugAIOCB) timer_next;
 } BlkdebugAIOCB;
 
 static void blkdebug_aio_cancel(BlockDriverAIOCB *blockacb);
+static void delay_timer_remove(BlkdebugAIOCB *acb);
 
 static AIOPool blkdebug_aio_pool = {
     .aiocb_size = sizeof(BlkdebugAIOCB),
@@ -62,6 +86,8 @@ static AIOPool blkdebug_aio_pool = {
 enum {
     ACTION_INJECT_ERROR,
     ACTION_SET_STATE,
+    ACTION_DELAY,
+    ACTION_BANDWIDTH,
 };
 
 typedef struct BlkdebugRule {
@@ -77,6 +103,15 @@ typedef struct BlkdebugRule {
         struct {
             int new_state;
         } set_state;
+        struct {
+            int64_t latency;
+            int64_t jitter;
+            int probability;
+        } delay;
+        struct {
+            uint64_t bps;
+            int64_t busy_until;
+        } bandwidth;
     } options;
     QLIST_ENTRY(BlkdebugRule) next;
 } BlkdebugRule;
@@ -129,12 +164,80 @@ static QemuOptsList set_state_opts = {
     },
 };
 
+/*
+ * [delay] makes requests of the given type ("read", "write" or "flush") take
+ * at least latency + a uniformly distributed 0..jitter microseconds.  With
+ * probability (in percent) only some requests are delayed, several rules for
+ * the same type add up, e.g. for occasional flush stalls or latency tails.
+ *
+ * [bandwidth] limits reads or writes to bps bytes per second.  Requests of
+ * the type are transferred one after another at that rate.
+ *
+ * Both only slow requests down to the configured speed: a request that the
+ * image file needs longer for completes when the image file is done.
+ */
+static QemuOptsList delay_opts = {
+    .name = "delay",
+    .head = QTAILQ_HEAD_INITIALIZER(delay_opts.head),
+    .desc = {
+        {
+            .name = "type",
+            .type = QEMU_OPT_STRING,
+        },
+        {
+            .name = "state",
+            .type = QEMU_OPT_NUMBER,
+        },
+        {
+            .name = "latency",
+            .type = QEMU_OPT_NUMBER,
+        },
+        {
+            .name = "jitter",
+            .type = QEMU_OPT_NUMBER,
+        },
+        {
+            .name = "probability",
+            .type = QEMU_OPT_NUMBER,
+        },
+        { /* end of list */ }
+    },
+};
+
+static QemuOptsList bandwidth_opts = {
+    .name = "bandwidth",
+    .head = QTAILQ_HEAD_INITIALIZER(bandwidth_opts.head),
+    .desc = {
+        {
+            .name = "type",
+            .type = QEMU_OPT_STRING,
+        },
+        {
+            .name = "state",
+            .type = QEMU_OPT_NUMBER,
+        },
+        {
+            .name = "bps",
+            .type = QEMU_OPT_NUMBER,
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList *config_groups[] = {
     &inject_error_opts,
     &set_state_opts,
+    &delay_opts,
+    &bandwidth_opts,
     NULL
 };
 
+static const char *io_type_names[BLKDEBUG_IO_MAX] = {
+    [BLKDEBUG_IO_READ]                      = "read",
+    [BLKDEBUG_IO_WRITE]                     = "write",
+    [BLKDEBUG_IO_FLUSH]                     = "flush",
+};
+
 static const char *event_names[BLKDBG_EVENT_MAX] = {
     [BLKDBG_L1_UPDATE]                      = "l1_update",
     [BLKDBG_L1_GROW_ALLOC_TABLE]            = "l1_grow.alloc_table",
@@ -242,6 +345,59 @@ static int add_rule(QemuOpts *opts, void *opaque)
     return 0;
 }
 
+static int add_io_rule(QemuOpts *opts, void *opaque)
+{
+    struct add_rule_data *d = opaque;
+    BDRVBlkdebugState *s = d->s;
+    const char *type_name;
+    struct BlkdebugRule *rule;
+    int type;
+
+    /* Find the request type for the rule */
+    type_name = qemu_opt_get(opts, "type");
+    if (!type_name) {
+        return -1;
+    }
+    for (type = 0; type < BLKDEBUG_IO_MAX; type++) {
+        if (!strcmp(io_type_names[type], type_name)) {
+            break;
+        }
+    }
+    if (type == BLKDEBUG_IO_MAX ||
+        (d->action == ACTION_BANDWIDTH && type == BLKDEBUG_IO_FLUSH)) {
+        return -1;
+    }
+
+    rule = g_malloc0(sizeof(*rule));
+    *rule = (struct BlkdebugRule) {
+        .action = d->action,
+        .state  = qemu_opt_get_number(opts, "state", 0),
+    };
+
+    switch (d->action) {
+    case ACTION_DELAY:
+        rule->options.delay.latency =
+            qemu_opt_get_number(opts, "latency", 0) * 1000;
+        rule->options.delay.jitter =
+            qemu_opt_get_number(opts, "jitter", 0) * 1000;
+        rule->options.delay.probability =
+            qemu_opt_get_number(opts, "probability", 100);
+        break;
+
+    case ACTION_BANDWIDTH:
+        rule->options.bandwidth.bps = qemu_opt_get_number(opts, "bps", 0);
+        if (rule->options.bandwidth.bps == 0) {
+            g_free(rule);
+            return -1;
+        }
+        break;
+    }
+
+    QLIST_INSERT_HEAD(&s->io_rules[type], rule, next);
+
+    return 0;
+}
+
 static int read_config(BDRVBlkdebugState *s, const char *filename)
 {
     FILE *f;
@@ -265,10 +421,24 @@ static int read_config(BDRVBlkdebugState *s, const char *filename)
     d.action = ACTION_SET_STATE;
     qemu_opts_foreach(&set_state_opts, add_rule, &d, 0);
 
+    d.action = ACTION_DELAY;
+    if (qemu_opts_foreach(&delay_opts, add_io_rule, &d, 1)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    d.action = ACTION_BANDWIDTH;
+    if (qemu_opts_foreach(&bandwidth_opts, add_io_rule, &d, 1)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
     ret = 0;
 fail:
     qemu_opts_reset(&inject_error_opts);
     qemu_opts_reset(&set_state_opts);
+    qemu_opts_reset(&delay_opts);
+    qemu_opts_reset(&bandwidth_opts);
     fclose(f);
     return ret;
 }
@@ -303,6 +473,7 @@ static int blkdebug_open(BlockDriverState *bs, const char *filename, int flags)
 
     /* Set initial state */
     s->vars.state = 1;
+    s->rand_state = 1;
 
     /* Open the backing file */
     ret = bdrv_file_open(&bs->file, filename, flags);
@@ -324,9 +495,211 @@ static void error_callback_bh(void *opaque)
 static void blkdebug_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     BlkdebugAIOCB *acb = container_of(blockacb, BlkdebugAIOCB, common);
+
+    if (acb->bh) {
+        qemu_bh_delete(acb->bh);
+    }
+    if (acb->child) {
+        bdrv_aio_cancel(acb->child);
+    }
+    if (acb->timer) {
+        delay_timer_remove(acb);
+    }
     qemu_aio_release(acb);
 }
 
+/* xorshift64* */
+static uint64_t blkdebug_rand(BDRVBlkdebugState *s)
+{
+    s->rand_state ^= s->rand_state >> 12;
+    s->rand_state ^= s->rand_state << 25;
+    s->rand_state ^= s->rand_state >> 27;
+    return s->rand_state * 2685821657736338717ULL;
+}
+
+/* Earliest time at which a request of the given type may complete */
+static int64_t io_complete_time(BDRVBlkdebugState *s, int type, int64_t bytes)
+{
+    int64_t now = get_clock();
+    int64_t delay = 0, complete_at = now;
+    struct BlkdebugRule *rule;
+
+    QLIST_FOREACH(rule, &s->io_rules[type], next) {
+        if (rule->state && rule->state != s->vars.state) {
+            continue;
+        }
+
+        switch (rule->action) {
+        case ACTION_DELAY:
+            if (rule->options.delay.probability < 100 &&
+                blkdebug_rand(s) % 100 >= rule->options.delay.probability) {
+                break;
+            }
+            delay += rule->options.delay.latency;
+            if (rule->options.delay.jitter) {
+                delay += blkdebug_rand(s) % (rule->options.delay.jitter + 1);
+            }
+            break;
+
+        case ACTION_BANDWIDTH:
+            rule->options.bandwidth.busy_until =
+                MAX(now, rule->options.bandwidth.busy_until) +
+                bytes * 1000000000LL / rule->options.bandwidth.bps;
+            complete_at = MAX(complete_at, rule->options.bandwidth.busy_until);
+            break;
+        }
+    }
+
+    return MAX(complete_at, now + delay);
+}
+
+static void delay_sleep_done(void *opaque, int ret)
+{
+    BlkdebugAIOCB *acb = opaque;
+
+    acb->common.cb(acb->common.opaque, acb->ret);
+    qemu_aio_release(acb);
+}
+
+#ifdef CONFIG_POSIX
+/*
+ * Requests waiting for their delay timer.  Timers only run in the main loop,
+ * not in the qemu_aio_wait() loops of bdrv_drain_all() or synchronous I/O.
+ * There the delayed requests are completed right away, like bdrv_drain_all()
+ * does with throttled requests, so that the waits terminate.
+ */
+static QLIST_HEAD(, BlkdebugAIOCB) delay_timer_acbs =
+    QLIST_HEAD_INITIALIZER(delay_timer_acbs);
+static int delay_timer_fds[2] = { -1, -1 };
+
+static void delay_timer_remove(BlkdebugAIOCB *acb)
+{
+    QLIST_REMOVE(acb, timer_next);
+    qemu_del_timer(acb->timer);
+    qemu_free_timer(acb->timer);
+    acb->timer = NULL;
+}
+
+static void delay_timer_cb(void *opaque)
+{
+    BlkdebugAIOCB *acb = opaque;
+
+    delay_timer_remove(acb);
+    delay_sleep_done(acb, 0);
+}
+
+/* Never called, the pipe is only there to hook into qemu_aio_wait() */
+static void delay_timer_read(void *opaque)
+{
+}
+
+static int delay_timer_flush(void *opaque)
+{
+    return !QLIST_EMPTY(&delay_timer_acbs);
+}
+
+static int delay_timer_process_queue(void *opaque)
+{
+    BlkdebugAIOCB *acb;
+    int ret = 0;
+
+    while ((acb = QLIST_FIRST(&delay_timer_acbs))) {
+        delay_timer_cb(acb);
+        ret = 1;
+    }
+    return ret;
+}
+
+static int delay_timer_start(BlkdebugAIOCB *acb)
+{
+    if (delay_timer_fds[0] < 0) {
+        if (qemu_pipe(delay_timer_fds) < 0) {
+            return -errno;
+        }
+        qemu_aio_set_fd_handler(delay_timer_fds[0], delay_timer_read, NULL,
+                                delay_timer_flush, delay_timer_process_queue,
+                                NULL);
+    }
+
+    acb->timer = qemu_new_timer_ns(rt_clock, delay_timer_cb, acb);
+    qemu_mod_timer(acb->timer, qemu_get_clock_ns(rt_clock) + acb->delay_ns);
+    QLIST_INSERT_HEAD(&delay_timer_acbs, acb, timer_next);
+    return 0;
+}
+
+/* Only used by the tools, which have no timers */
+static int delay_sleep(void *opaque)
+{
+    BlkdebugAIOCB *acb = opaque;
+    struct timespec ts = {
+        .tv_sec  = acb->delay_ns / 1000000000LL,
+        .tv_nsec = acb->delay_ns % 1000000000LL,
+    };
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        /* sleep for the rest of the time */
+    }
+    return 0;
+}
+#else
+static void delay_timer_remove(BlkdebugAIOCB *acb)
+{
+}
+#endif
+
+/*
+ * Completes a request once its delay has passed.  The emulator uses a timer,
+ * the tools sleep on a worker thread.  If neither is possible, the request
+ * completes without delay rather than blocking the main loop.
+ */
+static void delay_io_done(void *opaque, int ret)
+{
+    BlkdebugAIOCB *acb = opaque;
+
+    acb->ret = ret;
+    acb->child = NULL;
+    acb->delay_ns = acb->complete_at - get_clock();
+    if (acb->delay_ns > 0) {
+#ifdef CONFIG_POSIX
+        /* rt_clock is only set up by the emulator */
+        if (rt_clock) {
+            if (delay_timer_start(acb) == 0) {
+                return;
+            }
+        } else if (paio_init() == 0) {
+            acb->child = paio_call(acb->common.bs, delay_sleep, acb,
+                                   delay_sleep_done, acb);
+            if (acb->child) {
+                return;
+            }
+        }
+#endif
+    }
+    delay_sleep_done(acb, 0);
+}
+
+/*
+ * Returns an AIOCB that completes the request no earlier than the delay and
+ * bandwidth rules allow, or NULL if there are no such rules.
+ */
+static BlkdebugAIOCB *delay_aio_get(BlockDriverState *bs, int type,
+    int64_t bytes, BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVBlkdebugState *s = bs->opaque;
+    BlkdebugAIOCB *acb;
+
+    if (QLIST_EMPTY(&s->io_rules[type])) {
+        return NULL;
+    }
+
+    acb = qemu_aio_get(&blkdebug_aio_pool, bs, cb, opaque);
+    acb->bh = NULL;
+    acb->child = NULL;
+    acb->timer = NULL;
+    acb->complete_at = io_complete_time(s, type, bytes);
+    return acb;
+}
+
 static BlockDriverAIOCB *inject_error(BlockDriverState *bs,
     BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -345,6 +718,8 @@ static BlockDriverAIOCB *inject_error(BlockDriverState *bs,
 
     acb = qemu_aio_get(&blkdebug_aio_pool, bs, cb, opaque);
     acb->ret = -error;
+    acb->child = NULL;
+    acb->timer = NULL;
 
     bh = qemu_bh_new(error_callback_bh, acb);
     acb->bh = bh;
@@ -358,11 +733,26 @@ static BlockDriverAIOCB *blkdebug_aio_readv(BlockDriverState *bs,
     BlockDriverCompletionFunc *cb, void *opaque)
 {
     BDRVBlkdebugState *s = bs->opaque;
+    BlkdebugAIOCB *delay_acb;
 
     if (s->vars.inject_errno) {
         return inject_error(bs, cb, opaque);
     }
 
+    delay_acb = delay_aio_get(bs, BLKDEBUG_IO_READ,
+                              (int64_t)nb_sectors * BDRV_SECTOR_SIZE,
+                              cb, opaque);
+    if (delay_acb) {
+        delay_acb->child = bdrv_aio_readv(bs->file, sector_num, qiov,
+                                          nb_sectors, delay_io_done,
+                                          delay_acb);
+        if (!delay_acb->child) {
+            qemu_aio_release(delay_acb);
+            return NULL;
+        }
+        return &delay_acb->common;
+    }
+
     BlockDriverAIOCB *acb =
         bdrv_aio_readv(bs->file, sector_num, qiov, nb_sectors, cb, opaque);
     return acb;
@@ -373,11 +763,26 @@ static BlockDriverAIOCB *blkdebug_aio_writev(BlockDriverState *bs,
     BlockDriverCompletionFunc *cb, void *opaque)
 {
     BDRVBlkdebugState *s = bs->opaque;
+    BlkdebugAIOCB *delay_acb;
 
     if (s->vars.inject_errno) {
         return inject_error(bs, cb, opaque);
     }
 
+    delay_acb = delay_aio_get(bs, BLKDEBUG_IO_WRITE,
+                              (int64_t)nb_sectors * BDRV_SECTOR_SIZE,
+                              cb, opaque);
+    if (delay_acb) {
+        delay_acb->child = bdrv_aio_writev(bs->file, sector_num, qiov,
+                                           nb_sectors, delay_io_done,
+                                           delay_acb);
+        if (!delay_acb->child) {
+            qemu_aio_release(delay_acb);
+            return NULL;
+        }
+        return &delay_acb->common;
+    }
+
     BlockDriverAIOCB *acb =
         bdrv_aio_writev(bs->file, sector_num, qiov, nb_sectors, cb, opaque);
     return acb;
@@ -395,14 +800,37 @@ static void blkdebug_close(BlockDriverState *bs)
             g_free(rule);
         }
     }
+    for (i = 0; i < BLKDEBUG_IO_MAX; i++) {
+        QLIST_FOREACH_SAFE(rule, &s->io_rules[i], next, next) {
+            QLIST_REMOVE(rule, next);
+            g_free(rule);
+        }
+    }
 }
 
 static BlockDriverAIOCB *blkdebug_aio_flush(BlockDriverState *bs,
     BlockDriverCompletionFunc *cb, void *opaque)
 {
+    BlkdebugAIOCB *delay_acb;
+
+    delay_acb = delay_aio_get(bs, BLKDEBUG_IO_FLUSH, 0, cb, opaque);
+    if (delay_acb) {
+        delay_acb->child = bdrv_aio_flush(bs->file, delay_io_done, delay_acb);
+        if (!delay_acb->child) {
+            qemu_aio_release(delay_acb);
+            return NULL;
+        }
+        return &delay_acb->common;
+    }
+
     return bdrv_aio_flush(bs->file, cb, opaque);
 }
 
+static int64_t blkdebug_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file);
+}
+
 static void process_rule(BlockDriverState *bs, struct BlkdebugRule *rule,
     BlkdebugVars *old_vars)
 {
@@ -449,6 +877,7 @@ static BlockDriver bdrv_blkdebug = {
 
     .bdrv_file_open     = blkdebug_open,
     .bdrv_close         = blkdebug_close,
+    .bdrv_getlength     = blkdebug_getlength,
 
     .bdrv_aio_readv     = blkdebug_aio_readv,
     .bdrv_aio_writev    = blkdebug_aio_writev,
@@ -0,0 +1,240 @@
+/*
+ * Cache of decompressed chunks for read-only compressed image formats
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Formats like cloop and dmg store the image as independently compressed
+ * chunks, and a read of a single sector needs the whole chunk decompressed.
+ * The cache keeps the most recently used chunks so that random reads do not
+ * decompress the same chunk again and again.
+ *
+ * Requests run in coroutines and do not serialize on a driver lock: a miss
+ * fills its entry while other requests keep using the cache, so that several
+ * chunks can be read and decompressed at the same time.  A request that needs
+ * a chunk which is being filled waits for it instead of decompressing it a
+ * second time.
+ *
+ * Entries are reference counted while a request copies data out of them and
+ * the least recently used unreferenced entry is reused on a miss.
+ */
+
+#include "qemu-common.h"
+#include "qemu-coroutine.h"
+#include "block/chunk-cache.h"
+#include <zlib.h>
+
+#define CHUNK_NONE UINT32_MAX
+
+typedef struct ChunkCacheEntry {
+    uint32_t chunk;             /* CHUNK_NONE if the entry is unused */
+    uint8_t *data;
+    int ref;
+    bool filling;
+    uint64_t lru_counter;
+    CoQueue waiters;            /* requests waiting for the fill to finish */
+} ChunkCacheEntry;
+
+struct ChunkCache {
+    BlockDriverState *bs;
+    ChunkCacheFillFunc *fill;
+    size_t chunk_size;
+    int nb_entries;
+    ChunkCacheEntry *entries;
+    uint64_t lru_counter;
+    CoQueue free_waiters;       /* requests waiting for an unused entry */
+};
+
+ChunkCache *chunk_cache_create(BlockDriverState *bs, int nb_entries,
+                               size_t chunk_size, ChunkCacheFillFunc *fill)
+{
+    ChunkCache *c = g_malloc0(sizeof(*c));
+    int i;
+
+    c->bs = bs;
+    c->fill = fill;
+    c->chunk_size = chunk_size;
+    c->nb_entries = nb_entries;
+    c->entries = g_malloc0(nb_entries * sizeof(c->entries[0]));
+    qemu_co_queue_init(&c->free_waiters);
+
+    for (i = 0; i < nb_entries; i++) {
+        c->entries[i].chunk = CHUNK_NONE;
+        qemu_co_queue_init(&c->entries[i].waiters);
+    }
+
+    bs->has_cache_stats = true;
+    return c;
+}
+
+void chunk_cache_destroy(ChunkCache *c)
+{
+    int i;
+
+    if (!c) {
+        return;
+    }
+    for (i = 0; i < c->nb_entries; i++) {
+        assert(c->entries[i].ref == 0);
+        g_free(c->entries[i].data);
+    }
+    g_free(c->entries);
+    g_free(c);
+}
+
+static ChunkCacheEntry *chunk_cache_find(ChunkCache *c, uint32_t chunk)
+{
+    int i;
+
+    for (i = 0; i < c->nb_entries; i++) {
+        if (c->entries[i].chunk == chunk) {
+            return &c->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static ChunkCacheEntry *chunk_cache_find_victim(ChunkCache *c)
+{
+    ChunkCacheEntry *victim = NULL;
+    int i;
+
+    /* Entries being filled are referenced by the filling request */
+    for (i = 0; i < c->nb_entries; i++) {
+        ChunkCacheEntry *e = &c->entries[i];
+
+        if (e->ref == 0 && (!victim || e->lru_counter < victim->lru_counter)) {
+            victim = e;
+        }
+    }
+    return victim;
+}
+
+/*
+ * Return the decompressed data of chunk in *buf.  The buffer stays valid
+ * until it is released with chunk_cache_put().
+ */
+int coroutine_fn chunk_cache_get(ChunkCache *c, uint32_t chunk, uint8_t **buf)
+{
+    ChunkCacheEntry *e;
+    int ret;
+
+    for (;;) {
+        e = chunk_cache_find(c, chunk);
+        if (e && e->filling) {
+            qemu_co_queue_wait(&e->waiters);
+            continue;
+        }
+        if (e) {
+            e->ref++;
+            e->lru_counter = ++c->lru_counter;
+            c->bs->nr_cache_hits++;
+            *buf = e->data;
+            return 0;
+        }
+
+        e = chunk_cache_find_victim(c);
+        if (e) {
+            break;
+        }
+        qemu_co_queue_wait(&c->free_waiters);
+    }
+
+    c->bs->nr_cache_misses++;
+    if (!e->data) {
+        e->data = g_malloc(c->chunk_size);
+    }
+    e->chunk = chunk;
+    e->ref = 1;
+    e->filling = true;
+
+    ret = c->fill(c->bs, chunk, e->data);
+
+    e->filling = false;
+    e->lru_counter = ++c->lru_counter;
+    while (qemu_co_queue_next(&e->waiters)) {
+        /* waiters look the chunk up again */
+    }
+
+    if (ret < 0) {
+        e->chunk = CHUNK_NONE;
+        e->lru_counter = 0;
+        chunk_cache_put(c, e->data);
+        return ret;
+    }
+
+    *buf = e->data;
+    return 0;
+}
+
+void chunk_cache_put(ChunkCache *c, uint8_t *buf)
+{
+    int i;
+
+    for (i = 0; i < c->nb_entries; i++) {
+        ChunkCacheEntry *e = &c->entries[i];
+
+        if (e->data == buf) {
+            assert(e->ref > 0);
+            if (--e->ref == 0) {
+                qemu_co_queue_next(&c->free_waiters);
+            }
+            return;
+        }
+    }
+    abort();
+}
+
+typedef struct ChunkInflate {
+    uint8_t *in;
+    size_t in_len;
+    uint8_t *out;
+    size_t out_len;
+} ChunkInflate;
+
+/* Runs on a worker thread */
+static int chunk_inflate_func(void *opaque)
+{
+    ChunkInflate *job = opaque;
+    z_stream zstream;
+    int ret;
+
+    memset(&zstream, 0, sizeof(zstream));
+    if (inflateInit(&zstream) != Z_OK) {
+        return -ENOMEM;
+    }
+
+    zstream.next_in = job->in;
+    zstream.avail_in = job->in_len;
+    zstream.next_out = job->out;
+    zstream.avail_out = job->out_len;
+    ret = inflate(&zstream, Z_FINISH);
+    if (ret != Z_STREAM_END || zstream.total_out != job->out_len) {
+        ret = -EIO;
+    } else {
+        ret = 0;
+    }
+
+    inflateEnd(&zstream);
+    return ret;
+}
+
+/*
+ * Decompress a zlib stream of exactly out_len bytes on a worker thread, so
+ * that several chunks can be decompressed in parallel.
+ */
+int coroutine_fn chunk_cache_inflate(BlockDriverState *bs,
+                                     uint8_t *in, size_t in_len,
+                                     uint8_t *out, size_t out_len)
+{
+    ChunkInflate job = {
+        .in = in,
+        .in_len = in_len,
+        .out = out,
+        .out_len = out_len,
+    };
+
+    return bdrv_co_run_in_worker(bs, chunk_inflate_func, &job);
+}
@@ -0,0 +1,34 @@
+/*
+ * Cache of decompressed chunks for read-only compressed image formats
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_CHUNK_CACHE_H
+#define BLOCK_CHUNK_CACHE_H
+
+#include "block_int.h"
+
+typedef struct ChunkCache ChunkCache;
+
+/*
+ * Fill buf with the decompressed data of chunk.  Called in coroutine context,
+ * typically reads the compressed chunk and decompresses it with
+ * bdrv_co_run_in_worker().  Returns 0 or a negative errno.
+ */
+typedef int coroutine_fn ChunkCacheFillFunc(BlockDriverState *bs,
+                                            uint32_t chunk, uint8_t *buf);
+
+ChunkCache *chunk_cache_create(BlockDriverState *bs, int nb_entries,
+                               size_t chunk_size, ChunkCacheFillFunc *fill);
+void chunk_cache_destroy(ChunkCache *c);
+int coroutine_fn chunk_cache_get(ChunkCache *c, uint32_t chunk,
+                                 uint8_t **buf);
+void chunk_cache_put(ChunkCache *c, uint8_t *buf);
+
+int coroutine_fn chunk_cache_inflate(BlockDriverState *bs,
+                                     uint8_t *in, size_t in_len,
+                                     uint8_t *out, size_t out_len);
+
+#endif
@@ -24,20 +24,27 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "module.h"
+#include "block/chunk-cache.h"
 #include <zlib.h>
 
+/* Number of decompressed blocks that are kept in memory */
+#define CLOOP_CACHE_SIZE 16
+
+/* Limits that keep a corrupted header from allocating huge buffers */
+#define CLOOP_MAX_BLOCK_SIZE (64 * 1024 * 1024)
+#define CLOOP_MAX_OFFSETS (512 * 1024 * 1024 / sizeof(uint64_t))
+
 typedef struct BDRVCloopState {
-    CoMutex lock;
     uint32_t block_size;
     uint32_t n_blocks;
     uint64_t *offsets;
     uint32_t sectors_per_block;
-    uint32_t current_block;
-    uint8_t *compressed_block;
-    uint8_t *uncompressed_block;
-    z_stream zstream;
+    ChunkCache *cache;
 } BDRVCloopState;
 
+static int coroutine_fn cloop_fill_block(BlockDriverState *bs,
+                                         uint32_t block_num, uint8_t *buf);
+
 static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
     const char *magic_version_2_0 = "#!/bin/sh\n"
@@ -56,126 +63,126 @@ static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
 static int cloop_open(BlockDriverState *bs, int flags)
 {
     BDRVCloopState *s = bs->opaque;
-    uint32_t offsets_size, max_compressed_block_size = 1, i;
+    uint32_t offsets_size, max_compressed_block_size, i;
+    int ret;
 
     bs->read_only = 1;
 
     /* read header */
-    if (bdrv_pread(bs->file, 128, &s->block_size, 4) < 4) {
-        goto cloop_close;
+    ret = bdrv_pread(bs->file, 128, &s->block_size, 4);
+    if (ret < 0) {
+        return ret;
     }
     s->block_size = be32_to_cpu(s->block_size);
+    if (s->block_size == 0 || s->block_size % 512 ||
+        s->block_size > CLOOP_MAX_BLOCK_SIZE) {
+        return -EINVAL;
+    }
 
-    if (bdrv_pread(bs->file, 128 + 4, &s->n_blocks, 4) < 4) {
-        goto cloop_close;
+    ret = bdrv_pread(bs->file, 128 + 4, &s->n_blocks, 4);
+    if (ret < 0) {
+        return ret;
     }
     s->n_blocks = be32_to_cpu(s->n_blocks);
+    if (s->n_blocks >= CLOOP_MAX_OFFSETS) {
+        return -EINVAL;
+    }
 
-    /* read offsets */
-    offsets_size = s->n_blocks * sizeof(uint64_t);
+    /* read offsets, the last one is the end of the last block */
+    offsets_size = (s->n_blocks + 1) * sizeof(uint64_t);
     s->offsets = g_malloc(offsets_size);
-    if (bdrv_pread(bs->file, 128 + 4 + 4, s->offsets, offsets_size) <
-            offsets_size) {
-        goto cloop_close;
+    ret = bdrv_pread(bs->file, 128 + 4 + 4, s->offsets, offsets_size);
+    if (ret < 0) {
+        goto fail;
     }
-    for(i=0;i<s->n_blocks;i++) {
+
+    /* zlib never grows a block by more than compressBound() */
+    max_compressed_block_size = compressBound(s->block_size);
+    for(i=0;i<=s->n_blocks;i++) {
         s->offsets[i] = be64_to_cpu(s->offsets[i]);
-        if (i > 0) {
-            uint32_t size = s->offsets[i] - s->offsets[i - 1];
-            if (size > max_compressed_block_size) {
-                max_compressed_block_size = size;
-            }
+        if (i > 0 && (s->offsets[i] < s->offsets[i - 1] ||
+                      s->offsets[i] - s->offsets[i - 1] >
+                      max_compressed_block_size)) {
+            ret = -EINVAL;
+            goto fail;
         }
     }
 
-    /* initialize zlib engine */
-    s->compressed_block = g_malloc(max_compressed_block_size + 1);
-    s->uncompressed_block = g_malloc(s->block_size);
-    if (inflateInit(&s->zstream) != Z_OK) {
-        goto cloop_close;
-    }
-    s->current_block = s->n_blocks;
+    s->cache = chunk_cache_create(bs, CLOOP_CACHE_SIZE, s->block_size,
+                                  cloop_fill_block);
 
     s->sectors_per_block = s->block_size/512;
-    bs->total_sectors = s->n_blocks * s->sectors_per_block;
-    qemu_co_mutex_init(&s->lock);
+    bs->total_sectors = (int64_t)s->n_blocks * s->sectors_per_block;
     return 0;
 
-cloop_close:
-    return -1;
+fail:
+    g_free(s->offsets);
+    return ret;
 }
 
-static inline int cloop_read_block(BlockDriverState *bs, int block_num)
+/* Read and decompress a block, the decompression runs on a worker thread */
+static int coroutine_fn cloop_fill_block(BlockDriverState *bs,
+                                         uint32_t block_num, uint8_t *buf)
 {
     BDRVCloopState *s = bs->opaque;
+    uint32_t bytes = s->offsets[block_num + 1] - s->offsets[block_num];
+    uint8_t *compressed_block;
+    int ret;
 
-    if (s->current_block != block_num) {
-        int ret;
-        uint32_t bytes = s->offsets[block_num + 1] - s->offsets[block_num];
-
-        ret = bdrv_pread(bs->file, s->offsets[block_num], s->compressed_block,
-                         bytes);
-        if (ret != bytes) {
-            return -1;
-        }
-
-        s->zstream.next_in = s->compressed_block;
-        s->zstream.avail_in = bytes;
-        s->zstream.next_out = s->uncompressed_block;
-        s->zstream.avail_out = s->block_size;
-        ret = inflateReset(&s->zstream);
-        if (ret != Z_OK) {
-            return -1;
-        }
-        ret = inflate(&s->zstream, Z_FINISH);
-        if (ret != Z_STREAM_END || s->zstream.total_out != s->block_size) {
-            return -1;
-        }
-
-        s->current_block = block_num;
+    compressed_block = g_malloc(bytes);
+    ret = bdrv_pread(bs->file, s->offsets[block_num], compressed_block, bytes);
+    if (ret == bytes) {
+        ret = chunk_cache_inflate(bs, compressed_block, bytes,
+                                  buf, s->block_size);
+    } else if (ret >= 0) {
+        ret = -EIO;
     }
-    return 0;
+    g_free(compressed_block);
+    return ret;
 }
 
-static int cloop_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static coroutine_fn int cloop_co_readv(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
 {
     BDRVCloopState *s = bs->opaque;
-    int i;
-
-    for (i = 0; i < nb_sectors; i++) {
-        uint32_t sector_offset_in_block =
-            ((sector_num + i) % s->sectors_per_block),
-            block_num = (sector_num + i) / s->sectors_per_block;
-        if (cloop_read_block(bs, block_num) != 0) {
-            return -1;
+    QEMUIOVector hd_qiov;
+    uint64_t bytes_done = 0;
+    uint8_t *block;
+    int ret = 0;
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    while (nb_sectors > 0) {
+        uint32_t block_num = sector_num / s->sectors_per_block;
+        uint32_t sector_in_block = sector_num % s->sectors_per_block;
+        int n = MIN(nb_sectors, s->sectors_per_block - sector_in_block);
+
+        ret = chunk_cache_get(s->cache, block_num, &block);
+        if (ret < 0) {
+            break;
         }
-        memcpy(buf + i * 512,
-            s->uncompressed_block + sector_offset_in_block * 512, 512);
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done, n * BDRV_SECTOR_SIZE);
+        qemu_iovec_from_buffer(&hd_qiov, block + sector_in_block * 512,
+                               n * BDRV_SECTOR_SIZE);
+        chunk_cache_put(s->cache, block);
+
+        nb_sectors -= n;
+        sector_num += n;
+        bytes_done += n * BDRV_SECTOR_SIZE;
     }
-    return 0;
-}
 
-static coroutine_fn int cloop_co_read(BlockDriverState *bs, int64_t sector_num,
-                                      uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVCloopState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = cloop_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
 
 static void cloop_close(BlockDriverState *bs)
 {
     BDRVCloopState *s = bs->opaque;
-    if (s->n_blocks > 0) {
-        g_free(s->offsets);
-    }
-    g_free(s->compressed_block);
-    g_free(s->uncompressed_block);
-    inflateEnd(&s->zstream);
+    g_free(s->offsets);
+    chunk_cache_destroy(s->cache);
 }
 
 static BlockDriver bdrv_cloop = {
@@ -183,7 +190,7 @@ static BlockDriver bdrv_cloop = {
     .instance_size  = sizeof(BDRVCloopState),
     .bdrv_probe     = cloop_probe,
     .bdrv_open      = cloop_open,
-    .bdrv_read      = cloop_co_read,
+    .bdrv_co_readv  = cloop_co_readv,
     .bdrv_close     = cloop_close,
 };
 
@@ -35,9 +35,14 @@
 #endif
 
 #define CURL_NUM_STATES 8
+#define CURL_MAX_STATES 32
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
-#define READ_AHEAD_SIZE (256 * 1024)
+#define READ_AHEAD_SIZE (1024 * 1024)
+#define READ_AHEAD_MIN  (64 * 1024)
+
+#define CURL_CACHE_BLOCK_SIZE   (64 * 1024)
+#define CURL_CACHE_SIZE         (16 * 1024 * 1024)
 
 #define FIND_RET_NONE   0
 #define FIND_RET_OK     1
@@ -69,14 +74,34 @@ typedef struct CURLState
     char range[128];
     char errmsg[CURL_ERROR_SIZE];
     char in_use;
+    uint64_t lru_counter;       /* last use of the buffer */
 } CURLState;
 
+typedef struct CURLCacheEntry {
+    size_t offset;              /* -1 if the entry is unused */
+    size_t len;
+    char *data;
+    uint64_t lru_counter;
+} CURLCacheEntry;
+
 typedef struct BDRVCURLState {
     CURLM *multi;
     size_t len;
-    CURLState states[CURL_NUM_STATES];
+    CURLState states[CURL_MAX_STATES];
+    int num_states;
     char *url;
-    size_t readahead_size;
+    size_t readahead_size;      /* maximum readahead */
+
+    /* Sequential access detection */
+    size_t last_end;            /* end of the previous request */
+    size_t cur_readahead;       /* readahead for the next request */
+    size_t fetch_end;           /* end of the data requested so far */
+    uint64_t state_lru_counter;
+
+    /* Fetched blocks, kept after the transfer buffers are reused */
+    CURLCacheEntry *cache;
+    int cache_entries;
+    uint64_t cache_lru_counter;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
@@ -121,6 +146,21 @@ static size_t curl_size_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     return realsize;
 }
 
+/*
+ * An HTTP server that does not support ranges answers with 200 and sends the
+ * image from its start, which is only the requested data for offset 0.
+ */
+static bool curl_range_ignored(CURLState *s)
+{
+    long code = 0;
+
+    if (strncmp(s->s->url, "http", 4)) {
+        return false;
+    }
+    curl_easy_getinfo(s->curl, CURLINFO_RESPONSE_CODE, &code);
+    return code == 200 && s->buf_start != 0;
+}
+
 static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
 {
     CURLState *s = ((CURLState*)opaque);
@@ -132,6 +172,15 @@ static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     if (!s || !s->orig_buf)
         goto read_end;
 
+    if (s->buf_off == 0 && curl_range_ignored(s)) {
+        return 0;
+    }
+
+    if (s->buf_off + realsize > s->buf_len) {
+        /* The server sent more than the range, fail the transfer */
+        return 0;
+    }
+
     memcpy(s->orig_buf + s->buf_off, ptr, realsize);
     s->buf_off += realsize;
 
@@ -160,18 +209,17 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     int i;
     size_t end = start + len;
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i = 0; i < s->num_states; i++) {
         CURLState *state = &s->states[i];
         size_t buf_end = (state->buf_start + state->buf_off);
         size_t buf_fend = (state->buf_start + state->buf_len);
 
         if (!state->orig_buf)
             continue;
-        if (!state->buf_off)
-            continue;
 
         // Does the existing buffer cover our section?
-        if ((start >= state->buf_start) &&
+        if (state->buf_off &&
+            (start >= state->buf_start) &&
             (start <= buf_end) &&
             (end >= state->buf_start) &&
             (end <= buf_end))
@@ -180,12 +228,14 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
 
             qemu_iovec_from_buffer(acb->qiov, buf, len);
             acb->common.cb(acb->common.opaque, 0);
+            state->lru_counter = ++s->state_lru_counter;
 
             return FIND_RET_OK;
         }
 
         // Wait for unfinished chunks
-        if ((start >= state->buf_start) &&
+        if (state->in_use &&
+            (start >= state->buf_start) &&
             (start <= buf_fend) &&
             (end >= state->buf_start) &&
             (end <= buf_fend))
@@ -198,6 +248,7 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
             for (j=0; j<CURL_NUM_ACB; j++) {
                 if (!state->acb[j]) {
                     state->acb[j] = acb;
+                    state->lru_counter = ++s->state_lru_counter;
                     return FIND_RET_WAIT;
                 }
             }
@@ -207,6 +258,90 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     return FIND_RET_NONE;
 }
 
+static CURLCacheEntry *curl_cache_find(BDRVCURLState *s, size_t offset)
+{
+    int i;
+
+    for (i = 0; i < s->cache_entries; i++) {
+        if (s->cache[i].offset == offset) {
+            return &s->cache[i];
+        }
+    }
+    return NULL;
+}
+
+/* Add the complete blocks of a finished transfer to the cache */
+static void curl_cache_insert(BDRVCURLState *s, size_t start, const char *buf,
+                              size_t len)
+{
+    size_t offset = DIV_ROUND_UP(start, CURL_CACHE_BLOCK_SIZE) *
+                    CURL_CACHE_BLOCK_SIZE;
+    size_t end = start + len;
+
+    for (; offset < end; offset += CURL_CACHE_BLOCK_SIZE) {
+        size_t n = MIN(CURL_CACHE_BLOCK_SIZE, s->len - offset);
+        CURLCacheEntry *e;
+        int i;
+
+        if (offset + n > end) {
+            break;
+        }
+
+        e = curl_cache_find(s, offset);
+        if (!e) {
+            for (i = 0; i < s->cache_entries; i++) {
+                if (!e || s->cache[i].lru_counter < e->lru_counter) {
+                    e = &s->cache[i];
+                }
+            }
+            if (!e) {
+                return;
+            }
+            if (!e->data) {
+                e->data = g_malloc(CURL_CACHE_BLOCK_SIZE);
+            }
+            e->offset = offset;
+            e->len = n;
+            memcpy(e->data, buf + (offset - start), n);
+        }
+        e->lru_counter = ++s->cache_lru_counter;
+    }
+}
+
+/* Complete acb from the cache if all of its blocks are there */
+static bool curl_cache_read(BDRVCURLState *s, CURLAIOCB *acb, size_t start,
+                            size_t len)
+{
+    size_t first = start - start % CURL_CACHE_BLOCK_SIZE;
+    size_t end = start + len;
+    size_t offset;
+    QEMUIOVector qiov;
+
+    for (offset = first; offset < end; offset += CURL_CACHE_BLOCK_SIZE) {
+        CURLCacheEntry *e = curl_cache_find(s, offset);
+
+        if (!e || offset + e->len < MIN(end, offset + CURL_CACHE_BLOCK_SIZE)) {
+            return false;
+        }
+    }
+
+    qemu_iovec_init(&qiov, acb->qiov->niov);
+    for (offset = first; offset < end; offset += CURL_CACHE_BLOCK_SIZE) {
+        CURLCacheEntry *e = curl_cache_find(s, offset);
+        size_t from = MAX(start, offset);
+        size_t to = MIN(end, offset + CURL_CACHE_BLOCK_SIZE);
+
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_copy(&qiov, acb->qiov, from - start, to - from);
+        qemu_iovec_from_buffer(&qiov, e->data + (from - offset), to - from);
+        e->lru_counter = ++s->cache_lru_counter;
+    }
+    qemu_iovec_destroy(&qiov);
+
+    acb->common.cb(acb->common.opaque, 0);
+    return true;
+}
+
 static void curl_multi_do(void *arg)
 {
     BDRVCURLState *s = (BDRVCURLState *)arg;
@@ -238,20 +373,25 @@ static void curl_multi_do(void *arg)
                 CURLState *state = NULL;
                 curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&state);
 
-                /* ACBs for successful messages get completed in curl_read_cb */
-                if (msg->data.result != CURLE_OK) {
-                    int i;
-                    for (i = 0; i < CURL_NUM_ACB; i++) {
-                        CURLAIOCB *acb = state->acb[i];
+                int i;
 
-                        if (acb == NULL) {
-                            continue;
-                        }
+                if (msg->data.result == CURLE_OK) {
+                    curl_cache_insert(s, state->buf_start, state->orig_buf,
+                                      state->buf_off);
+                }
+
+                /* ACBs for successful messages get completed in
+                 * curl_read_cb, the rest failed or were cut short */
+                for (i = 0; i < CURL_NUM_ACB; i++) {
+                    CURLAIOCB *acb = state->acb[i];
 
-                        acb->common.cb(acb->common.opaque, -EIO);
-                        qemu_aio_release(acb);
-                        state->acb[i] = NULL;
+                    if (acb == NULL) {
+                        continue;
                     }
+
+                    acb->common.cb(acb->common.opaque, -EIO);
+                    qemu_aio_release(acb);
+                    state->acb[i] = NULL;
                 }
 
                 curl_clean_state(state);
@@ -264,24 +404,36 @@ static void curl_multi_do(void *arg)
     } while(msgs_in_queue);
 }
 
+static int curl_num_free_states(BDRVCURLState *s)
+{
+    int i, n = 0;
+
+    for (i = 0; i < s->num_states; i++) {
+        if (!s->states[i].in_use) {
+            n++;
+        }
+    }
+    return n;
+}
+
 static CURLState *curl_init_state(BDRVCURLState *s)
 {
     CURLState *state = NULL;
-    int i, j;
+    int i;
 
     do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
-            for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
-                    continue;
+        /* Reuse the buffer that was used least recently */
+        for (i = 0; i < s->num_states; i++) {
             if (s->states[i].in_use)
                 continue;
 
-            state = &s->states[i];
-            state->in_use = 1;
-            break;
+            if (!state || s->states[i].lru_counter < state->lru_counter) {
+                state = &s->states[i];
+            }
         }
-        if (!state) {
+        if (state) {
+            state->in_use = 1;
+        } else {
             usleep(100);
             curl_multi_do(s);
         }
@@ -303,6 +455,9 @@ static CURLState *curl_init_state(BDRVCURLState *s)
     curl_easy_setopt(state->curl, CURLOPT_NOSIGNAL, 1);
     curl_easy_setopt(state->curl, CURLOPT_ERRORBUFFER, state->errmsg);
     curl_easy_setopt(state->curl, CURLOPT_FAILONERROR, 1);
+#if LIBCURL_VERSION_NUM >= 0x071900
+    curl_easy_setopt(state->curl, CURLOPT_TCP_KEEPALIVE, 1);
+#endif
 
 #ifdef DEBUG_VERBOSE
     curl_easy_setopt(state->curl, CURLOPT_VERBOSE, 1);
@@ -322,47 +477,129 @@ static void curl_clean_state(CURLState *s)
     s->in_use = 0;
 }
 
+/*
+ * Fetch len bytes at start into the buffer of state.  With the cache enabled
+ * the range is extended to whole cache blocks, so that all fetched data can
+ * be cached.
+ */
+static void curl_start_transfer(BDRVCURLState *s, CURLState *state,
+                                size_t start, size_t len)
+{
+    size_t align = s->cache_entries ? CURL_CACHE_BLOCK_SIZE : SECTOR_SIZE;
+    size_t end = DIV_ROUND_UP(start + len, align) * align;
+
+    state->buf_off = 0;
+    if (state->orig_buf)
+        g_free(state->orig_buf);
+    state->lru_counter = ++s->state_lru_counter;
+    state->buf_start = start - start % align;
+    state->buf_len = MIN(end, s->len) - state->buf_start;
+    state->orig_buf = g_malloc(state->buf_len);
+
+    snprintf(state->range, 127, "%zd-%zd", state->buf_start,
+             state->buf_start + state->buf_len - 1);
+    DPRINTF("CURL (AIO): Fetching %s\n", state->range);
+    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+
+    curl_multi_add_handle(s->multi, state->curl);
+}
+
+/*
+ * While the guest reads sequentially, keep the next readahead window in
+ * flight so that its requests find the data already on the way.  One state
+ * is always left for requests that miss.
+ */
+static void curl_prefetch(BDRVCURLState *s)
+{
+    CURLState *state;
+    size_t start = MAX(s->fetch_end, s->last_end);
+
+    /* Skip what is still cached from an earlier pass */
+    while (start < s->len &&
+           curl_cache_find(s, start - start % CURL_CACHE_BLOCK_SIZE)) {
+        start = start - start % CURL_CACHE_BLOCK_SIZE + CURL_CACHE_BLOCK_SIZE;
+    }
+    s->fetch_end = start;
+
+    if (s->cur_readahead == 0 || start >= s->len ||
+        start - s->last_end >= s->cur_readahead ||
+        curl_num_free_states(s) < 2) {
+        return;
+    }
+
+    state = curl_init_state(s);
+    if (!state) {
+        return;
+    }
+    curl_start_transfer(s, state, start, s->cur_readahead);
+    s->fetch_end = state->buf_start + state->buf_len;
+    curl_multi_do(s);
+}
+
+/*
+ * Options follow the URL as ":readahead=<bytes>:connections=<n>:".  Strip
+ * the last "name=<number>:" from file and return its value.
+ */
+static bool curl_strip_option(char *file, const char *name, size_t *val)
+{
+    size_t len = strlen(file);
+    size_t name_len = strlen(name);
+    char *p;
+
+    if (len == 0 || file[len - 1] != ':') {
+        return false;
+    }
+    p = file + len - 1;
+    while (p > file && qemu_isdigit(p[-1])) {
+        p--;
+    }
+    if (p == file + len - 1 || p - file < name_len + 2 || p[-1] != '=' ||
+        p[-2 - name_len] != ':' ||
+        strncmp(p - 1 - name_len, name, name_len) != 0) {
+        return false;
+    }
+
+    *val = strtoull(p, NULL, 10);
+    p[-1 - name_len] = '\0';
+    return true;
+}
+
 static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVCURLState *s = bs->opaque;
     CURLState *state = NULL;
     double d;
 
-    #define RA_OPTSTR ":readahead="
     char *file;
-    char *ra;
-    const char *ra_val;
-    int parse_state = 0;
+    size_t connections = CURL_NUM_STATES;
+    size_t cache_size = CURL_CACHE_SIZE;
+    struct {
+        const char *name;
+        size_t *val;
+    } opts[] = {
+        { "readahead",      &s->readahead_size },
+        { "connections",    &connections },
+        { "cache",          &cache_size },
+    };
+    bool found, has_opts = false;
+    int i;
 
     static int inited = 0;
 
     file = g_strdup(filename);
     s->readahead_size = READ_AHEAD_SIZE;
 
-    /* Parse a trailing ":readahead=#:" param, if present. */
-    ra = file + strlen(file) - 1;
-    while (ra >= file) {
-        if (parse_state == 0) {
-            if (*ra == ':')
-                parse_state++;
-            else
-                break;
-        } else if (parse_state == 1) {
-            if (*ra > '9' || *ra < '0') {
-                char *opt_start = ra - strlen(RA_OPTSTR) + 1;
-                if (opt_start > file &&
-                    strncmp(opt_start, RA_OPTSTR, strlen(RA_OPTSTR)) == 0) {
-                    ra_val = ra + 1;
-                    ra -= strlen(RA_OPTSTR) - 1;
-                    *ra = '\0';
-                    s->readahead_size = atoi(ra_val);
-                    break;
-                } else {
-                    break;
-                }
+    /* Parse trailing options, if present. */
+    do {
+        found = false;
+        for (i = 0; i < ARRAY_SIZE(opts); i++) {
+            if (curl_strip_option(file, opts[i].name, opts[i].val)) {
+                found = has_opts = true;
             }
         }
-        ra--;
+    } while (found);
+    if (has_opts) {
+        file[strlen(file) - 1] = '\0';
     }
 
     if ((s->readahead_size & 0x1ff) != 0) {
@@ -370,6 +607,13 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
                 s->readahead_size);
         goto out_noclean;
     }
+    if (connections < 1 || connections > CURL_MAX_STATES) {
+        fprintf(stderr, "CURL: connections must be between 1 and %d\n",
+                CURL_MAX_STATES);
+        goto out_noclean;
+    }
+    s->num_states = connections;
+    s->cur_readahead = MIN(READ_AHEAD_MIN, s->readahead_size);
 
     if (!inited) {
         curl_global_init(CURL_GLOBAL_ALL);
@@ -407,8 +651,17 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
     s->multi = curl_multi_init();
     curl_multi_setopt( s->multi, CURLMOPT_SOCKETDATA, s); 
     curl_multi_setopt( s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb ); 
+    /* Keep one connection alive per state */
+    curl_multi_setopt(s->multi, CURLMOPT_MAXCONNECTS, (long)s->num_states);
     curl_multi_do(s);
 
+    s->cache_entries = cache_size / CURL_CACHE_BLOCK_SIZE;
+    s->cache = g_malloc0(s->cache_entries * sizeof(s->cache[0]));
+    for (i = 0; i < s->cache_entries; i++) {
+        s->cache[i].offset = -1;
+    }
+    bs->has_cache_stats = true;
+
     return 0;
 
 out:
@@ -425,7 +678,7 @@ static int curl_aio_flush(void *opaque)
     BDRVCURLState *s = opaque;
     int i, j;
 
-    for (i=0; i < CURL_NUM_STATES; i++) {
+    for (i = 0; i < s->num_states; i++) {
         for(j=0; j < CURL_NUM_ACB; j++) {
             if (s->states[i].acb[j]) {
                 return 1;
@@ -453,25 +706,48 @@ static void curl_readv_bh_cb(void *p)
     CURLAIOCB *acb = p;
     BDRVCURLState *s = acb->common.bs->opaque;
 
+    BlockDriverState *bs = acb->common.bs;
+    int ret;
+
     qemu_bh_delete(acb->bh);
     acb->bh = NULL;
 
     size_t start = acb->sector_num * SECTOR_SIZE;
-    size_t end;
+    size_t len = acb->nb_sectors * SECTOR_SIZE;
+    bool sequential = (start == s->last_end);
+
+    // Grow the readahead while the guest reads sequentially, fall back
+    // to the minimum on random access.
+    if (sequential) {
+        s->cur_readahead = MIN(MAX(s->cur_readahead * 2, READ_AHEAD_MIN),
+                               s->readahead_size);
+    } else {
+        s->cur_readahead = MIN(READ_AHEAD_MIN, s->readahead_size);
+    }
+    s->last_end = start + len;
 
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
-    switch (curl_find_buf(s, start, acb->nb_sectors * SECTOR_SIZE, acb)) {
+    ret = curl_find_buf(s, start, len, acb);
+    if (ret == FIND_RET_NONE && curl_cache_read(s, acb, start, len)) {
+        ret = FIND_RET_OK;
+    }
+    switch (ret) {
         case FIND_RET_OK:
             qemu_aio_release(acb);
             // fall through
         case FIND_RET_WAIT:
+            bs->nr_cache_hits++;
+            if (sequential) {
+                curl_prefetch(s);
+            }
             return;
         default:
             break;
     }
 
     // No cache found, so let's start a new request
+    bs->nr_cache_misses++;
     state = curl_init_state(s);
     if (!state) {
         acb->common.cb(acb->common.opaque, -EIO);
@@ -479,26 +755,13 @@ static void curl_readv_bh_cb(void *p)
         return;
     }
 
-    acb->start = 0;
-    acb->end = (acb->nb_sectors * SECTOR_SIZE);
-
-    state->buf_off = 0;
-    if (state->orig_buf)
-        g_free(state->orig_buf);
-    state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
-    state->orig_buf = g_malloc(state->buf_len);
+    DPRINTF("CURL (AIO): Reading %zd at %zd\n", len, start);
+    curl_start_transfer(s, state, start, len + s->cur_readahead);
+    acb->start = start - state->buf_start;
+    acb->end = acb->start + len;
     state->acb[0] = acb;
-
-    snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (acb->nb_sectors * SECTOR_SIZE), start, state->range);
-    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
-
-    curl_multi_add_handle(s->multi, state->curl);
+    s->fetch_end = state->buf_start + state->buf_len;
     curl_multi_do(s);
-
 }
 
 static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
@@ -534,7 +797,7 @@ static void curl_close(BlockDriverState *bs)
     int i;
 
     DPRINTF("CURL: Close\n");
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i = 0; i < s->num_states; i++) {
         if (s->states[i].in_use)
             curl_clean_state(&s->states[i]);
         if (s->states[i].curl) {
@@ -548,6 +811,10 @@ static void curl_close(BlockDriverState *bs)
     }
     if (s->multi)
         curl_multi_cleanup(s->multi);
+    for (i = 0; i < s->cache_entries; i++) {
+        g_free(s->cache[i].data);
+    }
+    g_free(s->cache);
     if (s->url)
         free(s->url);
 }
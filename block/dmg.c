@@ -25,10 +25,17 @@
 #include "block_int.h"
 #include "bswap.h"
 #include "module.h"
+#include "block/chunk-cache.h"
 #include <zlib.h>
 
+/* Number of decompressed chunks that are kept in memory */
+#define DMG_CACHE_SIZE 16
+
+/* Limit that keeps a corrupted chunk table from allocating huge buffers */
+#define DMG_MAX_CHUNK_SIZE (64 * 1024 * 1024)
+#define DMG_MAX_SECTORS_PER_CHUNK (DMG_MAX_CHUNK_SIZE / 512)
+
 typedef struct BDRVDMGState {
-    CoMutex lock;
     /* each chunk contains a certain number of sectors,
      * offsets[i] is the offset in the .dmg file,
      * lengths[i] is the length of the compressed chunk,
@@ -43,12 +50,12 @@ typedef struct BDRVDMGState {
     uint64_t* lengths;
     uint64_t* sectors;
     uint64_t* sectorcounts;
-    uint32_t current_chunk;
-    uint8_t *compressed_chunk;
-    uint8_t *uncompressed_chunk;
-    z_stream zstream;
+    ChunkCache *cache;
 } BDRVDMGState;
 
+static int coroutine_fn dmg_fill_chunk(BlockDriverState *bs, uint32_t chunk,
+                                       uint8_t *buf);
+
 static int dmg_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
     int len=strlen(filename);
@@ -78,19 +85,23 @@ static int dmg_open(BlockDriverState *bs, int flags)
     BDRVDMGState *s = bs->opaque;
     off_t info_begin,info_end,last_in_offset,last_out_offset;
     uint32_t count;
-    uint32_t max_compressed_size=1,max_sectors_per_chunk=1,i;
-    int64_t offset;
+    uint32_t i;
+    uint64_t max_sectors_per_chunk = 1, chunk_size;
+    int64_t offset, file_size;
+    int ret = -EINVAL;
 
     bs->read_only = 1;
     s->n_chunks = 0;
+    s->types = NULL;
     s->offsets = s->lengths = s->sectors = s->sectorcounts = NULL;
 
     /* read offset of info blocks */
-    offset = bdrv_getlength(bs->file);
-    if (offset < 0) {
+    file_size = bdrv_getlength(bs->file);
+    if (file_size < 0) {
+        ret = file_size;
         goto fail;
     }
-    offset -= 0x1d8;
+    offset = file_size - 0x1d8;
 
     info_begin = read_off(bs, offset);
     if (info_begin == 0) {
@@ -121,13 +132,19 @@ static int dmg_open(BlockDriverState *bs, int flags)
 
 	type = read_uint32(bs, offset);
 	if (type == 0x6d697368 && count >= 244) {
-	    int new_size, chunk_count;
+	    size_t new_size;
+	    int chunk_count;
+
+            /* the chunk table must be in the file */
+            if (count > file_size - offset) {
+                goto fail;
+            }
 
             offset += 4;
             offset += 200;
 
 	    chunk_count = (count-204)/40;
-	    new_size = sizeof(uint64_t) * (s->n_chunks + chunk_count);
+	    new_size = sizeof(uint64_t) * ((size_t)s->n_chunks + chunk_count);
 	    s->types = g_realloc(s->types, new_size/2);
 	    s->offsets = g_realloc(s->offsets, new_size);
 	    s->lengths = g_realloc(s->lengths, new_size);
@@ -138,7 +155,7 @@ static int dmg_open(BlockDriverState *bs, int flags)
 		s->types[i] = read_uint32(bs, offset);
 		offset += 4;
 		if(s->types[i]!=0x80000005 && s->types[i]!=1 && s->types[i]!=2) {
-		    if(s->types[i]==0xffffffff) {
+		    if (s->types[i] == 0xffffffff && i > 0) {
 			last_in_offset = s->offsets[i-1]+s->lengths[i-1];
 			last_out_offset = s->sectors[i-1]+s->sectorcounts[i-1];
 		    }
@@ -161,8 +178,23 @@ static int dmg_open(BlockDriverState *bs, int flags)
 		s->lengths[i] = read_off(bs, offset);
 		offset += 8;
 
-		if(s->lengths[i]>max_compressed_size)
-		    max_compressed_size = s->lengths[i];
+                /*
+                 * Chunks are read whole into a buffer of the largest chunk
+                 * size, so their data must fit in it.
+                 */
+                if (s->sectorcounts[i] > DMG_MAX_SECTORS_PER_CHUNK) {
+                    goto fail;
+                }
+                if (s->types[i] == 1 &&
+                    s->lengths[i] > 512 * s->sectorcounts[i]) {
+                    goto fail;
+                }
+                /* zlib never grows data by more than compressBound() */
+                if (s->types[i] == 0x80000005 &&
+                    s->lengths[i] > compressBound(512 * s->sectorcounts[i])) {
+                    goto fail;
+                }
+
 		if(s->sectorcounts[i]>max_sectors_per_chunk)
 		    max_sectors_per_chunk = s->sectorcounts[i];
 	    }
@@ -170,28 +202,27 @@ static int dmg_open(BlockDriverState *bs, int flags)
 	}
     }
 
-    /* initialize zlib engine */
-    s->compressed_chunk = g_malloc(max_compressed_size+1);
-    s->uncompressed_chunk = g_malloc(512*max_sectors_per_chunk);
-    if(inflateInit(&s->zstream) != Z_OK)
-	goto fail;
+    /* the image ends with the last chunk */
+    if (s->n_chunks > 0) {
+        bs->total_sectors = s->sectors[s->n_chunks - 1] +
+                            s->sectorcounts[s->n_chunks - 1];
+    }
 
-    s->current_chunk = s->n_chunks;
+    if (max_sectors_per_chunk > DMG_MAX_SECTORS_PER_CHUNK) {
+        goto fail;
+    }
+    chunk_size = 512 * max_sectors_per_chunk;
 
-    qemu_co_mutex_init(&s->lock);
+    s->cache = chunk_cache_create(bs, DMG_CACHE_SIZE, chunk_size,
+                                  dmg_fill_chunk);
     return 0;
 fail:
-    return -1;
-}
-
-static inline int is_sector_in_chunk(BDRVDMGState* s,
-		uint32_t chunk_num,int sector_num)
-{
-    if(chunk_num>=s->n_chunks || s->sectors[chunk_num]>sector_num ||
-	    s->sectors[chunk_num]+s->sectorcounts[chunk_num]<=sector_num)
-	return 0;
-    else
-	return -1;
+    g_free(s->types);
+    g_free(s->offsets);
+    g_free(s->lengths);
+    g_free(s->sectors);
+    g_free(s->sectorcounts);
+    return ret;
 }
 
 static inline uint32_t search_chunk(BDRVDMGState* s,int sector_num)
@@ -210,102 +241,96 @@ static inline uint32_t search_chunk(BDRVDMGState* s,int sector_num)
     return s->n_chunks; /* error */
 }
 
-static inline int dmg_read_chunk(BlockDriverState *bs, int sector_num)
+/* Read a chunk into buf, decompression runs on a worker thread */
+static int coroutine_fn dmg_fill_chunk(BlockDriverState *bs, uint32_t chunk,
+                                       uint8_t *buf)
 {
     BDRVDMGState *s = bs->opaque;
+    uint8_t *compressed_chunk;
+    int ret;
 
-    if(!is_sector_in_chunk(s,s->current_chunk,sector_num)) {
-	int ret;
-	uint32_t chunk = search_chunk(s,sector_num);
-
-	if(chunk>=s->n_chunks)
-	    return -1;
-
-	s->current_chunk = s->n_chunks;
-	switch(s->types[chunk]) {
-	case 0x80000005: { /* zlib compressed */
-	    int i;
-
-	    /* we need to buffer, because only the chunk as whole can be
-	     * inflated. */
-	    i=0;
-	    do {
-                ret = bdrv_pread(bs->file, s->offsets[chunk] + i,
-                                 s->compressed_chunk+i, s->lengths[chunk]-i);
-		if(ret<0 && errno==EINTR)
-		    ret=0;
-		i+=ret;
-	    } while(ret>=0 && ret+i<s->lengths[chunk]);
-
-	    if (ret != s->lengths[chunk])
-		return -1;
-
-	    s->zstream.next_in = s->compressed_chunk;
-	    s->zstream.avail_in = s->lengths[chunk];
-	    s->zstream.next_out = s->uncompressed_chunk;
-	    s->zstream.avail_out = 512*s->sectorcounts[chunk];
-	    ret = inflateReset(&s->zstream);
-	    if(ret != Z_OK)
-		return -1;
-	    ret = inflate(&s->zstream, Z_FINISH);
-	    if(ret != Z_STREAM_END || s->zstream.total_out != 512*s->sectorcounts[chunk])
-		return -1;
-	    break; }
-	case 1: /* copy */
-	    ret = bdrv_pread(bs->file, s->offsets[chunk],
-                             s->uncompressed_chunk, s->lengths[chunk]);
-	    if (ret != s->lengths[chunk])
-		return -1;
-	    break;
-	case 2: /* zero */
-	    memset(s->uncompressed_chunk, 0, 512*s->sectorcounts[chunk]);
-	    break;
-	}
-	s->current_chunk = chunk;
+    switch (s->types[chunk]) {
+    case 0x80000005: /* zlib compressed */
+        /* we need to buffer, because only the chunk as whole can be
+         * inflated. */
+        compressed_chunk = g_malloc(s->lengths[chunk]);
+        ret = bdrv_pread(bs->file, s->offsets[chunk], compressed_chunk,
+                         s->lengths[chunk]);
+        if (ret == s->lengths[chunk]) {
+            ret = chunk_cache_inflate(bs, compressed_chunk, s->lengths[chunk],
+                                      buf, 512 * s->sectorcounts[chunk]);
+        } else if (ret >= 0) {
+            ret = -EIO;
+        }
+        g_free(compressed_chunk);
+        return ret;
+    case 1: /* copy */
+        ret = bdrv_pread(bs->file, s->offsets[chunk], buf, s->lengths[chunk]);
+        if (ret != s->lengths[chunk]) {
+            return ret < 0 ? ret : -EIO;
+        }
+        return 0;
+    default:
+        return -EIO;
     }
-    return 0;
 }
 
-static int dmg_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static coroutine_fn int dmg_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVDMGState *s = bs->opaque;
-    int i;
-
-    for(i=0;i<nb_sectors;i++) {
-	uint32_t sector_offset_in_chunk;
-	if(dmg_read_chunk(bs, sector_num+i) != 0)
-	    return -1;
-	sector_offset_in_chunk = sector_num+i-s->sectors[s->current_chunk];
-	memcpy(buf+i*512,s->uncompressed_chunk+sector_offset_in_chunk*512,512);
+    QEMUIOVector hd_qiov;
+    uint64_t bytes_done = 0;
+    uint8_t *data;
+    int ret = 0;
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    while (nb_sectors > 0) {
+        uint32_t chunk = search_chunk(s, sector_num);
+        uint64_t sector_in_chunk;
+        int n;
+
+        if (chunk >= s->n_chunks) {
+            ret = -EIO;
+            break;
+        }
+        sector_in_chunk = sector_num - s->sectors[chunk];
+        n = MIN(nb_sectors, s->sectorcounts[chunk] - sector_in_chunk);
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done, n * BDRV_SECTOR_SIZE);
+
+        if (s->types[chunk] == 2) { /* zero */
+            qemu_iovec_memset(&hd_qiov, 0, n * BDRV_SECTOR_SIZE);
+        } else {
+            ret = chunk_cache_get(s->cache, chunk, &data);
+            if (ret < 0) {
+                break;
+            }
+            qemu_iovec_from_buffer(&hd_qiov, data + sector_in_chunk * 512,
+                                   n * BDRV_SECTOR_SIZE);
+            chunk_cache_put(s->cache, data);
+        }
+
+        nb_sectors -= n;
+        sector_num += n;
+        bytes_done += n * BDRV_SECTOR_SIZE;
     }
-    return 0;
-}
 
-static coroutine_fn int dmg_co_read(BlockDriverState *bs, int64_t sector_num,
-                                    uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVDMGState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = dmg_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
 
 static void dmg_close(BlockDriverState *bs)
 {
     BDRVDMGState *s = bs->opaque;
-    if(s->n_chunks>0) {
-	free(s->types);
-	free(s->offsets);
-	free(s->lengths);
-	free(s->sectors);
-	free(s->sectorcounts);
-    }
-    free(s->compressed_chunk);
-    free(s->uncompressed_chunk);
-    inflateEnd(&s->zstream);
+    g_free(s->types);
+    g_free(s->offsets);
+    g_free(s->lengths);
+    g_free(s->sectors);
+    g_free(s->sectorcounts);
+    chunk_cache_destroy(s->cache);
 }
 
 static BlockDriver bdrv_dmg = {
@@ -313,7 +338,7 @@ static BlockDriver bdrv_dmg = {
     .instance_size	= sizeof(BDRVDMGState),
     .bdrv_probe		= dmg_probe,
     .bdrv_open		= dmg_open,
-    .bdrv_read          = dmg_co_read,
+    .bdrv_co_readv      = dmg_co_readv,
     .bdrv_close		= dmg_close,
 };
 
@@ -31,6 +31,7 @@
 #include "block_int.h"
 #include "module.h"
 #include "qemu_socket.h"
+#include "qemu-aio.h"
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -46,14 +47,39 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
+#define MAX_NBD_REQUESTS    16
+#define NBD_MAX_SECTORS     (NBD_MAX_BUFFER_SIZE / BDRV_SECTOR_SIZE)
+
+/* Handles are the index of the request slot, scrambled so that a reply
+ * with a bogus handle is unlikely to match a request in flight.
+ */
+#define HANDLE_TO_INDEX(s, handle)  ((handle) ^ ((uint64_t)(intptr_t)(s)))
+#define INDEX_TO_HANDLE(s, index)   ((index) ^ ((uint64_t)(intptr_t)(s)))
+
 typedef struct BDRVNBDState {
-    CoMutex lock;
     int sock;
     uint32_t nbdflags;
     off_t size;
     size_t blocksize;
     char *export_name; /* An NBD server may export several devices */
 
+    /* Only one coroutine at a time may send a request */
+    CoMutex send_mutex;
+    Coroutine *send_coroutine;
+
+    /* Requests wait here while all MAX_NBD_REQUESTS slots are taken */
+    CoQueue free_queue;
+    int in_flight;
+
+    /* Slot i is owned by recv_coroutine[i]; reply_wait[i] is set once the
+     * request has been sent and the coroutine waits for or reads its reply.
+     */
+    Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
+    bool reply_wait[MAX_NBD_REQUESTS];
+
+    /* Header of the reply being received, handle is 0 if none */
+    struct nbd_reply reply;
+
     /* If it begins with  '/', this is a UNIX domain socket. Otherwise,
      * it's a string of the form <hostname|ip4|\[ip6\]>:port
      */
@@ -106,6 +132,142 @@ out:
     return err;
 }
 
+static int nbd_have_request(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+
+    return s->in_flight > 0;
+}
+
+static void nbd_reply_ready(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+    uint64_t i;
+
+    if (s->reply.handle == 0) {
+        /* No reply being received, fetch the next header */
+        if (nbd_receive_reply(s->sock, &s->reply) < 0) {
+            s->reply.handle = 0;
+            goto fail;
+        }
+    }
+
+    /* The coroutine owning the reply runs until it has read the payload,
+     * yielding back here whenever the socket runs dry, so there is no
+     * need for a lock on the receive side.
+     */
+    i = HANDLE_TO_INDEX(s, s->reply.handle);
+    if (i < MAX_NBD_REQUESTS && s->reply_wait[i]) {
+        qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+        return;
+    }
+
+fail:
+    /* The connection is broken or out of sync with the server.  Fail every
+     * request waiting for a reply, and stop watching the socket until the
+     * next request is sent.
+     */
+    if (!s->send_coroutine) {
+        qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL, NULL);
+    }
+    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+        if (s->reply_wait[i]) {
+            qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+        }
+    }
+    s->reply.handle = 0;
+}
+
+static void nbd_restart_write(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+
+    qemu_coroutine_enter(s->send_coroutine, NULL);
+}
+
+static void nbd_coroutine_start(BDRVNBDState *s, struct nbd_request *request)
+{
+    int i;
+
+    while (s->in_flight >= MAX_NBD_REQUESTS) {
+        qemu_co_queue_wait(&s->free_queue);
+    }
+    s->in_flight++;
+
+    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+        if (s->recv_coroutine[i] == NULL) {
+            s->recv_coroutine[i] = qemu_coroutine_self();
+            break;
+        }
+    }
+    assert(i < MAX_NBD_REQUESTS);
+
+    request->handle = INDEX_TO_HANDLE(s, i);
+}
+
+static void nbd_coroutine_end(BDRVNBDState *s, struct nbd_request *request)
+{
+    int i = HANDLE_TO_INDEX(s, request->handle);
+
+    s->recv_coroutine[i] = NULL;
+    s->reply_wait[i] = false;
+    s->in_flight--;
+    qemu_co_queue_next(&s->free_queue);
+}
+
+static int nbd_co_send_request(BDRVNBDState *s, struct nbd_request *request,
+                               QEMUIOVector *qiov)
+{
+    int ret;
+
+    qemu_co_mutex_lock(&s->send_mutex);
+    s->send_coroutine = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, nbd_restart_write,
+                            nbd_have_request, NULL, s);
+
+    ret = nbd_send_request(s->sock, request);
+    if (ret == 0 && qiov) {
+        if (qemu_co_sendv(s->sock, qiov->iov, qiov->niov) != request->len) {
+            ret = -1;
+        }
+    }
+
+    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, NULL,
+                            nbd_have_request, NULL, s);
+    s->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&s->send_mutex);
+    return ret < 0 ? -EIO : 0;
+}
+
+static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
+                                 struct nbd_reply *reply, QEMUIOVector *qiov)
+{
+    int i = HANDLE_TO_INDEX(s, request->handle);
+
+    /* Wait until nbd_reply_ready() has read the header of our reply, or
+     * gave up on the connection.
+     */
+    s->reply_wait[i] = true;
+    qemu_coroutine_yield();
+
+    *reply = s->reply;
+    if (reply->handle != request->handle) {
+        reply->error = EIO;
+        s->reply_wait[i] = false;
+        return;
+    }
+
+    if (qiov && reply->error == 0) {
+        if (qemu_co_recvv(s->sock, qiov->iov, qiov->niov) != request->len) {
+            reply->error = EIO;
+        }
+    }
+
+    /* Let nbd_reply_ready() read the next header */
+    s->reply_wait[i] = false;
+    s->reply.handle = 0;
+}
+
 static int nbd_establish_connection(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
@@ -135,8 +297,12 @@ static int nbd_establish_connection(BlockDriverState *bs)
         return -errno;
     }
 
-    /* Now that we're connected, set the socket to be non-blocking */
+    /* Now that we're connected, set the socket to be non-blocking and
+     * watch it for replies.
+     */
     socket_set_nonblock(sock);
+    qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL, nbd_have_request,
+                            NULL, s);
 
     s->sock = sock;
     s->size = size;
@@ -152,11 +318,12 @@ static void nbd_teardown_connection(BlockDriverState *bs)
     struct nbd_request request;
 
     request.type = NBD_CMD_DISC;
-    request.handle = (uint64_t)(intptr_t)bs;
+    request.handle = 0;
     request.from = 0;
     request.len = 0;
     nbd_send_request(s->sock, &request);
 
+    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL, NULL);
     closesocket(s->sock);
 }
 
@@ -174,92 +341,165 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
     /* establish TCP connection, return error if it fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
+    qemu_co_mutex_init(&s->send_mutex);
+    qemu_co_queue_init(&s->free_queue);
     result = nbd_establish_connection(bs);
 
-    qemu_co_mutex_init(&s->lock);
     return result;
 }
 
-static int nbd_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
     struct nbd_reply reply;
+    int ret;
 
     request.type = NBD_CMD_READ;
-    request.handle = (uint64_t)(intptr_t)bs;
-    request.from = sector_num * 512;;
-    request.len = nb_sectors * 512;
-
-    if (nbd_send_request(s->sock, &request) == -1)
-        return -errno;
-
-    if (nbd_receive_reply(s->sock, &reply) == -1)
-        return -errno;
-
-    if (reply.error !=0)
-        return -reply.error;
+    request.from = sector_num * BDRV_SECTOR_SIZE;
+    request.len = nb_sectors * BDRV_SECTOR_SIZE;
 
-    if (reply.handle != request.handle)
-        return -EIO;
-
-    if (nbd_wr_sync(s->sock, buf, request.len, 1) != request.len)
-        return -EIO;
-
-    return 0;
+    nbd_coroutine_start(s, &request);
+    ret = nbd_co_send_request(s, &request, NULL);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(s, &request, &reply, qiov);
+    }
+    nbd_coroutine_end(s, &request);
+    return -reply.error;
 }
 
-static int nbd_write(BlockDriverState *bs, int64_t sector_num,
-                     const uint8_t *buf, int nb_sectors)
+static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
+                           int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
     struct nbd_reply reply;
+    int ret;
 
     request.type = NBD_CMD_WRITE;
-    request.handle = (uint64_t)(intptr_t)bs;
-    request.from = sector_num * 512;;
-    request.len = nb_sectors * 512;
+    if (!bs->enable_write_cache && (s->nbdflags & NBD_FLAG_SEND_FUA)) {
+        request.type |= NBD_CMD_FLAG_FUA;
+    }
+    request.from = sector_num * BDRV_SECTOR_SIZE;
+    request.len = nb_sectors * BDRV_SECTOR_SIZE;
 
-    if (nbd_send_request(s->sock, &request) == -1)
-        return -errno;
+    nbd_coroutine_start(s, &request);
+    ret = nbd_co_send_request(s, &request, qiov);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(s, &request, &reply, NULL);
+    }
+    nbd_coroutine_end(s, &request);
+    return -reply.error;
+}
 
-    if (nbd_wr_sync(s->sock, (uint8_t*)buf, request.len, 0) != request.len)
-        return -EIO;
+/* The server refuses requests larger than NBD_MAX_BUFFER_SIZE, so split
+ * them into pieces that are sent one after the other.
+ */
+static int nbd_co_rw(BlockDriverState *bs, int64_t sector_num,
+                     int nb_sectors, QEMUIOVector *qiov, bool is_write)
+{
+    QEMUIOVector hd_qiov;
+    int offset = 0;
+    int ret = 0;
 
-    if (nbd_receive_reply(s->sock, &reply) == -1)
-        return -errno;
+    if (nb_sectors <= NBD_MAX_SECTORS) {
+        return is_write ? nbd_co_writev_1(bs, sector_num, nb_sectors, qiov) :
+                          nbd_co_readv_1(bs, sector_num, nb_sectors, qiov);
+    }
 
-    if (reply.error !=0)
-        return -reply.error;
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+    while (nb_sectors > 0) {
+        int n = MIN(nb_sectors, NBD_MAX_SECTORS);
 
-    if (reply.handle != request.handle)
-        return -EIO;
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, offset, n * BDRV_SECTOR_SIZE);
 
-    return 0;
+        if (is_write) {
+            ret = nbd_co_writev_1(bs, sector_num, n, &hd_qiov);
+        } else {
+            ret = nbd_co_readv_1(bs, sector_num, n, &hd_qiov);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        offset += n * BDRV_SECTOR_SIZE;
+    }
+    qemu_iovec_destroy(&hd_qiov);
+
+    return ret;
 }
 
-static coroutine_fn int nbd_co_read(BlockDriverState *bs, int64_t sector_num,
-                                    uint8_t *buf, int nb_sectors)
+static coroutine_fn int nbd_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors, QEMUIOVector *qiov)
 {
-    int ret;
-    BDRVNBDState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = nbd_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
+    return nbd_co_rw(bs, sector_num, nb_sectors, qiov, false);
+}
+
+static coroutine_fn int nbd_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
+{
+    return nbd_co_rw(bs, sector_num, nb_sectors, qiov, true);
 }
 
-static coroutine_fn int nbd_co_write(BlockDriverState *bs, int64_t sector_num,
-                                     const uint8_t *buf, int nb_sectors)
+static coroutine_fn int nbd_co_flush(BlockDriverState *bs)
 {
+    BDRVNBDState *s = bs->opaque;
+    struct nbd_request request;
+    struct nbd_reply reply;
     int ret;
+
+    if (!(s->nbdflags & NBD_FLAG_SEND_FLUSH)) {
+        return 0;
+    }
+
+    request.type = NBD_CMD_FLUSH;
+    request.from = 0;
+    request.len = 0;
+
+    nbd_coroutine_start(s, &request);
+    ret = nbd_co_send_request(s, &request, NULL);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(s, &request, &reply, NULL);
+    }
+    nbd_coroutine_end(s, &request);
+    return -reply.error;
+}
+
+static coroutine_fn int nbd_co_discard(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors)
+{
     BDRVNBDState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = nbd_write(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
+    struct nbd_request request;
+    struct nbd_reply reply;
+    int ret;
+
+    if (!(s->nbdflags & NBD_FLAG_SEND_TRIM)) {
+        return 0;
+    }
+
+    request.type = NBD_CMD_TRIM;
+    request.from = sector_num * BDRV_SECTOR_SIZE;
+    request.len = nb_sectors * BDRV_SECTOR_SIZE;
+
+    nbd_coroutine_start(s, &request);
+    ret = nbd_co_send_request(s, &request, NULL);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(s, &request, &reply, NULL);
+    }
+    nbd_coroutine_end(s, &request);
+    return -reply.error;
 }
 
 static void nbd_close(BlockDriverState *bs)
@@ -282,8 +522,10 @@ static BlockDriver bdrv_nbd = {
     .format_name	= "nbd",
     .instance_size	= sizeof(BDRVNBDState),
     .bdrv_file_open	= nbd_open,
-    .bdrv_read          = nbd_co_read,
-    .bdrv_write         = nbd_co_write,
+    .bdrv_co_readv      = nbd_co_readv,
+    .bdrv_co_writev     = nbd_co_writev,
+    .bdrv_co_flush_to_disk = nbd_co_flush,
+    .bdrv_co_discard    = nbd_co_discard,
     .bdrv_close		= nbd_close,
     .bdrv_getlength	= nbd_getlength,
     .protocol_name	= "nbd",
@@ -0,0 +1,538 @@
+/*
+ * qcow2 image defragmentation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * qcow2 allocates clusters in the order they are first written, so after
+ * random writes guest-contiguous data is scattered across the image file.
+ * Defragmentation walks the guest address space in order and moves each data
+ * cluster to the next target slot of the image file.  Target slots are the
+ * host clusters in file order, except for fixed ones: metadata, compressed
+ * clusters and clusters shared with snapshots stay where they are.  In the
+ * end guest-contiguous data is host-contiguous between the fixed clusters and
+ * the free clusters at the end of the file are cut off.
+ *
+ * If a target slot holds the data of another guest cluster, that cluster is
+ * evicted to a newly allocated cluster first.  A reverse map from host to
+ * guest clusters, built when defragmentation starts, finds these clusters.
+ *
+ * The work is done in batches within one L2 table.  A batch copies the data
+ * and flushes it, then points the L2 entries to the new clusters and flushes
+ * them before the old clusters are freed and may be reused.  A crash at any
+ * point leaves a consistent image, at worst with leaked clusters.
+ *
+ * The caller may let guest requests run between batches.  Guest writes and
+ * discards then make the reverse map stale, so each slot is checked against
+ * its refcount and the L2 entry of its guest cluster before it is used.
+ * During a batch s->lock is held, so guest requests cannot see half-moved
+ * clusters.  Requests that were already past the lock when the batch started
+ * must have been drained by the caller.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+
+typedef struct Qcow2Defrag {
+    uint64_t *rmap;             /* host cluster -> guest cluster + 1, or 0 */
+    int64_t rmap_size;          /* in host clusters */
+    int64_t next_slot;          /* next target host cluster */
+} Qcow2Defrag;
+
+typedef struct Qcow2DefragMove {
+    int64_t guest;              /* guest cluster index */
+    uint64_t src;               /* in bytes */
+    uint64_t dst;
+} Qcow2DefragMove;
+
+enum {
+    QCOW2_SLOT_FREE,
+    QCOW2_SLOT_DATA,            /* holds a movable data cluster */
+    QCOW2_SLOT_FIXED,
+};
+
+/* Only clusters that belong to the active L2 tables alone can be moved */
+static bool qcow2_defrag_is_movable(uint64_t l2_entry)
+{
+    return (l2_entry & QCOW_OFLAG_COPIED) &&
+           !(l2_entry & QCOW_OFLAG_COMPRESSED) &&
+           (l2_entry & ~QCOW_OFLAG_COPIED);
+}
+
+static uint64_t qcow2_defrag_rmap_get(Qcow2Defrag *d, int64_t host)
+{
+    return host < d->rmap_size ? d->rmap[host] : 0;
+}
+
+static void qcow2_defrag_rmap_set(Qcow2Defrag *d, int64_t host, uint64_t val)
+{
+    if (host >= d->rmap_size) {
+        int64_t new_size = MAX(host + 1, d->rmap_size * 2);
+
+        d->rmap = g_realloc(d->rmap, new_size * sizeof(uint64_t));
+        memset(d->rmap + d->rmap_size, 0,
+               (new_size - d->rmap_size) * sizeof(uint64_t));
+        d->rmap_size = new_size;
+    }
+    d->rmap[host] = val;
+}
+
+/*
+ * Get the L2 entry of a guest cluster.  Clusters without an L2 table of their
+ * own have an entry of 0.
+ */
+static int qcow2_defrag_get_l2_entry(BlockDriverState *bs, int64_t guest,
+                                     uint64_t *l2_entry)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t l1_index = guest >> s->l2_bits;
+    uint64_t l2_offset, *l2_table;
+    int ret;
+
+    *l2_entry = 0;
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+    l2_offset = s->l1_table[l1_index];
+    if (!(l2_offset & QCOW_OFLAG_COPIED)) {
+        return 0;
+    }
+
+    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset & ~QCOW_OFLAG_COPIED,
+                          (void **) &l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+    *l2_entry = be64_to_cpu(l2_table[guest & (s->l2_size - 1)]);
+    return qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+}
+
+/* Point the L2 entry of a movable guest cluster to a new host cluster */
+static int qcow2_defrag_set_l2_entry(BlockDriverState *bs, int64_t guest,
+                                     uint64_t offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_offset = s->l1_table[guest >> s->l2_bits];
+    uint64_t *l2_table;
+    int ret;
+
+    assert(l2_offset & QCOW_OFLAG_COPIED);
+    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset & ~QCOW_OFLAG_COPIED,
+                          (void **) &l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+    l2_table[guest & (s->l2_size - 1)] = cpu_to_be64(offset |
+                                                     QCOW_OFLAG_COPIED);
+    return qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+}
+
+static int qcow2_defrag_init(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t nb_guest = (bs->total_sectors * BDRV_SECTOR_SIZE +
+                        s->cluster_size - 1) >> s->cluster_bits;
+    int64_t file_size, guest;
+    uint64_t *l2_table, l2_entry, host;
+    Qcow2Defrag *d;
+    int i, j, ret;
+
+    file_size = bdrv_getlength(bs->file);
+    if (file_size < 0) {
+        return file_size;
+    }
+
+    d = g_malloc0(sizeof(*d));
+    d->rmap_size = (file_size + s->cluster_size - 1) >> s->cluster_bits;
+    d->rmap = g_malloc0(d->rmap_size * sizeof(uint64_t));
+
+    for (i = 0; i < s->l1_size; i++) {
+        if (!(s->l1_table[i] & QCOW_OFLAG_COPIED)) {
+            continue;
+        }
+        ret = qcow2_cache_get(bs, s->l2_table_cache,
+                              s->l1_table[i] & ~QCOW_OFLAG_COPIED,
+                              (void **) &l2_table);
+        if (ret < 0) {
+            g_free(d->rmap);
+            g_free(d);
+            return ret;
+        }
+
+        for (j = 0; j < s->l2_size; j++) {
+            guest = ((int64_t)i << s->l2_bits) + j;
+            if (guest >= nb_guest) {
+                break;
+            }
+            l2_entry = be64_to_cpu(l2_table[j]);
+            if (!qcow2_defrag_is_movable(l2_entry)) {
+                continue;
+            }
+            host = (l2_entry & ~QCOW_OFLAG_COPIED) >> s->cluster_bits;
+            if (host < d->rmap_size) {
+                d->rmap[host] = guest + 1;
+            }
+        }
+
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    }
+
+    s->defrag = d;
+    return 0;
+}
+
+void qcow2_defrag_cancel(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->defrag) {
+        g_free(s->defrag->rmap);
+        g_free(s->defrag);
+        s->defrag = NULL;
+    }
+}
+
+/*
+ * Return the state of a host cluster.  For a slot holding movable data, the
+ * guest cluster is stored in *guest.
+ */
+static int qcow2_defrag_slot_state(BlockDriverState *bs, int64_t slot,
+                                   int64_t *guest)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t rmap, l2_entry;
+    int refcount, ret;
+
+    refcount = qcow2_get_refcount(bs, slot);
+    if (refcount < 0) {
+        return refcount;
+    } else if (refcount == 0) {
+        return QCOW2_SLOT_FREE;
+    }
+
+    rmap = qcow2_defrag_rmap_get(s->defrag, slot);
+    if (rmap == 0 || refcount != 1) {
+        return QCOW2_SLOT_FIXED;
+    }
+
+    /* The guest may have discarded the cluster and reused the slot */
+    ret = qcow2_defrag_get_l2_entry(bs, rmap - 1, &l2_entry);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!qcow2_defrag_is_movable(l2_entry) ||
+        (l2_entry & ~QCOW_OFLAG_COPIED) != (uint64_t)slot << s->cluster_bits) {
+        return QCOW2_SLOT_FIXED;
+    }
+
+    *guest = rmap - 1;
+    return QCOW2_SLOT_DATA;
+}
+
+/*
+ * Copy the data of each move from src to dst and flush it.  Contiguous
+ * source and destination ranges are accessed with one request each.
+ */
+static int qcow2_defrag_copy(BlockDriverState *bs, Qcow2DefragMove *moves,
+                             int nb_moves)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint8_t *buf;
+    int i, j, ret = 0;
+
+    buf = qemu_blockalign(bs, (size_t)nb_moves << s->cluster_bits);
+
+    for (i = 0; i < nb_moves; i = j) {
+        for (j = i + 1; j < nb_moves &&
+             moves[j].src == moves[j - 1].src + s->cluster_size; j++) {
+            /* extend the range */
+        }
+        ret = bdrv_pread(bs->file, moves[i].src,
+                         buf + ((size_t)i << s->cluster_bits),
+                         (j - i) << s->cluster_bits);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    for (i = 0; i < nb_moves; i = j) {
+        for (j = i + 1; j < nb_moves &&
+             moves[j].dst == moves[j - 1].dst + s->cluster_size; j++) {
+            /* extend the range */
+        }
+        ret = bdrv_pwrite(bs->file, moves[i].dst,
+                          buf + ((size_t)i << s->cluster_bits),
+                          (j - i) << s->cluster_bits);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    ret = bdrv_flush(bs->file);
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+/*
+ * Copy the data of each move and switch the L2 entries to the new clusters.
+ * The L2 tables are on disk when this returns, so the old clusters may be
+ * overwritten.
+ */
+static int qcow2_defrag_relink(BlockDriverState *bs, Qcow2DefragMove *moves,
+                               int nb_moves)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i, ret;
+
+    ret = qcow2_defrag_copy(bs, moves, nb_moves);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The refcounts of the new clusters must be on disk first */
+    ret = qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                     s->refcount_block_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < nb_moves; i++) {
+        ret = qcow2_defrag_set_l2_entry(bs, moves[i].guest, moves[i].dst);
+        if (ret < 0) {
+            return ret;
+        }
+        qcow2_defrag_rmap_set(s->defrag, moves[i].src >> s->cluster_bits, 0);
+        qcow2_defrag_rmap_set(s->defrag, moves[i].dst >> s->cluster_bits,
+                              moves[i].guest + 1);
+    }
+
+    return qcow2_cache_flush(bs, s->l2_table_cache);
+}
+
+static int qcow2_defrag_move(BlockDriverState *bs, Qcow2DefragMove *moves,
+                             int nb_moves)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DefragMove *evict;
+    int64_t guest;
+    int64_t offset;
+    int i, j, nb_evict = 0;
+    int ret;
+
+    evict = g_malloc(nb_moves * sizeof(*evict));
+
+    /* Reserve free target slots first, so that evicted data does not end up
+     * in one of them
+     */
+    for (i = 0; i < nb_moves; i++) {
+        ret = qcow2_defrag_slot_state(bs, moves[i].dst >> s->cluster_bits,
+                                      &guest);
+        if (ret == QCOW2_SLOT_FREE) {
+            ret = qcow2_alloc_clusters_at(bs, moves[i].dst, 1);
+            if (ret == 0) {
+                ret = -EIO;
+            }
+        } else if (ret == QCOW2_SLOT_DATA) {
+            evict[nb_evict++] = (Qcow2DefragMove) {
+                .guest  = guest,
+                .src    = moves[i].dst,
+            };
+        } else if (ret >= 0) {
+            ret = -EIO;
+        }
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    /* Move the data that is in the way elsewhere.  The target slots keep
+     * their refcount and are reused below.
+     */
+    for (i = 0; i < nb_evict; i++) {
+        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (offset < 0) {
+            ret = offset;
+            goto out;
+        }
+        evict[i].dst = offset;
+
+        for (j = 0; j < nb_moves; j++) {
+            if (moves[j].guest == evict[i].guest) {
+                moves[j].src = offset;
+            }
+        }
+    }
+    if (nb_evict) {
+        ret = qcow2_defrag_relink(bs, evict, nb_evict);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    ret = qcow2_defrag_relink(bs, moves, nb_moves);
+    if (ret < 0) {
+        goto out;
+    }
+
+    for (i = 0; i < nb_moves; i++) {
+        qcow2_free_clusters(bs, moves[i].src, s->cluster_size);
+    }
+
+    ret = 0;
+out:
+    g_free(evict);
+    return ret;
+}
+
+/*
+ * Cut off the free clusters at the end of the image file, including refcount
+ * blocks that only describe themselves.
+ */
+static int qcow2_defrag_finish(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t file_size, end;
+    int refcount, ret;
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    file_size = bdrv_getlength(bs->file);
+    if (file_size < 0) {
+        return file_size;
+    }
+
+    end = (file_size + s->cluster_size - 1) >> s->cluster_bits;
+    while (end > 0) {
+        refcount = qcow2_get_refcount(bs, end - 1);
+        if (refcount < 0) {
+            return refcount;
+        } else if (refcount != 0) {
+            ret = qcow2_drop_refcount_block(bs, end - 1);
+            if (ret < 0) {
+                return ret;
+            } else if (ret == 0) {
+                break;
+            }
+        }
+        end--;
+    }
+
+    s->free_cluster_index = MIN(s->free_cluster_index, end);
+    if (end << s->cluster_bits < file_size) {
+        return bdrv_truncate(bs->file, end << s->cluster_bits);
+    }
+    return 0;
+}
+
+/*
+ * Defragment the guest clusters from *offset on, up to max_bytes or the end
+ * of the L2 table.  Returns the number of bytes moved or -errno and advances
+ * *offset.
+ */
+static int64_t qcow2_defrag_step(BlockDriverState *bs, int64_t *offset,
+                                 int64_t max_bytes)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    int64_t guest, end, slot_guest;
+    Qcow2DefragMove *moves;
+    uint64_t l2_entry, src, dst;
+    int nb_moves = 0;
+    int ret;
+
+    if (*offset == 0 || !s->defrag) {
+        qcow2_defrag_cancel(bs);
+        ret = qcow2_defrag_init(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    guest = *offset >> s->cluster_bits;
+    end = guest + MAX(max_bytes >> s->cluster_bits, 1);
+    end = MIN(end, ((guest >> s->l2_bits) + 1) << s->l2_bits);
+    end = MIN(end, (size + s->cluster_size - 1) >> s->cluster_bits);
+
+    moves = g_malloc(MAX(end - guest, 1) * sizeof(*moves));
+
+    for (; guest < end; guest++) {
+        ret = qcow2_defrag_get_l2_entry(bs, guest, &l2_entry);
+        if (ret < 0) {
+            goto fail;
+        }
+        if (!qcow2_defrag_is_movable(l2_entry)) {
+            continue;
+        }
+        src = l2_entry & ~QCOW_OFLAG_COPIED;
+
+        /* Find the next target slot */
+        for (;;) {
+            ret = qcow2_defrag_slot_state(bs, s->defrag->next_slot,
+                                          &slot_guest);
+            if (ret < 0) {
+                goto fail;
+            } else if (ret != QCOW2_SLOT_FIXED) {
+                break;
+            }
+            s->defrag->next_slot++;
+        }
+        dst = s->defrag->next_slot++ << s->cluster_bits;
+
+        if (dst != src) {
+            moves[nb_moves++] = (Qcow2DefragMove) {
+                .guest  = guest,
+                .src    = src,
+                .dst    = dst,
+            };
+        }
+    }
+
+    if (nb_moves) {
+        ret = qcow2_defrag_move(bs, moves, nb_moves);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+    g_free(moves);
+
+    *offset = MIN(end << s->cluster_bits, size);
+    if (*offset >= size) {
+        ret = qcow2_defrag_finish(bs);
+        qcow2_defrag_cancel(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return (int64_t)nb_moves << s->cluster_bits;
+
+fail:
+    g_free(moves);
+    qcow2_defrag_cancel(bs);
+    return ret;
+}
+
+int64_t coroutine_fn qcow2_co_defrag(BlockDriverState *bs, int64_t *offset,
+                                     int64_t max_bytes)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_defrag_step(bs, offset, max_bytes);
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
@@ -82,7 +82,7 @@ static int load_refcount_block(BlockDriverState *bs,
  * return value is the refcount of the cluster, negative values are -errno
  * and indicate an error.
  */
-static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
+int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index)
 {
     BDRVQcowState *s = bs->opaque;
     int refcount_table_index, block_index;
@@ -527,7 +527,7 @@ static int update_cluster_refcount(BlockDriverState *bs,
 
     bdrv_flush(bs->file);
 
-    return get_refcount(bs, cluster_index);
+    return qcow2_get_refcount(bs, cluster_index);
 }
 
 
@@ -547,7 +547,7 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size)
 retry:
     for(i = 0; i < nb_clusters; i++) {
         int64_t next_cluster_index = s->free_cluster_index++;
-        refcount = get_refcount(bs, next_cluster_index);
+        refcount = qcow2_get_refcount(bs, next_cluster_index);
 
         if (refcount < 0) {
             return refcount;
@@ -582,6 +582,84 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size)
     return offset;
 }
 
+/*
+ * Allocates nb_clusters clusters starting at offset, as far as they are free.
+ * Returns the number of clusters allocated, which stops at the first cluster
+ * in use, or -errno.
+ */
+int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
+    int nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t cluster_index = offset >> s->cluster_bits;
+    int i, refcount, ret;
+
+    for (i = 0; i < nb_clusters; i++) {
+        refcount = qcow2_get_refcount(bs, cluster_index + i);
+        if (refcount < 0) {
+            return refcount;
+        } else if (refcount != 0) {
+            break;
+        }
+    }
+
+    ret = update_refcount(bs, offset, (int64_t)i << s->cluster_bits, 1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return i;
+}
+
+/*
+ * Unhooks the refcount block stored in the cluster cluster_index from the
+ * refcount table if it is the block that describes this cluster and all
+ * other clusters it describes are free, so that the image file can be
+ * truncated before it.  The block is allocated again when it is needed.
+ *
+ * Returns 1 if the block was unhooked, 0 if not, or -errno.
+ */
+int qcow2_drop_refcount_block(BlockDriverState *bs, int64_t cluster_index)
+{
+    BDRVQcowState *s = bs->opaque;
+    int block_bits = s->cluster_bits - REFCOUNT_SHIFT;
+    int64_t refcount_table_index = cluster_index >> block_bits;
+    int64_t i, first = refcount_table_index << block_bits;
+    uint64_t data64;
+    int refcount, ret;
+
+    if (refcount_table_index >= s->refcount_table_size ||
+        s->refcount_table[refcount_table_index] !=
+        cluster_index << s->cluster_bits) {
+        return 0;
+    }
+
+    for (i = first; i < first + (1 << block_bits); i++) {
+        refcount = qcow2_get_refcount(bs, i);
+        if (refcount < 0) {
+            return refcount;
+        } else if (refcount != (i == cluster_index)) {
+            return 0;
+        }
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    data64 = 0;
+    ret = bdrv_pwrite_sync(bs->file,
+        s->refcount_table_offset + refcount_table_index * sizeof(uint64_t),
+        &data64, sizeof(data64));
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->refcount_table[refcount_table_index] = 0;
+    return 1;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -761,7 +839,8 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         if (addend != 0) {
                             refcount = update_cluster_refcount(bs, offset >> s->cluster_bits, addend);
                         } else {
-                            refcount = get_refcount(bs, offset >> s->cluster_bits);
+                            refcount = qcow2_get_refcount(bs,
+                                offset >> s->cluster_bits);
                         }
 
                         if (refcount < 0) {
@@ -793,7 +872,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             if (addend != 0) {
                 refcount = update_cluster_refcount(bs, l2_offset >> s->cluster_bits, addend);
             } else {
-                refcount = get_refcount(bs, l2_offset >> s->cluster_bits);
+                refcount = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits);
             }
             if (refcount < 0) {
                 ret = -EIO;
@@ -933,7 +1012,8 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                 if (check_copied) {
                     uint64_t entry = offset;
                     offset &= ~QCOW_OFLAG_COPIED;
-                    refcount = get_refcount(bs, offset >> s->cluster_bits);
+                    refcount = qcow2_get_refcount(bs,
+                        offset >> s->cluster_bits);
                     if (refcount < 0) {
                         fprintf(stderr, "Can't get refcount for offset %"
                             PRIx64 ": %s\n", entry, strerror(-refcount));
@@ -1013,8 +1093,8 @@ static int check_refcounts_l1(BlockDriverState *bs,
         if (l2_offset) {
             /* QCOW_OFLAG_COPIED must be set iff refcount == 1 */
             if (check_copied) {
-                refcount = get_refcount(bs, (l2_offset & ~QCOW_OFLAG_COPIED)
-                    >> s->cluster_bits);
+                refcount = qcow2_get_refcount(bs,
+                    (l2_offset & ~QCOW_OFLAG_COPIED) >> s->cluster_bits);
                 if (refcount < 0) {
                     fprintf(stderr, "Can't get refcount for l2_offset %"
                         PRIx64 ": %s\n", l2_offset, strerror(-refcount));
@@ -1136,7 +1216,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
 
     /* compare ref counts */
     for(i = 0; i < nb_clusters; i++) {
-        refcount1 = get_refcount(bs, i);
+        refcount1 = qcow2_get_refcount(bs, i);
         if (refcount1 < 0) {
             fprintf(stderr, "Can't get refcount for cluster %d: %s\n",
                 i, strerror(-refcount1));
@@ -360,6 +360,50 @@ static int qcow2_is_allocated(BlockDriverState *bs, int64_t sector_num,
     return (cluster_offset != 0);
 }
 
+static int qcow2_get_extents(BlockDriverState *bs, int64_t sector_num,
+                             int64_t nb_sectors, BlockExtent *extents,
+                             int max_extents)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int nb_extents = 0;
+    int ret, n, flags;
+    int64_t offset;
+
+    while (nb_sectors > 0 && nb_extents < max_extents) {
+        n = MIN(nb_sectors, INT_MAX / BDRV_SECTOR_SIZE);
+        ret = qcow2_get_cluster_offset(bs, sector_num << 9, &n,
+                                       &cluster_offset);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset = 0;
+        if (!cluster_offset) {
+            flags = 0;
+        } else if (cluster_offset & QCOW_OFLAG_COMPRESSED) {
+            /* compressed clusters are never contiguous on disk */
+            n = MIN(n, s->cluster_sectors -
+                       (sector_num & (s->cluster_sectors - 1)));
+            flags = BDRV_EXTENT_DATA;
+        } else if (s->crypt_method_header) {
+            flags = BDRV_EXTENT_DATA;
+        } else {
+            flags = BDRV_EXTENT_DATA | BDRV_EXTENT_OFFSET;
+            offset = cluster_offset +
+                     ((sector_num & (s->cluster_sectors - 1)) << 9);
+        }
+
+        bdrv_add_extent(extents, &nb_extents, sector_num, n, flags,
+                        (flags & BDRV_EXTENT_OFFSET) ? bs->file : NULL,
+                        offset);
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    return nb_extents;
+}
+
 /* handle reading after the end of the backing file */
 int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
                   int64_t sector_num, int nb_sectors)
@@ -631,6 +675,7 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->cluster_cache);
     qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
+    qcow2_defrag_cancel(bs);
 }
 
 static void qcow2_invalidate_cache(BlockDriverState *bs)
@@ -816,9 +861,44 @@ static int preallocate(BlockDriverState *bs)
     return 0;
 }
 
+/*
+ * Size of the image file once every cluster of the image is allocated,
+ * including the L1 and L2 tables and the refcount structures.
+ */
+static int64_t qcow2_prealloc_file_size(int64_t total_size, int cluster_bits)
+{
+    int64_t cluster_size = 1 << cluster_bits;
+    uint64_t clusters, l2_clusters, l1_clusters;
+    uint64_t refblocks = 0, reftable_clusters = 0;
+    uint64_t new_refblocks, new_reftable_clusters;
+
+    clusters = DIV_ROUND_UP(total_size, cluster_size);
+    l2_clusters = DIV_ROUND_UP(clusters, cluster_size / sizeof(uint64_t));
+    l1_clusters = DIV_ROUND_UP(l2_clusters, cluster_size / sizeof(uint64_t));
+
+    /* Header and refcount table written by qcow2_create2() */
+    clusters += 2 + l2_clusters + l1_clusters;
+
+    /* Refcount blocks and the refcount table have refcounts, too */
+    for (;;) {
+        new_refblocks = DIV_ROUND_UP(clusters + refblocks + reftable_clusters,
+                                     cluster_size / sizeof(uint16_t));
+        new_reftable_clusters = DIV_ROUND_UP(new_refblocks * sizeof(uint64_t),
+                                             cluster_size);
+        if (new_refblocks == refblocks &&
+            new_reftable_clusters == reftable_clusters) {
+            break;
+        }
+        refblocks = new_refblocks;
+        reftable_clusters = new_reftable_clusters;
+    }
+
+    return (clusters + refblocks + reftable_clusters) << cluster_bits;
+}
+
 static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
-                         int flags, size_t cluster_size, int prealloc,
+                         int flags, size_t cluster_size, PreallocMode prealloc,
                          QEMUOptionParameter *options)
 {
     /* Calulate cluster_bits */
@@ -850,7 +930,15 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     uint8_t* refcount_table;
     int ret;
 
-    ret = bdrv_create_file(filename, options);
+    if (prealloc == PREALLOC_FALLOC || prealloc == PREALLOC_FULL) {
+        /* Let the host allocate the whole file in one go */
+        ret = bdrv_create_file_prealloc(filename,
+            qcow2_prealloc_file_size(total_size * BDRV_SECTOR_SIZE,
+                                     cluster_bits),
+            prealloc);
+    } else {
+        ret = bdrv_create_file(filename, options);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -929,8 +1017,12 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         }
     }
 
-    /* And if we're supposed to preallocate metadata, do that now */
-    if (prealloc) {
+    /*
+     * And if we're supposed to preallocate metadata, do that now.  With falloc
+     * and full preallocation the data clusters are already allocated in the
+     * image file and only need to be referenced by the metadata.
+     */
+    if (prealloc != PREALLOC_OFF) {
         ret = preallocate(bs);
         if (ret < 0) {
             goto out;
@@ -950,7 +1042,7 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
     uint64_t sectors = 0;
     int flags = 0;
     size_t cluster_size = DEFAULT_CLUSTER_SIZE;
-    int prealloc = 0;
+    PreallocMode prealloc = PREALLOC_OFF;
 
     /* Read out options */
     while (options && options->name) {
@@ -967,20 +1059,14 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
                 cluster_size = options->value.n;
             }
         } else if (!strcmp(options->name, BLOCK_OPT_PREALLOC)) {
-            if (!options->value.s || !strcmp(options->value.s, "off")) {
-                prealloc = 0;
-            } else if (!strcmp(options->value.s, "metadata")) {
-                prealloc = 1;
-            } else {
-                fprintf(stderr, "Invalid preallocation mode: '%s'\n",
-                    options->value.s);
+            if (bdrv_parse_prealloc_mode(options->value.s, &prealloc) < 0) {
                 return -EINVAL;
             }
         }
         options++;
     }
 
-    if (backing_file && prealloc) {
+    if (backing_file && prealloc != PREALLOC_OFF) {
         fprintf(stderr, "Backing file and preallocation cannot be used at "
             "the same time\n");
         return -EINVAL;
@@ -1060,39 +1146,23 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
-/* XXX: put compressed sectors first, then all the cluster aligned
-   tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+/* Compress one cluster with deflate. Returns the compressed length, 0 if the
+   cluster does not shrink and must be stored uncompressed, or -errno. Only
+   reads s->cluster_size, so it may run outside the caller's thread. */
+static int qcow2_compress_cluster(BlockDriverState *bs, const uint8_t *buf,
+                                  uint8_t *out_buf, int level)
 {
     BDRVQcowState *s = bs->opaque;
     z_stream strm;
     int ret, out_len;
-    uint8_t *out_buf;
-    uint64_t cluster_offset;
-
-    if (nb_sectors == 0) {
-        /* align end of file to a sector boundary to ease reading with
-           sector based I/Os */
-        cluster_offset = bdrv_getlength(bs->file);
-        cluster_offset = (cluster_offset + 511) & ~511;
-        bdrv_truncate(bs->file, cluster_offset);
-        return 0;
-    }
 
-    if (nb_sectors != s->cluster_sectors)
-        return -EINVAL;
-
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
+    /* small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+    ret = deflateInit2(&strm, level,
                        Z_DEFLATED, -12,
                        9, Z_DEFAULT_STRATEGY);
     if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
+        return -EINVAL;
     }
 
     strm.avail_in = s->cluster_size;
@@ -1103,36 +1173,73 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
     ret = deflate(&strm, Z_FINISH);
     if (ret != Z_STREAM_END && ret != Z_OK) {
         deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
+        return -EINVAL;
     }
     out_len = strm.next_out - out_buf;
 
     deflateEnd(&strm);
 
     if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+        return 0;
+    }
+    return out_len;
+}
+
+/* XXX: put compressed sectors first, then all the cluster aligned
+   tables to avoid losing bytes in alignment */
+static int qcow2_write_compressed_cluster(BlockDriverState *bs,
+                                          int64_t sector_num,
+                                          const uint8_t *buf,
+                                          const uint8_t *out_buf, int out_len)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int ret;
+
+    if (out_len == 0) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
-        cluster_offset &= s->cluster_offset_mask;
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+        return ret < 0 ? ret : 0;
+    }
+
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, out_len);
+    if (!cluster_offset) {
+        return -EIO;
+    }
+    cluster_offset &= s->cluster_offset_mask;
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+    return ret < 0 ? ret : 0;
+}
+
+static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+    uint8_t *out_buf;
+    uint64_t cluster_offset;
+
+    if (nb_sectors == 0) {
+        /* align end of file to a sector boundary to ease reading with
+           sector based I/Os */
+        cluster_offset = bdrv_getlength(bs->file);
+        cluster_offset = (cluster_offset + 511) & ~511;
+        bdrv_truncate(bs->file, cluster_offset);
+        return 0;
+    }
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    out_buf = g_malloc(s->cluster_size);
+
+    ret = qcow2_compress_cluster(bs, buf, out_buf, Z_DEFAULT_COMPRESSION);
+    if (ret >= 0) {
+        ret = qcow2_write_compressed_cluster(bs, sector_num, buf, out_buf, ret);
     }
 
-    ret = 0;
-fail:
     g_free(out_buf);
     return ret;
 }
@@ -1194,9 +1301,9 @@ static void dump_refcounts(BlockDriverState *bs)
     nb_clusters = size_to_clusters(s, size);
     for(k = 0; k < nb_clusters;) {
         k1 = k;
-        refcount = get_refcount(bs, k);
+        refcount = qcow2_get_refcount(bs, k);
         k++;
-        while (k < nb_clusters && get_refcount(bs, k) == refcount)
+        while (k < nb_clusters && qcow2_get_refcount(bs, k) == refcount)
             k++;
         printf("%" PRId64 ": refcount=%d nb=%" PRId64 "\n", k, refcount,
                k - k1);
@@ -1264,7 +1371,8 @@ static QEMUOptionParameter qcow2_create_options[] = {
     {
         .name = BLOCK_OPT_PREALLOC,
         .type = OPT_STRING,
-        .help = "Preallocation mode (allowed values: off, metadata)"
+        .help = "Preallocation mode (allowed values: off, metadata, "
+                "falloc, full)"
     },
     { NULL }
 };
@@ -1277,6 +1385,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_close         = qcow2_close,
     .bdrv_create        = qcow2_create,
     .bdrv_is_allocated  = qcow2_is_allocated,
+    .bdrv_get_extents   = qcow2_get_extents,
     .bdrv_set_key       = qcow2_set_key,
     .bdrv_make_empty    = qcow2_make_empty,
 
@@ -1288,6 +1397,8 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
     .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_compress_cluster  = qcow2_compress_cluster,
+    .bdrv_write_compressed_cluster = qcow2_write_compressed_cluster,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
@@ -1305,6 +1416,8 @@ static BlockDriver bdrv_qcow2 = {
 
     .create_options = qcow2_create_options,
     .bdrv_check = qcow2_check,
+    .bdrv_co_defrag     = qcow2_co_defrag,
+    .bdrv_defrag_cancel = qcow2_defrag_cancel,
 };
 
 static void bdrv_qcow2_init(void)
@@ -48,21 +48,26 @@
  * start reading the L2 table from the image file.  The first to finish will
  * commit its L2 table into the cache.  When the second tries to commit its
  * table will be deleted in favor of the existing cache entry.
+ *
+ * When the cache is full, the least recently used entry that no request holds
+ * a reference to is evicted.  Entries in use are never evicted so that all
+ * requests accessing an L2 table share the same copy.  Allocating writes
+ * update that copy in place and rely on it when they write it out.
  */
 
 #include "trace.h"
 #include "qed.h"
 
-/* Each L2 holds 2GB so this let's us fully cache a 100GB disk */
-#define MAX_L2_CACHE_SIZE 50
-
 /**
  * Initialize the L2 cache
+ *
+ * @max_entries:    Number of L2 tables to keep cached
  */
-void qed_init_l2_cache(L2TableCache *l2_cache)
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries)
 {
     QTAILQ_INIT(&l2_cache->entries);
     l2_cache->n_entries = 0;
+    l2_cache->max_entries = max_entries;
 }
 
 /**
@@ -130,6 +135,10 @@ CachedL2Table *qed_find_l2_cache_entry(L2TableCache *l2_cache, uint64_t offset)
         if (entry->offset == offset) {
             trace_qed_find_l2_cache_entry(l2_cache, entry, offset, entry->ref);
             entry->ref++;
+
+            /* Move to the most recently used end */
+            QTAILQ_REMOVE(&l2_cache->entries, entry, node);
+            QTAILQ_INSERT_TAIL(&l2_cache->entries, entry, node);
             return entry;
         }
     }
@@ -161,11 +170,18 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
         return;
     }
 
-    if (l2_cache->n_entries >= MAX_L2_CACHE_SIZE) {
-        entry = QTAILQ_FIRST(&l2_cache->entries);
-        QTAILQ_REMOVE(&l2_cache->entries, entry, node);
-        l2_cache->n_entries--;
-        qed_unref_l2_cache_entry(entry);
+    /* The cache may temporarily grow beyond max_entries if all entries are in
+     * use by requests
+     */
+    if (l2_cache->n_entries >= l2_cache->max_entries) {
+        QTAILQ_FOREACH(entry, &l2_cache->entries, node) {
+            if (entry->ref == 1) {
+                QTAILQ_REMOVE(&l2_cache->entries, entry, node);
+                l2_cache->n_entries--;
+                qed_unref_l2_cache_entry(entry);
+                break;
+            }
+        }
     }
 
     l2_cache->n_entries++;
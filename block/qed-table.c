@@ -72,20 +72,61 @@ static void qed_read_table(BDRVQEDState *s, uint64_t offset, QEDTable *table,
     }
 }
 
-typedef struct {
+struct QEDWriteTableCB {
     GenericCB gencb;
     BDRVQEDState *s;
     QEDTable *orig_table;
     QEDTable *table;
+    uint64_t offset;        /* offset of table in image file, in bytes */
+    unsigned int start;     /* first element to write */
+    unsigned int end;       /* one after last element to write */
     bool flush;             /* flush after write? */
 
     struct iovec iov;
     QEMUIOVector qiov;
-} QEDWriteTableCB;
+
+    QSIMPLEQ_ENTRY(QEDWriteTableCB) next;
+    QSIMPLEQ_HEAD(, QEDWriteTableCB) batch;   /* written along with this one */
+    QSIMPLEQ_HEAD(, QEDWriteTableCB) waiting; /* arrived while in flight */
+};
+
+static void qed_write_table_submit(QEDWriteTableCB *write_table_cb);
+
+/**
+ * Start the next write of a table once the current one has completed
+ *
+ * All updates that arrived in the meantime are written out together.  The
+ * first one submits the write and the others complete along with it.
+ */
+static void qed_write_table_next(QEDWriteTableCB *write_table_cb)
+{
+    BDRVQEDState *s = write_table_cb->s;
+    QEDWriteTableCB *next_cb, *batch_cb;
+
+    QSIMPLEQ_REMOVE(&s->table_writes, write_table_cb, QEDWriteTableCB, next);
+
+    next_cb = QSIMPLEQ_FIRST(&write_table_cb->waiting);
+    if (!next_cb) {
+        return;
+    }
+    QSIMPLEQ_REMOVE_HEAD(&write_table_cb->waiting, next);
+    QSIMPLEQ_CONCAT(&next_cb->batch, &write_table_cb->waiting);
+
+    QSIMPLEQ_FOREACH(batch_cb, &next_cb->batch, next) {
+        next_cb->start = MIN(next_cb->start, batch_cb->start);
+        next_cb->end = MAX(next_cb->end, batch_cb->end);
+        next_cb->flush |= batch_cb->flush;
+    }
+
+    QSIMPLEQ_INSERT_TAIL(&s->table_writes, next_cb, next);
+    qed_write_table_submit(next_cb);
+}
 
 static void qed_write_table_cb(void *opaque, int ret)
 {
     QEDWriteTableCB *write_table_cb = opaque;
+    QEDWriteTableCB *batch_cb, *next_batch_cb;
+    QSIMPLEQ_HEAD(, QEDWriteTableCB) batch;
 
     trace_qed_write_table_cb(write_table_cb->s,
                              write_table_cb->orig_table,
@@ -106,8 +147,55 @@ static void qed_write_table_cb(void *opaque, int ret)
 
 out:
     qemu_vfree(write_table_cb->table);
+
+    /* Start the next write before completing, completion callbacks may update
+     * the table again
+     */
+    qed_write_table_next(write_table_cb);
+
+    QSIMPLEQ_INIT(&batch);
+    QSIMPLEQ_CONCAT(&batch, &write_table_cb->batch);
+
     gencb_complete(&write_table_cb->gencb, ret);
-    return;
+    QSIMPLEQ_FOREACH_SAFE(batch_cb, &batch, next, next_batch_cb) {
+        gencb_complete(&batch_cb->gencb, ret);
+    }
+}
+
+static void qed_write_table_submit(QEDWriteTableCB *write_table_cb)
+{
+    BDRVQEDState *s = write_table_cb->s;
+    QEDTable *table = write_table_cb->orig_table;
+    unsigned int start = write_table_cb->start;
+    unsigned int end = write_table_cb->end;
+    uint64_t offset;
+    BlockDriverAIOCB *aiocb;
+    size_t len_bytes;
+    unsigned int i;
+
+    len_bytes = (end - start) * sizeof(uint64_t);
+
+    write_table_cb->table = qemu_blockalign(s->bs, len_bytes);
+    write_table_cb->iov.iov_base = write_table_cb->table->offsets;
+    write_table_cb->iov.iov_len = len_bytes;
+    qemu_iovec_init_external(&write_table_cb->qiov, &write_table_cb->iov, 1);
+
+    /* Byteswap table */
+    for (i = start; i < end; i++) {
+        uint64_t le_offset = cpu_to_le64(table->offsets[i]);
+        write_table_cb->table->offsets[i - start] = le_offset;
+    }
+
+    /* Adjust for offset into table */
+    offset = write_table_cb->offset + start * sizeof(uint64_t);
+
+    aiocb = bdrv_aio_writev(s->bs->file, offset / BDRV_SECTOR_SIZE,
+                            &write_table_cb->qiov,
+                            write_table_cb->iov.iov_len / BDRV_SECTOR_SIZE,
+                            qed_write_table_cb, write_table_cb);
+    if (!aiocb) {
+        qed_write_table_cb(write_table_cb, -EIO);
+    }
 }
 
 /**
@@ -121,50 +209,42 @@ out:
  * @flush:      Whether or not to sync to disk
  * @cb:         Completion function
  * @opaque:     Argument for completion function
+ *
+ * Only one write per table is in flight at a time, so that an older copy of a
+ * table sector cannot overwrite a newer one.  Updates that arrive while the
+ * table is being written are batched into the next write, which takes the
+ * table contents at the time it is submitted.
  */
 static void qed_write_table(BDRVQEDState *s, uint64_t offset, QEDTable *table,
                             unsigned int index, unsigned int n, bool flush,
                             BlockDriverCompletionFunc *cb, void *opaque)
 {
-    QEDWriteTableCB *write_table_cb;
-    BlockDriverAIOCB *aiocb;
+    QEDWriteTableCB *write_table_cb, *in_flight;
     unsigned int sector_mask = BDRV_SECTOR_SIZE / sizeof(uint64_t) - 1;
-    unsigned int start, end, i;
-    size_t len_bytes;
 
     trace_qed_write_table(s, offset, table, index, n);
 
-    /* Calculate indices of the first and one after last elements */
-    start = index & ~sector_mask;
-    end = (index + n + sector_mask) & ~sector_mask;
-
-    len_bytes = (end - start) * sizeof(uint64_t);
-
     write_table_cb = gencb_alloc(sizeof(*write_table_cb), cb, opaque);
     write_table_cb->s = s;
     write_table_cb->orig_table = table;
+    write_table_cb->offset = offset;
     write_table_cb->flush = flush;
-    write_table_cb->table = qemu_blockalign(s->bs, len_bytes);
-    write_table_cb->iov.iov_base = write_table_cb->table->offsets;
-    write_table_cb->iov.iov_len = len_bytes;
-    qemu_iovec_init_external(&write_table_cb->qiov, &write_table_cb->iov, 1);
+    QSIMPLEQ_INIT(&write_table_cb->batch);
+    QSIMPLEQ_INIT(&write_table_cb->waiting);
 
-    /* Byteswap table */
-    for (i = start; i < end; i++) {
-        uint64_t le_offset = cpu_to_le64(table->offsets[i]);
-        write_table_cb->table->offsets[i - start] = le_offset;
+    /* Calculate indices of the first and one after last elements */
+    write_table_cb->start = index & ~sector_mask;
+    write_table_cb->end = (index + n + sector_mask) & ~sector_mask;
+
+    QSIMPLEQ_FOREACH(in_flight, &s->table_writes, next) {
+        if (in_flight->orig_table == table) {
+            QSIMPLEQ_INSERT_TAIL(&in_flight->waiting, write_table_cb, next);
+            return;
+        }
     }
 
-    /* Adjust for offset into table */
-    offset += start * sizeof(uint64_t);
-
-    aiocb = bdrv_aio_writev(s->bs->file, offset / BDRV_SECTOR_SIZE,
-                            &write_table_cb->qiov,
-                            write_table_cb->iov.iov_len / BDRV_SECTOR_SIZE,
-                            qed_write_table_cb, write_table_cb);
-    if (!aiocb) {
-        qed_write_table_cb(write_table_cb, -EIO);
-    }
+    QSIMPLEQ_INSERT_TAIL(&s->table_writes, write_table_cb, next);
+    qed_write_table_submit(write_table_cb);
 }
 
 /**
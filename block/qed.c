@@ -291,8 +291,132 @@ static CachedL2Table *qed_new_l2_table(BDRVQEDState *s)
     return l2_table;
 }
 
+/**
+ * Number of L2 tables to cache
+ *
+ * Cache enough tables to cover the whole image, within a memory limit for
+ * large images or large tables.
+ */
+static unsigned int qed_l2_cache_size(BDRVQEDState *s)
+{
+    uint64_t table_bytes = (uint64_t)s->header.cluster_size *
+                           s->header.table_size;
+    uint64_t n = DIV_ROUND_UP(s->header.image_size,
+                              (uint64_t)1 << s->l1_shift);
+    uint64_t max = MAX(QED_MAX_L2_CACHE_BYTES / table_bytes,
+                       QED_MIN_L2_CACHE_SIZE);
+
+    return MAX(MIN(n, max), 1);
+}
+
 static void qed_aio_next_io(void *opaque, int ret);
 
+/**
+ * Check if two allocating writes must not run at the same time
+ */
+static bool qed_allocating_writes_conflict(QEDAIOCB *a, QEDAIOCB *b)
+{
+    /* Only one request at a time may allocate an L2 table and no other
+     * request may use the table until it is linked into the L1 table
+     */
+    if (a->alloc_l1_index == b->alloc_l1_index &&
+        (a->alloc_l2_table || b->alloc_l2_table)) {
+        return true;
+    }
+
+    /* Different clusters of the same L2 table are fine, qed_write_table()
+     * batches the table updates
+     */
+    return a->alloc_start < b->alloc_end && b->alloc_start < a->alloc_end;
+}
+
+/**
+ * Check if an allocating write may start
+ *
+ * The request must not conflict with allocating writes in progress, nor
+ * overtake a conflicting request that has been waiting longer.
+ */
+static bool qed_allocating_write_may_start(BDRVQEDState *s, QEDAIOCB *acb)
+{
+    QEDAIOCB *other;
+
+    if (s->allocating_write_reqs_plugged) {
+        return false;
+    }
+
+    QLIST_FOREACH(other, &s->allocating_writes, alloc_node) {
+        if (qed_allocating_writes_conflict(acb, other)) {
+            return false;
+        }
+    }
+
+    QSIMPLEQ_FOREACH(other, &s->allocating_write_reqs, next) {
+        if (other == acb) {
+            break;
+        }
+        if (qed_allocating_writes_conflict(acb, other)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Start waiting allocating writes that no longer conflict
+ */
+static void qed_start_allocating_write_reqs(BDRVQEDState *s)
+{
+    QSIMPLEQ_HEAD(, QEDAIOCB) runnable = QSIMPLEQ_HEAD_INITIALIZER(runnable);
+    QEDAIOCB *acb, *next_acb;
+
+    QSIMPLEQ_FOREACH_SAFE(acb, &s->allocating_write_reqs, next, next_acb) {
+        if (!qed_allocating_write_may_start(s, acb)) {
+            continue;
+        }
+
+        QSIMPLEQ_REMOVE(&s->allocating_write_reqs, acb, QEDAIOCB, next);
+        acb->alloc_state = QED_ALLOC_ACTIVE;
+        QLIST_INSERT_HEAD(&s->allocating_writes, acb, alloc_node);
+        QSIMPLEQ_INSERT_TAIL(&runnable, acb, next);
+    }
+
+    /* The clusters may have been allocated in the meantime, so look them up
+     * again.  The requests keep their place in allocating_writes.
+     */
+    while ((acb = QSIMPLEQ_FIRST(&runnable))) {
+        QSIMPLEQ_REMOVE_HEAD(&runnable, next);
+        qed_aio_next_io(acb, 0);
+    }
+}
+
+static void qed_start_need_check_timer(BDRVQEDState *s);
+
+/**
+ * Leave the allocating write state and let conflicting requests run
+ */
+static void qed_finish_allocating_write(BDRVQEDState *s, QEDAIOCB *acb)
+{
+    switch (acb->alloc_state) {
+    case QED_ALLOC_WAITING:
+        QSIMPLEQ_REMOVE(&s->allocating_write_reqs, acb, QEDAIOCB, next);
+        break;
+    case QED_ALLOC_ACTIVE:
+        QLIST_REMOVE(acb, alloc_node);
+        break;
+    default:
+        return;
+    }
+    acb->alloc_state = QED_ALLOC_NONE;
+
+    qed_start_allocating_write_reqs(s);
+
+    if (QLIST_EMPTY(&s->allocating_writes) &&
+        QSIMPLEQ_EMPTY(&s->allocating_write_reqs) &&
+        (s->header.features & QED_F_NEED_CHECK)) {
+        qed_start_need_check_timer(s);
+    }
+}
+
 static void qed_plug_allocating_write_reqs(BDRVQEDState *s)
 {
     assert(!s->allocating_write_reqs_plugged);
@@ -302,16 +426,11 @@ static void qed_plug_allocating_write_reqs(BDRVQEDState *s)
 
 static void qed_unplug_allocating_write_reqs(BDRVQEDState *s)
 {
-    QEDAIOCB *acb;
-
     assert(s->allocating_write_reqs_plugged);
 
     s->allocating_write_reqs_plugged = false;
 
-    acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-    if (acb) {
-        qed_aio_next_io(acb, 0);
-    }
+    qed_start_allocating_write_reqs(s);
 }
 
 static void qed_finish_clear_need_check(void *opaque, int ret)
@@ -347,7 +466,8 @@ static void qed_need_check_timer_cb(void *opaque)
     BDRVQEDState *s = opaque;
 
     /* The timer should only fire when allocating writes have drained */
-    assert(!QSIMPLEQ_FIRST(&s->allocating_write_reqs));
+    assert(QLIST_EMPTY(&s->allocating_writes));
+    assert(QSIMPLEQ_EMPTY(&s->allocating_write_reqs));
 
     trace_qed_need_check_timer_cb(s);
 
@@ -383,7 +503,9 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
     int ret;
 
     s->bs = bs;
+    QLIST_INIT(&s->allocating_writes);
     QSIMPLEQ_INIT(&s->allocating_write_reqs);
+    QSIMPLEQ_INIT(&s->table_writes);
 
     ret = bdrv_pread(bs->file, 0, &le_header, sizeof(le_header));
     if (ret < 0) {
@@ -471,7 +593,7 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
     }
 
     s->l1_table = qed_alloc_table(s);
-    qed_init_l2_cache(&s->l2_cache);
+    qed_init_l2_cache(&s->l2_cache, qed_l2_cache_size(s));
 
     ret = qed_read_l1_table_sync(s);
     if (ret) {
@@ -542,9 +664,53 @@ static void bdrv_qed_close(BlockDriverState *bs)
     qemu_vfree(s->l1_table);
 }
 
+/*
+ * Allocate every cluster of a new image.  The L2 tables follow the L1 table
+ * and are followed by the data clusters in guest order, so the metadata is
+ * written in one pass and the data is contiguous in the image file.
+ */
+static int qed_preallocate(BlockDriverState *bs, QEDHeader *header,
+                           uint64_t *l1_table, uint64_t nl2,
+                           uint64_t data_offset)
+{
+    size_t table_bytes = header->cluster_size * header->table_size;
+    uint32_t table_nelems = table_bytes / sizeof(uint64_t);
+    uint64_t clusters = DIV_ROUND_UP(header->image_size,
+                                     header->cluster_size);
+    uint64_t l2_offset = header->l1_table_offset + table_bytes;
+    uint64_t *l2_table;
+    uint64_t cluster = 0;
+    uint64_t i;
+    uint32_t j;
+    int ret = 0;
+
+    l2_table = qemu_blockalign(bs, table_bytes);
+    for (i = 0; i < nl2; i++) {
+        l1_table[i] = cpu_to_le64(l2_offset + i * table_bytes);
+
+        for (j = 0; j < table_nelems; j++, cluster++) {
+            if (cluster < clusters) {
+                l2_table[j] = cpu_to_le64(data_offset +
+                                          cluster * header->cluster_size);
+            } else {
+                l2_table[j] = 0;
+            }
+        }
+
+        ret = bdrv_pwrite(bs, l2_offset + i * table_bytes, l2_table,
+                          table_bytes);
+        if (ret < 0) {
+            break;
+        }
+    }
+    qemu_vfree(l2_table);
+    return ret < 0 ? ret : 0;
+}
+
 static int qed_create(const char *filename, uint32_t cluster_size,
                       uint64_t image_size, uint32_t table_size,
-                      const char *backing_file, const char *backing_fmt)
+                      const char *backing_file, const char *backing_fmt,
+                      PreallocMode prealloc)
 {
     QEDHeader header = {
         .magic = QED_MAGIC,
@@ -559,10 +725,23 @@ static int qed_create(const char *filename, uint32_t cluster_size,
     QEDHeader le_header;
     uint8_t *l1_table = NULL;
     size_t l1_size = header.cluster_size * header.table_size;
+    uint64_t nl2 = 0, data_offset = 0;
     int ret = 0;
     BlockDriverState *bs = NULL;
 
-    ret = bdrv_create_file(filename, NULL);
+    if (prealloc == PREALLOC_OFF) {
+        ret = bdrv_create_file(filename, NULL);
+    } else {
+        uint32_t table_nelems = l1_size / sizeof(uint64_t);
+        uint64_t clusters = DIV_ROUND_UP(image_size, cluster_size);
+
+        /* The last cluster is allocated in full even if it is partial */
+        nl2 = DIV_ROUND_UP(clusters, table_nelems);
+        data_offset = header.l1_table_offset + (1 + nl2) * l1_size;
+        ret = bdrv_create_file_prealloc(filename,
+                                        data_offset + clusters * cluster_size,
+                                        prealloc);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -573,9 +752,11 @@ static int qed_create(const char *filename, uint32_t cluster_size,
     }
 
     /* File must start empty and grow, check truncate is supported */
-    ret = bdrv_truncate(bs, 0);
-    if (ret < 0) {
-        goto out;
+    if (prealloc == PREALLOC_OFF) {
+        ret = bdrv_truncate(bs, 0);
+        if (ret < 0) {
+            goto out;
+        }
     }
 
     if (backing_file) {
@@ -600,6 +781,13 @@ static int qed_create(const char *filename, uint32_t cluster_size,
     }
 
     l1_table = g_malloc0(l1_size);
+    if (prealloc != PREALLOC_OFF) {
+        ret = qed_preallocate(bs, &header, (uint64_t *)l1_table, nl2,
+                              data_offset);
+        if (ret < 0) {
+            goto out;
+        }
+    }
     ret = bdrv_pwrite(bs, header.l1_table_offset, l1_table, l1_size);
     if (ret < 0) {
         goto out;
@@ -619,6 +807,7 @@ static int bdrv_qed_create(const char *filename, QEMUOptionParameter *options)
     uint32_t table_size = QED_DEFAULT_TABLE_SIZE;
     const char *backing_file = NULL;
     const char *backing_fmt = NULL;
+    PreallocMode prealloc = PREALLOC_OFF;
 
     while (options && options->name) {
         if (!strcmp(options->name, BLOCK_OPT_SIZE)) {
@@ -635,6 +824,10 @@ static int bdrv_qed_create(const char *filename, QEMUOptionParameter *options)
             if (options->value.n) {
                 table_size = options->value.n;
             }
+        } else if (!strcmp(options->name, BLOCK_OPT_PREALLOC)) {
+            if (bdrv_parse_prealloc_mode(options->value.s, &prealloc) < 0) {
+                return -EINVAL;
+            }
         }
         options++;
     }
@@ -656,8 +849,14 @@ static int bdrv_qed_create(const char *filename, QEMUOptionParameter *options)
         return -EINVAL;
     }
 
+    if (backing_file && prealloc != PREALLOC_OFF) {
+        fprintf(stderr, "Backing file and preallocation cannot be used at "
+                "the same time\n");
+        return -EINVAL;
+    }
+
     return qed_create(filename, cluster_size, image_size, table_size,
-                      backing_file, backing_fmt);
+                      backing_file, backing_fmt, prealloc);
 }
 
 typedef struct {
@@ -695,6 +894,79 @@ static int bdrv_qed_is_allocated(BlockDriverState *bs, int64_t sector_num,
     return cb.is_allocated;
 }
 
+typedef struct {
+    int ret;
+    uint64_t offset;
+    size_t len;
+} QEDGetExtentsCB;
+
+static void qed_get_extents_cb(void *opaque, int ret, uint64_t offset,
+                               size_t len)
+{
+    QEDGetExtentsCB *cb = opaque;
+
+    cb->offset = offset;
+    cb->len = len;
+    cb->ret = ret;
+}
+
+static int bdrv_qed_get_extents(BlockDriverState *bs, int64_t sector_num,
+                                int64_t nb_sectors, BlockExtent *extents,
+                                int max_extents)
+{
+    BDRVQEDState *s = bs->opaque;
+    int nb_extents = 0;
+    int flags, n;
+
+    while (nb_sectors > 0 && nb_extents < max_extents) {
+        uint64_t pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
+        QEDGetExtentsCB cb = {
+            .ret = -EINPROGRESS,
+        };
+        QEDRequest request = { .l2_table = NULL };
+
+        qed_find_cluster(s, &request, pos,
+                         MIN(nb_sectors, INT_MAX / BDRV_SECTOR_SIZE) *
+                         BDRV_SECTOR_SIZE,
+                         qed_get_extents_cb, &cb);
+
+        while (cb.ret == -EINPROGRESS) {
+            qemu_aio_wait();
+        }
+
+        qed_unref_l2_cache_entry(request.l2_table);
+
+        if (cb.ret < 0) {
+            return cb.ret;
+        }
+
+        switch (cb.ret) {
+        case QED_CLUSTER_FOUND:
+            flags = BDRV_EXTENT_DATA | BDRV_EXTENT_OFFSET;
+            cb.offset += qed_offset_into_cluster(s, pos);
+            break;
+        case QED_CLUSTER_ZERO:
+            flags = BDRV_EXTENT_ZERO;
+            break;
+        default:
+            flags = 0;
+            break;
+        }
+
+        n = cb.len / BDRV_SECTOR_SIZE;
+        if (n <= 0) {
+            return -EIO;
+        }
+        bdrv_add_extent(extents, &nb_extents, sector_num, n, flags,
+                        (flags & BDRV_EXTENT_OFFSET) ? bs->file : NULL,
+                        cb.offset);
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    return nb_extents;
+}
+
 static int bdrv_qed_make_empty(BlockDriverState *bs)
 {
     return -ENOTSUP;
@@ -890,21 +1162,19 @@ static void qed_aio_complete(QEDAIOCB *acb, int ret)
     acb->bh = qemu_bh_new(qed_aio_complete_bh, acb);
     qemu_bh_schedule(acb->bh);
 
-    /* Start next allocating write request waiting behind this one.  Note that
-     * requests enqueue themselves when they first hit an unallocated cluster
-     * but they wait until the entire request is finished before waking up the
-     * next request in the queue.  This ensures that we don't cycle through
-     * requests multiple times but rather finish one at a time completely.
-     */
-    if (acb == QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        QSIMPLEQ_REMOVE_HEAD(&s->allocating_write_reqs, next);
-        acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-        if (acb) {
-            qed_aio_next_io(acb, 0);
-        } else if (s->header.features & QED_F_NEED_CHECK) {
-            qed_start_need_check_timer(s);
-        }
-    }
+    /* Start allocating write requests waiting behind this one */
+    qed_finish_allocating_write(s, acb);
+}
+
+/**
+ * Complete the allocation of clusters and continue with the next ones
+ */
+static void qed_aio_write_alloc_done(void *opaque, int ret)
+{
+    QEDAIOCB *acb = opaque;
+
+    qed_finish_allocating_write(acb_to_s(acb), acb);
+    qed_aio_next_io(acb, ret);
 }
 
 /**
@@ -925,7 +1195,7 @@ static void qed_commit_l2_update(void *opaque, int ret)
     acb->request.l2_table = qed_find_l2_cache_entry(&s->l2_cache, l2_offset);
     assert(acb->request.l2_table != NULL);
 
-    qed_aio_next_io(opaque, ret);
+    qed_aio_write_alloc_done(opaque, ret);
 }
 
 /**
@@ -978,7 +1248,7 @@ static void qed_aio_write_l2_update(void *opaque, int ret)
     } else {
         /* Write out only the updated part of the L2 table */
         qed_write_l2_table(s, &acb->request, index, acb->cur_nclusters, false,
-                            qed_aio_next_io, acb);
+                            qed_aio_write_alloc_done, acb);
     }
     return;
 
@@ -1096,6 +1366,22 @@ static bool qed_should_set_need_check(BDRVQEDState *s)
     return !(s->header.features & QED_F_NEED_CHECK);
 }
 
+/**
+ * Continue allocating write once the need check flag is on disk
+ */
+static void qed_aio_write_need_check_set(void *opaque, int ret)
+{
+    QEDAIOCB *acb = opaque;
+
+    qed_unplug_allocating_write_reqs(acb_to_s(acb));
+
+    if (ret) {
+        qed_aio_complete(acb, ret);
+        return;
+    }
+    qed_aio_write_prefill(acb, 0);
+}
+
 /**
  * Write new data cluster
  *
@@ -1103,23 +1389,46 @@ static bool qed_should_set_need_check(BDRVQEDState *s)
  * @len:        Length in bytes
  *
  * This path is taken when writing to previously unallocated clusters.
+ *
+ * Allocating writes run in parallel unless they touch the same clusters or
+ * one of them allocates the L2 table of the other.  A conflicting request
+ * waits in allocating_write_reqs and looks its clusters up again when it is
+ * started, since they may have been allocated in the meantime.
  */
 static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
 {
     BDRVQEDState *s = acb_to_s(acb);
 
     /* Cancel timer when the first allocating request comes in */
-    if (QSIMPLEQ_EMPTY(&s->allocating_write_reqs)) {
+    if (QLIST_EMPTY(&s->allocating_writes) &&
+        QSIMPLEQ_EMPTY(&s->allocating_write_reqs)) {
         qed_cancel_need_check_timer(s);
     }
 
-    /* Freeze this request if another allocating write is in progress */
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        QSIMPLEQ_INSERT_TAIL(&s->allocating_write_reqs, acb, next);
-    }
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs) ||
+    acb->alloc_start = qed_start_of_cluster(s, acb->cur_pos);
+    acb->alloc_end = qed_start_of_cluster(s, acb->cur_pos + len +
+                                          s->header.cluster_size - 1);
+    acb->alloc_l1_index = qed_l1_index(s, acb->cur_pos);
+    acb->alloc_l2_table = acb->find_cluster_ret == QED_CLUSTER_L1;
+
+    /* A request started along with one that sets the need check flag waits
+     * until the flag is on disk
+     */
+    if (acb->alloc_state == QED_ALLOC_ACTIVE &&
         s->allocating_write_reqs_plugged) {
-        return; /* wait for existing request to finish */
+        QLIST_REMOVE(acb, alloc_node);
+        acb->alloc_state = QED_ALLOC_NONE;
+    }
+
+    /* Freeze this request if a conflicting allocating write is in progress */
+    if (acb->alloc_state == QED_ALLOC_NONE) {
+        if (!qed_allocating_write_may_start(s, acb)) {
+            acb->alloc_state = QED_ALLOC_WAITING;
+            QSIMPLEQ_INSERT_TAIL(&s->allocating_write_reqs, acb, next);
+            return; /* wait for conflicting requests to finish */
+        }
+        acb->alloc_state = QED_ALLOC_ACTIVE;
+        QLIST_INSERT_HEAD(&s->allocating_writes, acb, alloc_node);
     }
 
     acb->cur_nclusters = qed_bytes_to_clusters(s,
@@ -1128,8 +1437,10 @@ static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
     qemu_iovec_copy(&acb->cur_qiov, acb->qiov, acb->qiov_offset, len);
 
     if (qed_should_set_need_check(s)) {
+        /* Hold back other allocating writes until the flag is on disk */
         s->header.features |= QED_F_NEED_CHECK;
-        qed_write_header(s, qed_aio_write_prefill, acb);
+        qed_plug_allocating_write_reqs(s);
+        qed_write_header(s, qed_aio_write_need_check_set, acb);
     } else {
         qed_aio_write_prefill(acb, 0);
     }
@@ -1176,6 +1487,9 @@ static void qed_aio_write_data(void *opaque, int ret,
 
     switch (ret) {
     case QED_CLUSTER_FOUND:
+        /* Allocated by another request while this one was waiting */
+        qed_finish_allocating_write(acb_to_s(acb), acb);
+
         qed_aio_write_inplace(acb, offset, len);
         break;
 
@@ -1299,6 +1613,7 @@ static BlockDriverAIOCB *qed_aio_setup(BlockDriverState *bs,
     acb->cur_pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
     acb->end_pos = acb->cur_pos + nb_sectors * BDRV_SECTOR_SIZE;
     acb->request.l2_table = NULL;
+    acb->alloc_state = QED_ALLOC_NONE;
     qemu_iovec_init(&acb->cur_qiov, qiov->niov);
 
     /* Start request */
@@ -1352,7 +1667,10 @@ static int bdrv_qed_truncate(BlockDriverState *bs, int64_t offset)
     ret = qed_write_header_sync(s);
     if (ret < 0) {
         s->header.image_size = old_image_size;
+        return ret;
     }
+
+    s->l2_cache.max_entries = qed_l2_cache_size(s);
     return ret;
 }
 
@@ -1472,6 +1790,11 @@ static QEMUOptionParameter qed_create_options[] = {
         .name = BLOCK_OPT_TABLE_SIZE,
         .type = OPT_SIZE,
         .help = "L1/L2 table size (in clusters)"
+    }, {
+        .name = BLOCK_OPT_PREALLOC,
+        .type = OPT_STRING,
+        .help = "Preallocation mode (allowed values: off, metadata, "
+                "falloc, full)"
     },
     { /* end of list */ }
 };
@@ -1486,6 +1809,7 @@ static BlockDriver bdrv_qed = {
     .bdrv_close               = bdrv_qed_close,
     .bdrv_create              = bdrv_qed_create,
     .bdrv_is_allocated        = bdrv_qed_is_allocated,
+    .bdrv_get_extents         = bdrv_qed_get_extents,
     .bdrv_make_empty          = bdrv_qed_make_empty,
     .bdrv_aio_readv           = bdrv_qed_aio_readv,
     .bdrv_aio_writev          = bdrv_qed_aio_writev,
@@ -81,6 +81,12 @@ enum {
 
     /* Delay to flush and clean image after last allocating write completes */
     QED_NEED_CHECK_TIMEOUT = 5,    /* in seconds */
+
+    /* The L2 cache holds enough tables to cover the whole image, but no more
+     * than QED_MAX_L2_CACHE_BYTES unless that is less than the minimum.
+     */
+    QED_MIN_L2_CACHE_SIZE = 4,     /* in tables */
+    QED_MAX_L2_CACHE_BYTES = 32 * 1024 * 1024,
 };
 
 typedef struct {
@@ -115,19 +121,28 @@ typedef struct CachedL2Table {
 } CachedL2Table;
 
 typedef struct {
-    QTAILQ_HEAD(, CachedL2Table) entries;
+    QTAILQ_HEAD(, CachedL2Table) entries;   /* least recently used first */
     unsigned int n_entries;
+    unsigned int max_entries;
 } L2TableCache;
 
 typedef struct QEDRequest {
     CachedL2Table *l2_table;
 } QEDRequest;
 
+/* Allocating write state of a request, see qed_aio_write_alloc() */
+enum {
+    QED_ALLOC_NONE,                 /* not allocating */
+    QED_ALLOC_WAITING,              /* waiting in allocating_write_reqs */
+    QED_ALLOC_ACTIVE,               /* allocating, in allocating_writes */
+};
+
 typedef struct QEDAIOCB {
     BlockDriverAIOCB common;
     QEMUBH *bh;
     int bh_ret;                     /* final return status for completion bh */
     QSIMPLEQ_ENTRY(QEDAIOCB) next;  /* next request */
+    QLIST_ENTRY(QEDAIOCB) alloc_node; /* allocating writes in progress */
     bool is_write;                  /* false - read, true - write */
     bool *finished;                 /* signal for cancel completion */
     uint64_t end_pos;               /* request end on block device, in bytes */
@@ -143,9 +158,18 @@ typedef struct QEDAIOCB {
     unsigned int cur_nclusters;     /* number of clusters being accessed */
     int find_cluster_ret;           /* used for L1/L2 update */
 
+    /* Clusters being allocated, on block device */
+    int alloc_state;
+    uint64_t alloc_start;           /* in bytes, cluster aligned */
+    uint64_t alloc_end;
+    unsigned int alloc_l1_index;
+    bool alloc_l2_table;            /* also allocating the L2 table? */
+
     QEDRequest request;
 } QEDAIOCB;
 
+typedef struct QEDWriteTableCB QEDWriteTableCB;
+
 typedef struct {
     BlockDriverState *bs;           /* device */
     uint64_t file_size;             /* length of image file, in bytes */
@@ -158,10 +182,16 @@ typedef struct {
     uint32_t l2_shift;
     uint32_t l2_mask;
 
-    /* Allocating write request queue */
+    /* Allocating write requests in progress and waiting ones.  Requests that
+     * allocate different clusters run in parallel.
+     */
+    QLIST_HEAD(, QEDAIOCB) allocating_writes;
     QSIMPLEQ_HEAD(, QEDAIOCB) allocating_write_reqs;
     bool allocating_write_reqs_plugged;
 
+    /* Table writes in flight, at most one per table */
+    QSIMPLEQ_HEAD(, QEDWriteTableCB) table_writes;
+
     /* Periodic flush and clear need check flag */
     QEMUTimer *need_check_timer;
 
@@ -210,7 +240,7 @@ void gencb_complete(void *opaque, int ret);
 /**
  * L2 cache functions
  */
-void qed_init_l2_cache(L2TableCache *l2_cache);
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries);
 void qed_free_l2_cache(L2TableCache *l2_cache);
 CachedL2Table *qed_alloc_l2_cache_entry(L2TableCache *l2_cache);
 void qed_unref_l2_cache_entry(CachedL2Table *entry);
@@ -18,26 +18,38 @@
 #define QEMU_AIO_WRITE        0x0002
 #define QEMU_AIO_IOCTL        0x0004
 #define QEMU_AIO_FLUSH        0x0008
+#define QEMU_AIO_CALL         0x0010
 #define QEMU_AIO_TYPE_MASK \
-	(QEMU_AIO_READ|QEMU_AIO_WRITE|QEMU_AIO_IOCTL|QEMU_AIO_FLUSH)
+	(QEMU_AIO_READ|QEMU_AIO_WRITE|QEMU_AIO_IOCTL|QEMU_AIO_FLUSH| \
+	 QEMU_AIO_CALL)
 
 /* AIO flags */
 #define QEMU_AIO_MISALIGNED   0x1000
 
 
 /* posix-aio-compat.c - thread pool based implementation */
+typedef struct PaioBouncePool PaioBouncePool;
+
 int paio_init(void);
+int paio_configure(int min_threads, int max_threads, int idle_timeout);
+PaioBouncePool *paio_bounce_pool_new(BlockDriverState *bs);
+void paio_bounce_pool_free(PaioBouncePool *pool);
 BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
-        BlockDriverCompletionFunc *cb, void *opaque, int type);
+        BlockDriverCompletionFunc *cb, void *opaque, int type,
+        PaioBouncePool *bounce_pool);
 BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
         unsigned long int req, void *buf,
         BlockDriverCompletionFunc *cb, void *opaque);
+BlockDriverAIOCB *paio_call(BlockDriverState *bs, int (*func)(void *),
+        void *func_opaque, BlockDriverCompletionFunc *cb, void *opaque);
 
 /* linux-aio.c - Linux native implementation */
 void *laio_init(void);
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx);
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx);
 
 #endif /* QEMU_RAW_POSIX_AIO_H */
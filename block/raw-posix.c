@@ -25,6 +25,7 @@
 #include "qemu-timer.h"
 #include "qemu-char.h"
 #include "qemu-log.h"
+#include "qemu-error.h"
 #include "block_int.h"
 #include "module.h"
 #include "block/raw-posix-aio.h"
@@ -80,6 +81,11 @@
 #include <xfs/xfs.h>
 #endif
 
+#ifdef CONFIG_FIEMAP
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
 //#define DEBUG_FLOPPY
 
 //#define DEBUG_BLOCK
@@ -129,8 +135,7 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
-    uint8_t *aligned_buf;
-    unsigned aligned_buf_size;
+    PaioBouncePool *bounce_pool;    /* only with O_DIRECT */
 #ifdef CONFIG_XFS
     bool is_xfs : 1;
 #endif
@@ -216,18 +221,12 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
         return ret;
     }
     s->fd = fd;
-    s->aligned_buf = NULL;
+    s->bounce_pool = NULL;
 
     if ((bdrv_flags & BDRV_O_NOCACHE)) {
-        /*
-         * Allocate a buffer for read/modify/write cycles.  Chose the size
-         * pessimistically as we don't know the block size yet.
-         */
-        s->aligned_buf_size = 32 * MAX_BLOCKSIZE;
-        s->aligned_buf = qemu_memalign(MAX_BLOCKSIZE, s->aligned_buf_size);
-        if (s->aligned_buf == NULL) {
-            goto out_close;
-        }
+        /* Misaligned requests are copied through buffers from this pool */
+        s->bounce_pool = paio_bounce_pool_new(bs);
+        bs->has_misaligned_stats = true;
     }
 
     /* We're falling back to POSIX AIO in some cases so init always */
@@ -265,8 +264,7 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
     return 0;
 
 out_free_buf:
-    qemu_vfree(s->aligned_buf);
-out_close:
+    paio_bounce_pool_free(s->bounce_pool);
     close(fd);
     return -errno;
 }
@@ -326,9 +324,10 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
      * boundary.  Check if this is the case or tell the low-level
      * driver that it needs to copy the buffer.
      */
-    if (s->aligned_buf) {
+    if (s->bounce_pool) {
         if (!qiov_is_aligned(bs, qiov)) {
             type |= QEMU_AIO_MISALIGNED;
+            bs->nr_misaligned++;
 #ifdef CONFIG_LINUX_AIO
         } else if (s->use_aio) {
             return laio_submit(bs, s->aio_ctx, s->fd, sector_num, qiov,
@@ -338,7 +337,7 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
     }
 
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
-                       cb, opaque, type);
+                       cb, opaque, type, s->bounce_pool);
 }
 
 static BlockDriverAIOCB *raw_aio_readv(BlockDriverState *bs,
@@ -365,7 +364,60 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
-    return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
+    return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH,
+                       NULL);
+}
+
+#ifdef CONFIG_LINUX_AIO
+/*
+ * Return the file descriptor of a raw image opened with aio=native, for
+ * callers that submit Linux AIO requests on their own, or -ENOTSUP.
+ */
+int raw_get_aio_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+
+    if (bs->drv == bdrv_find_format("raw")) {
+        bs = bs->file;
+    }
+
+    /* raw-posix has several protocols so just check for raw_aio_readv */
+    if (bs->drv->bdrv_aio_readv != raw_aio_readv) {
+        return -ENOTSUP;
+    }
+
+    s = bs->opaque;
+    if (!s->use_aio) {
+        return -ENOTSUP;
+    }
+    return s->fd;
+}
+#endif
+
+static void raw_io_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_plug(bs, s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_io_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_unplug(bs, s->aio_ctx);
+    }
+#endif
 }
 
 static void raw_close(BlockDriverState *bs)
@@ -374,9 +426,9 @@ static void raw_close(BlockDriverState *bs)
     if (s->fd >= 0) {
         close(s->fd);
         s->fd = -1;
-        if (s->aligned_buf != NULL)
-            qemu_vfree(s->aligned_buf);
     }
+    paio_bounce_pool_free(s->bounce_pool);
+    s->bounce_pool = NULL;
 }
 
 static int raw_truncate(BlockDriverState *bs, int64_t offset)
@@ -554,16 +606,218 @@ static int64_t raw_get_allocated_file_size(BlockDriverState *bs)
     return (int64_t)st.st_blocks * 512;
 }
 
+/*
+ * Find out whether the byte at @start is in a data region or in a hole of
+ * the file, and how far the region extends (at most @max_len bytes).
+ *
+ * Returns 1 for data, 0 for a hole, which reads as zeroes, and -errno on
+ * failure.  Files on filesystems that cannot report holes are all data.
+ */
+static int raw_find_allocation(BDRVRawState *s, off_t start, off_t max_len,
+                               off_t *pnum)
+{
+    off_t data, hole;
+
+#ifdef SEEK_DATA
+    hole = lseek(s->fd, start, SEEK_HOLE);
+    if (hole == -1 && errno == ENXIO) {
+        /* start is at or beyond the end of the file */
+        *pnum = max_len;
+        return 0;
+    } else if (hole > start) {
+        *pnum = MIN(hole - start, max_len);
+        return 1;
+    } else if (hole == start) {
+        data = lseek(s->fd, start, SEEK_DATA);
+        if (data == -1) {
+            /* hole up to the end of the file */
+            *pnum = max_len;
+        } else {
+            *pnum = MIN(data - start, max_len);
+        }
+        return 0;
+    }
+    /* SEEK_HOLE not supported, try FIEMAP */
+#endif
+
+#ifdef CONFIG_FIEMAP
+    {
+        struct {
+            struct fiemap fm;
+            struct fiemap_extent fe;
+        } f;
+
+        memset(&f, 0, sizeof(f));
+        f.fm.fm_start = start;
+        f.fm.fm_length = max_len;
+        f.fm.fm_flags = FIEMAP_FLAG_SYNC;
+        f.fm.fm_extent_count = 1;
+        if (ioctl(s->fd, FS_IOC_FIEMAP, &f) == 0) {
+            if (f.fm.fm_mapped_extents == 0) {
+                /* no extent in the whole range */
+                *pnum = max_len;
+                return 0;
+            }
+            if (f.fe.fe_logical > start) {
+                *pnum = MIN(f.fe.fe_logical - start, max_len);
+                return 0;
+            }
+            *pnum = MIN(f.fe.fe_logical + f.fe.fe_length - start, max_len);
+            /* preallocated but unwritten extents read as zeroes */
+            return !(f.fe.fe_flags & FIEMAP_EXTENT_UNWRITTEN);
+        }
+    }
+#endif
+
+    *pnum = max_len;
+    return 1;
+}
+
+/*
+ * Sector granularity version of raw_find_allocation().  Sectors that are
+ * only partially allocated count as data.
+ */
+static int raw_sector_allocation(BDRVRawState *s, int64_t sector_num,
+                                 int64_t nb_sectors, int64_t *pnum)
+{
+    off_t n;
+    int ret;
+
+    ret = raw_find_allocation(s, sector_num * BDRV_SECTOR_SIZE,
+                              nb_sectors * BDRV_SECTOR_SIZE, &n);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (ret) {
+        *pnum = DIV_ROUND_UP(n, BDRV_SECTOR_SIZE);
+    } else {
+        *pnum = n / BDRV_SECTOR_SIZE;
+        if (*pnum == 0) {
+            *pnum = 1;
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Holes in the file are reported as unallocated, so that callers like
+ * qemu-img convert or block migration do not read them.
+ */
+static int coroutine_fn raw_co_is_allocated(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors, int *pnum)
+{
+    BDRVRawState *s = bs->opaque;
+    int64_t n;
+    int ret;
+
+    ret = raw_sector_allocation(s, sector_num, nb_sectors, &n);
+    if (ret < 0) {
+        /* the interface cannot pass errors on, read everything */
+        *pnum = nb_sectors;
+        return 1;
+    }
+    *pnum = n;
+    return ret;
+}
+
+static int raw_get_extents(BlockDriverState *bs, int64_t sector_num,
+                           int64_t nb_sectors, BlockExtent *extents,
+                           int max_extents)
+{
+    BDRVRawState *s = bs->opaque;
+    int nb_extents = 0;
+    int64_t n;
+    int ret;
+
+    while (nb_sectors > 0 && nb_extents < max_extents) {
+        ret = raw_sector_allocation(s, sector_num, nb_sectors, &n);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (ret) {
+            bdrv_add_extent(extents, &nb_extents, sector_num, n,
+                            BDRV_EXTENT_DATA | BDRV_EXTENT_OFFSET, bs,
+                            sector_num * BDRV_SECTOR_SIZE);
+        } else {
+            bdrv_add_extent(extents, &nb_extents, sector_num, n,
+                            BDRV_EXTENT_ZERO, NULL, 0);
+        }
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    return nb_extents;
+}
+
+/* Allocate the first size bytes of a new file by writing zeroes */
+static int raw_write_zeroes(int fd, int64_t size)
+{
+    const size_t buf_size = 1024 * 1024;
+    uint8_t *buf;
+    int64_t offset = 0;
+    ssize_t len;
+    int ret = 0;
+
+    buf = g_malloc0(buf_size);
+    while (offset < size) {
+        len = pwrite(fd, buf, MIN(buf_size, size - offset), offset);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = -errno;
+            break;
+        }
+        offset += len;
+    }
+    g_free(buf);
+
+    /* Make the file system allocate the blocks now, not on writeback */
+    if (ret == 0 && qemu_fdatasync(fd) < 0) {
+        ret = -errno;
+    }
+    return ret;
+}
+
+static int raw_preallocate(int fd, int64_t size, PreallocMode mode)
+{
+#ifdef CONFIG_POSIX_FALLOCATE
+    int ret;
+
+    if (mode == PREALLOC_FALLOC) {
+        ret = posix_fallocate(fd, 0, size);
+        if (ret != EINVAL && ret != EOPNOTSUPP && ret != ENOSYS) {
+            return -ret;
+        }
+        /* Not supported by the file system, write the zeroes ourselves */
+    }
+#endif
+    return raw_write_zeroes(fd, size);
+}
+
 static int raw_create(const char *filename, QEMUOptionParameter *options)
 {
     int fd;
     int result = 0;
     int64_t total_size = 0;
+    PreallocMode prealloc = PREALLOC_OFF;
 
     /* Read out options */
     while (options && options->name) {
         if (!strcmp(options->name, BLOCK_OPT_SIZE)) {
             total_size = options->value.n / BDRV_SECTOR_SIZE;
+        } else if (!strcmp(options->name, BLOCK_OPT_PREALLOC)) {
+            if (bdrv_parse_prealloc_mode(options->value.s, &prealloc) < 0) {
+                return -EINVAL;
+            }
+            if (prealloc == PREALLOC_METADATA) {
+                error_report("Raw images have no metadata to preallocate");
+                return -EINVAL;
+            }
         }
         options++;
     }
@@ -576,6 +830,10 @@ static int raw_create(const char *filename, QEMUOptionParameter *options)
         if (ftruncate(fd, total_size * BDRV_SECTOR_SIZE) != 0) {
             result = -errno;
         }
+        if (result == 0 && prealloc != PREALLOC_OFF) {
+            result = raw_preallocate(fd, total_size * BDRV_SECTOR_SIZE,
+                                     prealloc);
+        }
         if (close(fd) != 0) {
             result = -errno;
         }
@@ -622,6 +880,11 @@ static QEMUOptionParameter raw_create_options[] = {
         .type = OPT_SIZE,
         .help = "Virtual disk size"
     },
+    {
+        .name = BLOCK_OPT_PREALLOC,
+        .type = OPT_STRING,
+        .help = "Preallocation mode (allowed values: off, falloc, full)"
+    },
     { NULL }
 };
 
@@ -638,11 +901,15 @@ static BlockDriver bdrv_file = {
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
+    .bdrv_co_is_allocated = raw_co_is_allocated,
+    .bdrv_get_extents = raw_get_extents,
 
     .create_options = raw_create_options,
 };
@@ -906,6 +1173,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -25,6 +25,8 @@
 #include "qemu-timer.h"
 #include "block_int.h"
 #include "module.h"
+#include "qerror.h"
+#include "qmp-commands.h"
 #include <windows.h>
 #include <winioctl.h>
 
@@ -422,6 +424,13 @@ static BlockDriver bdrv_host_device = {
                         = raw_get_allocated_file_size,
 };
 
+/* I/O is synchronous here, there is no thread pool */
+AioPoolInfo *qmp_query_aio_pool(Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
 static void bdrv_file_init(void)
 {
     bdrv_register(&bdrv_file);
@@ -51,6 +51,33 @@ static int coroutine_fn raw_co_discard(BlockDriverState *bs,
     return bdrv_co_discard(bs->file, sector_num, nb_sectors);
 }
 
+static int coroutine_fn raw_co_is_allocated(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors, int *pnum)
+{
+    return bdrv_co_is_allocated(bs->file, sector_num, nb_sectors, pnum);
+}
+
+static int raw_get_extents(BlockDriverState *bs, int64_t sector_num,
+                           int64_t nb_sectors, BlockExtent *extents,
+                           int max_extents)
+{
+    int i, n;
+
+    n = bdrv_get_extents(bs->file, sector_num, nb_sectors, extents,
+                         max_extents);
+
+    /* Without any metadata every sector is stored at its own offset */
+    for (i = 0; i < n; i++) {
+        if (extents[i].flags == BDRV_EXTENT_DATA) {
+            extents[i].flags |= BDRV_EXTENT_OFFSET;
+            extents[i].file = bs->file;
+            extents[i].offset = extents[i].sector_num * BDRV_SECTOR_SIZE;
+        }
+    }
+    return n;
+}
+
 static int raw_is_inserted(BlockDriverState *bs)
 {
     return bdrv_is_inserted(bs->file);
@@ -115,10 +142,12 @@ static BlockDriver bdrv_raw = {
     .bdrv_co_writev         = raw_co_writev,
     .bdrv_co_flush_to_disk  = raw_co_flush,
     .bdrv_co_discard        = raw_co_discard,
+    .bdrv_co_is_allocated   = raw_co_is_allocated,
 
     .bdrv_probe         = raw_probe,
     .bdrv_getlength     = raw_getlength,
     .bdrv_truncate      = raw_truncate,
+    .bdrv_get_extents   = raw_get_extents,
 
     .bdrv_is_inserted   = raw_is_inserted,
     .bdrv_media_changed = raw_media_changed,
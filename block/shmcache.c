@@ -0,0 +1,390 @@
+/*
+ * Block protocol for sharing a read cache of base images between processes
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "qemu-common.h"
+#include "qemu-barrier.h"
+#include "block_int.h"
+
+/*
+ * The cache is a file that every process using it maps shared, typically
+ * on a tmpfs like /dev/shm.  If the file does not exist it is created with
+ * SHMCACHE_DEFAULT_SIZE bytes; to get another size, create the file with
+ * that size before the first user opens it.
+ *
+ * The file starts with a header, followed by the slot index and the data
+ * of the slots.  The index is organised in sets of SHMCACHE_WAYS slots, and
+ * a slot holds one chunk of an image, keyed by (image id, chunk number).
+ * The image id is derived from the identity of the image file, so a base
+ * image that is replaced gets a new id.  The image must not change while it
+ * is in use, as for any backing file.
+ *
+ * This is a protocol: "shmcache:/dev/shm/cache:base.qcow2" caches the bytes
+ * of base.qcow2, and the qcow2 driver parses them like for any other file.
+ *
+ * Slots are updated without a lock across processes: the sequence number of
+ * a slot is odd while the slot is being written and is incremented again
+ * afterwards.  Readers check that the sequence number did not change while
+ * they copied the data, and go to the image otherwise.
+ */
+
+#define SHMCACHE_MAGIC          0x51454d55434143ULL     /* "QEMUCAC" */
+#define SHMCACHE_VERSION        1
+#define SHMCACHE_HEADER_SIZE    4096
+#define SHMCACHE_CHUNK_SIZE     (64 * 1024)
+#define SHMCACHE_WAYS           4
+#define SHMCACHE_DEFAULT_SIZE   (256 * 1024 * 1024)
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t nb_sets;
+    uint64_t data_offset;
+} ShmCacheHeader;
+
+typedef struct {
+    uint32_t seq;
+    uint32_t reserved;
+    uint64_t image_id;
+    uint64_t chunk;             /* chunk number + 1, 0 if the slot is empty */
+} ShmCacheSlot;
+
+typedef struct {
+    BlockDriverState *image;
+    uint64_t image_id;
+
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    ShmCacheHeader *header;
+    ShmCacheSlot *slots;
+    uint8_t *data;
+    int chunk_sectors;
+    unsigned int next_victim;
+} BDRVShmCacheState;
+
+static uint64_t shmcache_hash(uint64_t hash, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    /* FNV-1a */
+    while (len--) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t shmcache_image_id(const char *filename)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    struct stat st;
+
+    if (stat(filename, &st) < 0) {
+        return shmcache_hash(hash, filename, strlen(filename));
+    }
+    hash = shmcache_hash(hash, &st.st_dev, sizeof(st.st_dev));
+    hash = shmcache_hash(hash, &st.st_ino, sizeof(st.st_ino));
+    hash = shmcache_hash(hash, &st.st_size, sizeof(st.st_size));
+    return shmcache_hash(hash, &st.st_mtime, sizeof(st.st_mtime));
+}
+
+/* Map the cache file and format it if needed, with the file locked */
+static int shmcache_map(BDRVShmCacheState *s, const char *path)
+{
+    ShmCacheHeader *header;
+    struct stat st;
+    uint64_t slot_bytes;
+    int ret;
+
+    s->fd = qemu_open(path, O_RDWR | O_CREAT | O_BINARY, 0600);
+    if (s->fd < 0) {
+        return -errno;
+    }
+    if (flock(s->fd, LOCK_EX) < 0) {
+        ret = -errno;
+        goto fail;
+    }
+
+    if (fstat(s->fd, &st) < 0) {
+        ret = -errno;
+        goto fail;
+    }
+    if (st.st_size == 0) {
+        if (ftruncate(s->fd, SHMCACHE_DEFAULT_SIZE) < 0) {
+            ret = -errno;
+            goto fail;
+        }
+        st.st_size = SHMCACHE_DEFAULT_SIZE;
+    }
+    slot_bytes = SHMCACHE_WAYS * (sizeof(ShmCacheSlot) + SHMCACHE_CHUNK_SIZE);
+    if (st.st_size < 2 * SHMCACHE_HEADER_SIZE + slot_bytes) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->map_size = st.st_size;
+    s->map = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  s->fd, 0);
+    if (s->map == MAP_FAILED) {
+        s->map = NULL;
+        ret = -errno;
+        goto fail;
+    }
+    header = (ShmCacheHeader *)s->map;
+
+    if (header->magic != SHMCACHE_MAGIC) {
+        header->nb_sets = (s->map_size - 2 * SHMCACHE_HEADER_SIZE) /
+                          slot_bytes;
+        header->data_offset = SHMCACHE_HEADER_SIZE +
+            DIV_ROUND_UP(header->nb_sets * SHMCACHE_WAYS * sizeof(ShmCacheSlot),
+                         SHMCACHE_HEADER_SIZE) * SHMCACHE_HEADER_SIZE;
+        header->chunk_size = SHMCACHE_CHUNK_SIZE;
+        header->version = SHMCACHE_VERSION;
+        memset(s->map + SHMCACHE_HEADER_SIZE, 0,
+               header->nb_sets * SHMCACHE_WAYS * sizeof(ShmCacheSlot));
+        smp_wmb();
+        header->magic = SHMCACHE_MAGIC;
+    } else if (header->version != SHMCACHE_VERSION ||
+               header->chunk_size != SHMCACHE_CHUNK_SIZE ||
+               header->nb_sets == 0 ||
+               header->data_offset + header->nb_sets * SHMCACHE_WAYS *
+                   SHMCACHE_CHUNK_SIZE > s->map_size) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    flock(s->fd, LOCK_UN);
+
+    s->header = header;
+    s->slots = (ShmCacheSlot *)(s->map + SHMCACHE_HEADER_SIZE);
+    s->data = s->map + header->data_offset;
+    return 0;
+
+fail:
+    if (s->map) {
+        munmap(s->map, s->map_size);
+        s->map = NULL;
+    }
+    close(s->fd);
+    return ret;
+}
+
+/* Valid shmcache filenames look like shmcache:path/to/cache:path/to/image */
+static int shmcache_open(BlockDriverState *bs, const char *filename, int flags)
+{
+    BDRVShmCacheState *s = bs->opaque;
+    char *path, *c;
+    int ret;
+
+    /* The cache is only coherent for images that don't change */
+    if (flags & BDRV_O_RDWR) {
+        return -EROFS;
+    }
+
+    /* Parse the shmcache: prefix */
+    if (strncmp(filename, "shmcache:", strlen("shmcache:"))) {
+        return -EINVAL;
+    }
+    filename += strlen("shmcache:");
+
+    /* Parse the cache filename */
+    c = strchr(filename, ':');
+    if (c == NULL) {
+        return -EINVAL;
+    }
+
+    path = g_strndup(filename, c - filename);
+    ret = shmcache_map(s, path);
+    g_free(path);
+    if (ret < 0) {
+        return ret;
+    }
+    filename = c + 1;
+
+    /*
+     * Open the image file without probing its format: the cache holds the
+     * bytes of the file and the format driver is opened on top of us.
+     */
+    ret = bdrv_file_open(&s->image, filename, flags);
+    if (ret < 0) {
+        s->image = NULL;
+        munmap(s->map, s->map_size);
+        close(s->fd);
+        return ret;
+    }
+
+    s->image_id = shmcache_image_id(filename);
+    s->chunk_sectors = SHMCACHE_CHUNK_SIZE / BDRV_SECTOR_SIZE;
+    bs->has_cache_stats = true;
+    return 0;
+}
+
+static void shmcache_close(BlockDriverState *bs)
+{
+    BDRVShmCacheState *s = bs->opaque;
+
+    bdrv_delete(s->image);
+    s->image = NULL;
+    munmap(s->map, s->map_size);
+    close(s->fd);
+}
+
+static int64_t shmcache_getlength(BlockDriverState *bs)
+{
+    BDRVShmCacheState *s = bs->opaque;
+
+    return bdrv_getlength(s->image);
+}
+
+static ShmCacheSlot *shmcache_set(BDRVShmCacheState *s, uint64_t chunk)
+{
+    uint64_t hash;
+
+    hash = shmcache_hash(s->image_id, &chunk, sizeof(chunk));
+    return &s->slots[(hash % s->header->nb_sets) * SHMCACHE_WAYS];
+}
+
+static uint8_t *shmcache_slot_data(BDRVShmCacheState *s, ShmCacheSlot *slot)
+{
+    return s->data + (uint64_t)(slot - s->slots) * SHMCACHE_CHUNK_SIZE;
+}
+
+/*
+ * Copy nb_sectors sectors from offset index of a cached chunk into qiov.
+ * Returns false if the chunk is not in the cache.
+ */
+static bool shmcache_lookup(BDRVShmCacheState *s, uint64_t chunk,
+                            int index, int nb_sectors, QEMUIOVector *qiov)
+{
+    ShmCacheSlot *slot = shmcache_set(s, chunk);
+    uint32_t seq;
+    int i;
+
+    for (i = 0; i < SHMCACHE_WAYS; i++, slot++) {
+        seq = slot->seq;
+        __sync_synchronize(); /* read memory barrier before the slot */
+        if ((seq & 1) || slot->image_id != s->image_id ||
+            slot->chunk != chunk + 1) {
+            continue;
+        }
+        qemu_iovec_from_buffer(qiov,
+                               shmcache_slot_data(s, slot) +
+                               index * BDRV_SECTOR_SIZE,
+                               nb_sectors * BDRV_SECTOR_SIZE);
+        __sync_synchronize(); /* read memory barrier after the copy */
+        return slot->seq == seq;
+    }
+    return false;
+}
+
+/* Store a chunk, unless another process is updating its slot right now */
+static void shmcache_insert(BDRVShmCacheState *s, uint64_t chunk,
+                            const uint8_t *buf)
+{
+    ShmCacheSlot *set = shmcache_set(s, chunk);
+    ShmCacheSlot *slot = NULL;
+    uint32_t seq;
+    int i;
+
+    for (i = 0; i < SHMCACHE_WAYS; i++) {
+        if (set[i].image_id == s->image_id && set[i].chunk == chunk + 1) {
+            return;
+        }
+        if (!slot && set[i].chunk == 0) {
+            slot = &set[i];
+        }
+    }
+    if (!slot) {
+        slot = &set[s->next_victim++ % SHMCACHE_WAYS];
+    }
+
+    seq = slot->seq;
+    if ((seq & 1) || !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1)) {
+        return;
+    }
+    slot->image_id = s->image_id;
+    slot->chunk = chunk + 1;
+    memcpy(shmcache_slot_data(s, slot), buf, SHMCACHE_CHUNK_SIZE);
+    smp_wmb();
+    slot->seq = seq + 2;
+}
+
+static coroutine_fn int shmcache_co_readv(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
+{
+    BDRVShmCacheState *s = bs->opaque;
+    QEMUIOVector hd_qiov;
+    uint64_t bytes_done = 0;
+    uint8_t *buf = NULL;
+    int ret = 0;
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    while (nb_sectors > 0) {
+        uint64_t chunk = sector_num / s->chunk_sectors;
+        int index = sector_num % s->chunk_sectors;
+        int n = MIN(s->chunk_sectors - index, nb_sectors);
+        int64_t chunk_start = chunk * s->chunk_sectors;
+        int len;
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done, n * BDRV_SECTOR_SIZE);
+
+        if (shmcache_lookup(s, chunk, index, n, &hd_qiov)) {
+            bs->nr_cache_hits++;
+        } else {
+            bs->nr_cache_misses++;
+            if (!buf) {
+                buf = qemu_blockalign(bs, SHMCACHE_CHUNK_SIZE);
+            }
+            len = MIN(s->chunk_sectors, bs->total_sectors - chunk_start);
+            ret = bdrv_read(s->image, chunk_start, buf, len);
+            if (ret < 0) {
+                goto out;
+            }
+            memset(buf + len * BDRV_SECTOR_SIZE, 0,
+                   SHMCACHE_CHUNK_SIZE - len * BDRV_SECTOR_SIZE);
+            shmcache_insert(s, chunk, buf);
+            qemu_iovec_from_buffer(&hd_qiov, buf + index * BDRV_SECTOR_SIZE,
+                                   n * BDRV_SECTOR_SIZE);
+        }
+
+        nb_sectors -= n;
+        sector_num += n;
+        bytes_done += n * BDRV_SECTOR_SIZE;
+    }
+
+out:
+    qemu_iovec_destroy(&hd_qiov);
+    qemu_vfree(buf);
+    return ret;
+}
+
+static BlockDriver bdrv_shmcache = {
+    .format_name        = "shmcache",
+    .protocol_name      = "shmcache",
+
+    .instance_size      = sizeof(BDRVShmCacheState),
+
+    .bdrv_getlength     = shmcache_getlength,
+
+    .bdrv_file_open     = shmcache_open,
+    .bdrv_close         = shmcache_close,
+
+    .bdrv_co_readv      = shmcache_co_readv,
+};
+
+static void bdrv_shmcache_init(void)
+{
+    bdrv_register(&bdrv_shmcache);
+}
+
+block_init(bdrv_shmcache_init);
@@ -143,29 +143,6 @@ void uuid_unparse(const uuid_t uu, char *out)
 }
 #endif
 
-typedef struct {
-    BlockDriverAIOCB common;
-    int64_t sector_num;
-    QEMUIOVector *qiov;
-    uint8_t *buf;
-    /* Total number of sectors. */
-    int nb_sectors;
-    /* Number of sectors for current AIO. */
-    int n_sectors;
-    /* New allocated block map entry. */
-    uint32_t bmap_first;
-    uint32_t bmap_last;
-    /* Buffer for new allocated block. */
-    void *block_buffer;
-    void *orig_buf;
-    bool is_write;
-    int header_modified;
-    BlockDriverAIOCB *hd_aiocb;
-    struct iovec hd_iov;
-    QEMUIOVector hd_qiov;
-    QEMUBH *bh;
-} VdiAIOCB;
-
 typedef struct {
     char text[0x40];
     uint32_t signature;
@@ -205,6 +182,9 @@ typedef struct {
     /* VDI header (converted to host endianness). */
     VdiHeader header;
 
+    /* Serializes block allocation and the block map and header updates. */
+    CoMutex alloc_lock;
+
     Error *migration_blocker;
 } BDRVVdiState;
 
@@ -457,6 +437,8 @@ static int vdi_open(BlockDriverState *bs, int flags)
         goto fail_free_bmap;
     }
 
+    qemu_co_mutex_init(&s->alloc_lock);
+
     /* Disable migration when vdi images are used */
     error_set(&s->migration_blocker,
               QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED,
@@ -489,358 +471,208 @@ static int vdi_is_allocated(BlockDriverState *bs, int64_t sector_num,
     return VDI_IS_ALLOCATED(bmap_entry);
 }
 
-static void vdi_aio_cancel(BlockDriverAIOCB *blockacb)
+static int vdi_get_extents(BlockDriverState *bs, int64_t sector_num,
+                           int64_t nb_sectors, BlockExtent *extents,
+                           int max_extents)
 {
-    /* TODO: This code is untested. How can I get it executed? */
-    VdiAIOCB *acb = container_of(blockacb, VdiAIOCB, common);
-    logout("\n");
-    if (acb->hd_aiocb) {
-        bdrv_aio_cancel(acb->hd_aiocb);
-    }
-    qemu_aio_release(acb);
-}
-
-static AIOPool vdi_aio_pool = {
-    .aiocb_size = sizeof(VdiAIOCB),
-    .cancel = vdi_aio_cancel,
-};
+    BDRVVdiState *s = (BDRVVdiState *)bs->opaque;
+    int nb_extents = 0;
+    int flags;
+
+    logout("%p, %" PRId64 ", %" PRId64 ", %d\n", bs, sector_num, nb_sectors,
+           max_extents);
+    while (nb_sectors > 0 && nb_extents < max_extents) {
+        size_t bmap_index = sector_num / s->block_sectors;
+        size_t sector_in_block = sector_num % s->block_sectors;
+        int64_t n_sectors = MIN(s->block_sectors - sector_in_block,
+                                nb_sectors);
+        uint32_t bmap_entry = le32_to_cpu(s->bmap[bmap_index]);
+        uint64_t offset = 0;
 
-static VdiAIOCB *vdi_aio_setup(BlockDriverState *bs, int64_t sector_num,
-        QEMUIOVector *qiov, int nb_sectors,
-        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
-{
-    VdiAIOCB *acb;
-
-    logout("%p, %" PRId64 ", %p, %d, %p, %p, %d\n",
-           bs, sector_num, qiov, nb_sectors, cb, opaque, is_write);
-
-    acb = qemu_aio_get(&vdi_aio_pool, bs, cb, opaque);
-    if (acb) {
-        acb->hd_aiocb = NULL;
-        acb->sector_num = sector_num;
-        acb->qiov = qiov;
-        acb->is_write = is_write;
-
-        if (qiov->niov > 1) {
-            acb->buf = qemu_blockalign(bs, qiov->size);
-            acb->orig_buf = acb->buf;
-            if (is_write) {
-                qemu_iovec_to_buffer(qiov, acb->buf);
-            }
+        if (VDI_IS_ALLOCATED(bmap_entry)) {
+            flags = BDRV_EXTENT_DATA | BDRV_EXTENT_OFFSET;
+            offset = s->header.offset_data +
+                     (uint64_t)bmap_entry * s->block_size +
+                     sector_in_block * SECTOR_SIZE;
+        } else if (bmap_entry == VDI_DISCARDED) {
+            flags = BDRV_EXTENT_ZERO;
         } else {
-            acb->buf = (uint8_t *)qiov->iov->iov_base;
+            flags = 0;
         }
-        acb->nb_sectors = nb_sectors;
-        acb->n_sectors = 0;
-        acb->bmap_first = VDI_UNALLOCATED;
-        acb->bmap_last = VDI_UNALLOCATED;
-        acb->block_buffer = NULL;
-        acb->header_modified = 0;
-    }
-    return acb;
-}
 
-static int vdi_schedule_bh(QEMUBHFunc *cb, VdiAIOCB *acb)
-{
-    logout("\n");
-
-    if (acb->bh) {
-        return -EIO;
+        bdrv_add_extent(extents, &nb_extents, sector_num, n_sectors, flags,
+                        (flags & BDRV_EXTENT_OFFSET) ? bs->file : NULL,
+                        offset);
+        sector_num += n_sectors;
+        nb_sectors -= n_sectors;
     }
 
-    acb->bh = qemu_bh_new(cb, acb);
-    if (!acb->bh) {
-        return -EIO;
-    }
-
-    qemu_bh_schedule(acb->bh);
-
-    return 0;
+    return nb_extents;
 }
 
-static void vdi_aio_read_cb(void *opaque, int ret);
-static void vdi_aio_write_cb(void *opaque, int ret);
-
-static void vdi_aio_rw_bh(void *opaque)
+static coroutine_fn int vdi_co_readv(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
 {
-    VdiAIOCB *acb = opaque;
-    logout("\n");
-    qemu_bh_delete(acb->bh);
-    acb->bh = NULL;
-
-    if (acb->is_write) {
-        vdi_aio_write_cb(opaque, 0);
-    } else {
-        vdi_aio_read_cb(opaque, 0);
-    }
-}
-
-static void vdi_aio_read_cb(void *opaque, int ret)
-{
-    VdiAIOCB *acb = opaque;
-    BlockDriverState *bs = acb->common.bs;
     BDRVVdiState *s = bs->opaque;
-    uint32_t bmap_entry;
-    uint32_t block_index;
-    uint32_t sector_in_block;
-    uint32_t n_sectors;
-
-    logout("%u sectors read\n", acb->n_sectors);
-
-    acb->hd_aiocb = NULL;
-
-    if (ret < 0) {
-        goto done;
-    }
+    QEMUIOVector hd_qiov;
+    uint64_t bytes_done = 0;
+    int ret = 0;
 
-    acb->nb_sectors -= acb->n_sectors;
+    logout("\n");
 
-    if (acb->nb_sectors == 0) {
-        /* request completed */
-        ret = 0;
-        goto done;
-    }
+    qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    acb->sector_num += acb->n_sectors;
-    acb->buf += acb->n_sectors * SECTOR_SIZE;
+    /* The block map lives in memory, so requests only wait for their own
+     * data and can run in parallel.
+     */
+    while (nb_sectors > 0) {
+        uint32_t block_index = sector_num / s->block_sectors;
+        uint32_t sector_in_block = sector_num % s->block_sectors;
+        uint32_t n_sectors = MIN(s->block_sectors - sector_in_block,
+                                 nb_sectors);
+        uint32_t bmap_entry = le32_to_cpu(s->bmap[block_index]);
 
-    block_index = acb->sector_num / s->block_sectors;
-    sector_in_block = acb->sector_num % s->block_sectors;
-    n_sectors = s->block_sectors - sector_in_block;
-    if (n_sectors > acb->nb_sectors) {
-        n_sectors = acb->nb_sectors;
-    }
+        logout("will read %u sectors starting at sector %" PRIu64 "\n",
+               n_sectors, sector_num);
 
-    logout("will read %u sectors starting at sector %" PRIu64 "\n",
-           n_sectors, acb->sector_num);
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done, n_sectors * SECTOR_SIZE);
 
-    /* prepare next AIO request */
-    acb->n_sectors = n_sectors;
-    bmap_entry = le32_to_cpu(s->bmap[block_index]);
-    if (!VDI_IS_ALLOCATED(bmap_entry)) {
-        /* Block not allocated, return zeros, no need to wait. */
-        memset(acb->buf, 0, n_sectors * SECTOR_SIZE);
-        ret = vdi_schedule_bh(vdi_aio_rw_bh, acb);
-        if (ret < 0) {
-            goto done;
-        }
-    } else {
-        uint64_t offset = s->header.offset_data / SECTOR_SIZE +
-                          (uint64_t)bmap_entry * s->block_sectors +
-                          sector_in_block;
-        acb->hd_iov.iov_base = (void *)acb->buf;
-        acb->hd_iov.iov_len = n_sectors * SECTOR_SIZE;
-        qemu_iovec_init_external(&acb->hd_qiov, &acb->hd_iov, 1);
-        acb->hd_aiocb = bdrv_aio_readv(bs->file, offset, &acb->hd_qiov,
-                                       n_sectors, vdi_aio_read_cb, acb);
-        if (acb->hd_aiocb == NULL) {
-            ret = -EIO;
-            goto done;
+        if (!VDI_IS_ALLOCATED(bmap_entry)) {
+            /* Block not allocated, return zeros. */
+            qemu_iovec_memset(&hd_qiov, 0, n_sectors * SECTOR_SIZE);
+        } else {
+            uint64_t offset = s->header.offset_data / SECTOR_SIZE +
+                              (uint64_t)bmap_entry * s->block_sectors +
+                              sector_in_block;
+            ret = bdrv_co_readv(bs->file, offset, n_sectors, &hd_qiov);
+            if (ret < 0) {
+                break;
+            }
         }
-    }
-    return;
-done:
-    if (acb->qiov->niov > 1) {
-        qemu_iovec_from_buffer(acb->qiov, acb->orig_buf, acb->qiov->size);
-        qemu_vfree(acb->orig_buf);
-    }
-    acb->common.cb(acb->common.opaque, ret);
-    qemu_aio_release(acb);
-}
-
-static BlockDriverAIOCB *vdi_aio_readv(BlockDriverState *bs,
-        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
-        BlockDriverCompletionFunc *cb, void *opaque)
-{
-    VdiAIOCB *acb;
-    int ret;
-
-    logout("\n");
-    acb = vdi_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, 0);
-    if (!acb) {
-        return NULL;
-    }
 
-    ret = vdi_schedule_bh(vdi_aio_rw_bh, acb);
-    if (ret < 0) {
-        if (acb->qiov->niov > 1) {
-            qemu_vfree(acb->orig_buf);
-        }
-        qemu_aio_release(acb);
-        return NULL;
+        nb_sectors -= n_sectors;
+        sector_num += n_sectors;
+        bytes_done += n_sectors * SECTOR_SIZE;
     }
 
-    return &acb->common;
+    qemu_iovec_destroy(&hd_qiov);
+    return ret;
 }
 
-static void vdi_aio_write_cb(void *opaque, int ret)
+/*
+ * Allocate block_index and fill it with the data in qiov, which belongs at
+ * sector_in_block; the rest of the block is zeroed.  The block map entry is
+ * only set once the data is on disk, so that concurrent readers keep seeing
+ * zeros until then.
+ */
+static coroutine_fn int vdi_co_alloc_block(BlockDriverState *bs,
+        uint32_t block_index, uint32_t sector_in_block, QEMUIOVector *qiov)
 {
-    VdiAIOCB *acb = opaque;
-    BlockDriverState *bs = acb->common.bs;
     BDRVVdiState *s = bs->opaque;
     uint32_t bmap_entry;
-    uint32_t block_index;
-    uint32_t sector_in_block;
-    uint32_t n_sectors;
+    uint32_t bmap_sector;
+    uint64_t offset;
+    uint8_t *block;
+    VdiHeader *header;
+    int ret;
 
-    acb->hd_aiocb = NULL;
+    bmap_entry = s->header.blocks_allocated;
+    offset = s->header.offset_data / SECTOR_SIZE +
+             (uint64_t)bmap_entry * s->block_sectors;
 
-    if (ret < 0) {
-        goto done;
-    }
+    logout("allocating block %u at entry %u\n", block_index, bmap_entry);
 
-    acb->nb_sectors -= acb->n_sectors;
-    acb->sector_num += acb->n_sectors;
-    acb->buf += acb->n_sectors * SECTOR_SIZE;
-
-    if (acb->nb_sectors == 0) {
-        logout("finished data write\n");
-        acb->n_sectors = 0;
-        if (acb->header_modified) {
-            VdiHeader *header = acb->block_buffer;
-            logout("now writing modified header\n");
-            assert(VDI_IS_ALLOCATED(acb->bmap_first));
-            *header = s->header;
-            vdi_header_to_le(header);
-            acb->header_modified = 0;
-            acb->hd_iov.iov_base = acb->block_buffer;
-            acb->hd_iov.iov_len = SECTOR_SIZE;
-            qemu_iovec_init_external(&acb->hd_qiov, &acb->hd_iov, 1);
-            acb->hd_aiocb = bdrv_aio_writev(bs->file, 0, &acb->hd_qiov, 1,
-                                            vdi_aio_write_cb, acb);
-            if (acb->hd_aiocb == NULL) {
-                ret = -EIO;
-                goto done;
-            }
-            return;
-        } else if (VDI_IS_ALLOCATED(acb->bmap_first)) {
-            /* One or more new blocks were allocated. */
-            uint64_t offset;
-            uint32_t bmap_first;
-            uint32_t bmap_last;
-            g_free(acb->block_buffer);
-            acb->block_buffer = NULL;
-            bmap_first = acb->bmap_first;
-            bmap_last = acb->bmap_last;
-            logout("now writing modified block map entry %u...%u\n",
-                   bmap_first, bmap_last);
-            /* Write modified sectors from block map. */
-            bmap_first /= (SECTOR_SIZE / sizeof(uint32_t));
-            bmap_last /= (SECTOR_SIZE / sizeof(uint32_t));
-            n_sectors = bmap_last - bmap_first + 1;
-            offset = s->bmap_sector + bmap_first;
-            acb->bmap_first = VDI_UNALLOCATED;
-            acb->hd_iov.iov_base = (void *)((uint8_t *)&s->bmap[0] +
-                                            bmap_first * SECTOR_SIZE);
-            acb->hd_iov.iov_len = n_sectors * SECTOR_SIZE;
-            qemu_iovec_init_external(&acb->hd_qiov, &acb->hd_iov, 1);
-            logout("will write %u block map sectors starting from entry %u\n",
-                   n_sectors, bmap_first);
-            acb->hd_aiocb = bdrv_aio_writev(bs->file, offset, &acb->hd_qiov,
-                                            n_sectors, vdi_aio_write_cb, acb);
-            if (acb->hd_aiocb == NULL) {
-                ret = -EIO;
-                goto done;
-            }
-            return;
-        }
-        ret = 0;
-        goto done;
+    block = qemu_blockalign(bs, s->block_size);
+    memset(block, 0, s->block_size);
+    qemu_iovec_to_buffer(qiov, block + sector_in_block * SECTOR_SIZE);
+    ret = bdrv_write(bs->file, offset, block, s->block_sectors);
+    if (ret < 0) {
+        goto out;
     }
 
-    logout("%u sectors written\n", acb->n_sectors);
-
-    block_index = acb->sector_num / s->block_sectors;
-    sector_in_block = acb->sector_num % s->block_sectors;
-    n_sectors = s->block_sectors - sector_in_block;
-    if (n_sectors > acb->nb_sectors) {
-        n_sectors = acb->nb_sectors;
-    }
+    s->header.blocks_allocated++;
+    s->bmap[block_index] = cpu_to_le32(bmap_entry);
 
-    logout("will write %u sectors starting at sector %" PRIu64 "\n",
-           n_sectors, acb->sector_num);
-
-    /* prepare next AIO request */
-    acb->n_sectors = n_sectors;
-    bmap_entry = le32_to_cpu(s->bmap[block_index]);
-    if (!VDI_IS_ALLOCATED(bmap_entry)) {
-        /* Allocate new block and write to it. */
-        uint64_t offset;
-        uint8_t *block;
-        bmap_entry = s->header.blocks_allocated;
-        s->bmap[block_index] = cpu_to_le32(bmap_entry);
-        s->header.blocks_allocated++;
-        offset = s->header.offset_data / SECTOR_SIZE +
-                 (uint64_t)bmap_entry * s->block_sectors;
-        block = acb->block_buffer;
-        if (block == NULL) {
-            block = g_malloc0(s->block_size);
-            acb->block_buffer = block;
-            acb->bmap_first = block_index;
-            assert(!acb->header_modified);
-            acb->header_modified = 1;
-        }
-        acb->bmap_last = block_index;
-        memcpy(block + sector_in_block * SECTOR_SIZE,
-               acb->buf, n_sectors * SECTOR_SIZE);
-        acb->hd_iov.iov_base = (void *)block;
-        acb->hd_iov.iov_len = s->block_size;
-        qemu_iovec_init_external(&acb->hd_qiov, &acb->hd_iov, 1);
-        acb->hd_aiocb = bdrv_aio_writev(bs->file, offset,
-                                        &acb->hd_qiov, s->block_sectors,
-                                        vdi_aio_write_cb, acb);
-        if (acb->hd_aiocb == NULL) {
-            ret = -EIO;
-            goto done;
-        }
-    } else {
-        uint64_t offset = s->header.offset_data / SECTOR_SIZE +
-                          (uint64_t)bmap_entry * s->block_sectors +
-                          sector_in_block;
-        acb->hd_iov.iov_base = (void *)acb->buf;
-        acb->hd_iov.iov_len = n_sectors * SECTOR_SIZE;
-        qemu_iovec_init_external(&acb->hd_qiov, &acb->hd_iov, 1);
-        acb->hd_aiocb = bdrv_aio_writev(bs->file, offset, &acb->hd_qiov,
-                                        n_sectors, vdi_aio_write_cb, acb);
-        if (acb->hd_aiocb == NULL) {
-            ret = -EIO;
-            goto done;
-        }
+    /* Write the modified header and block map sector. */
+    header = (VdiHeader *)block;
+    memset(block, 0, SECTOR_SIZE);
+    *header = s->header;
+    vdi_header_to_le(header);
+    ret = bdrv_write(bs->file, 0, block, 1);
+    if (ret < 0) {
+        goto out;
     }
 
-    return;
+    bmap_sector = block_index / (SECTOR_SIZE / sizeof(uint32_t));
+    ret = bdrv_write(bs->file, s->bmap_sector + bmap_sector,
+                     (uint8_t *)&s->bmap[0] + bmap_sector * SECTOR_SIZE, 1);
 
-done:
-    if (acb->qiov->niov > 1) {
-        qemu_vfree(acb->orig_buf);
-    }
-    acb->common.cb(acb->common.opaque, ret);
-    qemu_aio_release(acb);
+out:
+    qemu_vfree(block);
+    return ret;
 }
 
-static BlockDriverAIOCB *vdi_aio_writev(BlockDriverState *bs,
-        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
-        BlockDriverCompletionFunc *cb, void *opaque)
+static coroutine_fn int vdi_co_writev(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
 {
-    VdiAIOCB *acb;
-    int ret;
+    BDRVVdiState *s = bs->opaque;
+    QEMUIOVector hd_qiov;
+    uint64_t bytes_done = 0;
+    int ret = 0;
 
     logout("\n");
-    acb = vdi_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
-    if (!acb) {
-        return NULL;
-    }
 
-    ret = vdi_schedule_bh(vdi_aio_rw_bh, acb);
-    if (ret < 0) {
-        if (acb->qiov->niov > 1) {
-            qemu_vfree(acb->orig_buf);
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    while (nb_sectors > 0) {
+        uint32_t block_index = sector_num / s->block_sectors;
+        uint32_t sector_in_block = sector_num % s->block_sectors;
+        uint32_t n_sectors = MIN(s->block_sectors - sector_in_block,
+                                 nb_sectors);
+        uint32_t bmap_entry = le32_to_cpu(s->bmap[block_index]);
+
+        logout("will write %u sectors starting at sector %" PRIu64 "\n",
+               n_sectors, sector_num);
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done, n_sectors * SECTOR_SIZE);
+
+        if (!VDI_IS_ALLOCATED(bmap_entry)) {
+            /* Another request may have allocated the block while we were
+             * waiting for the lock.
+             */
+            qemu_co_mutex_lock(&s->alloc_lock);
+            bmap_entry = le32_to_cpu(s->bmap[block_index]);
+            if (!VDI_IS_ALLOCATED(bmap_entry)) {
+                ret = vdi_co_alloc_block(bs, block_index, sector_in_block,
+                                         &hd_qiov);
+                qemu_co_mutex_unlock(&s->alloc_lock);
+                if (ret < 0) {
+                    break;
+                }
+                goto next;
+            }
+            qemu_co_mutex_unlock(&s->alloc_lock);
         }
-        qemu_aio_release(acb);
-        return NULL;
+
+        ret = bdrv_co_writev(bs->file,
+                             s->header.offset_data / SECTOR_SIZE +
+                             (uint64_t)bmap_entry * s->block_sectors +
+                             sector_in_block,
+                             n_sectors, &hd_qiov);
+        if (ret < 0) {
+            break;
+        }
+
+next:
+        nb_sectors -= n_sectors;
+        sector_num += n_sectors;
+        bytes_done += n_sectors * SECTOR_SIZE;
     }
 
-    return &acb->common;
+    qemu_iovec_destroy(&hd_qiov);
+    return ret;
 }
 
 static int vdi_create(const char *filename, QEMUOptionParameter *options)
@@ -997,11 +829,12 @@ static BlockDriver bdrv_vdi = {
     .bdrv_create = vdi_create,
     .bdrv_co_flush_to_disk = vdi_co_flush,
     .bdrv_is_allocated = vdi_is_allocated,
+    .bdrv_get_extents = vdi_get_extents,
     .bdrv_make_empty = vdi_make_empty,
 
-    .bdrv_aio_readv = vdi_aio_readv,
+    .bdrv_co_readv = vdi_co_readv,
 #if defined(CONFIG_VDI_WRITE)
-    .bdrv_aio_writev = vdi_aio_writev,
+    .bdrv_co_writev = vdi_co_writev,
 #endif
 
     .bdrv_get_info = vdi_get_info,
@@ -88,6 +88,14 @@ typedef struct VmdkExtent {
     uint32_t l2_cache_counts[L2_CACHE_SIZE];
 
     unsigned int cluster_sectors;
+
+    /* Compressed extents only: the grain last inflated by a read, and the
+     * grain that is being filled by writes (pending_sector is -1 if none).
+     */
+    uint64_t grain_cache_offset;
+    uint8_t *grain_cache;
+    int64_t pending_sector;
+    uint8_t *pending_grain;
 } VmdkExtent;
 
 typedef struct BDRVVmdkState {
@@ -189,6 +197,8 @@ static void vmdk_free_extents(BlockDriverState *bs)
         g_free(e->l1_table);
         g_free(e->l2_cache);
         g_free(e->l1_backup_table);
+        g_free(e->grain_cache);
+        g_free(e->pending_grain);
         if (e->file != bs->file) {
             bdrv_delete(e->file);
         }
@@ -350,6 +360,7 @@ static VmdkExtent *vmdk_add_extent(BlockDriverState *bs,
     extent->l1_entry_sectors = l2_size * cluster_sectors;
     extent->l2_size = l2_size;
     extent->cluster_sectors = cluster_sectors;
+    extent->pending_sector = -1;
 
     if (s->num_extents > 1) {
         extent->end_sector = (*(extent - 1)).end_sector + extent->sectors;
@@ -826,8 +837,9 @@ static int get_cluster_offset(BlockDriverState *bs,
          * that may to corrupt the image.
          * This problem may occur because of insufficient space on host disk
          * or inappropriate VM shutdown.
+         * Compressed grains are assembled in memory and written as a whole.
          */
-        if (get_whole_cluster(
+        if (!extent->compressed && get_whole_cluster(
                 bs, extent, *cluster_offset, offset, allocate) == -1) {
             return -1;
         }
@@ -887,37 +899,82 @@ static int vmdk_is_allocated(BlockDriverState *bs, int64_t sector_num,
     return ret;
 }
 
-static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, const uint8_t *buf,
-                            int nb_sectors, int64_t sector_num)
+static int vmdk_get_extents(BlockDriverState *bs, int64_t sector_num,
+                            int64_t nb_sectors, BlockExtent *extents,
+                            int max_extents)
 {
-    int ret;
-    VmdkGrainMarker *data = NULL;
-    uLongf buf_len;
-    const uint8_t *write_buf = buf;
-    int write_len = nb_sectors * 512;
+    BDRVVmdkState *s = bs->opaque;
+    VmdkExtent *extent = NULL;
+    int64_t extent_begin, index_in_cluster, n;
+    uint64_t offset;
+    int nb_extents = 0;
+    int flags;
 
-    if (extent->compressed) {
-        if (!extent->has_marker) {
-            ret = -EINVAL;
-            goto out;
+    while (nb_sectors > 0 && nb_extents < max_extents) {
+        extent = find_extent(s, sector_num, extent);
+        if (!extent) {
+            break;
         }
-        buf_len = (extent->cluster_sectors << 9) * 2;
-        data = g_malloc(buf_len + sizeof(VmdkGrainMarker));
-        if (compress(data->data, &buf_len, buf, nb_sectors << 9) != Z_OK ||
-                buf_len == 0) {
-            ret = -EINVAL;
-            goto out;
+        extent_begin = extent->end_sector - extent->sectors;
+
+        if (extent->flat) {
+            n = extent->end_sector - sector_num;
+            flags = BDRV_EXTENT_DATA | BDRV_EXTENT_OFFSET;
+            offset = extent->flat_start_offset +
+                     (sector_num - extent_begin) * BDRV_SECTOR_SIZE;
+        } else {
+            index_in_cluster = (sector_num - extent_begin) %
+                               extent->cluster_sectors;
+            n = extent->cluster_sectors - index_in_cluster;
+            if (get_cluster_offset(bs, extent, NULL, sector_num << 9, 0,
+                                   &offset)) {
+                flags = 0;
+                offset = 0;
+            } else if (extent->compressed) {
+                flags = BDRV_EXTENT_DATA;
+                offset = 0;
+            } else {
+                flags = BDRV_EXTENT_DATA | BDRV_EXTENT_OFFSET;
+                offset += index_in_cluster * BDRV_SECTOR_SIZE;
+            }
         }
-        data->lba = sector_num;
-        data->size = buf_len;
-        write_buf = (uint8_t *)data;
-        write_len = buf_len + sizeof(VmdkGrainMarker);
-    }
-    ret = bdrv_pwrite(extent->file,
-                        cluster_offset + offset_in_cluster,
-                        write_buf,
-                        write_len);
+        n = MIN(n, nb_sectors);
+
+        bdrv_add_extent(extents, &nb_extents, sector_num, n, flags,
+                        (flags & BDRV_EXTENT_OFFSET) ? extent->file : NULL,
+                        offset);
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    return nb_extents;
+}
+
+/*
+ * Compress a whole grain and write it, preceded by its marker, at
+ * cluster_offset.  The write is padded to a sector boundary because the next
+ * grain is appended at the end of the file.
+ */
+static int vmdk_write_grain(VmdkExtent *extent, uint64_t cluster_offset,
+                            const uint8_t *grain, int64_t sector_num)
+{
+    int ret;
+    int cluster_bytes = extent->cluster_sectors * 512;
+    VmdkGrainMarker *data;
+    uLongf buf_len;
+    int write_len;
+
+    buf_len = compressBound(cluster_bytes);
+    data = g_malloc0(sizeof(VmdkGrainMarker) + buf_len + 511);
+    if (compress(data->data, &buf_len, grain, cluster_bytes) != Z_OK ||
+            buf_len == 0) {
+        ret = -EINVAL;
+        goto out;
+    }
+    data->lba = cpu_to_le64(sector_num);
+    data->size = cpu_to_le32(buf_len);
+    write_len = DIV_ROUND_UP(sizeof(VmdkGrainMarker) + buf_len, 512) * 512;
+    ret = bdrv_pwrite(extent->file, cluster_offset, data, write_len);
     if (ret != write_len) {
         ret = ret < 0 ? ret : -EIO;
         goto out;
@@ -928,85 +985,244 @@ static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, uint8_t *buf,
-                            int nb_sectors)
+/* Append the pending grain of a compressed extent to the file */
+static int vmdk_flush_pending_grain(BlockDriverState *bs, VmdkExtent *extent)
 {
+    int64_t sector_num = extent->pending_sector;
+    uint64_t cluster_offset;
+    VmdkMetaData m_data;
     int ret;
-    int cluster_bytes, buf_bytes;
-    uint8_t *cluster_buf, *compressed_data;
-    uint8_t *uncomp_buf;
-    uint32_t data_len;
-    VmdkGrainMarker *marker;
-    uLongf buf_len;
 
+    if (sector_num < 0) {
+        return 0;
+    }
+    extent->pending_sector = -1;
 
-    if (!extent->compressed) {
-        ret = bdrv_pread(extent->file,
-                          cluster_offset + offset_in_cluster,
-                          buf, nb_sectors * 512);
-        if (ret == nb_sectors * 512) {
-            return 0;
-        } else {
+    if (get_cluster_offset(bs, extent, &m_data,
+                           sector_num << 9, 1, &cluster_offset)) {
+        return -EINVAL;
+    }
+    ret = vmdk_write_grain(extent, cluster_offset, extent->pending_grain,
+                           sector_num);
+    if (ret < 0) {
+        return ret;
+    }
+    if (m_data.valid && vmdk_L2update(extent, &m_data) == -1) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Grains of a compressed extent can only be written once, as a whole.  Writes
+ * are collected in extent->pending_grain until the grain is complete or a
+ * write moves on to another grain, so that sequential writers like qemu-img
+ * convert produce full grains even if their requests are not grain aligned.
+ *
+ * Called with s->lock held, for sectors of a single grain.
+ */
+static int vmdk_write_compressed(BlockDriverState *bs, VmdkExtent *extent,
+                                 int64_t sector_num, int nb_sectors,
+                                 QEMUIOVector *qiov)
+{
+    int64_t index_in_cluster = sector_num % extent->cluster_sectors;
+    int64_t grain_sector = sector_num - index_in_cluster;
+    uint64_t cluster_offset;
+    int ret, n;
+
+    if (!extent->has_marker) {
+        return -EINVAL;
+    }
+
+    if (grain_sector != extent->pending_sector) {
+        ret = vmdk_flush_pending_grain(bs, extent);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!get_cluster_offset(bs, extent, NULL,
+                                sector_num << 9, 0, &cluster_offset)) {
+            /* Refuse write to allocated cluster for streamOptimized */
+            fprintf(stderr,
+                    "VMDK: can't write to allocated cluster"
+                    " for streamOptimized\n");
             return -EIO;
         }
+
+        if (!extent->pending_grain) {
+            extent->pending_grain = g_malloc(extent->cluster_sectors * 512);
+        }
+        memset(extent->pending_grain, 0, extent->cluster_sectors * 512);
+        if (bs->backing_hd) {
+            if (!vmdk_is_cid_valid(bs)) {
+                return -EINVAL;
+            }
+            n = MIN(extent->cluster_sectors,
+                    extent->end_sector - grain_sector);
+            ret = bdrv_read(bs->backing_hd, grain_sector,
+                            extent->pending_grain, n);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        extent->pending_sector = grain_sector;
     }
-    cluster_bytes = extent->cluster_sectors * 512;
-    /* Read two clusters in case GrainMarker + compressed data > one cluster */
-    buf_bytes = cluster_bytes * 2;
-    cluster_buf = g_malloc(buf_bytes);
-    uncomp_buf = g_malloc(cluster_bytes);
-    ret = bdrv_pread(extent->file,
-                cluster_offset,
-                cluster_buf, buf_bytes);
-    if (ret < 0) {
-        goto out;
+
+    qemu_iovec_to_buffer(qiov, extent->pending_grain + index_in_cluster * 512);
+
+    if (index_in_cluster + nb_sectors == extent->cluster_sectors ||
+        sector_num + nb_sectors >= extent->end_sector) {
+        return vmdk_flush_pending_grain(bs, extent);
     }
-    compressed_data = cluster_buf;
-    buf_len = cluster_bytes;
-    data_len = cluster_bytes;
+    return 0;
+}
+
+/*
+ * Inflate the compressed grain at the start of buf, which holds buf_bytes
+ * bytes of the extent file starting at cluster_offset, into the grain cache.
+ */
+static int vmdk_inflate_grain(VmdkExtent *extent, uint64_t cluster_offset,
+                              uint8_t *buf, int64_t buf_bytes)
+{
+    int cluster_bytes = extent->cluster_sectors * 512;
+    uint8_t *compressed_data = buf;
+    int64_t data_len = MIN(cluster_bytes, buf_bytes);
+    uLongf buf_len = cluster_bytes;
+    VmdkGrainMarker *marker;
+
+    extent->grain_cache_offset = 0;
     if (extent->has_marker) {
-        marker = (VmdkGrainMarker *)cluster_buf;
+        marker = (VmdkGrainMarker *)buf;
         compressed_data = marker->data;
         data_len = le32_to_cpu(marker->size);
+        buf_bytes -= sizeof(VmdkGrainMarker);
     }
     if (!data_len || data_len > buf_bytes) {
-        ret = -EINVAL;
-        goto out;
+        return -EINVAL;
     }
-    ret = uncompress(uncomp_buf, &buf_len, compressed_data, data_len);
-    if (ret != Z_OK) {
-        ret = -EINVAL;
-        goto out;
+    if (uncompress(extent->grain_cache, &buf_len,
+                   compressed_data, data_len) != Z_OK) {
+        return -EINVAL;
+    }
+    /* Older versions wrote partial grains */
+    memset(extent->grain_cache + buf_len, 0, cluster_bytes - buf_len);
+    extent->grain_cache_offset = cluster_offset;
+    return 0;
+}
+
+#define VMDK_MAX_GRAIN_RUN 32
 
+/*
+ * Read from a compressed extent, starting with the allocated grain at
+ * cluster_offset that contains sector_num.  The grains of streamOptimized
+ * images follow each other in the file, so the compressed data of a run of
+ * grains is fetched with a single request and inflated from memory.  The
+ * last grain stays in the grain cache, which serves the small sequential
+ * reads of a guest without going to the file again.
+ *
+ * Called with s->lock held.  Returns the number of sectors read or -errno.
+ */
+static coroutine_fn int vmdk_read_compressed(BlockDriverState *bs,
+                            VmdkExtent *extent, uint64_t cluster_offset,
+                            int64_t sector_num, int nb_sectors,
+                            QEMUIOVector *qiov, uint64_t qiov_offset)
+{
+    BDRVVmdkState *s = bs->opaque;
+    int64_t cluster_bytes = extent->cluster_sectors * 512;
+    uint64_t offsets[VMDK_MAX_GRAIN_RUN];
+    uint64_t next;
+    int nb_grains, i, n, done;
+    int64_t index_in_cluster, buf_bytes = 0;
+    uint8_t *buf = NULL;
+    QEMUIOVector hd_qiov;
+    int ret;
+
+    if (!extent->grain_cache) {
+        extent->grain_cache = g_malloc(cluster_bytes);
+    }
+
+    offsets[0] = cluster_offset;
+    nb_grains = 1;
+    done = MIN(extent->cluster_sectors - sector_num % extent->cluster_sectors,
+               nb_sectors);
+    if (cluster_offset != extent->grain_cache_offset) {
+        while (nb_grains < VMDK_MAX_GRAIN_RUN && done < nb_sectors &&
+               sector_num + done < extent->end_sector) {
+            if (get_cluster_offset(bs, extent, NULL,
+                                   (sector_num + done) << 9, 0, &next) ||
+                next <= offsets[nb_grains - 1] ||
+                next - offsets[nb_grains - 1] > 2 * cluster_bytes) {
+                break;
+            }
+            offsets[nb_grains++] = next;
+            done += MIN(extent->cluster_sectors, nb_sectors - done);
+        }
+
+        /* Read two clusters past the last grain in case GrainMarker +
+         * compressed data > one cluster */
+        buf_bytes = offsets[nb_grains - 1] - offsets[0] + 2 * cluster_bytes;
+        buf = g_malloc(buf_bytes);
+        qemu_co_mutex_unlock(&s->lock);
+        ret = bdrv_pread(extent->file, offsets[0], buf, buf_bytes);
+        qemu_co_mutex_lock(&s->lock);
+        if (ret < 0) {
+            g_free(buf);
+            return ret;
+        }
     }
-    if (offset_in_cluster < 0 ||
-            offset_in_cluster + nb_sectors * 512 > buf_len) {
-        ret = -EINVAL;
-        goto out;
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+    done = 0;
+    for (i = 0; i < nb_grains; i++) {
+        if (buf) {
+            ret = vmdk_inflate_grain(extent, offsets[i],
+                                     buf + (offsets[i] - offsets[0]),
+                                     buf_bytes - (offsets[i] - offsets[0]));
+            if (ret < 0) {
+                goto out;
+            }
+        }
+        index_in_cluster = (sector_num + done) % extent->cluster_sectors;
+        n = MIN(extent->cluster_sectors - index_in_cluster, nb_sectors - done);
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, qiov_offset + done * 512, n * 512);
+        qemu_iovec_from_buffer(&hd_qiov,
+                               extent->grain_cache + index_in_cluster * 512,
+                               n * 512);
+        done += n;
     }
-    memcpy(buf, uncomp_buf + offset_in_cluster, nb_sectors * 512);
-    ret = 0;
+    ret = done;
 
  out:
-    g_free(uncomp_buf);
-    g_free(cluster_buf);
+    qemu_iovec_destroy(&hd_qiov);
+    g_free(buf);
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * The L1 table and the L2 cache are protected by s->lock, which is dropped
+ * while guest data is transferred so that requests run in parallel.
+ */
+static coroutine_fn int vmdk_co_readv(BlockDriverState *bs,
+                                      int64_t sector_num, int nb_sectors,
+                                      QEMUIOVector *qiov)
 {
     BDRVVmdkState *s = bs->opaque;
     int ret;
     uint64_t n, index_in_cluster;
     VmdkExtent *extent = NULL;
     uint64_t cluster_offset;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    qemu_co_mutex_lock(&s->lock);
 
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
-            return -EIO;
+            ret = -EIO;
+            goto fail;
         }
         ret = get_cluster_offset(
                             bs, extent, NULL,
@@ -1016,54 +1232,72 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
         if (n > nb_sectors) {
             n = nb_sectors;
         }
-        if (ret) {
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done, n * 512);
+
+        if (extent->pending_sector == sector_num - index_in_cluster) {
+            qemu_iovec_from_buffer(&hd_qiov,
+                                   extent->pending_grain +
+                                   index_in_cluster * 512, n * 512);
+        } else if (ret) {
             /* if not allocated, try to read from parent image, if exist */
             if (bs->backing_hd) {
                 if (!vmdk_is_cid_valid(bs)) {
-                    return -EINVAL;
+                    ret = -EINVAL;
+                    goto fail;
                 }
-                ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
+                qemu_co_mutex_unlock(&s->lock);
+                ret = bdrv_co_readv(bs->backing_hd, sector_num, n, &hd_qiov);
+                qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
-                    return ret;
+                    goto fail;
                 }
             } else {
-                memset(buf, 0, 512 * n);
+                qemu_iovec_memset(&hd_qiov, 0, 512 * n);
+            }
+        } else if (extent->compressed) {
+            ret = vmdk_read_compressed(bs, extent, cluster_offset,
+                                       sector_num, nb_sectors,
+                                       qiov, bytes_done);
+            if (ret < 0) {
+                goto fail;
             }
+            n = ret;
         } else {
-            ret = vmdk_read_extent(extent,
-                            cluster_offset, index_in_cluster * 512,
-                            buf, n);
-            if (ret) {
-                return ret;
+            qemu_co_mutex_unlock(&s->lock);
+            ret = bdrv_co_readv(extent->file,
+                                (cluster_offset >> 9) + index_in_cluster,
+                                n, &hd_qiov);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0) {
+                goto fail;
             }
         }
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
+        bytes_done += n * 512;
     }
-    return 0;
-}
+    ret = 0;
 
-static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
-                                     uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_read(bs, sector_num, buf, nb_sectors);
+fail:
     qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
 
-static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
-                     const uint8_t *buf, int nb_sectors)
+static coroutine_fn int vmdk_co_writev(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
 {
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *extent = NULL;
     int n, ret;
     int64_t index_in_cluster;
     uint64_t cluster_offset;
+    uint64_t bytes_done = 0;
     VmdkMetaData m_data;
+    QEMUIOVector hd_qiov;
 
     if (sector_num > bs->total_sectors) {
         fprintf(stderr,
@@ -1073,36 +1307,15 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
         return -EIO;
     }
 
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    qemu_co_mutex_lock(&s->lock);
+
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
-            return -EIO;
-        }
-        ret = get_cluster_offset(
-                                bs,
-                                extent,
-                                &m_data,
-                                sector_num << 9, !extent->compressed,
-                                &cluster_offset);
-        if (extent->compressed) {
-            if (ret == 0) {
-                /* Refuse write to allocated cluster for streamOptimized */
-                fprintf(stderr,
-                        "VMDK: can't write to allocated cluster"
-                        " for streamOptimized\n");
-                return -EIO;
-            } else {
-                /* allocate */
-                ret = get_cluster_offset(
-                                        bs,
-                                        extent,
-                                        &m_data,
-                                        sector_num << 9, 1,
-                                        &cluster_offset);
-            }
-        }
-        if (ret) {
-            return -EINVAL;
+            ret = -EIO;
+            goto fail;
         }
         index_in_cluster = sector_num % extent->cluster_sectors;
         n = extent->cluster_sectors - index_in_cluster;
@@ -1110,43 +1323,60 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
             n = nb_sectors;
         }
 
-        ret = vmdk_write_extent(extent,
-                        cluster_offset, index_in_cluster * 512,
-                        buf, n, sector_num);
-        if (ret) {
-            return ret;
-        }
-        if (m_data.valid) {
-            /* update L2 tables */
-            if (vmdk_L2update(extent, &m_data) == -1) {
-                return -EIO;
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done, n * 512);
+
+        if (extent->compressed) {
+            ret = vmdk_write_compressed(bs, extent, sector_num, n, &hd_qiov);
+            if (ret < 0) {
+                goto fail;
+            }
+        } else {
+            ret = get_cluster_offset(bs, extent, &m_data,
+                                     sector_num << 9, 1, &cluster_offset);
+            if (ret) {
+                ret = -EINVAL;
+                goto fail;
+            }
+            /* A newly allocated grain already holds the data of the backing
+             * file (or zeros), so the L2 table can point to it before the
+             * guest data is written.  Doing this under the lock keeps other
+             * requests from allocating the grain a second time.
+             */
+            if (m_data.valid) {
+                if (vmdk_L2update(extent, &m_data) == -1) {
+                    ret = -EIO;
+                    goto fail;
+                }
+            }
+            qemu_co_mutex_unlock(&s->lock);
+            ret = bdrv_co_writev(extent->file,
+                                 (cluster_offset >> 9) + index_in_cluster,
+                                 n, &hd_qiov);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0) {
+                goto fail;
             }
         }
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
+        bytes_done += n * 512;
 
         /* update CID on the first write every time the virtual disk is
          * opened */
         if (!s->cid_updated) {
             ret = vmdk_write_cid(bs, time(NULL));
             if (ret < 0) {
-                return ret;
+                goto fail;
             }
             s->cid_updated = true;
         }
     }
-    return 0;
-}
+    ret = 0;
 
-static coroutine_fn int vmdk_co_write(BlockDriverState *bs, int64_t sector_num,
-                                      const uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_write(bs, sector_num, buf, nb_sectors);
+fail:
     qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
 
@@ -1514,7 +1744,11 @@ exit:
 static void vmdk_close(BlockDriverState *bs)
 {
     BDRVVmdkState *s = bs->opaque;
+    int i;
 
+    for (i = 0; i < s->num_extents; i++) {
+        vmdk_flush_pending_grain(bs, &s->extents[i]);
+    }
     vmdk_free_extents(bs);
 
     migrate_del_blocker(s->migration_blocker);
@@ -1526,7 +1760,20 @@ static coroutine_fn int vmdk_co_flush(BlockDriverState *bs)
     int i, ret, err;
     BDRVVmdkState *s = bs->opaque;
 
-    ret = bdrv_co_flush(bs->file);
+    ret = 0;
+    qemu_co_mutex_lock(&s->lock);
+    for (i = 0; i < s->num_extents; i++) {
+        err = vmdk_flush_pending_grain(bs, &s->extents[i]);
+        if (err < 0) {
+            ret = err;
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    err = bdrv_co_flush(bs->file);
+    if (err < 0) {
+        ret = err;
+    }
     for (i = 0; i < s->num_extents; i++) {
         err = bdrv_co_flush(s->extents[i].file);
         if (err < 0) {
@@ -1591,12 +1838,13 @@ static BlockDriver bdrv_vmdk = {
     .instance_size  = sizeof(BDRVVmdkState),
     .bdrv_probe     = vmdk_probe,
     .bdrv_open      = vmdk_open,
-    .bdrv_read      = vmdk_co_read,
-    .bdrv_write     = vmdk_co_write,
+    .bdrv_co_readv  = vmdk_co_readv,
+    .bdrv_co_writev = vmdk_co_writev,
     .bdrv_close     = vmdk_close,
     .bdrv_create    = vmdk_create,
     .bdrv_co_flush_to_disk  = vmdk_co_flush,
     .bdrv_is_allocated      = vmdk_is_allocated,
+    .bdrv_get_extents       = vmdk_get_extents,
     .bdrv_get_allocated_file_size  = vmdk_get_allocated_file_size,
 
     .create_options = vmdk_create_options,
@@ -365,6 +365,7 @@ static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
     ret = bdrv_pwrite_sync(bs->file, s->free_data_block_offset, bitmap,
         s->bitmap_size);
     if (ret < 0) {
+        s->pagetable[index] = 0xFFFFFFFF;
         return ret;
     }
 
@@ -384,17 +385,24 @@ static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
     return get_sector_offset(bs, sector_num, 0);
 
 fail:
+    s->pagetable[index] = 0xFFFFFFFF;
     s->free_data_block_offset -= (s->block_size + s->bitmap_size);
     return -1;
 }
 
-static int vpc_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static coroutine_fn int vpc_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVPCState *s = bs->opaque;
-    int ret;
+    int ret = 0;
     int64_t offset;
     int64_t sectors, sectors_per_block;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    qemu_co_mutex_lock(&s->lock);
 
     while (nb_sectors > 0) {
         offset = get_sector_offset(bs, sector_num, 0);
@@ -405,43 +413,51 @@ static int vpc_read(BlockDriverState *bs, int64_t sector_num,
             sectors = nb_sectors;
         }
 
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done,
+                        sectors * BDRV_SECTOR_SIZE);
+
         if (offset == -1) {
-            memset(buf, 0, sectors * BDRV_SECTOR_SIZE);
+            qemu_iovec_memset(&hd_qiov, 0, sectors * BDRV_SECTOR_SIZE);
         } else {
-            ret = bdrv_pread(bs->file, offset, buf,
-                sectors * BDRV_SECTOR_SIZE);
-            if (ret != sectors * BDRV_SECTOR_SIZE) {
-                return -1;
+            /* The BAT is in memory, only the data needs to be read */
+            qemu_co_mutex_unlock(&s->lock);
+            ret = bdrv_co_readv(bs->file, offset >> BDRV_SECTOR_BITS,
+                                sectors, &hd_qiov);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0) {
+                goto fail;
             }
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
-    return 0;
-}
+    ret = 0;
 
-static coroutine_fn int vpc_co_read(BlockDriverState *bs, int64_t sector_num,
-                                    uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVPCState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vpc_read(bs, sector_num, buf, nb_sectors);
+fail:
     qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
 
-static int vpc_write(BlockDriverState *bs, int64_t sector_num,
-    const uint8_t *buf, int nb_sectors)
+static coroutine_fn int vpc_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVPCState *s = bs->opaque;
     int64_t offset;
     int64_t sectors, sectors_per_block;
-    int ret;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
+    int ret = 0;
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    qemu_co_mutex_lock(&s->lock);
 
     while (nb_sectors > 0) {
+        /* Block allocation and bitmap updates happen under the lock */
         offset = get_sector_offset(bs, sector_num, 1);
 
         sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
@@ -452,31 +468,33 @@ static int vpc_write(BlockDriverState *bs, int64_t sector_num,
 
         if (offset == -1) {
             offset = alloc_block(bs, sector_num);
-            if (offset < 0)
-                return -1;
+            if (offset < 0) {
+                ret = -EIO;
+                goto fail;
+            }
         }
 
-        ret = bdrv_pwrite(bs->file, offset, buf, sectors * BDRV_SECTOR_SIZE);
-        if (ret != sectors * BDRV_SECTOR_SIZE) {
-            return -1;
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done,
+                        sectors * BDRV_SECTOR_SIZE);
+
+        qemu_co_mutex_unlock(&s->lock);
+        ret = bdrv_co_writev(bs->file, offset >> BDRV_SECTOR_BITS,
+                             sectors, &hd_qiov);
+        qemu_co_mutex_lock(&s->lock);
+        if (ret < 0) {
+            goto fail;
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
+    ret = 0;
 
-    return 0;
-}
-
-static coroutine_fn int vpc_co_write(BlockDriverState *bs, int64_t sector_num,
-                                     const uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVPCState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vpc_write(bs, sector_num, buf, nb_sectors);
+fail:
     qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
 
@@ -687,8 +705,8 @@ static BlockDriver bdrv_vpc = {
     .bdrv_close     = vpc_close,
     .bdrv_create    = vpc_create,
 
-    .bdrv_read              = vpc_co_read,
-    .bdrv_write             = vpc_co_write,
+    .bdrv_co_readv          = vpc_co_readv,
+    .bdrv_co_writev         = vpc_co_writev,
     .bdrv_co_flush_to_disk  = vpc_co_flush,
 
     .create_options = vpc_create_options,
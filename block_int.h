@@ -42,8 +42,39 @@
 #define BLOCK_OPT_CLUSTER_SIZE  "cluster_size"
 #define BLOCK_OPT_TABLE_SIZE    "table_size"
 #define BLOCK_OPT_PREALLOC      "preallocation"
+
+/* Values of BLOCK_OPT_PREALLOC */
+typedef enum {
+    PREALLOC_OFF,
+    PREALLOC_METADATA,      /* allocate the image metadata */
+    PREALLOC_FALLOC,        /* also reserve host space for the data */
+    PREALLOC_FULL,          /* also write zeroes to the data area */
+} PreallocMode;
 #define BLOCK_OPT_SUBFMT        "subformat"
 
+#define BLOCK_IO_LIMIT_READ     0
+#define BLOCK_IO_LIMIT_WRITE    1
+#define BLOCK_IO_LIMIT_TOTAL    2
+
+#define BLOCK_IO_SLICE_TIME     100000000
+
+/*
+ * Request latencies are counted in log2 buckets of microseconds: bucket 0
+ * holds requests that took less than 1 us, bucket n > 0 those that took
+ * [2^(n-1), 2^n) us.  The last bucket also holds everything slower.
+ */
+#define BDRV_LATENCY_BUCKETS    28
+
+typedef struct BlockIOLimit {
+    int64_t bps[3];
+    int64_t iops[3];
+} BlockIOLimit;
+
+typedef struct BlockIODisp {
+    uint64_t bytes[2];
+    uint64_t ios[2];
+} BlockIODisp;
+
 typedef struct AIOPool {
     void (*cancel)(BlockDriverAIOCB *acb);
     int aiocb_size;
@@ -65,6 +96,15 @@ struct BlockDriver {
     int (*bdrv_create)(const char *filename, QEMUOptionParameter *options);
     int (*bdrv_is_allocated)(BlockDriverState *bs, int64_t sector_num,
                              int nb_sectors, int *pnum);
+    int coroutine_fn (*bdrv_co_is_allocated)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum);
+    /*
+     * Describe the allocation status of the range starting at sector_num in
+     * up to max_extents extents, see bdrv_get_extents().
+     */
+    int (*bdrv_get_extents)(BlockDriverState *bs, int64_t sector_num,
+                            int64_t nb_sectors, BlockExtent *extents,
+                            int max_extents);
     int (*bdrv_set_key)(BlockDriverState *bs, const char *key);
     int (*bdrv_make_empty)(BlockDriverState *bs);
     /* aio */
@@ -117,6 +157,18 @@ struct BlockDriver {
     int64_t (*bdrv_get_allocated_file_size)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    /*
+     * Two halves of bdrv_write_compressed, so that callers can compress
+     * clusters in parallel. bdrv_compress_cluster must not modify any driver
+     * state because it is called from worker threads; it returns the
+     * compressed length, or 0 if the cluster has to be written uncompressed.
+     */
+    int (*bdrv_compress_cluster)(BlockDriverState *bs, const uint8_t *buf,
+                                 uint8_t *out_buf, int level);
+    int (*bdrv_write_compressed_cluster)(BlockDriverState *bs,
+                                         int64_t sector_num,
+                                         const uint8_t *buf,
+                                         const uint8_t *out_buf, int out_len);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -159,8 +211,23 @@ struct BlockDriver {
      */
     int (*bdrv_check)(BlockDriverState* bs, BdrvCheckResult *result);
 
+    /*
+     * Move data clusters so that guest-contiguous data becomes contiguous in
+     * the image file, see bdrv_defrag().
+     */
+    int64_t coroutine_fn (*bdrv_co_defrag)(BlockDriverState *bs,
+                                           int64_t *offset, int64_t max_bytes);
+    void (*bdrv_defrag_cancel)(BlockDriverState *bs);
+
     void (*bdrv_debug_event)(BlockDriverState *bs, BlkDebugEvent event);
 
+    /*
+     * While plugged, the driver may hold back requests and submit them as
+     * one batch when the outermost unplug happens.
+     */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
     /*
      * Returns 1 if newly created images are guaranteed to contain only
      * zeros, 0 otherwise.
@@ -201,11 +268,35 @@ struct BlockDriverState {
 
     void *sync_aiocb;
 
+    /* I/O throttling, see bdrv_set_io_limits() */
+    BlockIOLimit io_limits;
+    bool io_limits_enabled;
+    BlockIODisp io_disps;       /* dispatched in the current slice */
+    int64_t slice_start;
+    int64_t slice_end;
+    CoQueue throttled_reqs;
+    QEMUTimer *block_timer;
+
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
+    uint64_t nr_merged[BDRV_MAX_IOTYPE]; /* requests merged into another */
+    uint64_t latency[BDRV_MAX_IOTYPE][BDRV_LATENCY_BUCKETS];
+    int64_t in_flight;          /* read, write and flush requests */
+    int64_t max_in_flight;
+    uint64_t idle_time_ns;      /* time without requests in flight */
+    int64_t idle_start_ns;
+
+    /* Reads served from a cache kept by the driver, e.g. shmcache */
+    bool has_cache_stats;
+    uint64_t nr_cache_hits;
+    uint64_t nr_cache_misses;
+
+    /* Requests that had to be copied to aligned memory, e.g. for O_DIRECT */
+    bool has_misaligned_stats;
+    uint64_t nr_misaligned;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -226,6 +317,9 @@ struct BlockDriverState {
     unsigned long *dirty_bitmap;
     int64_t dirty_count;
     int in_use; /* users other than guest access, eg. block migration */
+
+    /* called with the BlockDriverState when an image is about to be closed */
+    NotifierList close_notifiers;
     QTAILQ_ENTRY(BlockDriverState) list;
     void *private;
 };
@@ -240,6 +334,15 @@ struct BlockDriverAIOCB {
 
 void get_tmp_filename(char *filename, int size);
 
+void bdrv_set_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits);
+
+int coroutine_fn bdrv_co_run_in_worker(BlockDriverState *bs,
+                                       int (*func)(void *), void *opaque);
+
+int bdrv_parse_prealloc_mode(const char *value, PreallocMode *mode);
+int bdrv_create_file_prealloc(const char *filename, int64_t size,
+                              PreallocMode mode);
+
 void *qemu_aio_get(AIOPool *pool, BlockDriverState *bs,
                    BlockDriverCompletionFunc *cb, void *opaque);
 void qemu_aio_release(void *p);
@@ -0,0 +1,198 @@
+/*
+ * Defragmenting block devices while the guest is running
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "blockdev.h"
+#include "block_int.h"
+#include "monitor.h"
+#include "qerror.h"
+#include "sysemu.h"
+#include "qmp-commands.h"
+#include "qemu-timer.h"
+#include "qjson.h"
+
+/* Amount of guest data looked at in one step.  Guest requests are held back
+ * while a step runs, so keep it small.
+ */
+#define DEFRAG_STEP_BYTES (1024 * 1024)
+
+typedef struct DefragJob {
+    BlockDriverState *bs;
+    QEMUTimer *timer;
+    Notifier close_notifier;
+    int64_t offset;
+    int64_t len;
+    int64_t moved;
+    int64_t speed;              /* bytes per second, 0 for unlimited */
+    QTAILQ_ENTRY(DefragJob) next;
+} DefragJob;
+
+static QTAILQ_HEAD(, DefragJob) defrag_jobs =
+    QTAILQ_HEAD_INITIALIZER(defrag_jobs);
+
+static DefragJob *defrag_job_find(BlockDriverState *bs)
+{
+    DefragJob *job;
+
+    QTAILQ_FOREACH(job, &defrag_jobs, next) {
+        if (job->bs == bs) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static void defrag_job_free(DefragJob *job)
+{
+    QTAILQ_REMOVE(&defrag_jobs, job, next);
+    bdrv_remove_close_notifier(job->bs, &job->close_notifier);
+    bdrv_set_in_use(job->bs, 0);
+    qemu_del_timer(job->timer);
+    qemu_free_timer(job->timer);
+    g_free(job);
+}
+
+static void defrag_job_completed(DefragJob *job, int ret)
+{
+    QObject *data;
+
+    data = qobject_from_jsonf("{ 'device': %s, 'len': %" PRId64 ", "
+                              "'offset': %" PRId64 ", 'moved': %" PRId64 " }",
+                              bdrv_get_device_name(job->bs), job->len,
+                              job->offset, job->moved);
+    if (ret < 0) {
+        qdict_put(qobject_to_qdict(data), "error",
+                  qstring_from_str(strerror(-ret)));
+    }
+    monitor_protocol_event(QEVENT_BLOCK_DEFRAG_COMPLETED, data);
+    qobject_decref(data);
+
+    defrag_job_free(job);
+}
+
+static void defrag_job_run(void *opaque)
+{
+    DefragJob *job = opaque;
+    int64_t ret, delay_ns = 0;
+
+    /* Requests that arrive during the step wait for the driver's lock, even
+     * those that the nested aio waits dispatch, e.g. from NBD clients.  The
+     * ones that already got past it must complete first.
+     */
+    bdrv_drain_all();
+
+    ret = bdrv_defrag(job->bs, &job->offset, DEFRAG_STEP_BYTES);
+    if (ret < 0 || job->offset >= job->len) {
+        defrag_job_completed(job, MIN(ret, 0));
+        return;
+    }
+    job->moved += ret;
+
+    if (job->speed) {
+        delay_ns = ret * get_ticks_per_sec() / job->speed;
+    }
+    qemu_mod_timer(job->timer, qemu_get_clock_ns(vm_clock) + delay_ns);
+}
+
+static void defrag_close_notifier(Notifier *n, void *data)
+{
+    DefragJob *job = container_of(n, DefragJob, close_notifier);
+
+    defrag_job_completed(job, -ECANCELED);
+}
+
+void qmp_block_defrag(const char *device, bool has_speed, int64_t speed,
+                      Error **errp)
+{
+    BlockDriverState *bs;
+    DefragJob *job;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_NOT_ACTIVE, device);
+        return;
+    }
+    if (bdrv_in_use(bs) || defrag_job_find(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        return;
+    }
+    if (bdrv_is_read_only(bs)) {
+        error_set(errp, QERR_DEVICE_IS_READ_ONLY, device);
+        return;
+    }
+    if (!bs->drv->bdrv_co_defrag) {
+        error_set(errp, QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED,
+                  bs->drv->format_name, device, "defragmentation");
+        return;
+    }
+    if (has_speed && speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "speed",
+                  "a non-negative value");
+        return;
+    }
+
+    job = g_malloc0(sizeof(*job));
+    job->bs = bs;
+    job->len = bdrv_getlength(bs);
+    job->speed = has_speed ? speed : 0;
+
+    /* vm_clock stops with the guest, so the image is not touched any more
+     * once it has been migrated.
+     */
+    job->timer = qemu_new_timer_ns(vm_clock, defrag_job_run, job);
+    job->close_notifier.notify = defrag_close_notifier;
+    bdrv_add_close_notifier(bs, &job->close_notifier);
+    bdrv_set_in_use(bs, 1);
+    QTAILQ_INSERT_TAIL(&defrag_jobs, job, next);
+
+    qemu_mod_timer(job->timer, qemu_get_clock_ns(vm_clock));
+}
+
+void qmp_block_defrag_cancel(const char *device, Error **errp)
+{
+    BlockDriverState *bs;
+    DefragJob *job;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+    job = defrag_job_find(bs);
+    if (!job) {
+        error_set(errp, QERR_BLOCK_DEFRAG_NOT_ACTIVE, device);
+        return;
+    }
+
+    /* The clusters moved so far stay where they are */
+    bdrv_defrag_cancel(bs);
+    defrag_job_completed(job, -ECANCELED);
+}
+
+BlockDefragInfoList *qmp_query_block_defrag(Error **errp)
+{
+    BlockDefragInfoList *head = NULL, **p_next = &head;
+    DefragJob *job;
+
+    QTAILQ_FOREACH(job, &defrag_jobs, next) {
+        BlockDefragInfoList *elem = g_malloc0(sizeof(*elem));
+
+        elem->value = g_malloc0(sizeof(*elem->value));
+        elem->value->device = g_strdup(bdrv_get_device_name(job->bs));
+        elem->value->offset = job->offset;
+        elem->value->len = job->len;
+        elem->value->moved = job->moved;
+        elem->value->speed = job->speed;
+
+        *p_next = elem;
+        p_next = &elem->next;
+    }
+    return head;
+}
@@ -0,0 +1,140 @@
+/*
+ * Serving QEMU block devices via NBD
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "blockdev.h"
+#include "monitor.h"
+#include "qerror.h"
+#include "sysemu.h"
+#include "qmp-commands.h"
+#include "nbd.h"
+#include "qemu_socket.h"
+
+static int server_fd = -1;
+
+static void nbd_accept(void *opaque)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd;
+
+    fd = accept(server_fd, (struct sockaddr *)&addr, &addr_len);
+    if (fd >= 0) {
+        nbd_client_new_by_name(fd, NULL);
+    }
+}
+
+void qmp_nbd_server_start(const char *addr, Error **errp)
+{
+    const char *path;
+
+    if (server_fd != -1) {
+        error_set(errp, QERR_NBD_SERVER_ACTIVE);
+        return;
+    }
+
+    if (strstart(addr, "unix:", &path)) {
+        server_fd = unix_socket_incoming(path);
+    } else {
+        server_fd = tcp_socket_incoming_spec(addr);
+    }
+    if (server_fd == -1) {
+        error_set(errp, QERR_NBD_SERVER_FAILED, addr);
+        return;
+    }
+
+    qemu_set_fd_handler2(server_fd, NULL, nbd_accept, NULL, NULL);
+}
+
+/* An export goes away together with the image it serves, e.g. on eject or
+ * drive_del.
+ */
+typedef struct NBDCloseNotifier {
+    Notifier n;
+    NBDExport *exp;
+    QTAILQ_ENTRY(NBDCloseNotifier) next;
+} NBDCloseNotifier;
+
+static QTAILQ_HEAD(, NBDCloseNotifier) close_notifiers =
+    QTAILQ_HEAD_INITIALIZER(close_notifiers);
+
+static void nbd_close_notifier(Notifier *n, void *data)
+{
+    NBDCloseNotifier *cn = DO_UPCAST(NBDCloseNotifier, n, n);
+
+    bdrv_remove_close_notifier(nbd_export_get_blockdev(cn->exp), &cn->n);
+    QTAILQ_REMOVE(&close_notifiers, cn, next);
+
+    nbd_export_close(cn->exp);
+    g_free(cn);
+}
+
+void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
+                        Error **errp)
+{
+    BlockDriverState *bs;
+    NBDExport *exp;
+    NBDCloseNotifier *n;
+    int64_t len;
+
+    if (server_fd == -1) {
+        error_set(errp, QERR_NBD_SERVER_NOT_ACTIVE);
+        return;
+    }
+
+    if (nbd_export_find(device)) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        return;
+    }
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_NOT_ACTIVE, device);
+        return;
+    }
+
+    len = bdrv_getlength(bs);
+    if (len < 0) {
+        error_set(errp, QERR_IO_ERROR);
+        return;
+    }
+
+    if (!has_writable || bdrv_is_read_only(bs)) {
+        writable = false;
+    }
+
+    /* Idle clients must not keep qemu_aio_flush() from returning, the main
+     * loop watches their sockets.
+     */
+    exp = nbd_export_new(bs, 0, len,
+                         writable ? 0 : NBD_FLAG_READ_ONLY,
+                         NBD_DEFAULT_MAX_REQUESTS, false);
+    nbd_export_set_name(exp, device);
+
+    n = g_malloc0(sizeof(NBDCloseNotifier));
+    n->n.notify = nbd_close_notifier;
+    n->exp = exp;
+    bdrv_add_close_notifier(bs, &n->n);
+    QTAILQ_INSERT_TAIL(&close_notifiers, n, next);
+}
+
+void qmp_nbd_server_stop(Error **errp)
+{
+    while (!QTAILQ_EMPTY(&close_notifiers)) {
+        NBDCloseNotifier *cn = QTAILQ_FIRST(&close_notifiers);
+        nbd_close_notifier(&cn->n, NULL);
+    }
+
+    if (server_fd != -1) {
+        qemu_set_fd_handler2(server_fd, NULL, NULL, NULL, NULL);
+        close(server_fd);
+        server_fd = -1;
+    }
+}
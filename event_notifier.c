@@ -38,6 +38,22 @@ int event_notifier_get_fd(EventNotifier *e)
     return e->fd;
 }
 
+int event_notifier_set(EventNotifier *e)
+{
+    static const uint64_t value = 1;
+    ssize_t r;
+
+    do {
+        r = write(e->fd, &value, sizeof(value));
+    } while (r < 0 && errno == EINTR);
+
+    /* EAGAIN means the counter is about to overflow, it is set anyway */
+    if (r < 0 && errno != EAGAIN) {
+        return -errno;
+    }
+    return 0;
+}
+
 int event_notifier_test_and_clear(EventNotifier *e)
 {
     uint64_t value;
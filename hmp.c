@@ -216,6 +216,16 @@ void hmp_info_block(Monitor *mon)
                            info->value->inserted->ro,
                            info->value->inserted->drv,
                            info->value->inserted->encrypted);
+
+            monitor_printf(mon, " bps=%" PRId64 " bps_rd=%" PRId64
+                            " bps_wr=%" PRId64 " iops=%" PRId64
+                            " iops_rd=%" PRId64 " iops_wr=%" PRId64,
+                            info->value->inserted->bps,
+                            info->value->inserted->bps_rd,
+                            info->value->inserted->bps_wr,
+                            info->value->inserted->iops,
+                            info->value->inserted->iops_rd,
+                            info->value->inserted->iops_wr);
         } else {
             monitor_printf(mon, " [not inserted]");
         }
@@ -229,6 +239,7 @@ void hmp_info_block(Monitor *mon)
 void hmp_info_blockstats(Monitor *mon)
 {
     BlockStatsList *stats_list, *stats;
+    BlockDeviceStats *file_stats;
 
     stats_list = qmp_query_blockstats(NULL);
 
@@ -246,7 +257,11 @@ void hmp_info_blockstats(Monitor *mon)
                        " wr_total_time_ns=%" PRId64
                        " rd_total_time_ns=%" PRId64
                        " flush_total_time_ns=%" PRId64
-                       "\n",
+                       " in_flight=%" PRId64
+                       " max_in_flight=%" PRId64
+                       " idle_time_ns=%" PRId64
+                       " rd_merged=%" PRId64
+                       " wr_merged=%" PRId64,
                        stats->value->stats->rd_bytes,
                        stats->value->stats->wr_bytes,
                        stats->value->stats->rd_operations,
@@ -254,12 +269,53 @@ void hmp_info_blockstats(Monitor *mon)
                        stats->value->stats->flush_operations,
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
-                       stats->value->stats->flush_total_time_ns);
+                       stats->value->stats->flush_total_time_ns,
+                       stats->value->stats->in_flight,
+                       stats->value->stats->max_in_flight,
+                       stats->value->stats->idle_time_ns,
+                       stats->value->stats->rd_merged,
+                       stats->value->stats->wr_merged);
+
+        /* Misaligned requests are counted by the host file or device */
+        file_stats = stats->value->stats;
+        if (!file_stats->has_misaligned && stats->value->has_parent) {
+            file_stats = stats->value->parent->stats;
+        }
+        if (file_stats->has_misaligned) {
+            monitor_printf(mon, " misaligned=%" PRId64,
+                           file_stats->misaligned);
+        }
+        monitor_printf(mon, "\n");
     }
 
     qapi_free_BlockStatsList(stats_list);
 }
 
+void hmp_info_aio_pool(Monitor *mon)
+{
+    AioPoolInfo *info;
+    Error *err = NULL;
+
+    info = qmp_query_aio_pool(&err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    monitor_printf(mon, "threads: %" PRId64 " (%" PRId64 " idle, peak %"
+                   PRId64 ", min %" PRId64 " per queue, max %" PRId64 ")\n",
+                   info->threads, info->idle_threads, info->peak_threads,
+                   info->min_threads, info->max_threads);
+    monitor_printf(mon, "idle timeout: %" PRId64 " s\n", info->idle_timeout);
+    monitor_printf(mon, "queues: %" PRId64 "\n", info->queues);
+    monitor_printf(mon, "requests: %" PRId64 " queued, %" PRId64 " pending, %"
+                   PRId64 " completed\n",
+                   info->queued, info->pending, info->completed);
+
+    qapi_free_AioPoolInfo(info);
+}
+
 void hmp_info_vnc(Monitor *mon)
 {
     VncInfo *info;
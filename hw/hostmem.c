@@ -0,0 +1,143 @@
+/*
+ * Thread-safe guest to host memory mapping
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "hostmem.h"
+
+/* Remove [start, start + size) from the regions, splitting them if needed */
+static void hostmem_unassign(HostMem *hostmem, target_phys_addr_t start,
+                             ram_addr_t size)
+{
+    target_phys_addr_t end = start + size;
+    int i = 0;
+
+    while (i < hostmem->num_regions) {
+        HostMemRegion *reg = &hostmem->regions[i];
+        target_phys_addr_t reg_end = reg->guest_addr + reg->size;
+
+        if (reg_end <= start || reg->guest_addr >= end) {
+            i++;
+            continue;
+        }
+
+        if (reg->guest_addr < start && reg_end > end) {
+            /* Punch a hole: keep the head here and append the tail */
+            HostMemRegion tail = {
+                .guest_addr = end,
+                .size = reg_end - end,
+                .host_addr = reg->host_addr + (end - reg->guest_addr),
+            };
+
+            reg->size = start - reg->guest_addr;
+            hostmem->regions = g_renew(HostMemRegion, hostmem->regions,
+                                       hostmem->num_regions + 1);
+            hostmem->regions[hostmem->num_regions++] = tail;
+            i++;
+        } else if (reg->guest_addr < start) {
+            reg->size = start - reg->guest_addr;
+            i++;
+        } else if (reg_end > end) {
+            reg->host_addr += end - reg->guest_addr;
+            reg->size = reg_end - end;
+            reg->guest_addr = end;
+            i++;
+        } else {
+            hostmem->regions[i] = hostmem->regions[--hostmem->num_regions];
+        }
+    }
+}
+
+static void hostmem_client_set_memory(CPUPhysMemoryClient *client,
+                                      target_phys_addr_t start_addr,
+                                      ram_addr_t size,
+                                      ram_addr_t phys_offset,
+                                      bool log_dirty)
+{
+    HostMem *hostmem = container_of(client, HostMem, client);
+    ram_addr_t flags = phys_offset & ~TARGET_PAGE_MASK;
+    void *host_addr;
+    int i;
+
+    qemu_mutex_lock(&hostmem->lock);
+    hostmem_unassign(hostmem, start_addr, size);
+    if (flags != IO_MEM_RAM) {
+        goto out;
+    }
+
+    /* Merge with a region that this one continues */
+    host_addr = qemu_get_ram_ptr(phys_offset);
+    for (i = 0; i < hostmem->num_regions; i++) {
+        HostMemRegion *reg = &hostmem->regions[i];
+
+        if (reg->guest_addr + reg->size == start_addr &&
+            reg->host_addr + reg->size == host_addr) {
+            reg->size += size;
+            goto out;
+        }
+    }
+
+    hostmem->regions = g_renew(HostMemRegion, hostmem->regions,
+                               hostmem->num_regions + 1);
+    hostmem->regions[hostmem->num_regions++] = (HostMemRegion) {
+        .guest_addr = start_addr,
+        .size = size,
+        .host_addr = host_addr,
+    };
+out:
+    qemu_mutex_unlock(&hostmem->lock);
+}
+
+static int hostmem_client_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                            target_phys_addr_t start_addr,
+                                            target_phys_addr_t end_addr)
+{
+    return 0;
+}
+
+static int hostmem_client_migration_log(CPUPhysMemoryClient *client,
+                                        int enable)
+{
+    return 0;
+}
+
+void hostmem_init(HostMem *hostmem)
+{
+    memset(hostmem, 0, sizeof(*hostmem));
+    qemu_mutex_init(&hostmem->lock);
+
+    hostmem->client.set_memory = hostmem_client_set_memory;
+    hostmem->client.sync_dirty_bitmap = hostmem_client_sync_dirty_bitmap;
+    hostmem->client.migration_log = hostmem_client_migration_log;
+    cpu_register_phys_memory_client(&hostmem->client);
+}
+
+void hostmem_finalize(HostMem *hostmem)
+{
+    cpu_unregister_phys_memory_client(&hostmem->client);
+    qemu_mutex_destroy(&hostmem->lock);
+    g_free(hostmem->regions);
+}
+
+void *hostmem_lookup(HostMem *hostmem, target_phys_addr_t phys,
+                     target_phys_addr_t len)
+{
+    void *host_addr = NULL;
+    int i;
+
+    qemu_mutex_lock(&hostmem->lock);
+    for (i = 0; i < hostmem->num_regions; i++) {
+        HostMemRegion *reg = &hostmem->regions[i];
+
+        if (phys >= reg->guest_addr &&
+            phys - reg->guest_addr + len <= reg->size) {
+            host_addr = reg->host_addr + (phys - reg->guest_addr);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&hostmem->lock);
+    return host_addr;
+}
@@ -0,0 +1,42 @@
+/*
+ * Thread-safe guest to host memory mapping
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef HOSTMEM_H
+#define HOSTMEM_H
+
+#include "cpu-common.h"
+#include "qemu-thread.h"
+
+typedef struct {
+    target_phys_addr_t guest_addr;
+    ram_addr_t size;
+    void *host_addr;
+} HostMemRegion;
+
+/*
+ * A copy of the guest RAM layout, kept up to date through a memory client,
+ * that threads other than the iothread can use to access guest memory
+ * without taking the global mutex.
+ */
+typedef struct {
+    CPUPhysMemoryClient client;
+    QemuMutex lock;
+    HostMemRegion *regions;
+    int num_regions;
+} HostMem;
+
+void hostmem_init(HostMem *hostmem);
+void hostmem_finalize(HostMem *hostmem);
+
+/*
+ * Return the host address of a guest RAM range, or NULL if the range is not
+ * contained in a single RAM region.
+ */
+void *hostmem_lookup(HostMem *hostmem, target_phys_addr_t phys,
+                     target_phys_addr_t len);
+
+#endif
@@ -0,0 +1,527 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * The thread takes over the virtqueue from the device model while the guest
+ * driver is running: it waits for the guest's kicks on the ioeventfd, walks
+ * the vring in guest memory, submits the requests with Linux AIO and raises
+ * the interrupt through the guest notifier (an irqfd with KVM and MSI-X).
+ * None of this takes the global mutex.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <libaio.h>
+#include <poll.h>
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "qemu-thread.h"
+#include "qerror.h"
+#include "iov.h"
+#include "event_notifier.h"
+#include "migration.h"
+#include "block.h"
+#include "kvm.h"
+#include "virtio-blk.h"
+#include "virtio-blk-dataplane.h"
+#include "vring.h"
+
+enum {
+    SEG_MAX = 126,                  /* maximum number of I/O segments */
+    VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
+    IO_EVENTS_MAX = 64,             /* completions reaped per io_getevents() */
+};
+
+typedef struct {
+    struct iocb iocb;               /* Linux AIO control block */
+    struct virtio_blk_inhdr *inhdr; /* status byte in guest memory */
+    unsigned int head;              /* vring descriptor index */
+    size_t len;                     /* number of data bytes */
+    void *bounce;                   /* aligned copy of misaligned buffers */
+    bool is_write;
+    bool inflight;                  /* head popped, not pushed back yet */
+    struct iovec iov[VRING_MAX];    /* guest data buffers */
+    unsigned int niov;
+} VirtIOBlockRequest;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool starting;
+    bool stopping;
+    bool failed;                    /* could not start, don't try again */
+    bool need_notify;               /* requests completed since last irq */
+
+    VirtIODevice *vdev;
+    BlockDriverState *bs;
+    int fd;                         /* image file, opened with O_DIRECT */
+    char *serial;
+    unsigned int logical_block_size;
+    uint64_t nb_sectors;            /* image size when the thread started */
+    bool read_only;
+
+    Vring vring;
+    EventNotifier *host_notifier;   /* the guest kicked the virtqueue */
+    EventNotifier *guest_notifier;  /* raise the guest interrupt */
+    EventNotifier io_notifier;      /* Linux AIO completions */
+    EventNotifier stop_notifier;    /* virtio_blk_data_plane_stop() */
+    io_context_t io_ctx;
+    VirtIOBlockRequest *requests;   /* indexed by vring head */
+    struct iocb **iocbs;            /* requests waiting for io_submit() */
+    unsigned int num_iocbs;
+    unsigned int num_inflight;      /* requests submitted to Linux AIO */
+    QemuThread thread;
+
+    Error *migration_blocker;
+};
+
+static void notify_guest(VirtIOBlockDataPlane *s)
+{
+    if (s->need_notify && vring_should_notify(s->vdev, &s->vring)) {
+        event_notifier_set(s->guest_notifier);
+    }
+    s->need_notify = false;
+}
+
+static void complete_request(VirtIOBlockDataPlane *s, VirtIOBlockRequest *req,
+                             unsigned char status)
+{
+    if (req->bounce) {
+        if (!req->is_write && status == VIRTIO_BLK_S_OK) {
+            iov_from_buf(req->iov, req->niov, req->bounce, 0, req->len);
+        }
+        qemu_vfree(req->bounce);
+        req->bounce = NULL;
+    }
+
+    req->inhdr->status = status;
+    vring_push(&s->vring, req->head, req->len + sizeof(*req->inhdr));
+    req->inflight = false;
+    s->need_notify = true;
+}
+
+/* Submit the requests queued up by handle_notify() in one system call */
+static void submit_io(VirtIOBlockDataPlane *s)
+{
+    unsigned int done = 0, i;
+    int ret;
+
+    while (done < s->num_iocbs) {
+        ret = io_submit(s->io_ctx, s->num_iocbs - done, s->iocbs + done);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            error_report("virtio-blk data plane: io_submit failed: %s",
+                         strerror(-ret));
+            break;
+        }
+        done += ret;
+    }
+    s->num_inflight += done;
+
+    for (i = done; i < s->num_iocbs; i++) {
+        complete_request(s, container_of(s->iocbs[i], VirtIOBlockRequest,
+                                         iocb), VIRTIO_BLK_S_IOERR);
+    }
+    s->num_iocbs = 0;
+}
+
+static void complete_io(VirtIOBlockDataPlane *s)
+{
+    struct io_event events[IO_EVENTS_MAX];
+    int n, i;
+
+    do {
+        n = io_getevents(s->io_ctx, 0, IO_EVENTS_MAX, events, NULL);
+        if (n < 0) {
+            error_report("virtio-blk data plane: io_getevents failed: %s",
+                         strerror(-n));
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            VirtIOBlockRequest *req = container_of(events[i].obj,
+                                                   VirtIOBlockRequest, iocb);
+            long ret = events[i].res;
+
+            complete_request(s, req, ret == (long)req->len ? VIRTIO_BLK_S_OK
+                                                     : VIRTIO_BLK_S_IOERR);
+        }
+        s->num_inflight -= n;
+    } while (n == IO_EVENTS_MAX);
+
+    notify_guest(s);
+}
+
+/* O_DIRECT needs sector aligned buffers */
+static bool iov_is_aligned(struct iovec *iov, unsigned int niov)
+{
+    unsigned int i;
+
+    for (i = 0; i < niov; i++) {
+        if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) &
+            (BDRV_SECTOR_SIZE - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void do_rw(VirtIOBlockDataPlane *s, VirtIOBlockRequest *req,
+                  struct iovec *iov, unsigned int niov, uint64_t sector,
+                  bool is_write)
+{
+    uint64_t sector_mask = s->logical_block_size / BDRV_SECTOR_SIZE - 1;
+    off_t offset = sector * BDRV_SECTOR_SIZE;
+
+    memcpy(req->iov, iov, niov * sizeof(iov[0]));
+    req->niov = niov;
+    req->len = iov_size(iov, niov);
+    req->is_write = is_write;
+
+    if ((sector & sector_mask) || req->len % s->logical_block_size ||
+        sector > s->nb_sectors ||
+        req->len / BDRV_SECTOR_SIZE > s->nb_sectors - sector ||
+        (is_write && s->read_only)) {
+        complete_request(s, req, VIRTIO_BLK_S_IOERR);
+        return;
+    }
+    if (req->len == 0) {
+        complete_request(s, req, VIRTIO_BLK_S_OK);
+        return;
+    }
+
+    if (iov_is_aligned(req->iov, niov)) {
+        if (is_write) {
+            io_prep_pwritev(&req->iocb, s->fd, req->iov, niov, offset);
+        } else {
+            io_prep_preadv(&req->iocb, s->fd, req->iov, niov, offset);
+        }
+    } else {
+        req->bounce = qemu_memalign(BDRV_SECTOR_SIZE, req->len);
+        if (is_write) {
+            iov_to_buf(req->iov, niov, req->bounce, 0, req->len);
+            io_prep_pwrite(&req->iocb, s->fd, req->bounce, req->len, offset);
+        } else {
+            io_prep_pread(&req->iocb, s->fd, req->bounce, req->len, offset);
+        }
+    }
+    io_set_eventfd(&req->iocb, event_notifier_get_fd(&s->io_notifier));
+    s->iocbs[s->num_iocbs++] = &req->iocb;
+}
+
+static int process_request(VirtIOBlockDataPlane *s, struct iovec iov[],
+                           unsigned int out_num, unsigned int in_num,
+                           unsigned int head)
+{
+    VirtIOBlockRequest *req = &s->requests[head];
+    struct virtio_blk_outhdr outhdr;
+    uint32_t type;
+
+    /* virtio_blk_handle_request() exits in this case */
+    if (out_num < 1 || in_num < 1 ||
+        iov[0].iov_len < sizeof(outhdr) ||
+        iov[out_num + in_num - 1].iov_len < sizeof(*req->inhdr)) {
+        error_report("virtio-blk header not in correct element");
+        return -EFAULT;
+    }
+
+    /*
+     * The guest may only make a head available again after we pushed it to
+     * the used ring.  Reusing the request would corrupt the one in flight.
+     */
+    if (req->inflight) {
+        error_report("virtio-blk guest reused head %u in flight", head);
+        return -EFAULT;
+    }
+    req->inflight = true;
+
+    /* Copy the header, the guest could change it under our feet */
+    memcpy(&outhdr, iov[0].iov_base, sizeof(outhdr));
+    req->inhdr = iov[out_num + in_num - 1].iov_base;
+    req->head = head;
+    req->len = 0;
+    req->bounce = NULL;
+    type = outhdr.type;
+
+    if (type & VIRTIO_BLK_T_FLUSH) {
+        /*
+         * Make sure all outstanding writes are posted to the backing device.
+         * This blocks the thread, but flushes are rare compared to reads and
+         * writes.
+         */
+        submit_io(s);
+        complete_request(s, req, qemu_fdatasync(s->fd) == 0 ?
+                                 VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+    } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        complete_request(s, req, VIRTIO_BLK_S_UNSUPP);
+    } else if (type & VIRTIO_BLK_T_GET_ID) {
+        /*
+         * NB: per existing s/n string convention the string is
+         * terminated by '\0' only when shorter than buffer.
+         */
+        strncpy(iov[out_num].iov_base, s->serial ? s->serial : "",
+                MIN(iov[out_num].iov_len, VIRTIO_BLK_ID_BYTES));
+        complete_request(s, req, VIRTIO_BLK_S_OK);
+    } else if (type & VIRTIO_BLK_T_OUT) {
+        do_rw(s, req, &iov[1], out_num - 1, outhdr.sector, true);
+    } else {
+        do_rw(s, req, &iov[out_num], in_num - 1, outhdr.sector, false);
+    }
+    return 0;
+}
+
+/* Process the vring until it is empty, with guest kicks disabled */
+static void handle_notify(VirtIOBlockDataPlane *s)
+{
+    struct iovec iov[VRING_MAX];
+    unsigned int out_num, in_num;
+    int head;
+
+    for (;;) {
+        vring_disable_notification(s->vdev, &s->vring);
+
+        while ((head = vring_pop(s->vdev, &s->vring, iov, ARRAY_SIZE(iov),
+                                 &out_num, &in_num)) >= 0) {
+            if (process_request(s, iov, out_num, in_num, head) < 0) {
+                s->vring.broken = true;
+                break;
+            }
+        }
+        submit_io(s);
+
+        if (s->vring.broken) {
+            /* Stop processing until the guest resets the device */
+            break;
+        }
+        if (vring_enable_notification(s->vdev, &s->vring)) {
+            break;
+        }
+    }
+
+    notify_guest(s);
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    struct pollfd fds[] = {
+        { .fd = event_notifier_get_fd(s->host_notifier), .events = POLLIN },
+        { .fd = event_notifier_get_fd(&s->io_notifier), .events = POLLIN },
+        { .fd = event_notifier_get_fd(&s->stop_notifier), .events = POLLIN },
+    };
+    bool stopping = false;
+
+    /* The guest may have queued requests before the thread took over */
+    handle_notify(s);
+
+    /* Once asked to stop, only wait for the requests in flight */
+    while (!stopping || s->num_inflight > 0) {
+        if (poll(fds, ARRAY_SIZE(fds), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("virtio-blk data plane: poll failed: %s",
+                         strerror(errno));
+            abort();
+        }
+
+        if (fds[2].revents & POLLIN) {
+            event_notifier_test_and_clear(&s->stop_notifier);
+            stopping = true;
+            fds[0].fd = -1;
+        }
+        if (fds[1].revents & POLLIN) {
+            event_notifier_test_and_clear(&s->io_notifier);
+            complete_io(s);
+        }
+        if (fds[0].revents & POLLIN) {
+            event_notifier_test_and_clear(s->host_notifier);
+            handle_notify(s);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The data plane bypasses the block layer, so it only supports raw images
+ * opened with cache=none,aio=native.  Returns false if the device asked for
+ * a data plane that cannot be provided.
+ */
+bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
+                                  VirtIOBlockDataPlane **dataplane)
+{
+    VirtIOBlockDataPlane *s;
+    int fd;
+
+    *dataplane = NULL;
+
+    if (!blk->data_plane) {
+        return true;
+    }
+
+    if (blk->num_queues > 1) {
+        error_report("x-data-plane does not support num_queues > 1");
+        return false;
+    }
+
+    /* Only KVM can signal guest kicks on the ioeventfd the thread polls */
+    if (!kvm_has_many_ioeventfds()) {
+        error_report("x-data-plane requires KVM with ioeventfd support");
+        return false;
+    }
+
+    fd = raw_get_aio_fd(blk->conf.bs);
+    if (fd < 0) {
+        error_report("drive is incompatible with x-data-plane, "
+                     "use format=raw,cache=none,aio=native");
+        return false;
+    }
+    if (bdrv_in_use(blk->conf.bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, bdrv_get_device_name(blk->conf.bs));
+        return false;
+    }
+
+    s = g_malloc0(sizeof(*s));
+    s->vdev = vdev;
+    s->bs = blk->conf.bs;
+    s->fd = fd;
+    s->serial = blk->serial;
+    s->logical_block_size = blk->conf.logical_block_size;
+
+    /* Nothing else may touch the image while the thread writes to it */
+    bdrv_set_in_use(s->bs, 1);
+
+    /* Requests in flight are not visible to the block layer */
+    error_set(&s->migration_blocker, QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+              "virtio-blk", "x-data-plane");
+    migrate_add_blocker(s->migration_blocker);
+
+    *dataplane = s;
+    return true;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_blk_data_plane_stop(s);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+    bdrv_set_in_use(s->bs, 0);
+    g_free(s);
+}
+
+/*
+ * Hand the virtqueue over to the thread.  Returns false if that is not
+ * possible or the thread is being stopped, then the device model has to
+ * process the virtqueue itself.
+ */
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    const VirtIOBindings *binding = s->vdev->binding;
+    void *opaque = s->vdev->binding_opaque;
+    VirtQueue *vq = virtio_get_queue(s->vdev, 0);
+    int ret;
+
+    if (s->failed || s->stopping) {
+        return false;
+    }
+    if (s->started || s->starting) {
+        return true;
+    }
+
+    if (!binding->set_guest_notifiers || !binding->set_host_notifier) {
+        error_report("virtio-blk data plane needs guest and host notifiers");
+        s->failed = true;
+        return false;
+    }
+
+    /* Switching host notifiers can kick the queue, which calls us again */
+    s->starting = true;
+
+    if (vring_setup(&s->vring, s->vdev, 0) < 0) {
+        goto fail;
+    }
+
+    ret = binding->set_guest_notifiers(opaque, true);
+    if (ret < 0) {
+        error_report("virtio-blk failed to set guest notifier: %s",
+                     strerror(-ret));
+        goto fail_vring;
+    }
+    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+    ret = binding->set_host_notifier(opaque, 0, true);
+    if (ret < 0) {
+        error_report("virtio-blk failed to set host notifier: %s",
+                     strerror(-ret));
+        goto fail_guest_notifiers;
+    }
+    s->host_notifier = virtio_queue_get_host_notifier(vq);
+
+    ret = io_setup(s->vring.vr.num, &s->io_ctx);
+    if (ret < 0) {
+        error_report("virtio-blk data plane: io_setup failed: %s",
+                     strerror(-ret));
+        goto fail_host_notifier;
+    }
+    event_notifier_init(&s->io_notifier, 0);
+    event_notifier_init(&s->stop_notifier, 0);
+
+    s->requests = g_new0(VirtIOBlockRequest, s->vring.vr.num);
+    s->iocbs = g_new(struct iocb *, s->vring.vr.num);
+    s->num_iocbs = 0;
+    s->num_inflight = 0;
+    s->need_notify = false;
+    bdrv_get_geometry(s->bs, &s->nb_sectors);
+    s->read_only = bdrv_is_read_only(s->bs);
+
+    s->starting = false;
+    s->started = true;
+    qemu_thread_create(&s->thread, data_plane_thread, s);
+    return true;
+
+fail_host_notifier:
+    binding->set_host_notifier(opaque, 0, false);
+fail_guest_notifiers:
+    binding->set_guest_notifiers(opaque, false);
+fail_vring:
+    vring_teardown(&s->vring, s->vdev, 0);
+fail:
+    s->starting = false;
+    s->failed = true;
+    return false;
+}
+
+/* Wait for the requests in flight and give the virtqueue back */
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    const VirtIOBindings *binding = s->vdev->binding;
+    void *opaque = s->vdev->binding_opaque;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+
+    event_notifier_set(&s->stop_notifier);
+    qemu_thread_join(&s->thread);
+
+    io_destroy(s->io_ctx);
+    memset(&s->io_ctx, 0, sizeof(s->io_ctx));
+    event_notifier_cleanup(&s->io_notifier);
+    event_notifier_cleanup(&s->stop_notifier);
+    g_free(s->requests);
+    g_free(s->iocbs);
+
+    vring_teardown(&s->vring, s->vdev, 0);
+
+    /* A last kick that arrives here is processed by the device model */
+    binding->set_host_notifier(opaque, 0, false);
+    binding->set_guest_notifiers(opaque, false);
+    s->started = false;
+    s->stopping = false;
+}
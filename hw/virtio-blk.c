@@ -17,6 +17,9 @@
 #include "blockdev.h"
 #include "virtio-blk.h"
 #include "scsi-defs.h"
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#include "virtio-blk-dataplane.h"
+#endif
 #ifdef __linux__
 # include <scsi/sg.h>
 #endif
@@ -25,13 +28,17 @@ typedef struct VirtIOBlock
 {
     VirtIODevice vdev;
     BlockDriverState *bs;
-    VirtQueue *vq;
+    VirtQueue **vqs;
+    unsigned int num_queues;
     void *rq;
     QEMUBH *bh;
     BlockConf *conf;
     char *serial;
     unsigned short sector_mask;
     DeviceState *qdev;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlockDataPlane *dataplane;
+#endif
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -42,6 +49,7 @@ static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
 typedef struct VirtIOBlockReq
 {
     VirtIOBlock *dev;
+    VirtQueue *vq;
     VirtQueueElement elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr *out;
@@ -58,8 +66,8 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->qiov.size + sizeof(*req->in));
-    virtio_notify(&s->vdev, s->vq);
+    virtqueue_push(req->vq, &req->elem, req->qiov.size + sizeof(*req->in));
+    virtio_notify(&s->vdev, req->vq);
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
@@ -131,12 +139,13 @@ static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
     return req;
 }
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
 {
     VirtIOBlockReq *req = virtio_blk_alloc_request(s);
 
     if (req != NULL) {
-        if (!virtqueue_pop(s->vq, &req->elem)) {
+        req->vq = vq;
+        if (!virtqueue_pop(vq, &req->elem)) {
             g_free(req);
             return NULL;
         }
@@ -264,6 +273,8 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
 typedef struct MultiReqBuffer {
     BlockRequest        blkreq[32];
     unsigned int        num_writes;
+    BlockRequest        rdreq[32];
+    unsigned int        num_reads;
 } MultiReqBuffer;
 
 static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
@@ -286,6 +297,26 @@ static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
     mrb->num_writes = 0;
 }
 
+static void virtio_submit_multiread(BlockDriverState *bs, MultiReqBuffer *mrb)
+{
+    int i, ret;
+
+    if (!mrb->num_reads) {
+        return;
+    }
+
+    ret = bdrv_aio_multiread(bs, mrb->rdreq, mrb->num_reads);
+    if (ret != 0) {
+        for (i = 0; i < mrb->num_reads; i++) {
+            if (mrb->rdreq[i].error) {
+                virtio_blk_rw_complete(mrb->rdreq[i].opaque, -EIO);
+            }
+        }
+    }
+
+    mrb->num_reads = 0;
+}
+
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     BlockDriverAIOCB *acb;
@@ -338,9 +369,9 @@ static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     mrb->num_writes++;
 }
 
-static void virtio_blk_handle_read(VirtIOBlockReq *req)
+static void virtio_blk_handle_read(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
-    BlockDriverAIOCB *acb;
+    BlockRequest *blkreq;
     uint64_t sector;
 
     sector = ldq_p(&req->out->sector);
@@ -356,12 +387,23 @@ static void virtio_blk_handle_read(VirtIOBlockReq *req)
         return;
     }
 
-    acb = bdrv_aio_readv(req->dev->bs, sector, &req->qiov,
-                         req->qiov.size / BDRV_SECTOR_SIZE,
-                         virtio_blk_rw_complete, req);
-    if (!acb) {
-        virtio_blk_rw_complete(req, -EIO);
+    /*
+     * Guests with a noop elevator send sequential reads as separate
+     * requests, collect them so that they can be merged.
+     */
+    if (mrb->num_reads == 32) {
+        virtio_submit_multiread(req->dev->bs, mrb);
     }
+
+    blkreq = &mrb->rdreq[mrb->num_reads];
+    blkreq->sector = sector;
+    blkreq->nb_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
+    blkreq->qiov = &req->qiov;
+    blkreq->cb = virtio_blk_rw_complete;
+    blkreq->opaque = req;
+    blkreq->error = 0;
+
+    mrb->num_reads++;
 }
 
 static void virtio_blk_handle_request(VirtIOBlockReq *req,
@@ -408,7 +450,7 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
     } else {
         qemu_iovec_init_external(&req->qiov, &req->elem.in_sg[0],
                                  req->elem.in_num - 1);
-        virtio_blk_handle_read(req);
+        virtio_blk_handle_read(req, mrb);
     }
 }
 
@@ -418,13 +460,31 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOBlockReq *req;
     MultiReqBuffer mrb = {
         .num_writes = 0,
+        .num_reads = 0,
     };
 
-    while ((req = virtio_blk_get_request(s))) {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* The data plane thread processes the virtqueue once it is started */
+    if (s->dataplane && virtio_blk_data_plane_start(s->dataplane)) {
+        return;
+    }
+#endif
+
+    /*
+     * Hand everything the guest queued up to the host in one batch.  Each
+     * queue merges its own reads and writes, so vCPUs submitting on
+     * different queues do not share any state here.
+     */
+    bdrv_io_plug(s->bs);
+
+    while ((req = virtio_blk_get_request(s, vq))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_multiread(s->bs, &mrb);
+
+    bdrv_io_unplug(s->bs);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -439,6 +499,7 @@ static void virtio_blk_dma_restart_bh(void *opaque)
     VirtIOBlockReq *req = s->rq;
     MultiReqBuffer mrb = {
         .num_writes = 0,
+        .num_reads = 0,
     };
 
     qemu_bh_delete(s->bh);
@@ -446,12 +507,17 @@ static void virtio_blk_dma_restart_bh(void *opaque)
 
     s->rq = NULL;
 
+    bdrv_io_plug(s->bs);
+
     while (req) {
         virtio_blk_handle_request(req, &mrb);
         req = req->next;
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_multiread(s->bs, &mrb);
+
+    bdrv_io_unplug(s->bs);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running,
@@ -470,11 +536,19 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
 
 static void virtio_blk_reset(VirtIODevice *vdev)
 {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    if (s->dataplane) {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+#endif
+
     /*
      * This should cancel pending requests, but can't do nicely until there
      * are per-device request lists.
      */
-    qemu_aio_flush();
+    bdrv_drain_all();
 }
 
 /* coalesce internal state, copy to pci i/o region 0
@@ -501,7 +575,8 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.size_max = 0;
     blkcfg.physical_block_exp = get_physical_block_exp(s->conf);
     blkcfg.alignment_offset = 0;
-    memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
+    stw_raw(&blkcfg.num_queues, s->num_queues);
+    memcpy(config, &blkcfg, s->vdev.config_len);
 }
 
 static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
@@ -512,6 +587,9 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     features |= (1 << VIRTIO_BLK_F_GEOMETRY);
     features |= (1 << VIRTIO_BLK_F_TOPOLOGY);
     features |= (1 << VIRTIO_BLK_F_BLK_SIZE);
+    if (s->num_queues > 1) {
+        features |= (1 << VIRTIO_BLK_F_MQ);
+    }
 
     if (bdrv_enable_write_cache(s->bs))
         features |= (1 << VIRTIO_BLK_F_WCACHE);
@@ -522,6 +600,30 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     return features;
 }
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    /* The guest driver is going away, give the virtqueue back */
+    if (s->dataplane && !(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+}
+#endif
+
+static unsigned int virtio_blk_queue_index(VirtIOBlock *s, VirtQueue *vq)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->num_queues; i++) {
+        if (s->vqs[i] == vq) {
+            break;
+        }
+    }
+    return i;
+}
+
 static void virtio_blk_save(QEMUFile *f, void *opaque)
 {
     VirtIOBlock *s = opaque;
@@ -532,6 +634,10 @@ static void virtio_blk_save(QEMUFile *f, void *opaque)
     while (req) {
         qemu_put_sbyte(f, 1);
         qemu_put_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        /* Single queue devices keep the old format */
+        if (s->num_queues > 1) {
+            qemu_put_be32(f, virtio_blk_queue_index(s, req->vq));
+        }
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -547,7 +653,17 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
     virtio_load(&s->vdev, f);
     while (qemu_get_sbyte(f)) {
         VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+        unsigned int n = 0;
+
         qemu_get_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        if (s->num_queues > 1) {
+            n = qemu_get_be32(f);
+            if (n >= s->num_queues) {
+                g_free(req);
+                return -EINVAL;
+            }
+        }
+        req->vq = s->vqs[n];
         req->next = s->rq;
         s->rq = req;
 
@@ -571,13 +687,16 @@ static const BlockDevOps virtio_block_ops = {
     .resize_cb = virtio_blk_resize,
 };
 
-VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
-                              char **serial)
+VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
 {
+    BlockConf *conf = &blk->conf;
     VirtIOBlock *s;
     int cylinders, heads, secs;
     static int virtio_blk_id;
     DriveInfo *dinfo;
+    unsigned int num_queues = MAX(blk->num_queues, 1);
+    size_t config_size;
+    int i;
 
     if (!conf->bs) {
         error_report("virtio-blk-pci: drive property not set");
@@ -587,30 +706,49 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
         error_report("Device needs media, but drive is empty");
         return NULL;
     }
+    if (num_queues > VIRTIO_PCI_QUEUE_MAX) {
+        error_report("virtio-blk: num_queues must be at most %d",
+                     VIRTIO_PCI_QUEUE_MAX);
+        return NULL;
+    }
 
-    if (!*serial) {
+    if (!blk->serial) {
         /* try to fall back to value set with legacy -drive serial=... */
         dinfo = drive_get_by_blockdev(conf->bs);
         if (*dinfo->serial) {
-            *serial = strdup(dinfo->serial);
+            blk->serial = strdup(dinfo->serial);
         }
     }
 
+    /* Guests only see the num_queues field if it is used */
+    config_size = num_queues > 1 ? sizeof(struct virtio_blk_config)
+                                 : offsetof(struct virtio_blk_config, wce);
     s = (VirtIOBlock *)virtio_common_init("virtio-blk", VIRTIO_ID_BLOCK,
-                                          sizeof(struct virtio_blk_config),
-                                          sizeof(VirtIOBlock));
+                                          config_size, sizeof(VirtIOBlock));
 
     s->vdev.get_config = virtio_blk_update_config;
     s->vdev.get_features = virtio_blk_get_features;
     s->vdev.reset = virtio_blk_reset;
     s->bs = conf->bs;
     s->conf = conf;
-    s->serial = *serial;
+    s->serial = blk->serial;
     s->rq = NULL;
     s->sector_mask = (s->conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
     bdrv_guess_geometry(s->bs, &cylinders, &heads, &secs);
 
-    s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    s->num_queues = num_queues;
+    s->vqs = g_new(VirtQueue *, num_queues);
+    for (i = 0; i < num_queues; i++) {
+        s->vqs[i] = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    }
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (!virtio_blk_data_plane_create(&s->vdev, blk, &s->dataplane)) {
+        g_free(s->vqs);
+        virtio_cleanup(&s->vdev);
+        return NULL;
+    }
+    s->vdev.set_status = virtio_blk_set_status;
+#endif
 
     qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     s->qdev = dev;
@@ -628,6 +766,11 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
 void virtio_blk_exit(VirtIODevice *vdev)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    virtio_blk_data_plane_destroy(s->dataplane);
+    s->dataplane = NULL;
+#endif
     unregister_savevm(s->qdev, "virtio-blk", s);
+    g_free(s->vqs);
     virtio_cleanup(vdev);
 }
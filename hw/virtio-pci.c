@@ -745,12 +745,14 @@ static int virtio_blk_init_pci(PCIDevice *pci_dev)
         proxy->class_code != PCI_CLASS_STORAGE_OTHER)
         proxy->class_code = PCI_CLASS_STORAGE_SCSI;
 
-    vdev = virtio_blk_init(&pci_dev->qdev, &proxy->block,
-                           &proxy->block_serial);
+    vdev = virtio_blk_init(&pci_dev->qdev, &proxy->blk);
     if (!vdev) {
         return -1;
     }
-    vdev->nvectors = proxy->nvectors;
+    /* One vector per request queue plus one for configuration changes */
+    vdev->nvectors = proxy->nvectors == DEV_NVECTORS_UNSPECIFIED
+                                        ? proxy->blk.num_queues + 1
+                                        : proxy->nvectors;
     virtio_init_pci(proxy, vdev);
     /* make the actual value visible */
     proxy->nvectors = vdev->nvectors;
@@ -774,7 +776,7 @@ static int virtio_blk_exit_pci(PCIDevice *pci_dev)
 
     virtio_pci_stop_ioeventfd(proxy);
     virtio_blk_exit(proxy->vdev);
-    blockdev_mark_auto_del(proxy->block.bs);
+    blockdev_mark_auto_del(proxy->blk.conf.bs);
     return virtio_exit_pci(pci_dev);
 }
 
@@ -868,11 +870,17 @@ static PCIDeviceInfo virtio_info[] = {
         .class_id  = PCI_CLASS_STORAGE_SCSI,
         .qdev.props = (Property[]) {
             DEFINE_PROP_HEX32("class", VirtIOPCIProxy, class_code, 0),
-            DEFINE_BLOCK_PROPERTIES(VirtIOPCIProxy, block),
-            DEFINE_PROP_STRING("serial", VirtIOPCIProxy, block_serial),
+            DEFINE_BLOCK_PROPERTIES(VirtIOPCIProxy, blk.conf),
+            DEFINE_PROP_STRING("serial", VirtIOPCIProxy, blk.serial),
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+            DEFINE_PROP_BIT("x-data-plane", VirtIOPCIProxy, blk.data_plane,
+                            0, false),
+#endif
             DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
                             VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
-            DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
+            DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors,
+                               DEV_NVECTORS_UNSPECIFIED),
+            DEFINE_PROP_UINT32("num_queues", VirtIOPCIProxy, blk.num_queues, 1),
             DEFINE_VIRTIO_BLK_FEATURES(VirtIOPCIProxy, host_features),
             DEFINE_PROP_END_OF_LIST(),
         },
@@ -0,0 +1,267 @@
+/*
+ * Virtqueue access for threads that do not hold the global mutex
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu-barrier.h"
+#include "qemu-error.h"
+#include "vring.h"
+
+/* Map the rings of virtqueue n and take over its avail index */
+int vring_setup(Vring *vring, VirtIODevice *vdev, int n)
+{
+    hostmem_init(&vring->hostmem);
+
+    vring->vr.num = virtio_queue_get_num(vdev, n);
+    vring->vr.desc = hostmem_lookup(&vring->hostmem,
+                                    virtio_queue_get_desc_addr(vdev, n),
+                                    virtio_queue_get_desc_size(vdev, n));
+    vring->vr.avail = hostmem_lookup(&vring->hostmem,
+                                     virtio_queue_get_avail_addr(vdev, n),
+                                     virtio_queue_get_avail_size(vdev, n));
+    vring->vr.used = hostmem_lookup(&vring->hostmem,
+                                    virtio_queue_get_used_addr(vdev, n),
+                                    virtio_queue_get_used_size(vdev, n));
+    if (!vring->vr.desc || !vring->vr.avail || !vring->vr.used) {
+        error_report("virtqueue %d is not in guest RAM", n);
+        hostmem_finalize(&vring->hostmem);
+        return -EFAULT;
+    }
+
+    vring->last_avail_idx = virtio_queue_get_last_avail_idx(vdev, n);
+    vring->last_used_idx = vring->vr.used->idx;
+    vring->signalled_used = 0;
+    vring->signalled_used_valid = false;
+    vring->broken = false;
+    return 0;
+}
+
+/* Hand the virtqueue back to the device model */
+void vring_teardown(Vring *vring, VirtIODevice *vdev, int n)
+{
+    virtio_queue_set_last_avail_idx(vdev, n, vring->last_avail_idx);
+    virtio_queue_invalidate_signalled_used(vdev, n);
+    hostmem_finalize(&vring->hostmem);
+}
+
+/* Ask the guest not to kick while requests are being processed */
+void vring_disable_notification(VirtIODevice *vdev, Vring *vring)
+{
+    if (!(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        vring->vr.used->flags |= VRING_USED_F_NO_NOTIFY;
+    }
+}
+
+/*
+ * Ask the guest to kick again.  Returns false if the guest added requests in
+ * the meantime, which must be processed because no kick will come for them.
+ */
+bool vring_enable_notification(VirtIODevice *vdev, Vring *vring)
+{
+    if (vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        vring_avail_event(&vring->vr) = vring->vr.avail->idx;
+    } else {
+        vring->vr.used->flags &= ~VRING_USED_F_NO_NOTIFY;
+    }
+    smp_mb(); /* write the flag before reading the avail index */
+    return vring->vr.avail->idx == vring->last_avail_idx;
+}
+
+/* Whether the guest wants an interrupt for the requests pushed so far */
+bool vring_should_notify(VirtIODevice *vdev, Vring *vring)
+{
+    uint16_t old, new;
+    bool v;
+
+    smp_mb(); /* write the used index before reading the avail ring */
+
+    if ((vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) &&
+        unlikely(vring->vr.avail->idx == vring->last_avail_idx)) {
+        return true;
+    }
+
+    if (!(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        return !(vring->vr.avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+    old = vring->signalled_used;
+    v = vring->signalled_used_valid;
+    new = vring->signalled_used = vring->last_used_idx;
+    vring->signalled_used_valid = true;
+
+    if (unlikely(!v)) {
+        return true;
+    }
+    return vring_need_event(vring_used_event(&vring->vr), new, old);
+}
+
+static int get_desc(Vring *vring, struct iovec iov[], unsigned int iov_size,
+                    unsigned int *out_num, unsigned int *in_num,
+                    struct vring_desc *desc)
+{
+    struct iovec *iov_entry;
+
+    if (*out_num + *in_num >= iov_size) {
+        error_report("virtqueue request has too many descriptors");
+        vring->broken = true;
+        return -ENOBUFS;
+    }
+
+    if (desc->flags & VRING_DESC_F_WRITE) {
+        (*in_num)++;
+    } else {
+        /* All readable descriptors come before the writable ones */
+        if (*in_num) {
+            error_report("readable descriptor after writable one");
+            vring->broken = true;
+            return -EFAULT;
+        }
+        (*out_num)++;
+    }
+
+    iov_entry = &iov[*out_num + *in_num - 1];
+    iov_entry->iov_base = hostmem_lookup(&vring->hostmem, desc->addr,
+                                         desc->len);
+    if (!iov_entry->iov_base) {
+        error_report("descriptor address %#" PRIx64 " len %u not in RAM",
+                     (uint64_t)desc->addr, desc->len);
+        vring->broken = true;
+        return -EFAULT;
+    }
+    iov_entry->iov_len = desc->len;
+    return 0;
+}
+
+static int get_indirect(Vring *vring, struct iovec iov[],
+                        unsigned int iov_size, unsigned int *out_num,
+                        unsigned int *in_num, struct vring_desc *indirect)
+{
+    struct vring_desc *table, desc;
+    unsigned int count, i = 0, found = 0;
+    int ret;
+
+    if (unlikely(indirect->len % sizeof(desc))) {
+        error_report("invalid indirect table length %u", indirect->len);
+        vring->broken = true;
+        return -EFAULT;
+    }
+    count = indirect->len / sizeof(desc);
+    table = hostmem_lookup(&vring->hostmem, indirect->addr, indirect->len);
+    if (!table) {
+        error_report("indirect table not in guest RAM");
+        vring->broken = true;
+        return -EFAULT;
+    }
+
+    do {
+        if (unlikely(i >= count || ++found > count)) {
+            error_report("invalid indirect descriptor chain");
+            vring->broken = true;
+            return -EFAULT;
+        }
+        desc = table[i];
+        barrier(); /* read the descriptor only once */
+
+        if (unlikely(desc.flags & VRING_DESC_F_INDIRECT)) {
+            error_report("nested indirect descriptor");
+            vring->broken = true;
+            return -EFAULT;
+        }
+        ret = get_desc(vring, iov, iov_size, out_num, in_num, &desc);
+        if (ret < 0) {
+            return ret;
+        }
+        i = desc.next;
+    } while (desc.flags & VRING_DESC_F_NEXT);
+    return 0;
+}
+
+/*
+ * Map the next request of the ring to iov, its readable part in the first
+ * out_num entries and its writable part in the following in_num entries.
+ *
+ * Returns the head descriptor index, -EAGAIN if the ring is empty, or another
+ * negative errno on failure.  After a guest error the ring is marked broken
+ * and not processed any further.
+ */
+int vring_pop(VirtIODevice *vdev, Vring *vring,
+              struct iovec iov[], unsigned int iov_size,
+              unsigned int *out_num, unsigned int *in_num)
+{
+    struct vring_desc desc;
+    unsigned int i, head, found = 0, num = vring->vr.num;
+    uint16_t avail_idx, last_avail_idx;
+    int ret;
+
+    if (vring->broken) {
+        return -EFAULT;
+    }
+
+    last_avail_idx = vring->last_avail_idx;
+    avail_idx = vring->vr.avail->idx;
+    smp_rmb(); /* read the index before the ring entries */
+
+    if (unlikely((uint16_t)(avail_idx - last_avail_idx) > num)) {
+        error_report("guest moved avail index from %u to %u",
+                     last_avail_idx, avail_idx);
+        vring->broken = true;
+        return -EFAULT;
+    }
+    if (avail_idx == last_avail_idx) {
+        return -EAGAIN;
+    }
+
+    head = vring->vr.avail->ring[last_avail_idx % num];
+    if (unlikely(head >= num)) {
+        error_report("guest provided head %u >= ring size %u", head, num);
+        vring->broken = true;
+        return -EFAULT;
+    }
+
+    *out_num = *in_num = 0;
+    i = head;
+    do {
+        if (unlikely(i >= num || ++found > num)) {
+            error_report("invalid descriptor chain at head %u", head);
+            vring->broken = true;
+            return -EFAULT;
+        }
+        desc = vring->vr.desc[i];
+        barrier(); /* read the descriptor only once */
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            ret = get_indirect(vring, iov, iov_size, out_num, in_num, &desc);
+        } else {
+            ret = get_desc(vring, iov, iov_size, out_num, in_num, &desc);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        i = desc.next;
+    } while (desc.flags & VRING_DESC_F_NEXT);
+
+    vring->last_avail_idx++;
+    if (vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        vring_avail_event(&vring->vr) = vring->last_avail_idx;
+    }
+    return head;
+}
+
+/* Complete a request; the guest still has to be notified */
+void vring_push(Vring *vring, unsigned int head, int len)
+{
+    struct vring_used_elem *used;
+    uint16_t new;
+
+    used = &vring->vr.used->ring[vring->last_used_idx % vring->vr.num];
+    used->id = head;
+    used->len = len;
+
+    smp_wmb(); /* write the element before the index */
+    new = vring->vr.used->idx = ++vring->last_used_idx;
+    if (unlikely((int16_t)(new - vring->signalled_used) < (uint16_t)1)) {
+        vring->signalled_used_valid = false;
+    }
+}
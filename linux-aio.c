@@ -20,11 +20,17 @@
  *
  * XXX: eventually we need to communicate this to the guest and/or make it
  *      tunable by the guest.  If we get more outstanding requests at a time
- *      than this we will get EAGAIN from io_submit which is communicated to
- *      the guest as an I/O error.
+ *      than this we will get EAGAIN from io_submit; the requests are then
+ *      kept in the plug queue until earlier ones complete.
  */
 #define MAX_EVENTS 128
 
+/*
+ * Maximum number of requests that are collected while the device is plugged
+ * before they are submitted to the kernel anyway.
+ */
+#define MAX_QUEUED_IO  MAX_EVENTS
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -40,6 +46,13 @@ struct qemu_laio_state {
     io_context_t ctx;
     int efd;
     int count;
+
+    /* requests queued while plugged, see laio_io_plug() */
+    struct {
+        struct iocb *iocbs[MAX_QUEUED_IO];
+        int plugged;
+        unsigned int idx;
+    } io_q;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -77,11 +90,14 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
+static int ioq_submit(struct qemu_laio_state *s);
+
 static void qemu_laio_completion_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
     while (1) {
+        /* Local, a completion callback may get here again in a nested wait */
         struct io_event events[MAX_EVENTS];
         uint64_t val;
         ssize_t ret;
@@ -98,37 +114,146 @@ static void qemu_laio_completion_cb(void *opaque)
         if (ret != 8)
             break;
 
+        /*
+         * The eventfd counter only tells us how many requests completed
+         * before the read.  Keep reaping as long as the kernel fills the
+         * whole events array, so that completions which arrived meanwhile
+         * are handled in the same pass instead of taking another wakeup.
+         */
         do {
-            nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
+            do {
+                nevents = io_getevents(s->ctx, 0, MAX_EVENTS, events, &ts);
+            } while (nevents == -EINTR);
+
+            for (i = 0; i < nevents; i++) {
+                struct iocb *iocb = events[i].obj;
+                struct qemu_laiocb *laiocb =
+                        container_of(iocb, struct qemu_laiocb, iocb);
+
+                laiocb->ret = io_event_ret(&events[i]);
+                qemu_laio_process_completion(s, laiocb);
+            }
+        } while (nevents == MAX_EVENTS);
+    }
 
-        for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
+    /* Requests that the kernel had no room for fit in now */
+    if (s->io_q.idx > 0 && !s->io_q.plugged) {
+        ioq_submit(s);
+    }
+}
 
-            laiocb->ret = io_event_ret(&events[i]);
-            qemu_laio_process_completion(s, laiocb);
+/*
+ * Submits all requests collected in the plug queue with a single io_submit()
+ * call.  Requests that the kernel has no room for stay queued and are
+ * submitted again when a request completes or the device is unplugged.  They
+ * are only completed with an error if io_submit() fails otherwise.
+ */
+static int ioq_submit(struct qemu_laio_state *s)
+{
+    struct iocb *failed[MAX_QUEUED_IO];
+    int ret, i;
+    int len = s->io_q.idx;
+
+    do {
+        ret = io_submit(s->ctx, len, s->io_q.iocbs);
+    } while (ret == -EINTR);
+
+    /* Without requests in flight no completion would retry, so fail them */
+    if (ret == -EAGAIN && s->count > len) {
+        ret = 0;
+    }
+
+    if (ret >= 0) {
+        memmove(s->io_q.iocbs, s->io_q.iocbs + ret,
+                (len - ret) * sizeof(s->io_q.iocbs[0]));
+        s->io_q.idx = len - ret;
+        return ret;
+    }
+
+    /* The callbacks may queue new requests */
+    memcpy(failed, s->io_q.iocbs, len * sizeof(failed[0]));
+    s->io_q.idx = 0;
+
+    for (i = 0; i < len; i++) {
+        struct qemu_laiocb *laiocb =
+                container_of(failed[i], struct qemu_laiocb, iocb);
+
+        laiocb->ret = ret;
+        qemu_laio_process_completion(s, laiocb);
+    }
+
+    return ret;
+}
+
+static int ioq_enqueue(struct qemu_laio_state *s, struct iocb *iocb)
+{
+    /*
+     * Flush a full queue before adding the new request rather than after, so
+     * that a failing io_submit() never completes the request that the caller
+     * is just about to get back from laio_submit().
+     */
+    if (s->io_q.idx == MAX_QUEUED_IO) {
+        ioq_submit(s);
+        if (s->io_q.idx == MAX_QUEUED_IO) {
+            return -EAGAIN;
         }
     }
+
+    s->io_q.iocbs[s->io_q.idx++] = iocb;
+    return 0;
+}
+
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0 && s->io_q.idx > 0) {
+        ioq_submit(s);
+    }
 }
 
 static int qemu_laio_flush_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
+    /* Nobody is going to unplug while we wait for the queued requests */
+    if (s->io_q.idx > 0) {
+        ioq_submit(s);
+    }
+
     return (s->count > 0) ? 1 : 0;
 }
 
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    struct qemu_laio_state *s = laiocb->ctx;
     struct io_event event;
-    int ret;
+    int i, ret;
 
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* A request that still sits in the plug queue is simply dropped */
+    for (i = 0; i < s->io_q.idx; i++) {
+        if (s->io_q.iocbs[i] == &laiocb->iocb) {
+            memmove(&s->io_q.iocbs[i], &s->io_q.iocbs[i + 1],
+                    (s->io_q.idx - i - 1) * sizeof(s->io_q.iocbs[0]));
+            s->io_q.idx--;
+            s->count--;
+            qemu_aio_release(laiocb);
+            return;
+        }
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -164,6 +289,7 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     struct qemu_laiocb *laiocb;
     struct iocb *iocbs;
     off_t offset = sector_num * 512;
+    int ret;
 
     laiocb = qemu_aio_get(&laio_pool, bs, cb, opaque);
     if (!laiocb)
@@ -192,8 +318,20 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_dec_count;
+    if (s->io_q.plugged) {
+        if (ioq_enqueue(s, iocbs) < 0) {
+            goto out_dec_count;
+        }
+    } else {
+        ret = io_submit(s->ctx, 1, &iocbs);
+        /* A full kernel queue is retried when a request completes */
+        if (ret == -EAGAIN && s->count > 1 && ioq_enqueue(s, iocbs) == 0) {
+            ret = 0;
+        }
+        if (ret < 0) {
+            goto out_dec_count;
+        }
+    }
     return &laiocb->common;
 
 out_dec_count:
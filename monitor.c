@@ -479,6 +479,9 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
         case QEVENT_SPICE_DISCONNECTED:
             event_name = "SPICE_DISCONNECTED";
             break;
+        case QEVENT_BLOCK_DEFRAG_COMPLETED:
+            event_name = "BLOCK_DEFRAG_COMPLETED";
+            break;
         default:
             abort();
             break;
@@ -2655,6 +2658,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show block device statistics",
         .mhandler.info = hmp_info_blockstats,
     },
+    {
+        .name       = "aio-pool",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show block I/O thread pool statistics",
+        .mhandler.info = hmp_info_aio_pool,
+    },
     {
         .name       = "registers",
         .args_type  = "",
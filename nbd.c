@@ -18,6 +18,8 @@
 
 #include "nbd.h"
 #include "block.h"
+#include "qemu-coroutine.h"
+#include "qemu-aio.h"
 
 #include <errno.h>
 #include <string.h>
@@ -57,6 +59,8 @@
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
 #define NBD_REQUEST_MAGIC       0x25609513
 #define NBD_REPLY_MAGIC         0x67446698
+#define NBD_CLIENT_MAGIC        0x0000420281861253LL
+#define NBD_OPTS_MAGIC          0x49484156454F5054LL
 
 #define NBD_SET_SOCK            _IO(0xab, 0)
 #define NBD_SET_BLKSIZE         _IO(0xab, 1)
@@ -192,7 +196,7 @@ int nbd_negotiate(int csock, off_t size, uint32_t flags)
 
     TRACE("Beginning negotiation.");
     memcpy(buf, "NBDMAGIC", 8);
-    cpu_to_be64w((uint64_t*)(buf + 8), 0x00420281861253LL);
+    cpu_to_be64w((uint64_t*)(buf + 8), NBD_CLIENT_MAGIC);
     cpu_to_be64w((uint64_t*)(buf + 16), size);
     cpu_to_be32w((uint32_t*)(buf + 24), flags | NBD_FLAG_HAS_FLAGS);
     memset(buf + 28, 0, 124);
@@ -260,7 +264,7 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
         uint32_t namesize;
 
         TRACE("Checking magic (opts_magic)");
-        if (magic != 0x49484156454F5054LL) {
+        if (magic != NBD_OPTS_MAGIC) {
             LOG("Bad magic received");
             errno = EINVAL;
             return -1;
@@ -306,7 +310,7 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     } else {
         TRACE("Checking magic (cli_magic)");
 
-        if (magic != 0x00420281861253LL) {
+        if (magic != NBD_CLIENT_MAGIC) {
             LOG("Bad magic received");
             errno = EINVAL;
             return -1;
@@ -335,7 +339,7 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             errno = EINVAL;
             return -1;
         }
-        *flags |= be32_to_cpu(tmp);
+        *flags |= be16_to_cpu(tmp);
     }
     if (read_sync(csock, &buf, 124) != 124) {
         LOG("read failed (buf)");
@@ -487,43 +491,6 @@ int nbd_send_request(int csock, struct nbd_request *request)
     return 0;
 }
 
-static int nbd_receive_request(int csock, struct nbd_request *request)
-{
-    uint8_t buf[4 + 4 + 8 + 8 + 4];
-    uint32_t magic;
-
-    if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
-        LOG("read failed");
-        errno = EINVAL;
-        return -1;
-    }
-
-    /* Request
-       [ 0 ..  3]   magic   (NBD_REQUEST_MAGIC)
-       [ 4 ..  7]   type    (0 == READ, 1 == WRITE)
-       [ 8 .. 15]   handle
-       [16 .. 23]   from
-       [24 .. 27]   len
-     */
-
-    magic = be32_to_cpup((uint32_t*)buf);
-    request->type  = be32_to_cpup((uint32_t*)(buf + 4));
-    request->handle = be64_to_cpup((uint64_t*)(buf + 8));
-    request->from  = be64_to_cpup((uint64_t*)(buf + 16));
-    request->len   = be32_to_cpup((uint32_t*)(buf + 24));
-
-    TRACE("Got request: "
-          "{ magic = 0x%x, .type = %d, from = %" PRIu64" , len = %u }",
-          magic, request->type, request->from, request->len);
-
-    if (magic != NBD_REQUEST_MAGIC) {
-        LOG("invalid magic (got 0x%x)", magic);
-        errno = EINVAL;
-        return -1;
-    }
-    return 0;
-}
-
 int nbd_receive_reply(int csock, struct nbd_reply *reply)
 {
     uint8_t buf[NBD_REPLY_SIZE];
@@ -559,9 +526,146 @@ int nbd_receive_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-static int nbd_send_reply(int csock, struct nbd_reply *reply)
+/*
+ * Coroutine based server
+ *
+ * Each client socket is non-blocking.  A request is received and processed
+ * by its own coroutine, so that up to max_requests requests of a client run
+ * in parallel and their replies can be sent in any order.  Only one
+ * coroutine at a time receives from the socket (recv_coroutine) and sends to
+ * it (send_coroutine, serialized by send_lock); the fd handlers reenter
+ * them when the socket becomes ready.
+ */
+
+typedef struct NBDRequest NBDRequest;
+
+struct NBDRequest {
+    NBDClient *client;
+    uint8_t *data;
+};
+
+struct NBDExport {
+    BlockDriverState *bs;
+    off_t dev_offset;
+    off_t size;
+    uint32_t nbdflags;
+    int max_requests;
+    bool poll_idle;
+    QTAILQ_HEAD(, NBDClient) clients;
+
+    char *name;
+    QTAILQ_ENTRY(NBDExport) next;
+};
+
+static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
+
+struct NBDClient {
+    int refcount;
+    void (*close)(NBDClient *client);
+
+    NBDExport *exp;
+    int sock;
+
+    Coroutine *recv_coroutine;
+
+    CoMutex send_lock;
+    Coroutine *send_coroutine;
+
+    int nb_requests;
+    bool closing;
+    QTAILQ_ENTRY(NBDClient) next;
+};
+
+static void nbd_set_handlers(NBDClient *client);
+
+static void nbd_client_get(NBDClient *client)
+{
+    client->refcount++;
+}
+
+static void nbd_client_put(NBDClient *client)
+{
+    if (--client->refcount == 0) {
+        close(client->sock);
+        g_free(client);
+    }
+}
+
+void nbd_client_close(NBDClient *client)
+{
+    if (client->closing) {
+        return;
+    }
+
+    client->closing = true;
+    nbd_client_get(client);
+
+    /* Force requests to finish.  They will drop their own references,
+     * then we'll close the socket and free the NBDClient.
+     */
+    shutdown(client->sock, 2);
+    qemu_aio_set_fd_handler(client->sock, NULL, NULL, NULL, NULL, NULL);
+    QTAILQ_REMOVE(&client->exp->clients, client, next);
+
+    /* Coroutines waiting for the socket see the error now */
+    if (client->recv_coroutine) {
+        qemu_coroutine_enter(client->recv_coroutine, NULL);
+    }
+    if (client->send_coroutine) {
+        qemu_coroutine_enter(client->send_coroutine, NULL);
+    }
+
+    /* Also tell the owner */
+    if (client->close) {
+        client->close(client);
+    }
+    nbd_client_put(client);
+
+    /* Drop the reference taken in nbd_client_new() */
+    nbd_client_put(client);
+}
+
+NBDExport *nbd_client_get_export(NBDClient *client)
+{
+    return client->exp;
+}
+
+static NBDRequest *nbd_request_get(NBDClient *client)
+{
+    NBDRequest *req;
+
+    client->nb_requests++;
+    nbd_client_get(client);
+
+    req = g_malloc0(sizeof(*req));
+    req->client = client;
+    return req;
+}
+
+static void nbd_request_put(NBDRequest *req)
+{
+    NBDClient *client = req->client;
+
+    if (req->data) {
+        qemu_vfree(req->data);
+    }
+    g_free(req);
+
+    client->nb_requests--;
+    nbd_set_handlers(client);
+    nbd_client_put(client);
+}
+
+static int nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
+                             int len)
 {
-    uint8_t buf[4 + 4 + 8];
+    NBDClient *client = req->client;
+    uint8_t buf[NBD_REPLY_SIZE];
+    int ret;
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
 
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
@@ -574,129 +678,585 @@ static int nbd_send_reply(int csock, struct nbd_reply *reply)
 
     TRACE("Sending response to client");
 
-    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+    ret = qemu_co_send(client->sock, buf, sizeof(buf));
+    if (ret == sizeof(buf) && len) {
+        ret = qemu_co_send(client->sock, req->data, len);
+        if (ret == len) {
+            ret = sizeof(buf);
+        }
+    }
+    if (ret != sizeof(buf)) {
         LOG("writing to socket failed");
-        errno = EINVAL;
-        return -1;
+        ret = -EIO;
+    } else {
+        ret = 0;
     }
-    return 0;
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return ret;
 }
 
-int nbd_trip(BlockDriverState *bs, int csock, off_t size, uint64_t dev_offset,
-             off_t *offset, uint32_t nbdflags, uint8_t *data, int data_size)
+static int nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
-    struct nbd_request request;
-    struct nbd_reply reply;
+    NBDClient *client = req->client;
+    uint8_t buf[4 + 4 + 8 + 8 + 4];
+    uint32_t magic;
+    uint32_t command;
+    int ret;
 
-    TRACE("Reading request.");
+    client->recv_coroutine = qemu_coroutine_self();
 
-    if (nbd_receive_request(csock, &request) == -1)
-        return -1;
+    ret = qemu_co_recv(client->sock, buf, sizeof(buf));
+    if (ret != sizeof(buf)) {
+        if (ret != 0) {
+            LOG("read failed");
+        }
+        ret = -EIO;
+        goto out;
+    }
 
-    if (request.len + NBD_REPLY_SIZE > data_size) {
-        LOG("len (%u) is larger than max len (%u)",
-            request.len + NBD_REPLY_SIZE, data_size);
-        errno = EINVAL;
-        return -1;
+    /* Request
+       [ 0 ..  3]   magic   (NBD_REQUEST_MAGIC)
+       [ 4 ..  7]   type    (0 == READ, 1 == WRITE)
+       [ 8 .. 15]   handle
+       [16 .. 23]   from
+       [24 .. 27]   len
+     */
+
+    magic = be32_to_cpup((uint32_t*)buf);
+    request->type  = be32_to_cpup((uint32_t*)(buf + 4));
+    request->handle = be64_to_cpup((uint64_t*)(buf + 8));
+    request->from  = be64_to_cpup((uint64_t*)(buf + 16));
+    request->len   = be32_to_cpup((uint32_t*)(buf + 24));
+
+    TRACE("Got request: "
+          "{ magic = 0x%x, .type = %d, from = %" PRIu64" , len = %u }",
+          magic, request->type, request->from, request->len);
+
+    if (magic != NBD_REQUEST_MAGIC) {
+        LOG("invalid magic (got 0x%x)", magic);
+        ret = -EIO;
+        goto out;
+    }
+
+    command = request->type & NBD_CMD_MASK_COMMAND;
+    if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
+        if (request->len > NBD_MAX_BUFFER_SIZE) {
+            LOG("len (%u) is larger than max len (%u)",
+                request->len, NBD_MAX_BUFFER_SIZE);
+            ret = -EIO;
+            goto out;
+        }
+        req->data = qemu_blockalign(client->exp->bs, request->len);
     }
 
-    if ((request.from + request.len) < request.from) {
+    if ((request->from + request->len) < request->from) {
         LOG("integer overflow detected! "
             "you're probably being attacked");
-        errno = EINVAL;
-        return -1;
+        ret = -EIO;
+        goto out;
     }
 
-    if ((request.from + request.len) > size) {
-            LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
-            ", Offset: %" PRIu64 "\n",
-                    request.from, request.len, (uint64_t)size, dev_offset);
-        LOG("requested operation past EOF--bad client?");
-        errno = EINVAL;
-        return -1;
+    if (command == NBD_CMD_WRITE) {
+        TRACE("Reading %u byte(s)", request->len);
+
+        if (qemu_co_recv(client->sock, req->data, request->len) !=
+            request->len) {
+            LOG("reading from socket failed");
+            ret = -EIO;
+            goto out;
+        }
     }
 
-    TRACE("Decoding type");
+    ret = 0;
+
+out:
+    client->recv_coroutine = NULL;
+    nbd_set_handlers(client);
+    return ret;
+}
+
+static void coroutine_fn nbd_trip(void *opaque)
+{
+    NBDClient *client = opaque;
+    NBDRequest *req = nbd_request_get(client);
+    NBDExport *exp = client->exp;
+    struct nbd_request request;
+    struct nbd_reply reply;
+    int64_t sector_num;
+    int nb_sectors;
+    int ret;
+
+    TRACE("Reading request.");
+
+    if (nbd_co_receive_request(req, &request) < 0) {
+        goto out;
+    }
 
     reply.handle = request.handle;
     reply.error = 0;
 
-    switch (request.type) {
-    case NBD_CMD_READ:
+    if ((request.from + request.len) > exp->size) {
+        LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
+            ", Offset: %" PRIu64 "\n",
+            request.from, request.len,
+            (uint64_t)exp->size, (uint64_t)exp->dev_offset);
+        LOG("requested operation past EOF--bad client?");
+        goto invalid_request;
+    }
+
+    sector_num = (request.from + exp->dev_offset) / BDRV_SECTOR_SIZE;
+    nb_sectors = request.len / BDRV_SECTOR_SIZE;
+
+    switch (request.type & NBD_CMD_MASK_COMMAND) {
+    case NBD_CMD_READ: {
+        QEMUIOVector qiov;
+        struct iovec iov = {
+            .iov_base = req->data,
+            .iov_len = request.len,
+        };
+
         TRACE("Request type is READ");
 
-        if (bdrv_read(bs, (request.from + dev_offset) / 512,
-                  data + NBD_REPLY_SIZE,
-                  request.len / 512) == -1) {
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_readv(exp->bs, sector_num, nb_sectors, &qiov);
+        if (ret < 0) {
             LOG("reading from file failed");
-            errno = EINVAL;
-            return -1;
+            reply.error = -ret;
+            goto error_reply;
         }
-        *offset += request.len;
 
         TRACE("Read %u byte(s)", request.len);
-
-        /* Reply
-           [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
-           [ 4 ..  7]    error   (0 == no error)
-           [ 7 .. 15]    handle
-         */
-
-        cpu_to_be32w((uint32_t*)data, NBD_REPLY_MAGIC);
-        cpu_to_be32w((uint32_t*)(data + 4), reply.error);
-        cpu_to_be64w((uint64_t*)(data + 8), reply.handle);
-
-        TRACE("Sending data to client");
-
-        if (write_sync(csock, data,
-                   request.len + NBD_REPLY_SIZE) !=
-                   request.len + NBD_REPLY_SIZE) {
-            LOG("writing to socket failed");
-            errno = EINVAL;
-            return -1;
+        if (nbd_co_send_reply(req, &reply, request.len) < 0) {
+            goto out;
         }
         break;
+    }
     case NBD_CMD_WRITE:
         TRACE("Request type is WRITE");
 
-        TRACE("Reading %u byte(s)", request.len);
-
-        if (read_sync(csock, data, request.len) != request.len) {
-            LOG("reading from socket failed");
-            errno = EINVAL;
-            return -1;
-        }
-
-        if (nbdflags & NBD_FLAG_READ_ONLY) {
+        if (exp->nbdflags & NBD_FLAG_READ_ONLY) {
             TRACE("Server is read-only, return error");
-            reply.error = 1;
+            reply.error = EROFS;
+            goto error_reply;
         } else {
+            QEMUIOVector qiov;
+            struct iovec iov = {
+                .iov_base = req->data,
+                .iov_len = request.len,
+            };
+
             TRACE("Writing to device");
 
-            if (bdrv_write(bs, (request.from + dev_offset) / 512,
-                       data, request.len / 512) == -1) {
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_writev(exp->bs, sector_num, nb_sectors, &qiov);
+            if (ret < 0) {
                 LOG("writing to file failed");
-                errno = EINVAL;
-                return -1;
+                reply.error = -ret;
+                goto error_reply;
             }
 
-            *offset += request.len;
-        }
+            if (request.type & NBD_CMD_FLAG_FUA) {
+                ret = bdrv_co_flush(exp->bs);
+                if (ret < 0) {
+                    LOG("flush failed");
+                    reply.error = -ret;
+                    goto error_reply;
+                }
+            }
 
-        if (nbd_send_reply(csock, &reply) == -1)
-            return -1;
+            if (nbd_co_send_reply(req, &reply, 0) < 0) {
+                goto out;
+            }
+        }
         break;
     case NBD_CMD_DISC:
         TRACE("Request type is DISCONNECT");
         errno = 0;
-        return 1;
+        goto out;
+    case NBD_CMD_FLUSH:
+        TRACE("Request type is FLUSH");
+
+        ret = bdrv_co_flush(exp->bs);
+        if (ret < 0) {
+            LOG("flush failed");
+            reply.error = -ret;
+        }
+
+        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+            goto out;
+        }
+        break;
+    case NBD_CMD_TRIM:
+        TRACE("Request type is TRIM");
+
+        if (exp->nbdflags & NBD_FLAG_READ_ONLY) {
+            reply.error = EROFS;
+        } else {
+            ret = bdrv_co_discard(exp->bs, sector_num, nb_sectors);
+            if (ret < 0) {
+                LOG("discard failed");
+                reply.error = -ret;
+            }
+        }
+
+        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
-        errno = EINVAL;
-        return -1;
+    invalid_request:
+        reply.error = EINVAL;
+    error_reply:
+        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+            goto out;
+        }
+        break;
     }
 
     TRACE("Request/Reply complete");
 
-    return 0;
+    nbd_request_put(req);
+    return;
+
+out:
+    /* The request keeps the client alive until it is closed; another request
+     * may have closed it already and hold no reference any more.
+     */
+    nbd_client_close(client);
+    nbd_request_put(req);
+}
+
+static int nbd_flush(void *opaque)
+{
+    NBDClient *client = opaque;
+
+    return client->nb_requests > 0 || client->exp->poll_idle;
+}
+
+static void nbd_read(void *opaque)
+{
+    NBDClient *client = opaque;
+
+    if (client->recv_coroutine) {
+        qemu_coroutine_enter(client->recv_coroutine, NULL);
+    } else {
+        qemu_coroutine_enter(qemu_coroutine_create(nbd_trip), client);
+    }
+}
+
+static void nbd_restart_write(void *opaque)
+{
+    NBDClient *client = opaque;
+
+    qemu_coroutine_enter(client->send_coroutine, NULL);
+}
+
+/*
+ * Keep reading new requests until max_requests of them are in flight; a
+ * request that is being received counts, but must still be allowed to
+ * finish.  Watch for writability only while a reply is being sent.
+ */
+static void nbd_set_handlers(NBDClient *client)
+{
+    IOHandler *io_read = NULL;
+    IOHandler *io_write = NULL;
+
+    if (client->closing) {
+        return;
+    }
+
+    if (client->recv_coroutine ||
+        client->nb_requests < client->exp->max_requests) {
+        io_read = nbd_read;
+    }
+    if (client->send_coroutine) {
+        io_write = nbd_restart_write;
+    }
+
+    qemu_aio_set_fd_handler(client->sock, io_read, io_write, nbd_flush,
+                            NULL, client);
+}
+
+/**
+ * Export bs, starting dev_offset bytes into it and size bytes long, over
+ * NBD.  Each client may have up to max_requests requests in flight.
+ *
+ * If poll_idle is true, qemu_aio_wait() also waits for new requests from
+ * idle clients; this is for programs like qemu-nbd that have no other event
+ * loop.  Otherwise idle client sockets are only watched by the main loop,
+ * and qemu_aio_flush() does not wait for them.
+ */
+NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
+                          off_t size, uint32_t nbdflags, int max_requests,
+                          bool poll_idle)
+{
+    NBDExport *exp = g_malloc0(sizeof(*exp));
+
+    exp->bs = bs;
+    exp->dev_offset = dev_offset;
+    exp->size = size;
+    exp->nbdflags = nbdflags;
+    exp->max_requests = max_requests > 0 ? max_requests :
+                                           NBD_DEFAULT_MAX_REQUESTS;
+    exp->poll_idle = poll_idle;
+    QTAILQ_INIT(&exp->clients);
+    return exp;
+}
+
+/**
+ * Disconnect all clients and free the export, after waiting for the
+ * requests that are still in flight.
+ */
+void nbd_export_close(NBDExport *exp)
+{
+    nbd_export_set_name(exp, NULL);
+    while (!QTAILQ_EMPTY(&exp->clients)) {
+        nbd_client_close(QTAILQ_FIRST(&exp->clients));
+    }
+    bdrv_drain_all();
+    g_free(exp);
+}
+
+BlockDriverState *nbd_export_get_blockdev(NBDExport *exp)
+{
+    return exp->bs;
+}
+
+/**
+ * Make exp available to clients that ask for an export by name, or withdraw
+ * it if name is NULL.
+ */
+void nbd_export_set_name(NBDExport *exp, const char *name)
+{
+    if (exp->name) {
+        QTAILQ_REMOVE(&exports, exp, next);
+        g_free(exp->name);
+        exp->name = NULL;
+    }
+    if (name) {
+        exp->name = g_strdup(name);
+        QTAILQ_INSERT_TAIL(&exports, exp, next);
+    }
+}
+
+NBDExport *nbd_export_find(const char *name)
+{
+    NBDExport *exp;
+
+    QTAILQ_FOREACH(exp, &exports, next) {
+        if (strcmp(name, exp->name) == 0) {
+            return exp;
+        }
+    }
+    return NULL;
+}
+
+static uint32_t nbd_export_flags(NBDExport *exp)
+{
+    return exp->nbdflags | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+           NBD_FLAG_SEND_TRIM;
+}
+
+/*
+ * During new-style negotiation the client is not attached to an export yet.
+ * Its socket is non-blocking and watched by the main loop, which reenters the
+ * negotiating coroutine when the socket is ready.
+ */
+static void nbd_negotiate_restart(void *opaque)
+{
+    NBDClient *client = opaque;
+
+    qemu_coroutine_enter(client->recv_coroutine, NULL);
+}
+
+static int coroutine_fn nbd_negotiate_io(NBDClient *client, void *buf,
+                                         int len, bool do_send)
+{
+    int ret;
+
+    if (do_send) {
+        qemu_set_fd_handler2(client->sock, NULL, NULL, nbd_negotiate_restart,
+                             client);
+        ret = qemu_co_send(client->sock, buf, len);
+    } else {
+        qemu_set_fd_handler2(client->sock, NULL, nbd_negotiate_restart, NULL,
+                             client);
+        ret = qemu_co_recv(client->sock, buf, len);
+    }
+    qemu_set_fd_handler2(client->sock, NULL, NULL, NULL, NULL);
+
+    return ret == len ? 0 : -EIO;
+}
+
+/* New-style negotiation: the client picks one of the named exports */
+static NBDExport *coroutine_fn nbd_negotiate_export_name(NBDClient *client)
+{
+    char buf[8 + 8 + 2];
+    char reply[8 + 2 + 124];
+    uint32_t client_flags;
+    uint64_t magic;
+    uint32_t opt;
+    uint32_t length;
+    char name[256];
+    NBDExport *exp;
+
+    /* Negotiate
+        [ 0 ..   7]   passwd   ("NBDMAGIC")
+        [ 8 ..  15]   magic    (NBD_OPTS_MAGIC)
+        [16 ..  17]   server flags (0)
+     */
+    memcpy(buf, "NBDMAGIC", 8);
+    cpu_to_be64w((uint64_t*)(buf + 8), NBD_OPTS_MAGIC);
+    cpu_to_be16w((uint16_t*)(buf + 16), 0);
+    if (nbd_negotiate_io(client, buf, sizeof(buf), true) < 0) {
+        LOG("write failed");
+        return NULL;
+    }
+
+    /* Client flags, then the option
+        [ 0 ..   3]   client flags
+        [ 4 ..  11]   magic    (NBD_OPTS_MAGIC)
+        [12 ..  15]   option   (NBD_OPT_EXPORT_NAME)
+        [16 ..  19]   length
+        [20 ..    ]   export name
+     */
+    if (nbd_negotiate_io(client, &client_flags, sizeof(client_flags),
+                         false) < 0) {
+        LOG("read failed (client flags)");
+        return NULL;
+    }
+    if (nbd_negotiate_io(client, &magic, sizeof(magic), false) < 0 ||
+        nbd_negotiate_io(client, &opt, sizeof(opt), false) < 0 ||
+        nbd_negotiate_io(client, &length, sizeof(length), false) < 0) {
+        LOG("read failed (option)");
+        return NULL;
+    }
+    if (be64_to_cpu(magic) != NBD_OPTS_MAGIC) {
+        LOG("Bad magic received");
+        return NULL;
+    }
+    if (be32_to_cpu(opt) != NBD_OPT_EXPORT_NAME) {
+        LOG("Unsupported option 0x%x", be32_to_cpu(opt));
+        return NULL;
+    }
+    length = be32_to_cpu(length);
+    if (length > sizeof(name) - 1) {
+        LOG("Bad length received");
+        return NULL;
+    }
+    if (nbd_negotiate_io(client, name, length, false) < 0) {
+        LOG("read failed (name)");
+        return NULL;
+    }
+    name[length] = '\0';
+
+    exp = nbd_export_find(name);
+    if (!exp) {
+        LOG("Unknown export '%s'", name);
+        return NULL;
+    }
+
+    /* Reply
+        [ 0 ..   7]   size
+        [ 8 ..   9]   export flags
+        [10 .. 133]   reserved (0)
+     */
+    cpu_to_be64w((uint64_t*)reply, exp->size);
+    cpu_to_be16w((uint16_t*)(reply + 8),
+                 nbd_export_flags(exp) | NBD_FLAG_HAS_FLAGS);
+    memset(reply + 10, 0, 124);
+    if (nbd_negotiate_io(client, reply, sizeof(reply), true) < 0) {
+        LOG("write failed");
+        return NULL;
+    }
+
+    /* The export may have been removed while the reply was sent */
+    if (nbd_export_find(name) != exp) {
+        LOG("Export '%s' went away", name);
+        return NULL;
+    }
+    return exp;
+}
+
+static NBDClient *nbd_client_alloc(int csock, void (*close)(NBDClient *))
+{
+    NBDClient *client;
+
+    client = g_malloc0(sizeof(*client));
+    client->refcount = 1;
+    client->sock = csock;
+    client->close = close;
+    qemu_co_mutex_init(&client->send_lock);
+    return client;
+}
+
+/* Start serving the requests of a client that completed negotiation */
+static void nbd_client_attach(NBDClient *client, NBDExport *exp)
+{
+    client->exp = exp;
+    QTAILQ_INSERT_TAIL(&exp->clients, client, next);
+    nbd_set_handlers(client);
+}
+
+/**
+ * Negotiate with a client connected on csock and start serving its
+ * requests.  close is called when the connection goes away.  Returns NULL
+ * if the negotiation failed; csock is not closed in that case.
+ *
+ * The negotiation blocks, so this is meant for a process that does nothing
+ * but serve exp.
+ */
+NBDClient *nbd_client_new(NBDExport *exp, int csock,
+                          void (*close)(NBDClient *))
+{
+    NBDClient *client;
+
+    if (nbd_negotiate(csock, exp->size, nbd_export_flags(exp)) == -1) {
+        return NULL;
+    }
+
+    socket_set_nonblock(csock);
+
+    client = nbd_client_alloc(csock, close);
+    nbd_client_attach(client, exp);
+    return client;
+}
+
+static void coroutine_fn nbd_co_client_negotiate(void *opaque)
+{
+    NBDClient *client = opaque;
+    NBDExport *exp;
+
+    client->recv_coroutine = qemu_coroutine_self();
+    exp = nbd_negotiate_export_name(client);
+    client->recv_coroutine = NULL;
+
+    if (!exp) {
+        close(client->sock);
+        g_free(client);
+        return;
+    }
+    nbd_client_attach(client, exp);
+}
+
+/**
+ * Serve a client connected on csock that chooses among the exports that
+ * were given a name with nbd_export_set_name().  The negotiation runs in a
+ * coroutine without blocking the main loop, so a client that never
+ * completes it cannot stall other work.  csock belongs to the client from
+ * now on and is closed if the negotiation fails.  close is called when the
+ * connection goes away.
+ */
+void nbd_client_new_by_name(int csock, void (*close)(NBDClient *))
+{
+    NBDClient *client = nbd_client_alloc(csock, close);
+    Coroutine *co;
+
+    socket_set_nonblock(csock);
+    co = qemu_coroutine_create(nbd_co_client_negotiate);
+    qemu_coroutine_enter(co, client);
 }
@@ -57,6 +57,12 @@ enum {
 
 #define NBD_DEFAULT_PORT	10809
 
+/* Largest request the server accepts */
+#define NBD_MAX_BUFFER_SIZE     (32 * 1024 * 1024)
+
+/* Default number of requests a server processes in parallel per client */
+#define NBD_DEFAULT_MAX_REQUESTS 16
+
 size_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int tcp_socket_outgoing(const char *address, uint16_t port);
 int tcp_socket_incoming(const char *address, uint16_t port);
@@ -71,9 +77,24 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
 int nbd_init(int fd, int csock, uint32_t flags, off_t size, size_t blocksize);
 int nbd_send_request(int csock, struct nbd_request *request);
 int nbd_receive_reply(int csock, struct nbd_reply *reply);
-int nbd_trip(BlockDriverState *bs, int csock, off_t size, uint64_t dev_offset,
-             off_t *offset, uint32_t nbdflags, uint8_t *data, int data_size);
 int nbd_client(int fd);
 int nbd_disconnect(int fd);
 
+typedef struct NBDExport NBDExport;
+typedef struct NBDClient NBDClient;
+
+NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
+                          off_t size, uint32_t nbdflags, int max_requests,
+                          bool poll_idle);
+void nbd_export_close(NBDExport *exp);
+BlockDriverState *nbd_export_get_blockdev(NBDExport *exp);
+void nbd_export_set_name(NBDExport *exp, const char *name);
+NBDExport *nbd_export_find(const char *name);
+
+NBDClient *nbd_client_new(NBDExport *exp, int csock,
+                          void (*close)(NBDClient *));
+void nbd_client_new_by_name(int csock, void (*close)(NBDClient *));
+void nbd_client_close(NBDClient *client);
+NBDExport *nbd_client_get_export(NBDClient *client);
+
 #endif
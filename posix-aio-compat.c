@@ -28,9 +28,22 @@
 #include "trace.h"
 #include "block_int.h"
 
+#include "qmp-commands.h"
+
+#ifdef CONFIG_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 #include "block/raw-posix-aio.h"
 
-static void do_spawn_thread(void);
+/*
+ * Requests are spread over several queues by file descriptor, so that each
+ * drive has its own queue, lock and workers instead of every I/O thread and
+ * vCPU contending on a single pool lock.
+ */
+#define PAIO_NR_QUEUES 16
+
+typedef struct PaioQueue PaioQueue;
 
 struct qemu_paiocb {
     BlockDriverAIOCB common;
@@ -38,36 +51,81 @@ struct qemu_paiocb {
     union {
         struct iovec *aio_iov;
         void *aio_ioctl_buf;
+        void *aio_func_opaque;
     };
+    int (*aio_func)(void *opaque);  /* for QEMU_AIO_CALL */
     int aio_niov;
     size_t aio_nbytes;
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
 
+    /* on the queue's request_list, then on the done list of PosixAioState */
     QTAILQ_ENTRY(qemu_paiocb) node;
     int aio_type;
     ssize_t ret;
     int active;
-    struct qemu_paiocb *next;
+    bool cancelled;
+    PaioQueue *queue;
+    struct qemu_paiocb *next;   /* on completed_list */
+    PaioBouncePool *bounce_pool;
+    void *bounce_buf;           /* aligned copy of a misaligned request */
+};
+
+struct PaioQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    QTAILQ_HEAD(, qemu_paiocb) request_list;
+    int nr_queued;
+    int cur_threads;
+    int idle_threads;
+    int new_threads;            /* backlog of threads we need to create */
+    int pending_threads;        /* threads created but not running yet */
+};
+
+/*
+ * Misaligned requests on O_DIRECT files are copied through an aligned buffer.
+ * Each drive keeps the buffers it used in power of two size classes, so that
+ * guests that keep sending misaligned requests do not allocate and free
+ * memory for every one of them.  The pool is only used by the main thread:
+ * buffers are taken when a request is submitted and given back when it
+ * completes.
+ */
+#define PAIO_BOUNCE_MIN_SHIFT   12      /* 4 KB */
+#define PAIO_BOUNCE_CLASSES     9       /* up to 1 MB */
+#define PAIO_BOUNCE_MAX_CACHED  (4 * 1024 * 1024)
+
+struct PaioBouncePool {
+    BlockDriverState *bs;
+    void *free_list[PAIO_BOUNCE_CLASSES]; /* linked through the buffers */
+    size_t cached;              /* bytes on the free lists */
+    int in_use;                 /* buffers owned by requests */
+    bool closed;
 };
 
 typedef struct PosixAioState {
     int rfd, wfd;
-    struct qemu_paiocb *first_aio;
+    int nr_pending;             /* submitted, callback not run yet */
+    uint64_t nr_completed;
+    QTAILQ_HEAD(, qemu_paiocb) done;
 } PosixAioState;
 
 
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static PosixAioState *posix_aio_state;
+static PaioQueue queues[PAIO_NR_QUEUES];
 static pthread_t thread_id;
 static pthread_attr_t attr;
+static int min_threads = 0;     /* per queue, never time out */
 static int max_threads = 64;
-static int cur_threads = 0;
-static int idle_threads = 0;
-static int new_threads = 0;     /* backlog of threads we need to create */
-static int pending_threads = 0; /* threads created but not running yet */
+static int idle_timeout = 10;   /* seconds */
+static int total_threads = 0;
+static int peak_threads = 0;
 static QEMUBH *new_thread_bh;
-static QTAILQ_HEAD(, qemu_paiocb) request_list;
+
+/*
+ * Workers push finished requests here without taking any lock, the main
+ * thread takes the whole list at once.
+ */
+static struct qemu_paiocb *completed_list;
 
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
@@ -276,7 +334,10 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
      * Ok, we have to do it the hard way, copy all segments into
      * a single aligned buffer.
      */
-    buf = qemu_blockalign(aiocb->common.bs, aiocb->aio_nbytes);
+    buf = aiocb->bounce_buf;
+    if (!buf) {
+        buf = qemu_blockalign(aiocb->common.bs, aiocb->aio_nbytes);
+    }
     if (aiocb->aio_type & QEMU_AIO_WRITE) {
         char *p = buf;
         int i;
@@ -302,19 +363,42 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
             count -= copy;
         }
     }
-    qemu_vfree(buf);
+    if (buf != aiocb->bounce_buf) {
+        qemu_vfree(buf);
+    }
 
     return nbytes;
 }
 
 static void posix_aio_notify_event(void);
 
-static void *aio_thread(void *unused)
+static void do_spawn_thread(PaioQueue *q);
+
+/* Publish a finished request to the main thread */
+static void paio_complete(struct qemu_paiocb *aiocb, ssize_t ret)
+{
+    struct qemu_paiocb *old;
+
+    aiocb->ret = ret;
+    do {
+        old = completed_list;
+        aiocb->next = old;
+    } while (!__sync_bool_compare_and_swap(&completed_list, old, aiocb));
+
+    /* If the list was not empty, the main thread was already woken up */
+    if (!old) {
+        posix_aio_notify_event();
+    }
+}
+
+static void *aio_thread(void *opaque)
 {
-    mutex_lock(&lock);
-    pending_threads--;
-    mutex_unlock(&lock);
-    do_spawn_thread();
+    PaioQueue *q = opaque;
+
+    mutex_lock(&q->lock);
+    q->pending_threads--;
+    mutex_unlock(&q->lock);
+    do_spawn_thread(q);
 
     while (1) {
         struct qemu_paiocb *aiocb;
@@ -323,25 +407,31 @@ static void *aio_thread(void *unused)
         struct timespec ts;
 
         qemu_gettimeofday(&tv);
-        ts.tv_sec = tv.tv_sec + 10;
+        ts.tv_sec = tv.tv_sec + idle_timeout;
         ts.tv_nsec = 0;
 
-        mutex_lock(&lock);
+        mutex_lock(&q->lock);
 
-        while (QTAILQ_EMPTY(&request_list) &&
+        while (QTAILQ_EMPTY(&q->request_list) &&
                !(ret == ETIMEDOUT)) {
-            idle_threads++;
-            ret = cond_timedwait(&cond, &lock, &ts);
-            idle_threads--;
+            q->idle_threads++;
+            ret = cond_timedwait(&q->cond, &q->lock, &ts);
+            q->idle_threads--;
         }
 
-        if (QTAILQ_EMPTY(&request_list))
-            break;
+        if (QTAILQ_EMPTY(&q->request_list)) {
+            if (q->cur_threads > min_threads) {
+                break;
+            }
+            mutex_unlock(&q->lock);
+            continue;
+        }
 
-        aiocb = QTAILQ_FIRST(&request_list);
-        QTAILQ_REMOVE(&request_list, aiocb, node);
+        aiocb = QTAILQ_FIRST(&q->request_list);
+        QTAILQ_REMOVE(&q->request_list, aiocb, node);
+        q->nr_queued--;
         aiocb->active = 1;
-        mutex_unlock(&lock);
+        mutex_unlock(&q->lock);
 
         switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
         case QEMU_AIO_READ:
@@ -367,58 +457,84 @@ static void *aio_thread(void *unused)
         case QEMU_AIO_IOCTL:
             ret = handle_aiocb_ioctl(aiocb);
             break;
+        case QEMU_AIO_CALL:
+            ret = aiocb->aio_func(aiocb->aio_func_opaque);
+            break;
         default:
             fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
             ret = -EINVAL;
             break;
         }
 
-        mutex_lock(&lock);
-        aiocb->ret = ret;
-        mutex_unlock(&lock);
-
-        posix_aio_notify_event();
+        paio_complete(aiocb, ret);
     }
 
-    cur_threads--;
-    mutex_unlock(&lock);
+    q->cur_threads--;
+    mutex_unlock(&q->lock);
+    __sync_fetch_and_sub(&total_threads, 1);
 
     return NULL;
 }
 
-static void do_spawn_thread(void)
+static void do_spawn_thread(PaioQueue *q)
 {
     sigset_t set, oldset;
 
-    mutex_lock(&lock);
-    if (!new_threads) {
-        mutex_unlock(&lock);
+    mutex_lock(&q->lock);
+    if (!q->new_threads) {
+        mutex_unlock(&q->lock);
         return;
     }
 
-    new_threads--;
-    pending_threads++;
+    q->new_threads--;
+    q->pending_threads++;
 
-    mutex_unlock(&lock);
+    mutex_unlock(&q->lock);
 
     /* block all signals */
     if (sigfillset(&set)) die("sigfillset");
     if (sigprocmask(SIG_SETMASK, &set, &oldset)) die("sigprocmask");
 
-    thread_create(&thread_id, &attr, aio_thread, NULL);
+    thread_create(&thread_id, &attr, aio_thread, q);
 
     if (sigprocmask(SIG_SETMASK, &oldset, NULL)) die("sigprocmask restore");
 }
 
 static void spawn_thread_bh_fn(void *opaque)
 {
-    do_spawn_thread();
+    int i;
+
+    for (i = 0; i < PAIO_NR_QUEUES; i++) {
+        do_spawn_thread(&queues[i]);
+    }
 }
 
-static void spawn_thread(void)
+/*
+ * Account for a new worker against max_threads.  A queue without any worker
+ * always gets one, otherwise busy drives could starve an idle one.
+ */
+static bool reserve_thread(PaioQueue *q)
 {
-    cur_threads++;
-    new_threads++;
+    int n;
+
+    do {
+        n = total_threads;
+        if (n >= max_threads && q->cur_threads > 0) {
+            return false;
+        }
+    } while (!__sync_bool_compare_and_swap(&total_threads, n, n + 1));
+
+    if (n + 1 > peak_threads) {
+        peak_threads = n + 1;
+    }
+    return true;
+}
+
+/* Called with q->lock held */
+static void spawn_thread(PaioQueue *q)
+{
+    q->cur_threads++;
+    q->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
      * starving the current vcpu.
@@ -426,91 +542,188 @@ static void spawn_thread(void)
      * If there are no idle threads, ask the main thread to create one, so we
      * inherit the correct affinity instead of the vcpu affinity.
      */
-    if (!pending_threads) {
+    if (!q->pending_threads) {
         qemu_bh_schedule(new_thread_bh);
     }
 }
 
 static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
+    PaioQueue *q = &queues[aiocb->aio_fildes % PAIO_NR_QUEUES];
+
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
-    mutex_lock(&lock);
-    if (idle_threads == 0 && cur_threads < max_threads)
-        spawn_thread();
-    QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
-    mutex_unlock(&lock);
-    cond_signal(&cond);
+    aiocb->cancelled = false;
+    aiocb->queue = q;
+    posix_aio_state->nr_pending++;
+
+    mutex_lock(&q->lock);
+    if (q->idle_threads == 0 && reserve_thread(q))
+        spawn_thread(q);
+    QTAILQ_INSERT_TAIL(&q->request_list, aiocb, node);
+    q->nr_queued++;
+    mutex_unlock(&q->lock);
+    cond_signal(&q->cond);
 }
 
 static ssize_t qemu_paio_return(struct qemu_paiocb *aiocb)
 {
-    ssize_t ret;
+    /* Written by the worker before it publishes the request */
+    return *(volatile ssize_t *)&aiocb->ret;
+}
 
-    mutex_lock(&lock);
-    ret = aiocb->ret;
-    mutex_unlock(&lock);
+PaioBouncePool *paio_bounce_pool_new(BlockDriverState *bs)
+{
+    PaioBouncePool *pool = g_malloc0(sizeof(*pool));
 
-    return ret;
+    pool->bs = bs;
+    return pool;
 }
 
-static int qemu_paio_error(struct qemu_paiocb *aiocb)
+static void bounce_pool_drop_cached(PaioBouncePool *pool)
 {
-    ssize_t ret = qemu_paio_return(aiocb);
+    int i;
 
-    if (ret < 0)
-        ret = -ret;
-    else
-        ret = 0;
+    for (i = 0; i < PAIO_BOUNCE_CLASSES; i++) {
+        while (pool->free_list[i]) {
+            void *buf = pool->free_list[i];
 
-    return ret;
+            pool->free_list[i] = *(void **)buf;
+            qemu_vfree(buf);
+        }
+    }
+    pool->cached = 0;
+}
+
+/* Buffers still used by requests are freed when those complete */
+void paio_bounce_pool_free(PaioBouncePool *pool)
+{
+    if (!pool) {
+        return;
+    }
+    bounce_pool_drop_cached(pool);
+    if (pool->in_use) {
+        pool->closed = true;
+    } else {
+        g_free(pool);
+    }
+}
+
+/* Size class of a request, or -1 if it is too large to be cached */
+static int bounce_pool_class(size_t size)
+{
+    int i;
+
+    for (i = 0; i < PAIO_BOUNCE_CLASSES; i++) {
+        if (size <= ((size_t)1 << (PAIO_BOUNCE_MIN_SHIFT + i))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void *bounce_pool_get(PaioBouncePool *pool, size_t size)
+{
+    int i = bounce_pool_class(size);
+    void *buf;
+
+    pool->in_use++;
+    if (i < 0) {
+        return qemu_blockalign(pool->bs, size);
+    }
+
+    buf = pool->free_list[i];
+    if (buf) {
+        pool->free_list[i] = *(void **)buf;
+        pool->cached -= (size_t)1 << (PAIO_BOUNCE_MIN_SHIFT + i);
+        return buf;
+    }
+    return qemu_blockalign(pool->bs, (size_t)1 << (PAIO_BOUNCE_MIN_SHIFT + i));
+}
+
+static void bounce_pool_put(PaioBouncePool *pool, void *buf, size_t size)
+{
+    int i = bounce_pool_class(size);
+    size_t class_size = (size_t)1 << (PAIO_BOUNCE_MIN_SHIFT + i);
+
+    pool->in_use--;
+    if (pool->closed || i < 0 ||
+        pool->cached + class_size > PAIO_BOUNCE_MAX_CACHED) {
+        qemu_vfree(buf);
+        if (pool->closed && !pool->in_use) {
+            g_free(pool);
+        }
+        return;
+    }
+
+    *(void **)buf = pool->free_list[i];
+    pool->free_list[i] = buf;
+    pool->cached += class_size;
+}
+
+static void paio_put_bounce_buf(struct qemu_paiocb *acb)
+{
+    if (acb->bounce_buf) {
+        bounce_pool_put(acb->bounce_pool, acb->bounce_buf, acb->aio_nbytes);
+        acb->bounce_buf = NULL;
+    }
+}
+
+static void paio_release(struct qemu_paiocb *acb)
+{
+    paio_put_bounce_buf(acb);
+    qemu_aio_release(acb);
 }
 
 static int posix_aio_process_queue(void *opaque)
 {
     PosixAioState *s = opaque;
-    struct qemu_paiocb *acb, **pacb;
+    struct qemu_paiocb *acb, *list, *next, *oldest = NULL;
     int ret;
     int result = 0;
 
-    for(;;) {
-        pacb = &s->first_aio;
-        for(;;) {
-            acb = *pacb;
-            if (!acb)
-                return result;
-
-            ret = qemu_paio_error(acb);
-            if (ret == ECANCELED) {
-                /* remove the request */
-                *pacb = acb->next;
-                qemu_aio_release(acb);
-                result = 1;
-            } else if (ret != EINPROGRESS) {
-                /* end of aio */
-                if (ret == 0) {
-                    ret = qemu_paio_return(acb);
-                    if (ret == acb->aio_nbytes)
-                        ret = 0;
-                    else
-                        ret = -EINVAL;
-                } else {
-                    ret = -ret;
-                }
-
-                trace_paio_complete(acb, acb->common.opaque, ret);
-
-                /* remove the request */
-                *pacb = acb->next;
-                /* call the callback */
-                acb->common.cb(acb->common.opaque, ret);
-                qemu_aio_release(acb);
-                result = 1;
-                break;
-            } else {
-                pacb = &acb->next;
-            }
+    /* Take what the workers completed and append it oldest first */
+    do {
+        list = completed_list;
+    } while (list && !__sync_bool_compare_and_swap(&completed_list, list, NULL));
+
+    for (acb = list; acb; acb = next) {
+        next = acb->next;
+        acb->next = oldest;
+        oldest = acb;
+    }
+    for (acb = oldest; acb; acb = acb->next) {
+        QTAILQ_INSERT_TAIL(&s->done, acb, node);
+    }
+
+    /* Callbacks may run a nested event loop, which continues here */
+    while ((acb = QTAILQ_FIRST(&s->done))) {
+        QTAILQ_REMOVE(&s->done, acb, node);
+        s->nr_pending--;
+        s->nr_completed++;
+        result = 1;
+
+        if (acb->cancelled) {
+            paio_release(acb);
+            continue;
+        }
+
+        /* Requests submitted by the callback can use the buffer again */
+        paio_put_bounce_buf(acb);
+
+        ret = acb->ret;
+        if (ret >= 0) {
+            if (ret == acb->aio_nbytes)
+                ret = 0;
+            else
+                ret = -EINVAL;
         }
+
+        trace_paio_complete(acb, acb->common.opaque, ret);
+
+        /* call the callback */
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_release(acb);
     }
 
     return result;
@@ -521,7 +734,7 @@ static void posix_aio_read(void *opaque)
     PosixAioState *s = opaque;
     ssize_t len;
 
-    /* read all bytes from signal pipe */
+    /* read all bytes from the eventfd or signal pipe */
     for (;;) {
         char bytes[16];
 
@@ -539,64 +752,51 @@ static void posix_aio_read(void *opaque)
 static int posix_aio_flush(void *opaque)
 {
     PosixAioState *s = opaque;
-    return !!s->first_aio;
+    return s->nr_pending > 0;
 }
 
-static PosixAioState *posix_aio_state;
-
 static void posix_aio_notify_event(void)
 {
-    char byte = 0;
+    /* eventfd needs 8 bytes, a pipe does not care */
+    uint64_t value = 1;
     ssize_t ret;
 
-    ret = write(posix_aio_state->wfd, &byte, sizeof(byte));
+    ret = write(posix_aio_state->wfd, &value, sizeof(value));
     if (ret < 0 && errno != EAGAIN)
         die("write()");
 }
 
-static void paio_remove(struct qemu_paiocb *acb)
-{
-    struct qemu_paiocb **pacb;
-
-    /* remove the callback from the queue */
-    pacb = &posix_aio_state->first_aio;
-    for(;;) {
-        if (*pacb == NULL) {
-            fprintf(stderr, "paio_remove: aio request not found!\n");
-            break;
-        } else if (*pacb == acb) {
-            *pacb = acb->next;
-            qemu_aio_release(acb);
-            break;
-        }
-        pacb = &(*pacb)->next;
-    }
-}
-
 static void paio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_paiocb *acb = (struct qemu_paiocb *)blockacb;
+    PaioQueue *q = acb->queue;
     int active = 0;
 
     trace_paio_cancel(acb, acb->common.opaque);
 
-    mutex_lock(&lock);
+    mutex_lock(&q->lock);
     if (!acb->active) {
-        QTAILQ_REMOVE(&request_list, acb, node);
-        acb->ret = -ECANCELED;
-    } else if (acb->ret == -EINPROGRESS) {
+        QTAILQ_REMOVE(&q->request_list, acb, node);
+        q->nr_queued--;
+    } else {
         active = 1;
     }
-    mutex_unlock(&lock);
+    mutex_unlock(&q->lock);
 
-    if (active) {
-        /* fail safe: if the aio could not be canceled, we wait for
-           it */
-        while (qemu_paio_error(acb) == EINPROGRESS)
-            ;
+    if (!active) {
+        posix_aio_state->nr_pending--;
+        paio_release(acb);
+        return;
     }
 
-    paio_remove(acb);
+    /* fail safe: if the aio could not be canceled, we wait for
+       it */
+    while (qemu_paio_return(acb) == -EINPROGRESS)
+        ;
+
+    /* The request is (or is about to be) on the completed list, it is
+     * released there without calling the callback */
+    acb->cancelled = true;
 }
 
 static AIOPool raw_aio_pool = {
@@ -606,7 +806,8 @@ static AIOPool raw_aio_pool = {
 
 BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
-        BlockDriverCompletionFunc *cb, void *opaque, int type)
+        BlockDriverCompletionFunc *cb, void *opaque, int type,
+        PaioBouncePool *bounce_pool)
 {
     struct qemu_paiocb *acb;
 
@@ -623,8 +824,11 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     acb->aio_nbytes = nb_sectors * 512;
     acb->aio_offset = sector_num * 512;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
+    acb->bounce_pool = bounce_pool;
+    acb->bounce_buf = NULL;
+    if ((type & QEMU_AIO_MISALIGNED) && bounce_pool) {
+        acb->bounce_buf = bounce_pool_get(bounce_pool, acb->aio_nbytes);
+    }
 
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
     qemu_paio_submit(acb);
@@ -645,27 +849,120 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
     acb->aio_offset = 0;
     acb->aio_ioctl_buf = buf;
     acb->aio_ioctl_cmd = req;
+    acb->bounce_buf = NULL;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
+    qemu_paio_submit(acb);
+    return &acb->common;
+}
+
+/*
+ * Run func(func_opaque) on a worker thread, for CPU intensive work like
+ * decompression.  func returns 0 or a negative errno, which is passed to cb.
+ * Calls are spread over all queues so that they can run in parallel.
+ */
+BlockDriverAIOCB *paio_call(BlockDriverState *bs, int (*func)(void *),
+        void *func_opaque, BlockDriverCompletionFunc *cb, void *opaque)
+{
+    static unsigned int next_queue;
+    struct qemu_paiocb *acb;
+
+    acb = qemu_aio_get(&raw_aio_pool, bs, cb, opaque);
+    if (!acb)
+        return NULL;
+    acb->aio_type = QEMU_AIO_CALL;
+    acb->aio_fildes = next_queue++ % PAIO_NR_QUEUES;
+    acb->aio_offset = 0;
+    acb->aio_nbytes = 0;
+    acb->aio_func = func;
+    acb->aio_func_opaque = func_opaque;
+    acb->bounce_buf = NULL;
 
     qemu_paio_submit(acb);
     return &acb->common;
 }
 
+/*
+ * Set the pool limits, before the first request is submitted.  min_threads
+ * workers per queue never exit, the others exit after idle_timeout seconds
+ * without requests.  The workers kept by all queues must fit in max_threads.
+ * Negative values leave the respective setting unchanged.
+ */
+int paio_configure(int min, int max, int timeout)
+{
+    if (max == 0 || timeout == 0) {
+        return -EINVAL;
+    }
+    if (min < 0) {
+        min = min_threads;
+    }
+    if (max < 0) {
+        max = max_threads;
+    }
+    if (min > max / PAIO_NR_QUEUES) {
+        return -EINVAL;
+    }
+    if (posix_aio_state) {
+        return -EBUSY;
+    }
+
+    min_threads = min;
+    max_threads = max;
+    if (timeout > 0) {
+        idle_timeout = timeout;
+    }
+    return 0;
+}
+
+AioPoolInfo *qmp_query_aio_pool(Error **errp)
+{
+    AioPoolInfo *info = g_malloc0(sizeof(*info));
+    int i;
+
+    info->peak_threads = peak_threads;
+    info->min_threads = min_threads;
+    info->max_threads = max_threads;
+    info->idle_timeout = idle_timeout;
+    info->queues = PAIO_NR_QUEUES;
+
+    /* The queues are only initialized with the first raw image */
+    if (!posix_aio_state) {
+        return info;
+    }
+
+    for (i = 0; i < PAIO_NR_QUEUES; i++) {
+        PaioQueue *q = &queues[i];
+
+        mutex_lock(&q->lock);
+        info->threads += q->cur_threads;
+        info->idle_threads += q->idle_threads;
+        info->queued += q->nr_queued;
+        mutex_unlock(&q->lock);
+    }
+    info->pending = posix_aio_state->nr_pending;
+    info->completed = posix_aio_state->nr_completed;
+    return info;
+}
+
 int paio_init(void)
 {
     PosixAioState *s;
     int fds[2];
     int ret;
+    int i, j;
 
     if (posix_aio_state)
         return 0;
 
-    s = g_malloc(sizeof(PosixAioState));
+    s = g_malloc0(sizeof(PosixAioState));
+    QTAILQ_INIT(&s->done);
 
-    s->first_aio = NULL;
-    if (qemu_pipe(fds) == -1) {
+#ifdef CONFIG_EVENTFD
+    /* one eventfd serves as both ends of the signal pipe */
+    fds[0] = fds[1] = eventfd(0, 0);
+#else
+    fds[0] = -1;
+#endif
+    if (fds[0] == -1 && qemu_pipe(fds) == -1) {
         fprintf(stderr, "failed to create pipe\n");
         g_free(s);
         return -1;
@@ -688,9 +985,24 @@ int paio_init(void)
     if (ret)
         die2(ret, "pthread_attr_setdetachstate");
 
-    QTAILQ_INIT(&request_list);
     new_thread_bh = qemu_bh_new(spawn_thread_bh_fn, NULL);
 
+    for (i = 0; i < PAIO_NR_QUEUES; i++) {
+        PaioQueue *q = &queues[i];
+
+        ret = pthread_mutex_init(&q->lock, NULL);
+        if (ret)
+            die2(ret, "pthread_mutex_init");
+        ret = pthread_cond_init(&q->cond, NULL);
+        if (ret)
+            die2(ret, "pthread_cond_init");
+        QTAILQ_INIT(&q->request_list);
+
+        for (j = 0; j < min_threads && reserve_thread(q); j++) {
+            spawn_thread(q);
+        }
+    }
+
     posix_aio_state = s;
     return 0;
 }
@@ -7,12 +7,15 @@
 #if defined(__i386__) || defined(__x86_64__)
 
 /*
- * Because of the strongly ordered x86 storage model, wmb() is a nop
- * on x86(well, a compiler barrier only).  Well, at least as long as
+ * Because of the strongly ordered x86 storage model, wmb() and rmb() are
+ * nops on x86(well, a compiler barrier only).  Well, at least as long as
  * qemu doesn't do accesses to write-combining memory or non-temporal
- * load/stores from C code.
+ * load/stores from C code.  Only a store followed by a load needs a real
+ * fence.
  */
 #define smp_wmb()   barrier()
+#define smp_rmb()   barrier()
+#define smp_mb()    __sync_synchronize()
 
 #elif defined(_ARCH_PPC)
 
@@ -22,6 +25,8 @@
  * each other
  */
 #define smp_wmb()   asm volatile("eieio" ::: "memory")
+#define smp_rmb()   asm volatile("sync" ::: "memory")
+#define smp_mb()    asm volatile("sync" ::: "memory")
 
 #else
 
@@ -32,6 +37,8 @@
  * be overkill.
  */
 #define smp_wmb()   __sync_synchronize()
+#define smp_rmb()   __sync_synchronize()
+#define smp_mb()    __sync_synchronize()
 
 #endif
 
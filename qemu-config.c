@@ -89,6 +89,30 @@ static QemuOptsList qemu_drive_opts = {
             .name = "boot",
             .type = QEMU_OPT_BOOL,
             .help = "(deprecated, ignored)",
+        },{
+            .name = "bps",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit total bytes per second",
+        },{
+            .name = "bps_rd",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit read bytes per second",
+        },{
+            .name = "bps_wr",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit write bytes per second",
+        },{
+            .name = "iops",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit total I/O operations per second",
+        },{
+            .name = "iops_rd",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit read operations per second",
+        },{
+            .name = "iops_wr",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit write operations per second",
         },
         { /* end of list */ }
     },
@@ -280,6 +304,24 @@ static QemuOptsList qemu_rtc_opts = {
     },
 };
 
+static QemuOptsList qemu_aio_pool_opts = {
+    .name = "aio-pool",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_aio_pool_opts.head),
+    .desc = {
+        {
+            .name = "min-threads",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "max-threads",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "idle-timeout",
+            .type = QEMU_OPT_NUMBER,
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_global_opts = {
     .name = "global",
     .head = QTAILQ_HEAD_INITIALIZER(qemu_global_opts.head),
@@ -539,6 +581,7 @@ static QemuOptsList *vm_config_groups[32] = {
     &qemu_option_rom_opts,
     &qemu_machine_opts,
     &qemu_boot_opts,
+    &qemu_aio_pool_opts,
     NULL,
 };
 
@@ -0,0 +1,103 @@
+/*
+ * Coroutine-aware socket I/O
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "qemu-common.h"
+#include "qemu_socket.h"
+#include "qemu-coroutine.h"
+
+static int coroutine_fn qemu_co_send_recv(int sockfd, void *buf, int bytes,
+                                          bool do_send)
+{
+    int done = 0;
+
+    while (done < bytes) {
+        int ret;
+
+        if (do_send) {
+            ret = send(sockfd, buf + done, bytes - done, 0);
+        } else {
+            ret = qemu_recv(sockfd, buf + done, bytes - done, 0);
+        }
+
+        if (ret < 0) {
+            int err = socket_error();
+
+            if (err == EINTR) {
+                continue;
+            }
+            if (err == EAGAIN || err == EWOULDBLOCK) {
+                qemu_coroutine_yield();
+                continue;
+            }
+            return done ? done : -err;
+        }
+
+        if (ret == 0) {
+            /* eof */
+            break;
+        }
+
+        done += ret;
+    }
+
+    return done;
+}
+
+int coroutine_fn qemu_co_recv(int sockfd, void *buf, int bytes)
+{
+    return qemu_co_send_recv(sockfd, buf, bytes, false);
+}
+
+int coroutine_fn qemu_co_send(int sockfd, void *buf, int bytes)
+{
+    return qemu_co_send_recv(sockfd, buf, bytes, true);
+}
+
+static int coroutine_fn qemu_co_sendv_recvv(int sockfd, struct iovec *iov,
+                                            int iovcnt, bool do_send)
+{
+    int done = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        int ret = qemu_co_send_recv(sockfd, iov[i].iov_base, iov[i].iov_len,
+                                    do_send);
+        if (ret < 0) {
+            return done ? done : ret;
+        }
+        done += ret;
+        if (ret != iov[i].iov_len) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+int coroutine_fn qemu_co_recvv(int sockfd, struct iovec *iov, int iovcnt)
+{
+    return qemu_co_sendv_recvv(sockfd, iov, iovcnt, false);
+}
+
+int coroutine_fn qemu_co_sendv(int sockfd, struct iovec *iov, int iovcnt)
+{
+    return qemu_co_sendv_recvv(sockfd, iov, iovcnt, true);
+}
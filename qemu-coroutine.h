@@ -117,6 +117,12 @@ void qemu_co_queue_init(CoQueue *queue);
  */
 void coroutine_fn qemu_co_queue_wait(CoQueue *queue);
 
+/**
+ * Adds the current coroutine to the head of the CoQueue and transfers control
+ * to the caller of the coroutine.
+ */
+void coroutine_fn qemu_co_queue_wait_insert_head(CoQueue *queue);
+
 /**
  * Restarts the next coroutine in the CoQueue and removes it from the queue.
  *
@@ -188,4 +194,28 @@ void qemu_co_rwlock_wrlock(CoRwlock *lock);
  */
 void qemu_co_rwlock_unlock(CoRwlock *lock);
 
+/**
+ * Receives bytes bytes from the non-blocking socket sockfd.  Whenever the
+ * socket has no data, control is transferred to the caller of the current
+ * coroutine; whoever watches the socket must reenter the coroutine once it
+ * becomes readable.
+ *
+ * Returns the number of bytes received, which is less than bytes only on end
+ * of file or error, or -errno if an error occurred before any data arrived.
+ */
+int coroutine_fn qemu_co_recv(int sockfd, void *buf, int bytes);
+
+/**
+ * Sends bytes bytes to the non-blocking socket sockfd, yielding while the
+ * socket is not writable.  The return value is as for qemu_co_recv().
+ */
+int coroutine_fn qemu_co_send(int sockfd, void *buf, int bytes);
+
+/**
+ * Scatter/gather versions of qemu_co_recv() and qemu_co_send(), which
+ * transfer the iovcnt buffers of iov in order.
+ */
+int coroutine_fn qemu_co_recvv(int sockfd, struct iovec *iov, int iovcnt);
+int coroutine_fn qemu_co_sendv(int sockfd, struct iovec *iov, int iovcnt);
+
 #endif /* QEMU_COROUTINE_H */
@@ -27,7 +27,10 @@
 #include "osdep.h"
 #include "sysemu.h"
 #include "block_int.h"
+#include "qemu-thread.h"
+#include "qjson.h"
 #include <stdio.h>
+#include <getopt.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -77,6 +80,11 @@ static void help(void)
            "    name=value format. Use -o ? for an overview of the options supported by the\n"
            "    used format\n"
            "  '-c' indicates that target image must be compressed (qcow format only)\n"
+           "  '-j' is the number of threads compressing clusters in parallel with '-c'\n"
+           "  '-z' is the compression level used with '-c', from 1 (fastest) to 9 (best)\n"
+           "  '-m' is the number of parallel read/write requests used by convert\n"
+           "       (default 8)\n"
+           "  '-W' allows convert to write the target out of order\n"
            "  '-u' enables unsafe rebasing. It is assumed that old and new backing file\n"
            "       match exactly. The image doesn't need a working backing file before\n"
            "       rebasing in this case (useful for renaming the backing file)\n"
@@ -648,18 +656,410 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+/*
+ * Parallel compression for convert -c. The main thread reads clusters in
+ * order and hands them to a pool of worker threads which only compress.
+ * Compressed clusters are written back by the main thread in the order they
+ * were read, so the output has the same layout as with a single thread.
+ */
+typedef struct CompressJob {
+    int64_t sector_num;
+    uint8_t *buf;
+    uint8_t *out_buf;
+    int ret;
+    bool done;
+} CompressJob;
+
+typedef struct CompressPool {
+    BlockDriverState *bs;
+    int level;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    CompressJob *jobs;
+    int nb_jobs;
+    int64_t queued;     /* jobs handed to the workers */
+    int64_t started;    /* jobs picked up by a worker */
+    int64_t written;    /* jobs written to the image, only used by main */
+    int nb_threads;     /* workers still running */
+    bool stop;
+} CompressPool;
+
+static void *compress_worker(void *opaque)
+{
+    CompressPool *pool = opaque;
+    CompressJob *job;
+    int ret;
+
+    qemu_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->started == pool->queued && !pool->stop) {
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->started == pool->queued) {
+            break;
+        }
+        job = &pool->jobs[pool->started++ % pool->nb_jobs];
+        qemu_mutex_unlock(&pool->lock);
+
+        ret = bdrv_compress_cluster(pool->bs, job->buf, job->out_buf,
+                                    pool->level);
+
+        qemu_mutex_lock(&pool->lock);
+        job->ret = ret;
+        job->done = true;
+        qemu_cond_broadcast(&pool->done_cond);
+    }
+    pool->nb_threads--;
+    qemu_cond_broadcast(&pool->done_cond);
+    qemu_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static CompressPool *compress_pool_new(BlockDriverState *bs, int cluster_size,
+                                       int level, int nb_threads)
+{
+    CompressPool *pool = g_malloc0(sizeof(*pool));
+    QemuThread thread;
+    int i;
+
+    pool->bs = bs;
+    pool->level = level;
+    pool->nb_jobs = 2 * nb_threads;
+    pool->jobs = g_malloc0(pool->nb_jobs * sizeof(CompressJob));
+    for (i = 0; i < pool->nb_jobs; i++) {
+        pool->jobs[i].buf = qemu_blockalign(bs, cluster_size);
+        pool->jobs[i].out_buf = g_malloc(cluster_size);
+    }
+
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->work_cond);
+    qemu_cond_init(&pool->done_cond);
+
+    pool->nb_threads = nb_threads;
+    for (i = 0; i < nb_threads; i++) {
+        qemu_thread_create(&thread, compress_worker, pool);
+    }
+    return pool;
+}
+
+static void compress_pool_free(CompressPool *pool)
+{
+    int i;
+
+    qemu_mutex_lock(&pool->lock);
+    pool->stop = true;
+    qemu_cond_broadcast(&pool->work_cond);
+    while (pool->nb_threads > 0) {
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_mutex_destroy(&pool->lock);
+
+    for (i = 0; i < pool->nb_jobs; i++) {
+        qemu_vfree(pool->jobs[i].buf);
+        g_free(pool->jobs[i].out_buf);
+    }
+    g_free(pool->jobs);
+    g_free(pool);
+}
+
+/* Wait for the oldest queued job to be compressed and write it out */
+static int compress_pool_write_one(CompressPool *pool)
+{
+    CompressJob *job = &pool->jobs[pool->written % pool->nb_jobs];
+    int ret;
+
+    qemu_mutex_lock(&pool->lock);
+    while (!job->done) {
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    ret = job->ret;
+    if (ret >= 0) {
+        ret = bdrv_write_compressed_cluster(pool->bs, job->sector_num,
+                                            job->buf, job->out_buf, ret);
+    }
+    if (ret < 0) {
+        error_report("error while compressing sector %" PRId64 ": %s",
+                     job->sector_num, strerror(-ret));
+        return ret;
+    }
+
+    pool->written++;
+    return 0;
+}
+
+/* Return a free job whose buffer can be filled, or NULL on write error */
+static CompressJob *compress_pool_get_job(CompressPool *pool)
+{
+    if (pool->queued - pool->written == pool->nb_jobs) {
+        if (compress_pool_write_one(pool) < 0) {
+            return NULL;
+        }
+    }
+    return &pool->jobs[pool->queued % pool->nb_jobs];
+}
+
+static void compress_pool_queue(CompressPool *pool, CompressJob *job,
+                                int64_t sector_num)
+{
+    qemu_mutex_lock(&pool->lock);
+    job->sector_num = sector_num;
+    job->done = false;
+    pool->queued++;
+    qemu_cond_signal(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+}
+
+/* Write out all queued jobs */
+static int compress_pool_flush(CompressPool *pool)
+{
+    int ret;
+
+    while (pool->written < pool->queued) {
+        ret = compress_pool_write_one(pool);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Pipelined copy for convert. The main loop splits the input into chunks,
+ * skipping ranges that need not be copied, and starts one coroutine per
+ * chunk, keeping up to max_running of them in flight. Unless out of order
+ * writes are allowed, chunks are written in the order they were started.
+ */
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int src_num;
+    BlockDriverState *target;
+    int64_t total_sectors;
+    int64_t sector_num;         /* next sector to schedule */
+    int src_cur;                /* source image containing sector_num */
+    int64_t src_cur_offset;     /* first sector of src_cur in the output */
+    int64_t src_cur_sectors;
+    bool has_zero_init;
+    bool target_has_backing;
+    bool wr_in_order;
+    int min_sparse;
+    int buf_sectors;
+    int running;
+    int max_running;
+    int64_t next_seq;           /* sequence number of next started chunk */
+    int64_t write_seq;          /* chunk allowed to write next */
+    CoQueue write_queue;
+    int ret;
+} ImgConvertState;
+
+typedef struct ImgConvertRequest {
+    ImgConvertState *s;
+    BlockDriverState *bs;
+    int64_t src_sector;
+    int64_t sector_num;
+    int nb_sectors;
+    int64_t seq;
+} ImgConvertRequest;
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret, n, allocated;
+
+    while (nb_sectors > 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        if (!s->has_zero_init || s->target_has_backing) {
+            allocated = 1;
+            n = nb_sectors;
+        } else {
+            allocated = is_allocated_sectors_min(buf, nb_sectors, &n,
+                                                 s->min_sparse);
+        }
+        if (allocated) {
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                return ret;
+            }
+        }
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertRequest *req = opaque;
+    ImgConvertState *s = req->s;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint8_t *buf;
+    int ret;
+
+    buf = qemu_blockalign(s->target, req->nb_sectors * BDRV_SECTOR_SIZE);
+    iov.iov_base = buf;
+    iov.iov_len = req->nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(req->bs, req->src_sector, req->nb_sectors, &qiov);
+    if (ret < 0) {
+        error_report("error while reading sector %" PRId64 ": %s",
+                     req->src_sector, strerror(-ret));
+    }
+
+    if (s->wr_in_order) {
+        while (s->write_seq != req->seq) {
+            qemu_co_queue_wait(&s->write_queue);
+        }
+    }
+
+    if (ret >= 0 && !s->ret) {
+        ret = convert_co_write(s, req->sector_num, req->nb_sectors, buf);
+    }
+
+    if (s->wr_in_order) {
+        s->write_seq++;
+        while (qemu_co_queue_next(&s->write_queue)) {
+            /* wake everyone, the next chunk in sequence picks itself */
+        }
+    }
+
+    if (ret < 0 && !s->ret) {
+        s->ret = ret;
+    }
+    qemu_progress_print(100.0 * req->nb_sectors / s->total_sectors, 100);
+
+    qemu_vfree(buf);
+    g_free(req);
+    s->running--;
+}
+
+/*
+ * Decide what to do with the sectors starting at s->sector_num and either
+ * skip them or start a copy coroutine for them.
+ */
+static int convert_schedule(ImgConvertState *s)
+{
+    BlockDriverState *bs;
+    ImgConvertRequest *req;
+    uint64_t bs_sectors;
+    int64_t src_sector;
+    int n, n1;
+
+    while (s->sector_num - s->src_cur_offset >= s->src_cur_sectors) {
+        s->src_cur++;
+        assert(s->src_cur < s->src_num);
+        s->src_cur_offset += s->src_cur_sectors;
+        bdrv_get_geometry(s->src[s->src_cur], &bs_sectors);
+        s->src_cur_sectors = bs_sectors;
+    }
+
+    bs = s->src[s->src_cur];
+    src_sector = s->sector_num - s->src_cur_offset;
+    n = MIN(s->buf_sectors, s->src_cur_sectors - src_sector);
+
+    if (s->has_zero_init) {
+        /* Sectors which are unallocated in the input image either read as
+           zeros, which the target already contains, or, if both images
+           are copy on write images, are assumed to be present in both
+           the output's and input's base images. Either way there is no
+           need to copy them. Unallocated sectors of an input image without
+           a backing file, e.g. holes in a raw file, are zeros that must
+           be written over the output's base image. */
+        if (s->target_has_backing == (bs->backing_hd != NULL)) {
+            if (!bdrv_is_allocated(bs, src_sector, n, &n1)) {
+                if (n1 <= 0) {
+                    return -EIO;
+                }
+                s->sector_num += n1;
+                qemu_progress_print(100.0 * n1 / s->total_sectors, 100);
+                return 0;
+            }
+            /* The next 'n1' sectors are allocated in the input image. Copy
+               only those as they may be followed by unallocated sectors. */
+            n = n1;
+        }
+    }
+
+    req = g_malloc0(sizeof(*req));
+    req->s = s;
+    req->bs = bs;
+    req->src_sector = src_sector;
+    req->sector_num = s->sector_num;
+    req->nb_sectors = n;
+    req->seq = s->next_seq++;
+
+    s->sector_num += n;
+    s->running++;
+    qemu_coroutine_enter(qemu_coroutine_create(convert_co_do_copy), req);
+    return 0;
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    uint64_t bs_sectors;
+    int ret;
+
+    bdrv_get_geometry(s->src[0], &bs_sectors);
+    s->src_cur_sectors = bs_sectors;
+    qemu_co_queue_init(&s->write_queue);
+
+    while (s->running > 0 ||
+           (s->sector_num < s->total_sectors && !s->ret)) {
+        while (s->running < s->max_running &&
+               s->sector_num < s->total_sectors && !s->ret) {
+            ret = convert_schedule(s);
+            if (ret < 0) {
+                error_report("error while checking allocation status of "
+                             "sector %" PRId64 ": %s",
+                             s->sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+        if (s->running > 0) {
+            qemu_aio_wait();
+        }
+    }
+
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
-    int progress = 0, flags;
+    int c, ret = 0, n, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int progress = 0, flags, compress_threads = 1, compress_level = -1;
+    int num_coroutines = 8;
+    bool wr_in_order = true;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
     int64_t total_sectors, nb_sectors, sector_num, bs_offset;
     uint64_t bs_sectors;
     uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
+    CompressPool *pool = NULL;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
@@ -673,7 +1073,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:j:z:m:W");
         if (c == -1) {
             break;
         }
@@ -694,6 +1094,41 @@ static int img_convert(int argc, char **argv)
         case 'c':
             compress = 1;
             break;
+        case 'j':
+        {
+            char *end;
+            compress_threads = strtol(optarg, &end, 10);
+            if (compress_threads < 1 || compress_threads > 256 || *end) {
+                error_report("Invalid number of compression threads "
+                             "specified");
+                return 1;
+            }
+            break;
+        }
+        case 'z':
+        {
+            char *end;
+            compress_level = strtol(optarg, &end, 10);
+            if (compress_level < 1 || compress_level > 9 || *end) {
+                error_report("Invalid compression level specified");
+                return 1;
+            }
+            break;
+        }
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (num_coroutines < 1 || num_coroutines > 64 || *end) {
+                error_report("Invalid number of parallel requests specified. "
+                             "It must be between 1 and 64.");
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         case 'e':
             error_report("option -e is deprecated, please use \'-o "
                   "encryption\' instead!");
@@ -905,10 +1340,16 @@ static int img_convert(int argc, char **argv)
         local_progress = (float)100 /
             (nb_sectors / MIN(nb_sectors, cluster_sectors));
 
+        if (out_bs->drv->bdrv_compress_cluster) {
+            pool = compress_pool_new(out_bs, cluster_size, compress_level,
+                                     compress_threads);
+        }
+
         for(;;) {
             int64_t bs_num;
             int remainder;
-            uint8_t *buf2;
+            uint8_t *buf2, *cluster_buf;
+            CompressJob *job = NULL;
 
             nb_sectors = total_sectors - sector_num;
             if (nb_sectors <= 0)
@@ -918,10 +1359,21 @@ static int img_convert(int argc, char **argv)
             else
                 n = nb_sectors;
 
+            if (pool) {
+                job = compress_pool_get_job(pool);
+                if (!job) {
+                    ret = -1;
+                    goto out;
+                }
+                cluster_buf = job->buf;
+            } else {
+                cluster_buf = buf;
+            }
+
             bs_num = sector_num - bs_offset;
             assert (bs_num >= 0);
             remainder = n;
-            buf2 = buf;
+            buf2 = cluster_buf;
             while (remainder > 0) {
                 int nlow;
                 while (bs_num == bs_sectors) {
@@ -953,9 +1405,13 @@ static int img_convert(int argc, char **argv)
             assert (remainder == 0);
 
             if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
+                memset(cluster_buf + n * 512, 0, cluster_size - n * 512);
             }
-            if (is_not_zero(buf, cluster_size)) {
+            if (!is_not_zero(cluster_buf, cluster_size)) {
+                /* nothing to write */
+            } else if (pool) {
+                compress_pool_queue(pool, job, sector_num);
+            } else {
                 ret = bdrv_write_compressed(out_bs, sector_num, buf,
                                             cluster_sectors);
                 if (ret != 0) {
@@ -967,99 +1423,39 @@ static int img_convert(int argc, char **argv)
             sector_num += n;
             qemu_progress_print(local_progress, 100);
         }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
+        if (pool) {
+            ret = compress_pool_flush(pool);
             if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
                 goto out;
             }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
         }
+        /* signal EOF to align */
+        bdrv_write_compressed(out_bs, 0, NULL, 0);
+    } else {
+        ImgConvertState state = {
+            .src = bs,
+            .src_num = bs_n,
+            .target = out_bs,
+            .total_sectors = total_sectors,
+            .has_zero_init = bdrv_has_zero_init(out_bs),
+            .target_has_backing = out_baseimg != NULL,
+            .wr_in_order = wr_in_order,
+            .min_sparse = min_sparse,
+            .buf_sectors = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+            .max_running = num_coroutines,
+        };
+
+        qemu_progress_set_size(total_sectors * BDRV_SECTOR_SIZE);
+        ret = convert_do_copy(&state);
     }
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
     qemu_vfree(buf);
+    if (pool) {
+        compress_pool_free(pool);
+    }
     if (out_bs) {
         bdrv_delete(out_bs);
     }
@@ -1096,6 +1492,74 @@ static void dump_snapshots(BlockDriverState *bs)
     g_free(sn_tab);
 }
 
+/* Amount of data moved by one defragmentation step */
+#define DEFRAG_STEP_BYTES (32 * 1024 * 1024)
+
+static int img_defrag(int argc, char **argv)
+{
+    int c, progress = 0;
+    const char *filename, *fmt = NULL;
+    BlockDriverState *bs;
+    int64_t offset = 0, size, ret, moved = 0;
+
+    for(;;) {
+        c = getopt(argc, argv, "f:hp");
+        if (c == -1) {
+            break;
+        }
+        switch(c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'p':
+            progress = 1;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind++];
+
+    bs = bdrv_new_open(filename, fmt, BDRV_O_FLAGS | BDRV_O_RDWR);
+    if (!bs) {
+        return 1;
+    }
+
+    qemu_progress_init(progress, 2.0);
+    qemu_progress_print(0, 100);
+
+    size = bdrv_getlength(bs);
+    ret = 0;
+    while (offset < size) {
+        int64_t start = offset;
+
+        ret = bdrv_defrag(bs, &offset, DEFRAG_STEP_BYTES);
+        if (ret < 0) {
+            break;
+        }
+        moved += ret;
+        qemu_progress_print(100.0 * (offset - start) / size, 100);
+    }
+
+    qemu_progress_end();
+
+    if (ret == -ENOTSUP) {
+        error_report("This image format does not support defragmentation");
+    } else if (ret < 0) {
+        error_report("Error while defragmenting image: %s", strerror(-ret));
+    } else {
+        printf("Moved %" PRId64 " bytes.\n", moved);
+    }
+
+    bdrv_delete(bs);
+    return ret < 0;
+}
+
 static int img_info(int argc, char **argv)
 {
     int c;
@@ -1176,6 +1640,223 @@ static int img_info(int argc, char **argv)
 #define SNAPSHOT_APPLY  3
 #define SNAPSHOT_DELETE 4
 
+#define MAP_EXTENTS 1024
+
+enum {
+    OFORMAT_HUMAN,
+    OFORMAT_JSON,
+};
+
+typedef struct MapEntry {
+    int64_t start;
+    int64_t length;
+    int flags;
+    int depth;
+    BlockDriverState *bs;       /* layer the range was found in */
+    BlockDriverState *file;
+    int64_t offset;
+} MapEntry;
+
+typedef struct MapState {
+    int output_format;
+    int nb_entries;
+    MapEntry curr;
+} MapState;
+
+static void dump_map_entry(MapState *ms, MapEntry *e)
+{
+    switch (ms->output_format) {
+    case OFORMAT_HUMAN:
+        if (!(e->flags & BDRV_EXTENT_DATA)) {
+            break;
+        }
+        if (e->flags & BDRV_EXTENT_OFFSET) {
+            printf("%#-16" PRIx64 "%#-16" PRIx64 "%#-16" PRIx64 "%s\n",
+                   e->start, e->length, e->offset, e->file->filename);
+        } else {
+            /* compressed or encrypted data has no simple host mapping */
+            printf("%#-16" PRIx64 "%#-16" PRIx64 "%-16s%s\n",
+                   e->start, e->length, "-", e->bs->filename);
+        }
+        break;
+    case OFORMAT_JSON:
+        printf("%s{ \"start\": %" PRId64 ", \"length\": %" PRId64 ", "
+               "\"depth\": %d, \"zero\": %s, \"data\": %s",
+               ms->nb_entries ? ",\n" : "",
+               e->start, e->length, e->depth,
+               (e->flags & BDRV_EXTENT_ZERO) ? "true" : "false",
+               (e->flags & BDRV_EXTENT_DATA) ? "true" : "false");
+        if (e->flags & BDRV_EXTENT_OFFSET) {
+            QString *filename = qstring_from_str(e->file->filename);
+            QString *json = qobject_to_json(QOBJECT(filename));
+
+            printf(", \"offset\": %" PRId64 ", \"file\": %s",
+                   e->offset, qstring_get_str(json));
+            QDECREF(json);
+            QDECREF(filename);
+        }
+        printf(" }");
+        break;
+    }
+    ms->nb_entries++;
+}
+
+/* Merge the range into the pending entry, or print that and start anew */
+static void map_add_entry(MapState *ms, MapEntry *e)
+{
+    MapEntry *curr = &ms->curr;
+
+    if (curr->length && curr->start + curr->length == e->start &&
+        curr->flags == e->flags && curr->depth == e->depth &&
+        curr->bs == e->bs && curr->file == e->file &&
+        (!(e->flags & BDRV_EXTENT_OFFSET) ||
+         curr->offset + curr->length == e->offset)) {
+        curr->length += e->length;
+        return;
+    }
+
+    if (curr->length) {
+        dump_map_entry(ms, curr);
+    }
+    *curr = *e;
+}
+
+/*
+ * Describe the sectors starting at sector_num as seen through the backing
+ * chain below bs.  Ranges that are unallocated in a layer are looked up in
+ * its backing file; if no layer has them, they read as zeroes.
+ */
+static int map_chain(MapState *ms, BlockDriverState *bs, int depth,
+                     int64_t sector_num, int64_t nb_sectors)
+{
+    BlockExtent *extents;
+    MapEntry e;
+    int i, n, ret = 0;
+
+    extents = g_malloc(MAP_EXTENTS * sizeof(BlockExtent));
+    while (nb_sectors > 0) {
+        n = bdrv_get_extents(bs, sector_num, nb_sectors, extents,
+                             MAP_EXTENTS);
+        if (n < 0) {
+            error_report("Could not read allocation status of '%s': %s",
+                         bs->filename, strerror(-n));
+            ret = n;
+            break;
+        }
+        if (n == 0) {
+            /* beyond the end of this layer, reads as zeroes */
+            e = (MapEntry) {
+                .start  = sector_num * BDRV_SECTOR_SIZE,
+                .length = nb_sectors * BDRV_SECTOR_SIZE,
+                .flags  = BDRV_EXTENT_ZERO,
+                .depth  = depth,
+                .bs     = bs,
+            };
+            map_add_entry(ms, &e);
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            BlockExtent *ext = &extents[i];
+
+            if (!ext->flags && bs->backing_hd) {
+                ret = map_chain(ms, bs->backing_hd, depth + 1,
+                                ext->sector_num, ext->nb_sectors);
+                if (ret < 0) {
+                    goto out;
+                }
+            } else {
+                e = (MapEntry) {
+                    .start  = ext->sector_num * BDRV_SECTOR_SIZE,
+                    .length = ext->nb_sectors * BDRV_SECTOR_SIZE,
+                    .flags  = ext->flags ? ext->flags : BDRV_EXTENT_ZERO,
+                    .depth  = depth,
+                    .bs     = bs,
+                    .file   = ext->file,
+                    .offset = ext->offset,
+                };
+                map_add_entry(ms, &e);
+            }
+            sector_num += ext->nb_sectors;
+            nb_sectors -= ext->nb_sectors;
+        }
+    }
+
+out:
+    g_free(extents);
+    return ret;
+}
+
+static int img_map(int argc, char **argv)
+{
+    int c, ret;
+    const char *filename, *fmt = NULL;
+    const char *output = NULL;
+    BlockDriverState *bs;
+    MapState ms = { .output_format = OFORMAT_HUMAN };
+    uint64_t total_sectors;
+    static const struct option long_options[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "format", required_argument, NULL, 'f' },
+        { "output", required_argument, NULL, 'O' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    for(;;) {
+        c = getopt_long(argc, argv, "f:h", long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+        switch(c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'O':
+            output = optarg;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind++];
+
+    if (output && !strcmp(output, "json")) {
+        ms.output_format = OFORMAT_JSON;
+    } else if (output && strcmp(output, "human")) {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+
+    bs = bdrv_new_open(filename, fmt, BDRV_O_FLAGS);
+    if (!bs) {
+        return 1;
+    }
+
+    if (ms.output_format == OFORMAT_HUMAN) {
+        printf("%-16s%-16s%-16s%s\n", "Offset", "Length", "Mapped to", "File");
+    } else {
+        printf("[");
+    }
+
+    bdrv_get_geometry(bs, &total_sectors);
+    ret = map_chain(&ms, bs, 0, 0, total_sectors);
+    if (ms.curr.length) {
+        dump_map_entry(&ms, &ms.curr);
+    }
+
+    if (ms.output_format == OFORMAT_JSON) {
+        printf("]\n");
+    }
+
+    bdrv_delete(bs);
+    return ret < 0;
+}
+
 static int img_snapshot(int argc, char **argv)
 {
     BlockDriverState *bs;
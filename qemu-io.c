@@ -15,6 +15,7 @@
 #include <libgen.h>
 
 #include "qemu-common.h"
+#include "qemu-timer.h"
 #include "block_int.h"
 #include "cmd.h"
 
@@ -294,7 +295,8 @@ static void multiwrite_cb(void *opaque, int ret)
     }
 }
 
-static int do_aio_multiwrite(BlockRequest* reqs, int num_reqs, int *total)
+static int do_aio_multi_rw(BlockRequest* reqs, int num_reqs, int *total,
+                           bool is_write)
 {
     int i, ret;
     struct multiwrite_async_ret async_ret = {
@@ -309,7 +311,11 @@ static int do_aio_multiwrite(BlockRequest* reqs, int num_reqs, int *total)
         *total += reqs[i].qiov->size;
     }
 
-    ret = bdrv_aio_multiwrite(bs, reqs, num_reqs);
+    if (is_write) {
+        ret = bdrv_aio_multiwrite(bs, reqs, num_reqs);
+    } else {
+        ret = bdrv_aio_multiread(bs, reqs, num_reqs);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -910,10 +916,42 @@ static const cmdinfo_t multiwrite_cmd = {
     .help       = multiwrite_help,
 };
 
-static int multiwrite_f(int argc, char **argv)
+static void multiread_help(void)
+{
+    printf(
+"\n"
+" reads a range of bytes from the given offset into multiple buffers,\n"
+" in a batch of requests that may be merged by qemu\n"
+"\n"
+" Example:\n"
+" 'multiread 512 1k 1k ; 2560 1k'\n"
+"  reads 3 kB at 512 bytes from the open file, as two requests\n"
+"\n"
+" Reads segments of the currently open file.\n"
+" -P, -- verify the data of each request against a pattern, which is\n"
+"        increased by one for each request like in multiwrite\n"
+" -C, -- report statistics in a machine parsable format\n"
+" -q, -- quiet mode, do not show I/O statistics\n"
+"\n");
+}
+
+static int multiread_f(int argc, char **argv);
+
+static const cmdinfo_t multiread_cmd = {
+    .name       = "multiread",
+    .cfunc      = multiread_f,
+    .argmin     = 2,
+    .argmax     = -1,
+    .args       = "[-Cq] [-P pattern ] off len [len..] [; off len [len..]..]",
+    .oneline    = "issues multiple read requests at once",
+    .help       = multiread_help,
+};
+
+static int multi_rw_f(int argc, char **argv, bool is_write)
 {
+    const cmdinfo_t *cmd = is_write ? &multiwrite_cmd : &multiread_cmd;
     struct timeval t1, t2;
-    int Cflag = 0, qflag = 0;
+    int Cflag = 0, qflag = 0, Pflag = 0;
     int c, cnt;
     char **buf;
     int64_t offset, first_offset = 0;
@@ -923,6 +961,7 @@ static int multiwrite_f(int argc, char **argv)
     int nr_reqs;
     int pattern = 0xcd;
     QEMUIOVector *qiovs;
+    int64_t *offsets;
     int i;
     BlockRequest *reqs;
 
@@ -935,18 +974,19 @@ static int multiwrite_f(int argc, char **argv)
             qflag = 1;
             break;
         case 'P':
+            Pflag = 1;
             pattern = parse_pattern(optarg);
             if (pattern < 0) {
                 return 0;
             }
             break;
         default:
-            return command_usage(&writev_cmd);
+            return command_usage(cmd);
         }
     }
 
     if (optind > argc - 2) {
-        return command_usage(&writev_cmd);
+        return command_usage(cmd);
     }
 
     nr_reqs = 1;
@@ -959,6 +999,7 @@ static int multiwrite_f(int argc, char **argv)
     reqs = g_malloc0(nr_reqs * sizeof(*reqs));
     buf = g_malloc0(nr_reqs * sizeof(*buf));
     qiovs = g_malloc(nr_reqs * sizeof(*qiovs));
+    offsets = g_malloc(nr_reqs * sizeof(*offsets));
 
     for (i = 0; i < nr_reqs && optind < argc; i++) {
         int j;
@@ -990,14 +1031,20 @@ static int multiwrite_f(int argc, char **argv)
 
         nr_iov = j - optind;
 
-        /* Build request */
-        buf[i] = create_iovec(&qiovs[i], &argv[optind], nr_iov, pattern);
+        /*
+         * Build request.  Read buffers start out with a different byte than
+         * the one they are verified against, so a read that leaves them
+         * alone does not pass.
+         */
+        buf[i] = create_iovec(&qiovs[i], &argv[optind], nr_iov,
+                              is_write ? pattern : ~pattern & 0xff);
         if (buf[i] == NULL) {
             goto out;
         }
 
         reqs[i].qiov = &qiovs[i];
         reqs[i].sector = offset >> 9;
+        offsets[i] = offset;
         reqs[i].nb_sectors = reqs[i].qiov->size >> 9;
 
         optind = j + 1;
@@ -1009,21 +1056,39 @@ static int multiwrite_f(int argc, char **argv)
     nr_reqs = i;
 
     gettimeofday(&t1, NULL);
-    cnt = do_aio_multiwrite(reqs, nr_reqs, &total);
+    cnt = do_aio_multi_rw(reqs, nr_reqs, &total, is_write);
     gettimeofday(&t2, NULL);
 
     if (cnt < 0) {
-        printf("aio_multiwrite failed: %s\n", strerror(-cnt));
+        printf("aio_multi%s failed: %s\n", is_write ? "write" : "read",
+               strerror(-cnt));
         goto out;
     }
 
+    if (!is_write && Pflag) {
+        /* Requests may have been merged, so compare them one by one */
+        for (i = 0; i < nr_reqs; i++) {
+            QEMUIOVector *qiov = &qiovs[i];
+            void *cmp_buf = malloc(qiov->size);
+
+            memset(cmp_buf, (pattern - nr_reqs + i) & 0xff, qiov->size);
+            if (memcmp(buf[i], cmp_buf, qiov->size)) {
+                printf("Pattern verification failed at offset %"
+                       PRId64 ", %zd bytes\n",
+                       offsets[i], qiov->size);
+            }
+            free(cmp_buf);
+        }
+    }
+
     if (qflag) {
         goto out;
     }
 
     /* Finally, report back -- -C gives a parsable format */
     t2 = tsub(t2, t1);
-    print_report("wrote", &t2, first_offset, total, total, cnt, Cflag);
+    print_report(is_write ? "wrote" : "read", &t2, first_offset, total, total,
+                 cnt, Cflag);
 out:
     for (i = 0; i < nr_reqs; i++) {
         qemu_io_free(buf[i]);
@@ -1034,9 +1099,20 @@ out:
     g_free(buf);
     g_free(reqs);
     g_free(qiovs);
+    g_free(offsets);
     return 0;
 }
 
+static int multiwrite_f(int argc, char **argv)
+{
+    return multi_rw_f(argc, argv, true);
+}
+
+static int multiread_f(int argc, char **argv)
+{
+    return multi_rw_f(argc, argv, false);
+}
+
 struct aio_ctx {
     QEMUIOVector qiov;
     int64_t offset;
@@ -1602,6 +1678,400 @@ static const cmdinfo_t map_cmd = {
        .oneline        = "prints the allocated areas of a file",
 };
 
+enum {
+    BENCH_SEQ,
+    BENCH_RAND,
+    BENCH_MIXED,
+};
+
+struct bench_stats {
+    int64_t ops;
+    int64_t bytes;
+    int64_t *lat;               /* completion latencies in ns */
+    int64_t nb_lat;
+    int64_t lat_alloc;
+};
+
+struct bench_ctx {
+    int64_t offset;
+    int64_t len;
+    int64_t bsize;
+    int mode;
+    int read_pct;
+    int64_t max_ops;
+    int64_t end_ns;
+    uint64_t rand_state;
+
+    int64_t next_seq;
+    int64_t submitted;
+    int in_flight;
+    int error;
+    struct bench_stats stats[2];    /* reads, writes */
+};
+
+struct bench_req {
+    struct bench_ctx *ctx;
+    QEMUIOVector qiov;
+    char *buf;
+    bool is_write;
+    int64_t t1;
+};
+
+static void bench_help(void)
+{
+    printf(
+"\n"
+" runs a benchmark workload against the open file\n"
+"\n"
+" Example:\n"
+" 'bench -m rand -d 32 -b 4k -r 70 -t 30' - 30 seconds of random 4k requests,\n"
+" 70%% reads and 30%% writes, with 32 requests in flight\n"
+"\n"
+" Keeps a fixed number of asynchronous requests in flight until the time or\n"
+" request limit is reached, then reports bandwidth, IOPS and completion\n"
+" latency percentiles for reads and writes.  By default the whole file is\n"
+" used, an optional off and len restrict the workload to a region.\n"
+" Writes overwrite the data in the region.\n"
+" -b, -- block size of each request (default 4k)\n"
+" -C, -- report statistics in a machine parsable format\n"
+" -d, -- queue depth, the number of requests in flight (default 1)\n"
+" -m, -- access pattern: seq, rand or mixed (half sequential, half random;\n"
+"        default seq)\n"
+" -n, -- stop after this many requests\n"
+" -r, -- percentage of reads, the rest are writes (default 100)\n"
+" -S, -- seed for the random number generator\n"
+" -t, -- stop after this many seconds (default 10)\n"
+"\n");
+}
+
+static int bench_f(int argc, char **argv);
+
+static const cmdinfo_t bench_cmd = {
+    .name       = "bench",
+    .cfunc      = bench_f,
+    .argmin     = 0,
+    .argmax     = -1,
+    .args       = "[-C] [-b bsize] [-d depth] [-m seq|rand|mixed] [-n count] "
+                  "[-r read%] [-S seed] [-t secs] [off len]",
+    .oneline    = "runs a benchmark workload",
+    .help       = bench_help,
+};
+
+/* xorshift64*, so that a seed reproduces the same workload everywhere */
+static uint64_t bench_rand(struct bench_ctx *ctx)
+{
+    ctx->rand_state ^= ctx->rand_state >> 12;
+    ctx->rand_state ^= ctx->rand_state << 25;
+    ctx->rand_state ^= ctx->rand_state >> 27;
+    return ctx->rand_state * 2685821657736338717ULL;
+}
+
+static int64_t bench_next_offset(struct bench_ctx *ctx)
+{
+    int64_t offset;
+    bool random;
+
+    random = ctx->mode == BENCH_RAND ||
+             (ctx->mode == BENCH_MIXED && (bench_rand(ctx) >> 63));
+    if (random) {
+        return ctx->offset +
+               (bench_rand(ctx) % (ctx->len / ctx->bsize)) * ctx->bsize;
+    }
+
+    offset = ctx->next_seq;
+    ctx->next_seq += ctx->bsize;
+    if (ctx->next_seq + ctx->bsize > ctx->offset + ctx->len) {
+        ctx->next_seq = ctx->offset;
+    }
+    return offset;
+}
+
+static bool bench_finished(struct bench_ctx *ctx)
+{
+    return ctx->error ||
+           (ctx->max_ops && ctx->submitted >= ctx->max_ops) ||
+           get_clock() >= ctx->end_ns;
+}
+
+static void bench_done(void *opaque, int ret);
+
+static void bench_submit(struct bench_req *req)
+{
+    struct bench_ctx *ctx = req->ctx;
+    int64_t sector_num = bench_next_offset(ctx) >> 9;
+    int nb_sectors = ctx->bsize >> 9;
+    BlockDriverAIOCB *acb;
+
+    req->is_write = bench_rand(ctx) % 100 >= ctx->read_pct;
+    ctx->submitted++;
+    ctx->in_flight++;
+
+    req->t1 = get_clock();
+    if (req->is_write) {
+        acb = bdrv_aio_writev(bs, sector_num, &req->qiov, nb_sectors,
+                              bench_done, req);
+    } else {
+        acb = bdrv_aio_readv(bs, sector_num, &req->qiov, nb_sectors,
+                             bench_done, req);
+    }
+    if (!acb) {
+        ctx->error = -EIO;
+        ctx->in_flight--;
+    }
+}
+
+static void bench_done(void *opaque, int ret)
+{
+    struct bench_req *req = opaque;
+    struct bench_ctx *ctx = req->ctx;
+    struct bench_stats *s = &ctx->stats[req->is_write];
+    int64_t lat = get_clock() - req->t1;
+
+    ctx->in_flight--;
+    if (ret < 0) {
+        if (!ctx->error) {
+            ctx->error = ret;
+        }
+        return;
+    }
+
+    s->ops++;
+    s->bytes += req->qiov.size;
+    if (s->nb_lat == s->lat_alloc) {
+        s->lat_alloc = MAX(s->lat_alloc * 2, 4096);
+        s->lat = g_realloc(s->lat, s->lat_alloc * sizeof(s->lat[0]));
+    }
+    s->lat[s->nb_lat++] = lat;
+
+    if (!bench_finished(ctx)) {
+        bench_submit(req);
+    }
+}
+
+static int bench_cmp_lat(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Latency below which pct percent of the requests completed, in usec */
+static double bench_percentile(struct bench_stats *s, double pct)
+{
+    int64_t i = (int64_t)(pct * s->nb_lat / 100 + 0.999999) - 1;
+
+    return s->lat[MAX(MIN(i, s->nb_lat - 1), 0)] / 1000.0;
+}
+
+static void bench_report(const char *op, struct bench_stats *s,
+                         int64_t elapsed_ns, int Cflag)
+{
+    char s1[64], s2[64], ts[64];
+    struct timeval t;
+    double sum = 0;
+    int64_t i;
+
+    if (!s->ops) {
+        return;
+    }
+
+    qsort(s->lat, s->nb_lat, sizeof(s->lat[0]), bench_cmp_lat);
+    for (i = 0; i < s->nb_lat; i++) {
+        sum += s->lat[i];
+    }
+
+    t.tv_sec = elapsed_ns / 1000000000LL;
+    t.tv_usec = (elapsed_ns % 1000000000LL) / 1000;
+    timestr(&t, ts, sizeof(ts), Cflag ? VERBOSE_FIXED_TIME : 0);
+
+    if (!Cflag) {
+        cvtstr((double)s->bytes, s1, sizeof(s1));
+        cvtstr(tdiv((double)s->bytes, t), s2, sizeof(s2));
+        printf("%s: %s, %" PRId64 " ops; %s (%s/sec and %.4f ops/sec)\n",
+               op, s1, s->ops, ts, s2, tdiv((double)s->ops, t));
+        printf("%s latency: min %.1f avg %.1f max %.1f usec; "
+               "p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f usec\n",
+               op, s->lat[0] / 1000.0, sum / s->nb_lat / 1000.0,
+               s->lat[s->nb_lat - 1] / 1000.0,
+               bench_percentile(s, 50), bench_percentile(s, 90),
+               bench_percentile(s, 99), bench_percentile(s, 99.9));
+    } else {
+        /* op,bytes,ops,time,bytes/sec,ops/sec,
+         * min,avg,max,p50,p90,p99,p99.9 (usec) */
+        printf("%s,%" PRId64 ",%" PRId64 ",%s,%.3f,%.3f,"
+               "%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+               op, s->bytes, s->ops, ts,
+               tdiv((double)s->bytes, t), tdiv((double)s->ops, t),
+               s->lat[0] / 1000.0, sum / s->nb_lat / 1000.0,
+               s->lat[s->nb_lat - 1] / 1000.0,
+               bench_percentile(s, 50), bench_percentile(s, 90),
+               bench_percentile(s, 99), bench_percentile(s, 99.9));
+    }
+}
+
+static int bench_f(int argc, char **argv)
+{
+    struct bench_ctx ctx = {
+        .bsize      = 4096,
+        .mode       = BENCH_SEQ,
+        .read_pct   = 100,
+    };
+    struct bench_req *reqs;
+    int Cflag = 0, depth = 1;
+    double secs = 10;
+    uint64_t seed = time(NULL);
+    int64_t t1, t2;
+    char *endptr;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "b:Cd:m:n:r:S:t:")) != EOF) {
+        switch (c) {
+        case 'b':
+            ctx.bsize = cvtnum(optarg);
+            if (ctx.bsize <= 0 || (ctx.bsize & 0x1ff) ||
+                ctx.bsize > INT_MAX) {
+                printf("invalid block size -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'C':
+            Cflag = 1;
+            break;
+        case 'd':
+            depth = strtol(optarg, &endptr, 0);
+            if (*endptr != '\0' || depth < 1) {
+                printf("invalid queue depth -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'm':
+            if (!strcmp(optarg, "seq")) {
+                ctx.mode = BENCH_SEQ;
+            } else if (!strcmp(optarg, "rand")) {
+                ctx.mode = BENCH_RAND;
+            } else if (!strcmp(optarg, "mixed")) {
+                ctx.mode = BENCH_MIXED;
+            } else {
+                printf("invalid access pattern -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'n':
+            ctx.max_ops = cvtnum(optarg);
+            if (ctx.max_ops <= 0) {
+                printf("invalid request count -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'r':
+            ctx.read_pct = strtol(optarg, &endptr, 0);
+            if (*endptr != '\0' || ctx.read_pct < 0 || ctx.read_pct > 100) {
+                printf("invalid read percentage -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'S':
+            seed = strtoull(optarg, &endptr, 0);
+            if (*endptr != '\0') {
+                printf("invalid seed -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 't':
+            secs = strtod(optarg, &endptr);
+            if (*endptr != '\0' || secs <= 0) {
+                printf("invalid duration -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        default:
+            return command_usage(&bench_cmd);
+        }
+    }
+
+    if (optind == argc) {
+        ctx.offset = 0;
+        ctx.len = bdrv_getlength(bs);
+        if (ctx.len < 0) {
+            printf("getlength: %s\n", strerror(-ctx.len));
+            return 0;
+        }
+    } else if (optind == argc - 2) {
+        int64_t size;
+
+        ctx.offset = cvtnum(argv[optind]);
+        ctx.len = cvtnum(argv[optind + 1]);
+        if (ctx.offset < 0 || ctx.len < 0) {
+            printf("non-numeric region argument\n");
+            return 0;
+        }
+        if (ctx.offset & 0x1ff) {
+            printf("offset %" PRId64 " is not sector aligned\n", ctx.offset);
+            return 0;
+        }
+
+        /* Fail up front rather than with the first request past the end */
+        size = bdrv_getlength(bs);
+        if (size < 0) {
+            printf("getlength: %s\n", strerror(-size));
+            return 0;
+        }
+        if (ctx.offset > size || ctx.len > size - ctx.offset) {
+            printf("region %" PRId64 "+%" PRId64 " is beyond the end of the "
+                   "image (%" PRId64 " bytes)\n", ctx.offset, ctx.len, size);
+            return 0;
+        }
+    } else {
+        return command_usage(&bench_cmd);
+    }
+
+    if (ctx.len < ctx.bsize) {
+        printf("region of %" PRId64 " bytes is smaller than the block size\n",
+               ctx.len);
+        return 0;
+    }
+
+    /* xorshift needs a non-zero state */
+    ctx.rand_state = seed ? seed : 1;
+    ctx.next_seq = ctx.offset;
+
+    reqs = g_malloc0(depth * sizeof(reqs[0]));
+    for (i = 0; i < depth; i++) {
+        reqs[i].ctx = &ctx;
+        reqs[i].buf = qemu_io_alloc(ctx.bsize, 0xcd);
+        qemu_iovec_init(&reqs[i].qiov, 1);
+        qemu_iovec_add(&reqs[i].qiov, reqs[i].buf, ctx.bsize);
+    }
+
+    t1 = get_clock();
+    ctx.end_ns = t1 + (int64_t)(secs * 1000000000LL);
+    for (i = 0; i < depth && !bench_finished(&ctx); i++) {
+        bench_submit(&reqs[i]);
+    }
+    while (ctx.in_flight > 0) {
+        qemu_aio_wait();
+    }
+    t2 = get_clock();
+
+    if (ctx.error < 0) {
+        printf("bench failed: %s\n", strerror(-ctx.error));
+    }
+
+    /* Finally, report back -- -C gives a parsable format */
+    bench_report("read", &ctx.stats[0], t2 - t1, Cflag);
+    bench_report("write", &ctx.stats[1], t2 - t1, Cflag);
+
+    for (i = 0; i < depth; i++) {
+        qemu_iovec_destroy(&reqs[i].qiov);
+        qemu_io_free(reqs[i].buf);
+    }
+    g_free(reqs);
+    g_free(ctx.stats[0].lat);
+    g_free(ctx.stats[1].lat);
+    return 0;
+}
+
 
 static int close_f(int argc, char **argv)
 {
@@ -1828,6 +2298,7 @@ int main(int argc, char **argv)
     add_command(&write_cmd);
     add_command(&writev_cmd);
     add_command(&multiwrite_cmd);
+    add_command(&multiread_cmd);
     add_command(&aio_read_cmd);
     add_command(&aio_write_cmd);
     add_command(&aio_flush_cmd);
@@ -1838,6 +2309,7 @@ int main(int argc, char **argv)
     add_command(&discard_cmd);
     add_command(&alloc_cmd);
     add_command(&map_cmd);
+    add_command(&bench_cmd);
 
     add_args_command(init_args_command);
     add_check_command(init_check_command);
@@ -35,13 +35,19 @@
 
 #define SOCKET_PATH    "/var/lock/qemu-nbd-%s"
 
-#define NBD_BUFFER_SIZE (1024*1024)
+#define QEMU_NBD_OPT_MAX_REQUESTS 1
 
 static int sigterm_wfd;
 static int verbose;
 static char *device;
 static char *srcpath;
 static char *sockpath;
+static NBDExport *exp;
+static int server_fd;
+static int shared = 1;
+static int nb_fds;
+static int persistent;
+static bool terminate;
 
 static void usage(const char *name)
 {
@@ -62,12 +68,15 @@ static void usage(const char *name)
 "  -d, --disconnect     disconnect the specified device\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
 "  -t, --persistent     don't exit on the last connection\n"
+"      --max-requests=NUM\n"
+"                       process up to NUM requests of a client in parallel\n"
+"                       (default '%d')\n"
 "  -v, --verbose        display extra debugging information\n"
 "  -h, --help           display this help and exit\n"
 "  -V, --version        output version information and exit\n"
 "\n"
 "Report bugs to <anthony@codemonkey.ws>\n"
-    , name, NBD_DEFAULT_PORT, "DEVICE");
+    , name, NBD_DEFAULT_PORT, "DEVICE", NBD_DEFAULT_MAX_REQUESTS);
 }
 
 static void version(const char *name)
@@ -244,17 +253,69 @@ out:
     return (void *) EXIT_FAILURE;
 }
 
+static void termsig_read(void *opaque)
+{
+    int fd = (intptr_t) opaque;
+    char buf;
+
+    if (read(fd, &buf, 1) == 1) {
+        terminate = true;
+    }
+}
+
+static void nbd_accept(void *opaque);
+
+static void nbd_update_server_fd_handler(void)
+{
+    /* Leave further connections pending in the listen queue until one
+     * of the current clients goes away.
+     */
+    if (nb_fds < shared && !terminate) {
+        qemu_aio_set_fd_handler(server_fd, nbd_accept, NULL, NULL, NULL,
+                                NULL);
+    } else {
+        qemu_aio_set_fd_handler(server_fd, NULL, NULL, NULL, NULL, NULL);
+    }
+}
+
+static void nbd_client_closed(NBDClient *client)
+{
+    nb_fds--;
+    if (nb_fds == 0 && !persistent) {
+        terminate = true;
+    }
+    nbd_update_server_fd_handler();
+}
+
+static void nbd_accept(void *opaque)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd;
+
+    fd = accept(server_fd, (struct sockaddr *)&addr, &addr_len);
+    if (fd == -1) {
+        return;
+    }
+
+    if (nbd_client_new(exp, fd, nbd_client_closed) == NULL) {
+        close(fd);
+        return;
+    }
+
+    nb_fds++;
+    nbd_update_server_fd_handler();
+}
+
 int main(int argc, char **argv)
 {
     BlockDriverState *bs;
     off_t dev_offset = 0;
-    off_t offset = 0;
     uint32_t nbdflags = 0;
     bool disconnect = false;
     const char *bindto = "0.0.0.0";
     int port = NBD_DEFAULT_PORT;
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
+    int max_requests = NBD_DEFAULT_MAX_REQUESTS;
     off_t fd_size;
     const char *sopt = "hVb:o:p:rsnP:c:dvk:e:t";
     struct option lopt[] = {
@@ -272,6 +333,7 @@ int main(int argc, char **argv)
         { "nocache", 0, NULL, 'n' },
         { "shared", 1, NULL, 'e' },
         { "persistent", 0, NULL, 't' },
+        { "max-requests", 1, NULL, QEMU_NBD_OPT_MAX_REQUESTS },
         { "verbose", 0, NULL, 'v' },
         { NULL, 0, NULL, 0 }
     };
@@ -282,21 +344,14 @@ int main(int argc, char **argv)
     int flags = BDRV_O_RDWR;
     int partition = -1;
     int ret;
-    int shared = 1;
-    uint8_t *data;
-    fd_set fds;
-    int *sharing_fds;
     int fd;
-    int i;
-    int nb_fds = 0;
-    int max_fd;
-    int persistent = 0;
     pthread_t client_thread;
 
     /* The client thread uses SIGTERM to interrupt the server.  A signal
      * handler ensures that "qemu-nbd -v -c" exits with a nice status code.
      */
     struct sigaction sa_sigterm;
+    struct sigaction sa_sigpipe;
     int sigterm_fd[2];
     if (qemu_pipe(sigterm_fd) == -1) {
         err(EXIT_FAILURE, "Error setting up communication pipe");
@@ -307,6 +362,13 @@ int main(int argc, char **argv)
     sa_sigterm.sa_handler = termsig_handler;
     sigaction(SIGTERM, &sa_sigterm, NULL);
 
+    /* A client going away in the middle of a reply must not kill the
+     * server; the failed send is reported as EPIPE instead.
+     */
+    memset(&sa_sigpipe, 0, sizeof(sa_sigpipe));
+    sa_sigpipe.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa_sigpipe, NULL);
+
     while ((ch = getopt_long(argc, argv, sopt, lopt, &opt_ind)) != -1) {
         switch (ch) {
         case 's':
@@ -371,6 +433,15 @@ int main(int argc, char **argv)
 	case 't':
 	    persistent = 1;
 	    break;
+        case QEMU_NBD_OPT_MAX_REQUESTS:
+            max_requests = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid request number '%s'", optarg);
+            }
+            if (max_requests < 1) {
+                errx(EXIT_FAILURE, "Request number must be greater than 0\n");
+            }
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -492,16 +563,15 @@ int main(int argc, char **argv)
         err(EXIT_FAILURE, "Could not find partition %d", partition);
     }
 
-    sharing_fds = g_malloc((shared + 1) * sizeof(int));
-
     if (sockpath) {
-        sharing_fds[0] = unix_socket_incoming(sockpath);
+        server_fd = unix_socket_incoming(sockpath);
     } else {
-        sharing_fds[0] = tcp_socket_incoming(bindto, port);
+        server_fd = tcp_socket_incoming(bindto, port);
     }
 
-    if (sharing_fds[0] == -1)
+    if (server_fd == -1) {
         return 1;
+    }
 
     if (device) {
         int ret;
@@ -516,60 +586,27 @@ int main(int argc, char **argv)
         memset(&client_thread, 0, sizeof(client_thread));
     }
 
-    max_fd = sharing_fds[0];
-    nb_fds++;
+    /* qemu-nbd has nothing else to do while clients are connected, so
+     * let qemu_aio_wait() poll their sockets even when no request is in
+     * flight.
+     */
+    exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, max_requests,
+                         true);
 
-    data = qemu_blockalign(bs, NBD_BUFFER_SIZE);
-    if (data == NULL) {
-        errx(EXIT_FAILURE, "Cannot allocate data buffer");
-    }
+    qemu_aio_set_fd_handler(sigterm_fd[0], termsig_read, NULL, NULL, NULL,
+                            (void *)(intptr_t) sigterm_fd[0]);
+    nbd_update_server_fd_handler();
 
     do {
-        FD_ZERO(&fds);
-        FD_SET(sigterm_fd[0], &fds);
-        for (i = 0; i < nb_fds; i++)
-            FD_SET(sharing_fds[i], &fds);
-
-        do {
-            ret = select(max_fd + 1, &fds, NULL, NULL, NULL);
-        } while (ret == -1 && errno == EINTR);
-        if (ret == -1 || FD_ISSET(sigterm_fd[0], &fds)) {
-            break;
-        }
+        qemu_aio_wait();
+    } while (!terminate);
 
-        if (FD_ISSET(sharing_fds[0], &fds))
-            ret--;
-        for (i = 1; i < nb_fds && ret; i++) {
-            if (FD_ISSET(sharing_fds[i], &fds)) {
-                if (nbd_trip(bs, sharing_fds[i], fd_size, dev_offset,
-                    &offset, nbdflags, data, NBD_BUFFER_SIZE) != 0) {
-                    close(sharing_fds[i]);
-                    nb_fds--;
-                    sharing_fds[i] = sharing_fds[nb_fds];
-                    i--;
-                }
-                ret--;
-            }
-        }
-        /* new connection ? */
-        if (FD_ISSET(sharing_fds[0], &fds)) {
-            if (nb_fds < shared + 1) {
-                sharing_fds[nb_fds] = accept(sharing_fds[0],
-                                             (struct sockaddr *)&addr,
-                                             &addr_len);
-                if (sharing_fds[nb_fds] != -1 &&
-                    nbd_negotiate(sharing_fds[nb_fds], fd_size, nbdflags) != -1) {
-                        if (sharing_fds[nb_fds] > max_fd)
-                            max_fd = sharing_fds[nb_fds];
-                        nb_fds++;
-                }
-            }
-        }
-    } while (persistent || nb_fds > 1);
-    qemu_vfree(data);
+    qemu_aio_set_fd_handler(server_fd, NULL, NULL, NULL, NULL, NULL);
+    qemu_aio_set_fd_handler(sigterm_fd[0], NULL, NULL, NULL, NULL, NULL);
+
+    nbd_export_close(exp);
 
-    close(sharing_fds[0]);
-    g_free(sharing_fds);
+    close(server_fd);
     if (sockpath) {
         unlink(sockpath);
     }
@@ -136,6 +136,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off]\n"
+    "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -186,8 +187,20 @@ host disk is full; report the error to the guest otherwise).
 The default setting is @option{werror=enospc} and @option{rerror=report}.
 @item readonly
 Open drive @option{file} as read-only. Guest write attempts will fail.
+@item bps=@var{b},bps_rd=@var{r},bps_wr=@var{w}
+Limit the throughput of the drive to @var{b} bytes per second in total, or
+to @var{r} bytes per second for reads and @var{w} bytes per second for
+writes.  @option{bps} cannot be combined with @option{bps_rd} or
+@option{bps_wr}.
+@item iops=@var{i},iops_rd=@var{r},iops_wr=@var{w}
+Limit the drive to @var{i} I/O operations per second in total, or to
+@var{r} read and @var{w} write operations per second.  @option{iops} cannot be
+combined with @option{iops_rd} or @option{iops_wr}.
 @end table
 
+Requests that exceed the limits are delayed, not failed.  The limits can be
+changed at run time with the @code{block_set_io_throttle} monitor command.
+
 By default, writethrough caching is used for all block device.  This means that
 the host page cache will be used to read and write data but write notification
 will be sent to the guest only when the data has been reported as written by
@@ -359,6 +372,23 @@ the raw disk image you use is not written back. You can however force
 the write back by pressing @key{C-a s} (@pxref{disk_images}).
 ETEXI
 
+DEF("aio-pool", HAS_ARG, QEMU_OPTION_aio_pool,
+    "-aio-pool [min-threads=n][,max-threads=n][,idle-timeout=secs]\n"
+    "                configure the threads that perform block I/O\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -aio-pool [min-threads=@var{n}][,max-threads=@var{n}][,idle-timeout=@var{secs}]
+@findex -aio-pool
+Configure the pool of threads that performs I/O for images that are not
+accessed with native AIO.  Drives are spread over several request queues.
+@option{min-threads} workers per queue are kept even when idle (default 0),
+other workers exit after @option{idle-timeout} seconds without requests
+(default 10).  @option{max-threads} limits the number of workers (default
+64), although each queue can always use one worker.  There are 16 queues,
+so @option{min-threads} times 16 must not be larger than
+@option{max-threads}.  This option is not available on Windows hosts.
+ETEXI
+
 DEF("m", HAS_ARG, QEMU_OPTION_m,
     "-m megs         set virtual RAM size to megs MB [default="
     stringify(DEFAULT_RAM_SIZE) "]\n", QEMU_ARCH_ALL)
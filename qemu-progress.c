@@ -25,12 +25,15 @@
 #include "qemu-common.h"
 #include "osdep.h"
 #include "sysemu.h"
+#include "qemu-timer.h"
 #include <stdio.h>
 
 struct progress_state {
     float current;
     float last_print;
     float min_skip;
+    uint64_t size;
+    int64_t start;
     void (*print)(void);
     void (*end)(void);
 };
@@ -45,7 +48,15 @@ static volatile sig_atomic_t print_pending;
  */
 static void progress_simple_print(void)
 {
-    printf("    (%3.2f/100%%)\r", state.current);
+    int64_t elapsed = get_clock() - state.start;
+
+    if (state.size && elapsed > 0) {
+        double rate = state.current / 100 * state.size / elapsed *
+                      get_ticks_per_sec() / (1024 * 1024);
+        printf("    (%3.2f/100%%, %.1f MB/s)\r", state.current, rate);
+    } else {
+        printf("    (%3.2f/100%%)\r", state.current);
+    }
     fflush(stdout);
 }
 
@@ -112,6 +123,16 @@ void qemu_progress_init(int enabled, float min_skip)
     }
 }
 
+/*
+ * Set the number of bytes the whole operation processes, so that the
+ * progress report can include a rate.
+ */
+void qemu_progress_set_size(uint64_t size)
+{
+    state.size = size;
+    state.start = get_clock();
+}
+
 void qemu_progress_end(void)
 {
     state.end();
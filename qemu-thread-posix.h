@@ -14,4 +14,6 @@ struct QemuThread {
     pthread_t thread;
 };
 
+void *qemu_thread_join(QemuThread *thread);
+
 #endif
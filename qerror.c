@@ -48,6 +48,10 @@ static const QErrorStringTable qerror_table[] = {
         .error_fmt = QERR_BAD_BUS_FOR_DEVICE,
         .desc      = "Device '%(device)' can't go on a %(bad_bus_type) bus",
     },
+    {
+        .error_fmt = QERR_BLOCK_DEFRAG_NOT_ACTIVE,
+        .desc      = "Device '%(device)' is not being defragmented",
+    },
     {
         .error_fmt = QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED,
         .desc      = "Block format '%(format)' used by device '%(name)' does not support feature '%(feature)'",
@@ -76,6 +80,10 @@ static const QErrorStringTable qerror_table[] = {
         .error_fmt = QERR_DEVICE_IN_USE,
         .desc      = "Device '%(device)' is in use",
     },
+    {
+        .error_fmt = QERR_DEVICE_IS_READ_ONLY,
+        .desc      = "Device '%(device)' is read only",
+    },
     {
         .error_fmt = QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
         .desc      = "Migration is disabled when using feature '%(feature)' in device '%(device)'",
@@ -136,6 +144,10 @@ static const QErrorStringTable qerror_table[] = {
         .error_fmt = QERR_INVALID_PARAMETER,
         .desc      = "Invalid parameter '%(name)'",
     },
+    {
+        .error_fmt = QERR_INVALID_PARAMETER_COMBINATION,
+        .desc      = "Invalid parameter combination",
+    },
     {
         .error_fmt = QERR_INVALID_PARAMETER_TYPE,
         .desc      = "Invalid parameter type, expected: %(expected)",
@@ -148,6 +160,10 @@ static const QErrorStringTable qerror_table[] = {
         .error_fmt = QERR_INVALID_PASSWORD,
         .desc      = "Password incorrect",
     },
+    {
+        .error_fmt = QERR_IO_ERROR,
+        .desc      = "An IO error has occurred",
+    },
     {
         .error_fmt = QERR_JSON_PARSING,
         .desc      = "Invalid JSON syntax",
@@ -169,6 +185,18 @@ static const QErrorStringTable qerror_table[] = {
         .error_fmt = QERR_MISSING_PARAMETER,
         .desc      = "Parameter '%(name)' is missing",
     },
+    {
+        .error_fmt = QERR_NBD_SERVER_ACTIVE,
+        .desc      = "An NBD server is already running",
+    },
+    {
+        .error_fmt = QERR_NBD_SERVER_FAILED,
+        .desc      = "Could not start NBD server on %(target)",
+    },
+    {
+        .error_fmt = QERR_NBD_SERVER_NOT_ACTIVE,
+        .desc      = "No NBD server is running",
+    },
     {
         .error_fmt = QERR_NO_BUS_FOR_DEVICE,
         .desc      = "No '%(bus)' bus found for device '%(device)'",
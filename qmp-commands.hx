@@ -680,6 +680,168 @@ Example:
 -> { "execute": "block_resize", "arguments": { "device": "scratch", "size": 1073741824 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr",
+        .help       = "change I/O throttle limits for a block drive",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_set_io_throttle,
+    },
+
+SQMP
+block_set_io_throttle
+---------------------
+
+Change I/O throttle limits for a block drive.  A value of zero disables the
+corresponding limit.  The total limits cannot be combined with the read and
+write limits of the same kind.
+
+Arguments:
+
+- "device": device name (json-string)
+- "bps": total throughput limit in bytes per second (json-int)
+- "bps_rd": read throughput limit in bytes per second (json-int)
+- "bps_wr": write throughput limit in bytes per second (json-int)
+- "iops": total I/O operations per second (json-int)
+- "iops_rd": read I/O operations per second (json-int)
+- "iops_wr": write I/O operations per second (json-int)
+
+Example:
+
+-> { "execute": "block_set_io_throttle", "arguments": { "device": "virtio0",
+                                                       "bps": 1000000,
+                                                       "bps_rd": 0,
+                                                       "bps_wr": 0,
+                                                       "iops": 0,
+                                                       "iops_rd": 0,
+                                                       "iops_wr": 0 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "nbd-server-start",
+        .args_type  = "addr:s",
+        .mhandler.cmd_new = qmp_marshal_input_nbd_server_start,
+    },
+
+SQMP
+nbd-server-start
+----------------
+
+Start an NBD server that exports block devices of the running VM.
+
+Arguments:
+
+- "addr": "HOST:PORT" for a TCP socket, or "unix:PATH" for a UNIX domain
+          socket (json-string)
+
+Example:
+
+-> { "execute": "nbd-server-start", "arguments": { "addr": "0.0.0.0:10809" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "nbd-server-add",
+        .args_type  = "device:B,writable:b?",
+        .mhandler.cmd_new = qmp_marshal_input_nbd_server_add,
+    },
+
+SQMP
+nbd-server-add
+--------------
+
+Export a block device through the NBD server, under the device name.  The
+guest keeps using the device while it is exported.
+
+Arguments:
+
+- "device": device name (json-string)
+- "writable": whether clients may write to the device, false by default
+              (json-bool, optional)
+
+Example:
+
+-> { "execute": "nbd-server-add", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "nbd-server-stop",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_nbd_server_stop,
+    },
+
+SQMP
+nbd-server-stop
+---------------
+
+Stop the NBD server and disconnect all of its clients.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "nbd-server-stop" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-defrag",
+        .args_type  = "device:B,speed:o?",
+        .mhandler.cmd_new = qmp_marshal_input_block_defrag,
+    },
+
+SQMP
+block-defrag
+------------
+
+Defragment a block device in the background while the guest is running, so
+that data which is contiguous in the guest becomes contiguous in the image
+file.  The BLOCK_DEFRAG_COMPLETED event is emitted when it ends.
+
+Arguments:
+
+- "device": device name (json-string)
+- "speed": maximum amount of data moved per second, in bytes; unlimited by
+           default (json-int, optional)
+
+Example:
+
+-> { "execute": "block-defrag", "arguments": { "device": "virtio0",
+                                               "speed": 10485760 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-defrag-cancel",
+        .args_type  = "device:B",
+        .mhandler.cmd_new = qmp_marshal_input_block_defrag_cancel,
+    },
+
+SQMP
+block-defrag-cancel
+-------------------
+
+Stop defragmenting a block device.  The data moved so far stays in place.
+
+Arguments:
+
+- "device": device name (json-string)
+
+Example:
+
+-> { "execute": "block-defrag-cancel", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1152,6 +1314,12 @@ Each json-object contain the following:
                                 "tftp", "vdi", "vmdk", "vpc", "vvfat"
          - "backing_file": backing file name (json-string, optional)
          - "encrypted": true if encrypted, false otherwise (json-bool)
+         - "bps": limit total bytes per second (json-int)
+         - "bps_rd": limit read bytes per second (json-int)
+         - "bps_wr": limit write bytes per second (json-int)
+         - "iops": limit total I/O operations per second (json-int)
+         - "iops_rd": limit read operations per second (json-int)
+         - "iops_wr": limit write operations per second (json-int)
 - "io-status": I/O operation status, only present if the device supports it
                and the VM is configured to stop on errors. It's always reset
                to "ok" when the "cont" command is issued (json_string, optional)
@@ -1171,7 +1339,13 @@ Example:
                "ro":false,
                "drv":"qcow2",
                "encrypted":false,
-               "file":"disks/test.img"
+               "file":"disks/test.img",
+               "bps":1000000,
+               "bps_rd":0,
+               "bps_wr":0,
+               "iops":1000000,
+               "iops_rd":0,
+               "iops_wr":0
             },
             "type":"unknown"
          },
@@ -1228,10 +1402,34 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "rd_latency": histogram of read latencies, a json-array of the
+                    non-empty buckets, each a json-object containing:
+        - "latency_ns": lower bound of the bucket; the bucket counts
+                        requests taking less than twice as long, except
+                        for the last one which is open ended (json-int)
+        - "count": number of requests in the bucket (json-int)
+    - "wr_latency": histogram of write latencies (json-array)
+    - "flush_latency": histogram of cache flush latencies (json-array)
+    - "in_flight": requests currently in flight (json-int)
+    - "max_in_flight": highest number of requests in flight at the same
+                       time (json-int)
+    - "idle_time_ns": total time without requests in flight in
+                      nano-seconds (json-int)
+    - "rd_merged": read requests merged into an adjacent one (json-int)
+    - "wr_merged": write requests merged into an adjacent one (json-int)
+    - "cache_hits": reads served from the cache of a caching driver like
+                    shmcache (json-int, optional)
+    - "cache_misses": reads the caching driver passed to the image
+                      (json-int, optional)
+    - "misaligned": requests copied to aligned memory because of O_DIRECT
+                    (json-int, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "backing": Contains recursively the statistics of the backing image. If
+             there is no backing image, this field is omitted
+             (json-object, optional)
 
 Example:
 
@@ -1262,7 +1460,22 @@ Example:
                "flush_operations":51,
                "wr_total_times_ns":313253456
                "rd_total_times_ns":3465673657
-               "flush_total_times_ns":49653
+               "flush_total_times_ns":49653,
+               "rd_latency":[
+                  { "latency_ns":32000, "count":36012 },
+                  { "latency_ns":2048000, "count":592 }
+               ],
+               "wr_latency":[
+                  { "latency_ns":256000, "count":692 }
+               ],
+               "flush_latency":[
+                  { "latency_ns":512000, "count":51 }
+               ],
+               "in_flight":0,
+               "max_in_flight":32,
+               "idle_time_ns":183475934712,
+               "rd_merged":1536,
+               "wr_merged":204
             }
          },
          {
@@ -1318,6 +1531,72 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_blockstats,
     },
 
+SQMP
+query-aio-pool
+--------------
+
+Show the occupancy of the thread pool that performs block I/O for raw images.
+
+Return a json-object with the following information:
+
+- "threads": number of worker threads (json-int)
+- "idle_threads": number of workers waiting for requests (json-int)
+- "peak_threads": highest number of workers so far (json-int)
+- "min_threads": workers per queue that are kept when idle (json-int)
+- "max_threads": limit for the number of workers (json-int)
+- "idle_timeout": seconds after which an idle worker exits (json-int)
+- "queues": number of request queues (json-int)
+- "queued": requests waiting for a worker (json-int)
+- "pending": requests not completed yet (json-int)
+- "completed": requests completed so far (json-int)
+
+Example:
+
+-> { "execute": "query-aio-pool" }
+<- { "return": { "threads": 6, "idle_threads": 2, "peak_threads": 9,
+                 "min_threads": 0, "max_threads": 64, "idle_timeout": 10,
+                 "queues": 16, "queued": 0, "pending": 4,
+                 "completed": 120394 } }
+
+EQMP
+
+    {
+        .name       = "query-aio-pool",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_aio_pool,
+    },
+
+SQMP
+query-block-defrag
+------------------
+
+Show the progress of the block devices that are being defragmented with
+block-defrag.
+
+Each device is represented by a json-object, the returned value is a
+json-array of all devices.  The json-object contains the following:
+
+- "device": device name (json-string)
+- "offset": position reached so far, in bytes (json-int)
+- "len": size of the device in bytes (json-int)
+- "moved": amount of data moved so far, in bytes (json-int)
+- "speed": rate limit in bytes per second, 0 if unlimited (json-int)
+
+Example:
+
+-> { "execute": "query-block-defrag" }
+<- { "return": [ { "device": "virtio0", "offset": 4294967296,
+                   "len": 10737418240, "moved": 1207959552,
+                   "speed": 10485760 } ] }
+
+EQMP
+
+    {
+        .name       = "query-block-defrag",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_block_defrag,
+    },
+
 SQMP
 query-cpus
 ----------
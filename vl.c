@@ -139,6 +139,9 @@ int main(int argc, char **argv)
 #include "block.h"
 #include "blockdev.h"
 #include "block-migration.h"
+#ifndef _WIN32
+#include "block/raw-posix-aio.h"
+#endif
 #include "dma.h"
 #include "audio/audio.h"
 #include "migration.h"
@@ -760,6 +763,52 @@ static int bt_parse(const char *opt)
 #define MTD_OPTS ""
 #define SD_OPTS ""
 
+#ifndef _WIN32
+/* Returns -1 for an unset option, -2 for a value that does not fit an int */
+static int aio_pool_get_number(QemuOpts *opts, const char *name)
+{
+    uint64_t val;
+
+    if (!qemu_opt_get(opts, name)) {
+        return -1;
+    }
+
+    /* Negative numbers are accepted by the parser, but wrap around */
+    val = qemu_opt_get_number(opts, name, 0);
+    if (val > INT_MAX) {
+        fprintf(stderr, "qemu: aio-pool: %s is out of range\n", name);
+        return -2;
+    }
+    return val;
+}
+#endif
+
+static int aio_pool_init_func(QemuOpts *opts, void *opaque)
+{
+#ifndef _WIN32
+    int min, max, timeout;
+    int ret;
+
+    min = aio_pool_get_number(opts, "min-threads");
+    max = aio_pool_get_number(opts, "max-threads");
+    timeout = aio_pool_get_number(opts, "idle-timeout");
+    if (min == -2 || max == -2 || timeout == -2) {
+        return -1;
+    }
+
+    ret = paio_configure(min, max, timeout);
+    if (ret < 0) {
+        fprintf(stderr, "qemu: invalid aio-pool configuration: %s\n",
+                strerror(-ret));
+        return -1;
+    }
+    return 0;
+#else
+    fprintf(stderr, "qemu: -aio-pool is not supported on this host\n");
+    return -1;
+#endif
+}
+
 static int drive_init_func(QemuOpts *opts, void *opaque)
 {
     int *use_scsi = opaque;
@@ -2997,6 +3046,12 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_startdate:
                 configure_rtc_date_offset(optarg, 1);
                 break;
+            case QEMU_OPTION_aio_pool:
+                opts = qemu_opts_parse(qemu_find_opts("aio-pool"), optarg, 0);
+                if (!opts) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_rtc:
                 opts = qemu_opts_parse(qemu_find_opts("rtc"), optarg, 0);
                 if (!opts) {
@@ -3300,6 +3355,11 @@ int main(int argc, char **argv, char **envp)
 
     blk_mig_init();
 
+    if (qemu_opts_foreach(qemu_find_opts("aio-pool"), aio_pool_init_func,
+                          NULL, 1) != 0) {
+        exit(1);
+    }
+
     /* open the virtual block devices */
     if (snapshot)
         qemu_opts_foreach(qemu_find_opts("drive"), drive_enable_snapshot, NULL, 0);